@@ -45,6 +45,8 @@ class AccProjector
 	XFLOAT *mdlReal, *mdlImag;
 #else
 	std::complex<XFLOAT> *mdlComplex;
+	// Row offsets of a compact model (see SphericalFourierArray), NULL for a full model
+	size_t *mdlRowOffset;
 	int externalFree;
 #endif
 #endif  // PROJECTOR_NO_TEXTURES
@@ -75,6 +77,7 @@ public:
 		mdlImag = 0;
 #else
 		mdlComplex = 0;
+		mdlRowOffset = 0;
 		externalFree = 0;
 #endif
 #endif
@@ -91,7 +94,7 @@ public:
 	void initMdl(XFLOAT *real, XFLOAT *imag);
 	void initMdl(Complex *data);
 #ifdef ALTCPU
-	void initMdl(std::complex<XFLOAT> *data);
+	void initMdl(std::complex<XFLOAT> *data, size_t *rowOffset = NULL);
 #endif
 
 	void clear();
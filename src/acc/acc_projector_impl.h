@@ -283,9 +283,10 @@ void AccProjector::initMdl(XFLOAT *real, XFLOAT *imag)
 }
 
 #ifdef ALTCPU
-void AccProjector::initMdl(std::complex<XFLOAT> *data)
+void AccProjector::initMdl(std::complex<XFLOAT> *data, size_t *rowOffset)
 {
 	mdlComplex = data;  // No copy needed - everyone shares the complex reference arrays
+	mdlRowOffset = rowOffset; // Only set for compact models, also owned outside the projector
 	externalFree = 1;   // This is shared memory freed outside the projector
 }
 #endif
@@ -399,5 +400,6 @@ void AccProjector::clear()
 		delete [] mdlComplex;
 		mdlComplex = NULL;
 	}
+	mdlRowOffset = NULL;
 #endif  // ifdef CUDA or HIP
 }
@@ -28,6 +28,9 @@ public:
 	PROJECTOR_PTR_TYPE mdlComplex;
 #else
 	std::complex<XFLOAT> *mdlComplex;
+	// Only set for compact models, see AccProjector::initMdl
+	size_t *mdlRowOffset;
+	int mdlY;
 #endif
 
 	AccProjectorKernel(
@@ -39,7 +42,8 @@ public:
 #ifndef ALTCPU
 			PROJECTOR_PTR_TYPE mdlComplex
 #else
-			std::complex<XFLOAT> *mdlComplex
+			std::complex<XFLOAT> *mdlComplex,
+			size_t *mdlRowOffset = NULL
 #endif
 			):
 			mdlX(mdlX), mdlXY(mdlX*mdlY), mdlZ(mdlZ),
@@ -48,6 +52,9 @@ public:
 			padding_factor(padding_factor),
 			maxR(maxR), maxR2(maxR*maxR), maxR2_padded(maxR*maxR*padding_factor*padding_factor),
 			mdlComplex(mdlComplex)
+#ifdef ALTCPU
+			, mdlRowOffset(mdlRowOffset), mdlY(mdlY)
+#endif
 		{};
 
 	AccProjectorKernel(
@@ -66,6 +73,8 @@ public:
 				mdlReal(mdlReal), mdlImag(mdlImag)
 			{
 #ifdef ALTCPU
+				this->mdlRowOffset = NULL;
+				this->mdlY = mdlY;
 				std::complex<XFLOAT> *pData = mdlComplex;
 				for(size_t i=0; i<(size_t)mdlX * (size_t)mdlY * (size_t)mdlZ; i++) {
 					std::complex<XFLOAT> arrayval(*mdlReal ++, *mdlImag ++);
@@ -123,7 +132,10 @@ public:
 			real =   syclKernels::no_tex3D(mdlReal, xp, yp, zp, mdlX, mdlXY, mdlInitY, mdlInitZ);
 			imag = - syclKernels::no_tex3D(mdlImag, xp, yp, zp, mdlX, mdlXY, mdlInitY, mdlInitZ);
 #else
-			CpuKernels::complex3D(mdlComplex, real, imag, xp, yp, zp, mdlX, mdlXY, mdlInitY, mdlInitZ);
+			if (mdlRowOffset != NULL)
+				CpuKernels::complex3DCompact(mdlComplex, mdlRowOffset, real, imag, xp, yp, zp, mdlY, mdlInitY, mdlInitZ);
+			else
+				CpuKernels::complex3D(mdlComplex, real, imag, xp, yp, zp, mdlX, mdlXY, mdlInitY, mdlInitZ);
 #endif
 
 			if(invers)
@@ -206,7 +218,10 @@ public:
 			real = syclKernels::no_tex3D(mdlReal, xp, yp, zp, mdlX, mdlXY, mdlInitY, mdlInitZ);
 			imag = syclKernels::no_tex3D(mdlImag, xp, yp, zp, mdlX, mdlXY, mdlInitY, mdlInitZ);
 	#else
-			CpuKernels::complex3D(mdlComplex, real, imag, xp, yp, zp, mdlX, mdlXY, mdlInitY, mdlInitZ);
+			if (mdlRowOffset != NULL)
+				CpuKernels::complex3DCompact(mdlComplex, mdlRowOffset, real, imag, xp, yp, zp, mdlY, mdlInitY, mdlInitZ);
+			else
+				CpuKernels::complex3D(mdlComplex, real, imag, xp, yp, zp, mdlX, mdlXY, mdlInitY, mdlInitZ);
 	#endif
 
 			if(invers)
@@ -282,7 +297,10 @@ __device__ __forceinline__
 			real = syclKernels::no_tex2D(mdlReal, xp, yp, mdlX, mdlInitY);
 			imag = syclKernels::no_tex2D(mdlImag, xp, yp, mdlX, mdlInitY);
 	#else
-			CpuKernels::complex2D(mdlComplex, real, imag, xp, yp, mdlX, mdlInitY);
+			if (mdlRowOffset != NULL)
+				CpuKernels::complex2DCompact(mdlComplex, mdlRowOffset, real, imag, xp, yp, mdlInitY);
+			else
+				CpuKernels::complex2D(mdlComplex, real, imag, xp, yp, mdlX, mdlInitY);
 	#endif
 
 			if(invers)
@@ -332,7 +350,8 @@ __device__ __forceinline__
 					p.mdlReal,
 					p.mdlImag
 #else
-					p.mdlComplex
+					p.mdlComplex,
+					p.mdlRowOffset
 #endif
 #endif
 				);
@@ -306,6 +306,126 @@ static void complex3D(
 	imag = dxy0[1] + (dxy1[1] - dxy0[1])*fz;	
 }
 
+// Read two neighbouring voxels along X from one row of a compact (spherical) model,
+// see SphericalFourierArray. Voxels beyond the end of the row are zero.
+__attribute__((always_inline))
+inline
+static void compactRowPair(
+				std::complex<XFLOAT> * mdlComplex, size_t * mdlRowOffset,
+				size_t row, int x0, XFLOAT *d0, XFLOAT *d1)
+{
+	const size_t start = mdlRowOffset[row];
+	const int len = (int)(mdlRowOffset[row + 1] - start);
+
+	if (x0 < len)
+	{
+		d0[0] = mdlComplex[start + x0].real(); d0[1] = mdlComplex[start + x0].imag();
+	}
+	else
+	{
+		d0[0] = d0[1] = (XFLOAT)0.;
+	}
+
+	if (x0 + 1 < len)
+	{
+		d1[0] = mdlComplex[start + x0 + 1].real(); d1[1] = mdlComplex[start + x0 + 1].imag();
+	}
+	else
+	{
+		d1[0] = d1[1] = (XFLOAT)0.;
+	}
+}
+
+// 2D linear interpolation for a compact model that only stores the voxels inside r_max
+__attribute__((always_inline))
+inline
+static void complex2DCompact(
+				std::complex<XFLOAT> * mdlComplex, size_t * mdlRowOffset,
+				XFLOAT &real, XFLOAT &imag,
+				XFLOAT xp, XFLOAT yp, int mdlInitY)
+{
+	int x0 = floorf(xp);
+	XFLOAT fx = xp - x0;
+
+	int y0 = floorf(yp);
+	XFLOAT fy = yp - y0;
+	y0 -= mdlInitY;
+
+	XFLOAT d00[2], d01[2], d10[2], d11[2];
+	compactRowPair(mdlComplex, mdlRowOffset, (size_t)y0, x0, d00, d01);
+	compactRowPair(mdlComplex, mdlRowOffset, (size_t)y0 + 1, x0, d10, d11);
+
+	//-----------------------------
+	XFLOAT dx0[2], dx1[2];
+
+	dx0[0] = d00[0] + (d01[0] - d00[0]) * fx;
+	dx1[0] = d10[0] + (d11[0] - d10[0]) * fx;
+
+	dx0[1] = d00[1] + (d01[1] - d00[1]) * fx;
+	dx1[1] = d10[1] + (d11[1] - d10[1]) * fx;
+
+	//-----------------------------
+	real = dx0[0] + (dx1[0] - dx0[0])*fy;
+	imag = dx0[1] + (dx1[1] - dx0[1])*fy;
+}
+
+// 3D linear interpolation for a compact model that only stores the voxels inside r_max
+__attribute__((always_inline))
+inline
+static void complex3DCompact(
+				std::complex<XFLOAT> * mdlComplex, size_t * mdlRowOffset,
+				XFLOAT &real, XFLOAT &imag,
+				XFLOAT xp, XFLOAT yp, XFLOAT zp, int mdlY, int mdlInitY, int mdlInitZ)
+{
+	int x0 = floorf(xp);
+	XFLOAT fx = xp - x0;
+
+	int y0 = floorf(yp);
+	XFLOAT fy = yp - y0;
+	y0 -= mdlInitY;
+
+	int z0 = floorf(zp);
+	XFLOAT fz = zp - z0;
+	z0 -= mdlInitZ;
+
+	const size_t row00 = (size_t)z0 * (size_t)mdlY + (size_t)y0;
+	const size_t row01 = row00 + (size_t)1;
+	const size_t row10 = row00 + (size_t)mdlY;
+	const size_t row11 = row10 + (size_t)1;
+
+	XFLOAT d000[2], d001[2], d010[2], d011[2];
+	XFLOAT d100[2], d101[2], d110[2], d111[2];
+
+	compactRowPair(mdlComplex, mdlRowOffset, row00, x0, d000, d001);
+	compactRowPair(mdlComplex, mdlRowOffset, row01, x0, d010, d011);
+	compactRowPair(mdlComplex, mdlRowOffset, row10, x0, d100, d101);
+	compactRowPair(mdlComplex, mdlRowOffset, row11, x0, d110, d111);
+
+	//-----------------------------
+	XFLOAT dx00[2], dx01[2], dx10[2], dx11[2];
+	dx00[0] = d000[0] + (d001[0] - d000[0])*fx;
+	dx01[0] = d100[0] + (d101[0] - d100[0])*fx;
+	dx10[0] = d010[0] + (d011[0] - d010[0])*fx;
+	dx11[0] = d110[0] + (d111[0] - d110[0])*fx;
+
+	dx00[1] = d000[1] + (d001[1] - d000[1])*fx;
+	dx01[1] = d100[1] + (d101[1] - d100[1])*fx;
+	dx10[1] = d010[1] + (d011[1] - d010[1])*fx;
+	dx11[1] = d110[1] + (d111[1] - d110[1])*fx;
+
+	//-----------------------------
+	XFLOAT dxy0[2], dxy1[2];
+	dxy0[0] = dx00[0] + (dx10[0] - dx00[0])*fy;
+	dxy1[0] = dx01[0] + (dx11[0] - dx01[0])*fy;
+
+	dxy0[1] = dx00[1] + (dx10[1] - dx00[1])*fy;
+	dxy1[1] = dx01[1] + (dx11[1] - dx01[1])*fy;
+
+	//-----------------------------
+	real = dxy0[0] + (dxy1[0] - dxy0[0])*fz;
+	imag = dxy0[1] + (dxy1[1] - dxy0[1])*fz;
+}
+
 } // end of namespace CpuKernels
 
 #endif //CPU_UTILITIES_H
@@ -85,17 +85,34 @@ void MlDataBundle::setup(MlOptimiser *baseMLO)
 	//Loop over classes
 	for (int imodel = 0; imodel < nr_proj; imodel++)
 	{
-		projectors[imodel].setMdlDim(
-				baseMLO->mymodel.PPref[imodel].data.xdim,
-				baseMLO->mymodel.PPref[imodel].data.ydim,
-				baseMLO->mymodel.PPref[imodel].data.zdim,
-				baseMLO->mymodel.PPref[imodel].data.yinit,
-				baseMLO->mymodel.PPref[imodel].data.zinit,
-				baseMLO->mymodel.PPref[imodel].r_max,
-				baseMLO->mymodel.PPref[imodel].padding_factor);
-
-		projectors[imodel].initMdl(baseMLO->mdlClassComplex[imodel]);
+		Projector &PPref = baseMLO->mymodel.PPref[imodel];
 
+		if (PPref.hasCompactData())
+		{
+			projectors[imodel].setMdlDim(
+					PPref.compact_data.xdim,
+					PPref.compact_data.ydim,
+					PPref.compact_data.zdim,
+					PPref.compact_data.yinit,
+					PPref.compact_data.zinit,
+					PPref.r_max,
+					PPref.padding_factor);
+
+			projectors[imodel].initMdl(baseMLO->mdlClassComplex[imodel], &(PPref.compact_data.row_offset[0]));
+		}
+		else
+		{
+			projectors[imodel].setMdlDim(
+					PPref.data.xdim,
+					PPref.data.ydim,
+					PPref.data.zdim,
+					PPref.data.yinit,
+					PPref.data.zinit,
+					PPref.r_max,
+					PPref.padding_factor);
+
+			projectors[imodel].initMdl(baseMLO->mdlClassComplex[imodel]);
+		}
 	}
 
 	for (int imodel = 0; imodel < nr_bproj; imodel++)
@@ -25,6 +25,10 @@
 #include <src/jaz/single_particle/obs_model.h>
 #include <src/pipeline_jobs.h>
 #include <cmath>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <map>
 
 class star_handler_parameters
 {
@@ -38,7 +42,8 @@ class star_handler_parameters
 	std::string remove_col_label, add_col_label, add_col_value, add_col_from, hist_col_label, select_include_str, select_exclude_str;
 	RFLOAT eps, select_minval, select_maxval, multiply_by, add_to, center_X, center_Y, center_Z, hist_min, hist_max;
 	bool do_ignore_optics, do_combine, do_combine_picks, do_split, do_center, do_random_order, show_frac, show_cumulative, do_discard;
-	long int nr_split, size_split, nr_bin, random_seed;
+	long int nr_split, size_split, nr_bin, random_seed, chunk_size;
+	int nr_threads;
 	RFLOAT discard_sigma, duplicate_threshold, extract_angpix, cl_angpix;
 	ObservationModel obsModel;
 	// I/O Parser
@@ -58,6 +63,8 @@ class star_handler_parameters
 		fn_in = parser.getOption("--i", "Input STAR file(s)");
 		fn_out = parser.getOption("--o", "Output STAR file", "out.star");
 		do_ignore_optics = parser.checkOption("--ignore_optics", "Provide this option for relion-3.0 functionality, without optics groups");
+		chunk_size = textToLongLong(parser.getOption("--chunk_size", "Read and write the table in chunks of this many lines for --combine, --select, --split (without --random_order) and --operate, so that large STAR files need little memory (0: read whole tables)", "100000"));
+		nr_threads = textToInteger(parser.getOption("--j", "Number of threads for sorting (--check_duplicates), --remove_duplicates and --discard_on_stats", "1"));
 		cl_angpix = textToFloat(parser.getOption("--angpix", "Pixel size in Angstrom, for when ignoring the optics groups in the input star file", "1."));
 		tablename_in = parser.getOption("--i_tablename", "If ignoring optics, then read table with this name", "");
 
@@ -196,6 +203,151 @@ class star_handler_parameters
 		else obsModel.save(MD, fn, tablename);
 	}
 
+	// Open the table that read_check_ignore_optics would read from fn, and read its first chunk of (at most) chunk_size lines into MD.
+	// Returns false, and leaves in closed, if the whole table has to be read at once,
+	// e.g. for relion-3.0 files that need to be converted, or when the optics groups need to be renumbered.
+	bool open_chunks(std::ifstream &in, FileName fn, MetaDataTable &MD, ObservationModel &om)
+	{
+		if (chunk_size <= 0)
+			return false;
+
+		in.open(fn.removeFileFormat().c_str(), std::ios_base::in);
+		if (in.fail())
+			return false; // let the normal reading report the error
+
+		if (do_ignore_optics)
+		{
+			MD.readStar(in, tablename_in, false, chunk_size);
+			if (MD.getActiveLabels().size() == 0 || MD.isAList())
+			{
+				in.close();
+				return false;
+			}
+			return true;
+		}
+
+		MetaDataTable opticsMdt;
+		opticsMdt.readStar(in, "optics");
+		if (opticsMdt.numberOfObjects() > 0)
+			om = ObservationModel(opticsMdt, false);
+
+		bool is_ok = false;
+		std::vector<std::string> tablenames = {"particles", "micrographs", "movies", "tilt_images"};
+		if (opticsMdt.numberOfObjects() > 0 && om.opticsMdt.numberOfObjects() > 0 && om.opticsGroupsSorted())
+		{
+			for (int i = 0; i < tablenames.size(); i++)
+			{
+				in.clear();
+				if (MD.readStar(in, tablenames[i], false, chunk_size) > 0)
+				{
+					is_ok = MD.getName() == tablenames[i] && !MD.isAList() &&
+						(tablenames[i] == "particles" || !om.opticsMdt.containsLabel(EMDL_IMAGE_PIXEL_SIZE));
+					break;
+				}
+			}
+		}
+
+		if (!is_ok)
+		{
+			in.close();
+			return false;
+		}
+
+		check_optics_groups(MD, om, fn);
+
+		om.generalMdt.read(fn, "general");
+		if (om.generalMdt.numberOfObjects() > 0)
+			om.generalMdt.getValue(EMDL_TOMO_SUBTOMOGRAM_STACK2D, om.isTomoStack2D);
+		else
+			om.isTomoStack2D = false;
+
+		return true;
+	}
+
+	// Read the next chunk of the table opened by open_chunks into MD. Returns false at the end of the table.
+	bool next_chunk(std::ifstream &in, FileName fn, MetaDataTable &MD, ObservationModel &om)
+	{
+		if (MD.readStarLoopChunk(in, chunk_size) == 0)
+			return false;
+
+		if (!do_ignore_optics)
+			check_optics_groups(MD, om, fn);
+
+		return true;
+	}
+
+	// Same check as in ObservationModel::loadSafely
+	void check_optics_groups(MetaDataTable &MD, ObservationModel &om, FileName fn)
+	{
+		std::vector<int> undefinedOptGroups = om.findUndefinedOptGroups(MD);
+
+		if (undefinedOptGroups.size() > 0)
+		{
+			std::stringstream sts;
+
+			for (int i = 0; i < undefinedOptGroups.size(); i++)
+			{
+				sts << undefinedOptGroups[i];
+
+				if (i < undefinedOptGroups.size()-1)
+				{
+					sts << ", ";
+				}
+			}
+
+			REPORT_ERROR("ERROR: The following optics groups were not defined in "+
+						 fn + ": " + sts.str());
+		}
+	}
+
+	// Start writing fn in chunks: write_check_ignore_optics, but with the data table written by write_chunk
+	void open_output(std::ofstream &out, FileName fn, ObservationModel &om)
+	{
+		out.open((fn + ".tmp").c_str(), std::ios::out);
+		if (!out)
+			REPORT_ERROR("ERROR: cannot write to " + fn + ".tmp");
+
+		if (!do_ignore_optics)
+		{
+			if (om.generalMdt.numberOfObjects() > 0)
+			{
+				om.generalMdt.setName("general");
+				om.generalMdt.write(out);
+			}
+
+			om.opticsMdt.setName("optics");
+			om.opticsMdt.write(out);
+		}
+	}
+
+	// Write the rows of MD; all chunks written to the same file have to have the same labels
+	void write_chunk(std::ofstream &out, MetaDataTable &MD, std::string tablename, bool &has_header)
+	{
+		if (MD.numberOfObjects() == 0)
+			return;
+
+		if (!has_header)
+		{
+			if (!do_ignore_optics) MD.setName(tablename);
+			MD.writeStarLoopHeader(out);
+			has_header = true;
+		}
+
+		MD.writeStarLoopRows(out);
+	}
+
+	void close_output(std::ofstream &out, FileName fn, bool has_header)
+	{
+		if (has_header)
+			MetaDataTable::writeStarLoopEnd(out);
+
+		out.close();
+		if (!out)
+			REPORT_ERROR("ERROR: failed to write " + fn + ".tmp");
+
+		std::rename((fn + ".tmp").c_str(), fn.c_str());
+	}
+
 	void compare()
 	{
 	   	MetaDataTable MD1, MD2, MDonly1, MDonly2, MDboth;
@@ -235,6 +387,27 @@ class star_handler_parameters
 	{
 		MetaDataTable MDin, MDout;
 
+		std::ifstream in;
+		if (open_chunks(in, fn_in, MDin, obsModel))
+		{
+			std::ofstream out;
+			bool has_header = false;
+			long int nr_selected = 0;
+
+			open_output(out, fn_out, obsModel);
+			do
+			{
+				MDout = subsetMetaDataTable(MDin, EMDL::str2Label(select_label), select_minval, select_maxval);
+				write_chunk(out, MDout, MDin.getName(), has_header);
+				nr_selected += MDout.numberOfObjects();
+			}
+			while (next_chunk(in, fn_in, MDin, obsModel));
+			close_output(out, fn_out, has_header);
+
+			std::cout << " Written: " << fn_out << " with " << nr_selected << " item(s)" << std::endl;
+			return;
+		}
+
 		read_check_ignore_optics(MDin, fn_in, tablename_in);
 
 		MDout = subsetMetaDataTable(MDin, EMDL::str2Label(select_label), select_minval, select_maxval);
@@ -283,29 +456,51 @@ class star_handler_parameters
 		RFLOAT sum_stddev = 0.;
 		RFLOAT sum2_stddev = 0.;
 		RFLOAT sum_n = 0.;
-		std::vector<RFLOAT> avgs, stddevs;
-		long int ii = 0;
-		FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDin)
+		const long int nr_images = MDin.numberOfObjects();
+		const EMDLabel label = EMDL::str2Label(discard_label);
+		std::vector<RFLOAT> avgs(nr_images), stddevs(nr_images);
+		long int nr_done = 0;
+		std::exception_ptr error;
+
+		// Read the images in parallel
+		#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+		for (long int ii = 0; ii < nr_images; ii++)
 		{
-			Image<RFLOAT> img;
-			FileName fn_img;
-			RFLOAT avg, stddev, minval, maxval;
-			MDin.getValue(EMDL::str2Label(discard_label), fn_img);
-			img.read(fn_img);
-			img().computeStats(avg, stddev, minval, maxval);
-			sum_avg += avg;
-			sum2_avg += avg * avg;
-			sum_stddev += stddev;
-			sum2_stddev += stddev * stddev;
-			sum_n += 1.;
-			avgs.push_back(avg);
-			stddevs.push_back(stddev);
+			try
+			{
+				Image<RFLOAT> img;
+				FileName fn_img;
+				RFLOAT minval, maxval;
+				MDin.getValue(label, fn_img, ii);
+				img.read(fn_img);
+				img().computeStats(avgs[ii], stddevs[ii], minval, maxval);
+			}
+			catch (...)
+			{
+				#pragma omp critical(star_handler_discard_on_image_stats)
+				error = std::current_exception();
+			}
 
-			ii++;
-			if (ii%100 == 0) progress_bar(ii);
+			#pragma omp critical(star_handler_discard_on_image_stats)
+			{
+				nr_done++;
+				if (nr_done%100 == 0) progress_bar(nr_done);
+			}
 		}
 
-		progress_bar(MDin.numberOfObjects());
+		if (error) std::rethrow_exception(error);
+
+		progress_bar(nr_images);
+
+		// Sum in the order of the input, as before
+		for (long int ii = 0; ii < nr_images; ii++)
+		{
+			sum_avg += avgs[ii];
+			sum2_avg += avgs[ii] * avgs[ii];
+			sum_stddev += stddevs[ii];
+			sum2_stddev += stddevs[ii] * stddevs[ii];
+			sum_n += 1.;
+		}
 
 		sum_avg /= sum_n;
 		sum_stddev /= sum_n;
@@ -360,21 +555,47 @@ class star_handler_parameters
         std::vector<MetaDataTable> MDsin, MDoptics;
         std::vector<ObservationModel> obsModels;
         ObservationModel myobsModel0;
-        // Read the first table into the global obsModel
-        if (do_ignore_optics) MDin0.read(fns_in[0], tablename_in);
-        else ObservationModel::loadSafely(fns_in[0], obsModel, MDin0, "discover", 1);
-        MDsin.push_back(MDin0);
-        // Read all the rest of the tables into local obsModels
-        for (int i = 1; i < fns_in.size(); i++)
+
+        // If all tables can be read in chunks, only keep their first chunks in MDsin for now
+        std::vector<std::ifstream> ins(fns_in.size());
+        bool do_stream = true;
+        MDsin.resize(fns_in.size());
+        obsModels.resize(fns_in.size() - 1);
+        for (int i = 0; i < fns_in.size() && do_stream; i++)
         {
-            ObservationModel myobsModel;
-            MetaDataTable MDin; // define again, as reading from previous one may linger here...
-            if (do_ignore_optics) MDin.read(fns_in[i], tablename_in);
-            else ObservationModel::loadSafely(fns_in[i], myobsModel, MDin, "discover", 1);
-            MDsin.push_back(MDin);
-            obsModels.push_back(myobsModel);
+            do_stream = open_chunks(ins[i], fns_in[i], MDsin[i], (i == 0) ? obsModel : obsModels[i - 1]);
         }
 
+        if (!do_stream)
+        {
+            for (int i = 0; i < fns_in.size(); i++)
+                if (ins[i].is_open()) ins[i].close();
+            MDsin.clear();
+            obsModels.clear();
+
+            // Read the first table into the global obsModel
+            if (do_ignore_optics) MDin0.read(fns_in[0], tablename_in);
+            else ObservationModel::loadSafely(fns_in[0], obsModel, MDin0, "discover", 1);
+            MDsin.push_back(MDin0);
+            // Read all the rest of the tables into local obsModels
+            for (int i = 1; i < fns_in.size(); i++)
+            {
+                ObservationModel myobsModel;
+                MetaDataTable MDin; // define again, as reading from previous one may linger here...
+                if (do_ignore_optics) MDin.read(fns_in[i], tablename_in);
+                else ObservationModel::loadSafely(fns_in[i], myobsModel, MDin, "discover", 1);
+                MDsin.push_back(MDin);
+                obsModels.push_back(myobsModel);
+            }
+        }
+
+        // The optics tables are changed below: keep the original ones to check the optics groups of the next chunks
+        const ObservationModel obsModel_in0 = obsModel;
+        const std::vector<ObservationModel> obsModels_in = obsModels;
+
+        // For each input table: the new number of each of its optics groups
+        std::vector<std::map<int,int> > new_optics_groups(fns_in.size());
+
         // Combine optics groups with the same EMDL_IMAGE_OPTICS_GROUP_NAME, make new ones for those with a different name
         if (!do_ignore_optics)
         {
@@ -393,14 +614,6 @@ class star_handler_parameters
             {
                 const int obs_id = MDs_id - 1;
 
-                std::vector<int> new_optics_groups;
-                FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDsin[MDs_id])
-                {
-                    int tmp;
-                    MDsin[MDs_id].getValue(EMDL_IMAGE_OPTICS_GROUP, tmp);
-                    new_optics_groups.push_back(tmp);
-                }
-
                 MetaDataTable unique_opticsMdt;
                 unique_opticsMdt.addMissingLabels(&obsModels[obs_id].opticsMdt);
 
@@ -447,32 +660,13 @@ class star_handler_parameters
                         std::cout << " + Renumbering group " << myname << " from " << my_optics_group << " to " << new_group << std::endl;
                     }
 
-                    // Update the optics_group entry for all particles in the MDsin
-                    for (long int current_object2 = MDsin[MDs_id].firstObject();
-                         current_object2 < MDsin[MDs_id].numberOfObjects() && current_object2 >= 0;
-                         current_object2 = MDsin[MDs_id].nextObject())
-                    {
-                        int old_optics_group;
-                        MDsin[MDs_id].getValue(EMDL_IMAGE_OPTICS_GROUP, old_optics_group, current_object2);
-                        if (old_optics_group == my_optics_group)
-                            new_optics_groups[current_object2] = new_group;
-                    }
+                    new_optics_groups[MDs_id][my_optics_group] = new_group;
                 }
 
                 obsModels[obs_id].opticsMdt = unique_opticsMdt;
 
-                FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDsin[MDs_id])
-                {
-                    MDsin[MDs_id].setValue(EMDL_IMAGE_OPTICS_GROUP, new_optics_groups[current_object]);
-
-                    // Also rename the rlnGroupName to not have groups overlapping from different optics groups
-                    std::string name;
-                    if (MDsin[MDs_id].getValue(EMDL_MLMODEL_GROUP_NAME, name))
-                    {
-                        name = "optics"+integerToString(new_optics_groups[current_object])+"_"+name;
-                        MDsin[MDs_id].setValue(EMDL_MLMODEL_GROUP_NAME, name);
-                    }
-                }
+                // Update the optics_group entry for all particles in the MDsin
+                renumber_optics_groups(MDsin[MDs_id], new_optics_groups[MDs_id]);
             }
 
             // Make one vector for combination of the optics tables
@@ -617,6 +811,12 @@ class star_handler_parameters
             obsModel.opticsMdt = MetaDataTable::combineMetaDataTables(MDoptics);
         }
 
+        if (do_stream)
+        {
+            combine_chunks(ins, fns_in, MDsin, obsModel_in0, obsModels_in, new_optics_groups);
+            return;
+        }
+
         // Combine the particles tables
         MDout = MetaDataTable::combineMetaDataTables(MDsin);
 
@@ -630,36 +830,156 @@ class star_handler_parameters
                 REPORT_ERROR("ERROR: the output file does not contain the label to check for duplicates. Is it present in all input files?");
 
             /// Don't want to mess up original order, so make a MDsort with only that label...
-            FileName fn_this, fn_prev = "";
             MetaDataTable MDsort;
-            FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDout)
-            {
-                MDout.getValue(label, fn_this);
-                MDsort.addObject();
-                MDsort.setValue(label, fn_this);
-            }
-            // sort on the label
-            MDsort.newSort(label);
-            long int nr_duplicates = 0;
-            FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDsort)
-            {
-                MDsort.getValue(label, fn_this);
-                if (fn_this == fn_prev)
-                {
-                    nr_duplicates++;
-                    std::cerr << " WARNING: duplicate entry: " << fn_this << std::endl;
-                }
-                fn_prev = fn_this;
-            }
-
-            if (nr_duplicates > 0)
-                std::cerr << " WARNING: Total number of duplicate "<< fn_check << " entries: " << nr_duplicates << std::endl;
+            add_values_to_sort(MDout, MDsort, label);
+            report_duplicates(MDsort, label);
         }
 
         write_check_ignore_optics(MDout, fn_out, MDin0.getName());
 		std::cout << " Written: " << fn_out << std::endl;
 	}
 
+	// Write the combination of the tables that were opened by open_chunks (whose first chunks are in MDsin)
+	void combine_chunks(std::vector<std::ifstream> &ins, std::vector<FileName> &fns_in, std::vector<MetaDataTable> &MDsin,
+	                    const ObservationModel &obsModel_in0, const std::vector<ObservationModel> &obsModels_in,
+	                    const std::vector<std::map<int,int> > &new_optics_groups)
+	{
+		// Find the labels of the output from tables without rows, so that the tables that are read are not changed
+		std::vector<MetaDataTable> MDlabels(MDsin.size());
+		for (int i = 0; i < MDsin.size(); i++)
+		{
+			MDlabels[i].addMissingLabels(&MDsin[i]);
+			MDlabels[i].setName(MDsin[i].getName());
+		}
+		MetaDataTable MDcombined = MetaDataTable::combineMetaDataTables(MDlabels);
+
+		//Deactivate the group_name column
+		MDcombined.deactivateLabel(EMDL_MLMODEL_GROUP_NO);
+
+		EMDLabel label = EMDL_UNDEFINED;
+		if (fn_check != "")
+		{
+			label = EMDL::str2Label(fn_check);
+			if (!MDcombined.containsLabel(label))
+				REPORT_ERROR("ERROR: the output file does not contain the label to check for duplicates. Is it present in all input files?");
+		}
+
+		std::ofstream out;
+		bool has_header = false;
+		MetaDataTable MDsort;
+
+		open_output(out, fn_out, obsModel);
+		for (int i = 0; i < MDsin.size(); i++)
+		{
+			ObservationModel om = (i == 0) ? obsModel_in0 : obsModels_in[i - 1];
+
+			do
+			{
+				MetaDataTable MDchunk = MDsin[i];
+
+				// Disable the labels that are not in all input tables
+				bool changed = true;
+				while (changed)
+				{
+					changed = false;
+					std::vector<EMDLabel> labels = MDchunk.getActiveLabels();
+					for (int j = 0; j < labels.size(); j++)
+					{
+						std::string unknownLabel = (labels[j] == EMDL_UNKNOWN_LABEL) ? MDchunk.getUnknownLabelNameAt(j) : "";
+						if (!MDcombined.containsLabel(labels[j], unknownLabel))
+						{
+							MDchunk.deactivateLabel(labels[j], unknownLabel);
+							changed = true;
+							break;
+						}
+					}
+				}
+
+				MetaDataTable MDout;
+				MDout.addMissingLabels(&MDcombined);
+				MDout.setName(MDcombined.getName());
+				MDout.append(MDchunk);
+
+				if (fn_check != "")
+					add_values_to_sort(MDout, MDsort, label);
+
+				write_chunk(out, MDout, MDsin[0].getName(), has_header);
+
+				if (!next_chunk(ins[i], fns_in[i], MDsin[i], om))
+					break;
+
+				if (i > 0 && !do_ignore_optics)
+					renumber_optics_groups(MDsin[i], new_optics_groups[i]);
+			}
+			while (true);
+
+			ins[i].close();
+		}
+		close_output(out, fn_out, has_header);
+
+		if (fn_check != "")
+			report_duplicates(MDsort, label);
+
+		std::cout << " Written: " << fn_out << std::endl;
+	}
+
+	// Give the optics groups of MD their new numbers, and rename the rlnGroupName to not have groups overlapping from different optics groups
+	void renumber_optics_groups(MetaDataTable &MD, const std::map<int,int> &new_groups)
+	{
+		FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
+		{
+			int group;
+			if (!MD.getValue(EMDL_IMAGE_OPTICS_GROUP, group))
+				continue;
+
+			std::map<int,int>::const_iterator it = new_groups.find(group);
+			if (it != new_groups.end())
+			{
+				group = it->second;
+				MD.setValue(EMDL_IMAGE_OPTICS_GROUP, group);
+			}
+
+			std::string name;
+			if (MD.getValue(EMDL_MLMODEL_GROUP_NAME, name))
+			{
+				name = "optics"+integerToString(group)+"_"+name;
+				MD.setValue(EMDL_MLMODEL_GROUP_NAME, name);
+			}
+		}
+	}
+
+	void add_values_to_sort(MetaDataTable &MD, MetaDataTable &MDsort, EMDLabel label)
+	{
+		FileName fn_this;
+		FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
+		{
+			MD.getValue(label, fn_this);
+			MDsort.addObject();
+			MDsort.setValue(label, fn_this);
+		}
+	}
+
+	void report_duplicates(MetaDataTable &MDsort, EMDLabel label)
+	{
+		FileName fn_this, fn_prev = "";
+		// sort on the label
+		MDsort.newSort(label, false, false, false, nr_threads);
+		long int nr_duplicates = 0;
+		FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDsort)
+		{
+			MDsort.getValue(label, fn_this);
+			if (fn_this == fn_prev)
+			{
+				nr_duplicates++;
+				std::cerr << " WARNING: duplicate entry: " << fn_this << std::endl;
+			}
+			fn_prev = fn_this;
+		}
+
+		if (nr_duplicates > 0)
+			std::cerr << " WARNING: Total number of duplicate "<< fn_check << " entries: " << nr_duplicates << std::endl;
+	}
+
 	void combine_picks()
 	{
 
@@ -775,20 +1095,34 @@ class star_handler_parameters
 	void split()
 	{
 		MetaDataTable MD;
-		read_check_ignore_optics(MD, fn_in, tablename_in);
+		long int n_obj;
 
-		// Randomise if neccesary
-		if (do_random_order)
+		// Without randomisation, the splits can be written while reading the input in chunks
+		std::ifstream in;
+		const bool do_stream = !do_random_order && open_chunks(in, fn_in, MD, obsModel);
+		if (do_stream)
 		{
-			if (random_seed < 0)
-				randomize_random_generator();
-			else
-				init_random_generator(random_seed);
+			MetaDataTable MDcount;
+			n_obj = MDcount.read(fn_in, MD.getName(), true);
+		}
+		else
+		{
+			read_check_ignore_optics(MD, fn_in, tablename_in);
+
+			// Randomise if neccesary
+			if (do_random_order)
+			{
+				if (random_seed < 0)
+					randomize_random_generator();
+				else
+					init_random_generator(random_seed);
 
-			MD.randomiseOrder();
+				MD.randomiseOrder();
+			}
+
+			n_obj = MD.numberOfObjects();
 		}
 
-		long int n_obj = MD.numberOfObjects();
 		if (n_obj == 0)
 		{
 			REPORT_ERROR("ERROR: empty STAR file...");
@@ -808,23 +1142,29 @@ class star_handler_parameters
 		}
 
 		std::vector<MetaDataTable > MDouts;
-		MDouts.resize(nr_split);
-
-		long int n = 0;
-		FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
+		if (!do_stream)
 		{
-			int my_split = n / size_split;
-			if (my_split < nr_split)
-			{
-				MDouts[my_split].addObject(MD.getObject(current_object));
-			}
-			else
+			MDouts.resize(nr_split);
+
+			long int n = 0;
+			FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
 			{
-				break;
+				int my_split = n / size_split;
+				if (my_split < nr_split)
+				{
+					MDouts[my_split].addObject(MD.getObject(current_object));
+				}
+				else
+				{
+					break;
+				}
+				n++;
 			}
-			n++;
 		}
 
+		// Position in the current chunk when streaming
+		long int i_chunk = 0;
+
 		// Sjors 19jun2019: write out a star file with the output nodes
 		MetaDataTable MDnodes;
 		MDnodes.setName("output_nodes");
@@ -833,8 +1173,42 @@ class star_handler_parameters
 		for (int isplit = 0; isplit < nr_split; isplit ++)
 		{
 			FileName fnt = fn_out.insertBeforeExtension("_split"+integerToString(isplit+1));
-			write_check_ignore_optics(MDouts[isplit], fnt, MD.getName());
-			std::cout << " Written: " <<fnt << " with " << MDouts[isplit].numberOfObjects() << " objects." << std::endl;
+			if (do_stream)
+			{
+				std::ofstream out;
+				bool has_header = false;
+				long int nr_written = 0;
+				MetaDataTable MDpart;
+
+				open_output(out, fnt, obsModel);
+				while (nr_written < size_split)
+				{
+					if (i_chunk == MD.numberOfObjects())
+					{
+						i_chunk = 0;
+						if (!next_chunk(in, fn_in, MD, obsModel)) break;
+					}
+
+					MDpart.addObject(MD.getObject(i_chunk));
+					i_chunk++;
+					nr_written++;
+
+					if (MDpart.numberOfObjects() == chunk_size)
+					{
+						write_chunk(out, MDpart, MD.getName(), has_header);
+						MDpart.clear();
+					}
+				}
+				write_chunk(out, MDpart, MD.getName(), has_header);
+				close_output(out, fnt, has_header);
+
+				std::cout << " Written: " <<fnt << " with " << nr_written << " objects." << std::endl;
+			}
+			else
+			{
+				write_check_ignore_optics(MDouts[isplit], fnt, MD.getName());
+				std::cout << " Written: " <<fnt << " with " << MDouts[isplit].numberOfObjects() << " objects." << std::endl;
+			}
 
 			MDnodes.addObject();
 			MDnodes.setValue(EMDL_PIPELINE_NODE_NAME, fnt);
@@ -865,7 +1239,7 @@ class star_handler_parameters
 
 	void operate()
 	{
-		EMDLabel label1, label2, label3;
+		EMDLabel label1, label2 = EMDL_UNDEFINED, label3 = EMDL_UNDEFINED;
 		label1 = EMDL::str2Label(fn_operate);
 		if (fn_operate2 != "")
 		{
@@ -877,8 +1251,36 @@ class star_handler_parameters
 		}
 
 		MetaDataTable MD;
+
+		std::ifstream in;
+		if (open_chunks(in, fn_in, MD, obsModel))
+		{
+			std::ofstream out;
+			bool has_header = false;
+
+			open_output(out, fn_out, obsModel);
+			do
+			{
+				operate_on_table(MD, label1, label2, label3);
+				write_chunk(out, MD, MD.getName(), has_header);
+			}
+			while (next_chunk(in, fn_in, MD, obsModel));
+			close_output(out, fn_out, has_header);
+
+			std::cout << " Written: " << fn_out << std::endl;
+			return;
+		}
+
 		read_check_ignore_optics(MD, fn_in, tablename_in);
 
+		operate_on_table(MD, label1, label2, label3);
+
+		write_check_ignore_optics(MD, fn_out, MD.getName());
+		std::cout << " Written: " << fn_out << std::endl;
+	}
+
+	void operate_on_table(MetaDataTable &MD, EMDLabel label1, EMDLabel label2, EMDLabel label3)
+	{
 		FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
 		{
 			if (EMDL::isDouble(label1))
@@ -964,9 +1366,6 @@ class star_handler_parameters
 			}
 
 		}
-
-		write_check_ignore_optics(MD, fn_out, MD.getName());
-		std::cout << " Written: " << fn_out << std::endl;
 	}
 
 	void center()
@@ -1184,7 +1583,7 @@ class star_handler_parameters
 		FileName fn_removed = fn_out.withoutExtension() + "_removed.star";
 
 
-		MetaDataTable MDout = removeDuplicatedParticles(MD, mic_label, duplicate_threshold, scale, fn_removed, true);
+		MetaDataTable MDout = removeDuplicatedParticles(MD, mic_label, duplicate_threshold, scale, fn_removed, true, nr_threads);
 
 		write_check_ignore_optics(MDout, fn_out, "particles");
 		std::cout << " Written: " << fn_out << std::endl;
@@ -19,7 +19,9 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/autopicker.h"
+#include "src/parallel.h"
 #include <src/jaz/single_particle/new_ft.h>
+#include <omp.h>
 
 //#define DEBUG
 //#define DEBUG_HELIX
@@ -179,6 +181,8 @@ if(do_gpu)
 
 	int expert_section = parser.addSection("Expert options");
 	verb = textToInteger(parser.getOption("--verb", "Verbosity", "1"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads for the (CPU) template matching of each micrograph", "1"));
+	setThreadBudget(nr_threads);
 	padding = textToInteger(parser.getOption("--pad", "Padding factor for Fourier transforms", "2"));
 	random_seed = textToInteger(parser.getOption("--random_seed", "Number for the random seed generator", "1"));
 	workFrac = textToFloat(parser.getOption("--shrink", "Reduce micrograph to this fraction size, during correlation calc (saves memory and time)", "1.0"));
@@ -225,9 +229,8 @@ void AutoPicker::initialise(int rank)
 	TIMING_B1  =           timer.setNew("--FOM prep");
 	TIMING_B2  =           timer.setNew("--Read reference(s) via FOM");
 	TIMING_B3  =           timer.setNew("--Psi-dep correlation calc");
-	TIMING_B4  =           timer.setNew("----ctf-correction");
-	TIMING_B5  =           timer.setNew("----first psi");
-	TIMING_B6  =           timer.setNew("----rest of psis");
+	TIMING_B5  =           timer.setNew("----reference statistics");
+	TIMING_B6  =           timer.setNew("----all psis");
 	TIMING_B7  =           timer.setNew("----write fom maps");
 	TIMING_B8  =           timer.setNew("----peak-prune/-search");
 	TIMING_B9  =           timer.setNew("--final peak-prune");
@@ -239,6 +242,9 @@ void AutoPicker::initialise(int rank)
 #endif
 	if (random_seed == -1) random_seed = time(NULL);
 
+	if (nr_threads < 1)
+		REPORT_ERROR("ERROR: the number of threads (--j) should be at least one.");
+
 	if (fn_in.isStarFile())
 	{
 		ObservationModel::loadSafely(fn_in, obsModel, MDmic, "micrographs", verb);
@@ -3485,6 +3491,24 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 #endif
 	Mccf_best.resize(workSize, workSize);
 	Mpsi_best.resize(workSize, workSize);
+
+	// All in-plane rotations of the references, and scratch arrays for the threads that loop over them
+	std::vector<RFLOAT> psis;
+	for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
+		psis.push_back(psi);
+	struct RotationScratch
+	{
+		FourierTransformer transformer;
+		MultidimArray<Complex> Fref, Fccf;
+		MultidimArray<RFLOAT> Mccf, Mccf_best, Mpsi_best;
+	};
+	std::vector<RotationScratch> rotation_scratch(do_read_fom_maps ? 0 : nr_threads);
+	for (int ithread = 0; ithread < rotation_scratch.size(); ithread++)
+	{
+		rotation_scratch[ithread].Mccf.resize(workSize, workSize);
+		rotation_scratch[ithread].Mccf_best.resize(workSize, workSize);
+		rotation_scratch[ithread].Mpsi_best.resize(workSize, workSize);
+	}
 #ifdef TIMING
 	timer.toc(TIMING_A9);
 #endif
@@ -3665,35 +3689,18 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 #ifdef TIMING
 			timer.tic(TIMING_B3);
 #endif
-			Mccf_best.initConstant(-LARGE_NUMBER);
-			bool is_first_psi = true;
-			for (RFLOAT psi = 0. ; psi < 360.; psi+=psi_sampling)
+			// Calculate the expected ratio of probabilities for this CTF-corrected reference
+			// and the sum_ref_under_circ_mask and sum_ref_under_circ_mask2 from its non-rotated version
+			// This uses the random number generator, so it is done before the rotations are processed in parallel
 			{
-				// Get the Euler matrix
+#ifdef TIMING
+				timer.tic(TIMING_B5);
+#endif
 				Matrix2D<RFLOAT> A(3,3);
-				Euler_angles2matrix(0., 0., psi, A);
-
-				// Now get the FT of the rotated (non-ctf-corrected) template
+				Euler_angles2matrix(0., 0., 0., A);
 				Faux.initZeros(downsize_mic, downsize_mic/2 + 1);
 				PPref[iref].get2DFourierTransform(Faux, A);
 
-#ifdef DEBUG
-				std::cerr << " psi= " << psi << std::endl;
-				windowFourierTransform(Faux, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				tt().resize(micrograph_size, micrograph_size);
-				transformer.inverseFourierTransform(Faux2, tt());
-				tt.write("Mref_rot.spi");
-
-				windowFourierTransform(Fmic, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, tt());
-				tt.write("Mmic.spi");
-
-#endif
-#ifdef TIMING
-	timer.tic(TIMING_B4);
-#endif
 				// Apply the CTF on-the-fly (so same PPref can be used for many different micrographs)
 				if (do_ctf)
 				{
@@ -3701,111 +3708,116 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 					{
 						DIRECT_MULTIDIM_ELEM(Faux, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
 					}
-#ifdef TIMING
-	timer.toc(TIMING_B4);
-#endif
-#ifdef DEBUG
-				MultidimArray<RFLOAT> ttt(micrograph_size, micrograph_size);
-				windowFourierTransform(Faux, Faux2, micrograph_size);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, ttt);
-				ttt.setXmippOrigin();
-				tt().resize(particle_size, particle_size);
-				tt().setXmippOrigin();
-				FOR_ALL_ELEMENTS_IN_ARRAY2D(tt())
-				{
-					A2D_ELEM(tt(), i, j) = A2D_ELEM(ttt, i, j);
-				}
-				tt.write("Mref_rot_ctf.spi");
-#endif
 				}
 
-				if (is_first_psi)
-				{
-#ifdef TIMING
-	timer.tic(TIMING_B5);
-#endif
-					// Calculate the expected ratio of probabilities for this CTF-corrected reference
-					// and the sum_ref_under_circ_mask and sum_ref_under_circ_mask2
-					// Do this also if we're not recalculating the fom maps...
-					// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
-					windowFourierTransform(Faux, Faux2, micrograph_size);
-					CenterFFTbySign(Faux2);
-					Maux.resize(micrograph_size, micrograph_size);
-					transformer.inverseFourierTransform(Faux2, Maux);
-					Maux.setXmippOrigin();
+				// This calculation needs to be done on an "non-shrinked" micrograph, in order to get the correct I^2 statistics
+				windowFourierTransform(Faux, Faux2, micrograph_size);
+				CenterFFTbySign(Faux2);
+				Maux.resize(micrograph_size, micrograph_size);
+				transformer.inverseFourierTransform(Faux2, Maux);
+				Maux.setXmippOrigin();
 #ifdef DEBUG
-					Image<RFLOAT> ttt;
-					ttt()=Maux;
-					ttt.write("Maux.spi");
+				Image<RFLOAT> ttt;
+				ttt()=Maux;
+				ttt.write("Maux.spi");
 #endif
-					sum_ref_under_circ_mask = 0.;
-					sum_ref2_under_circ_mask = 0.;
-					RFLOAT suma2 = 0.;
-					RFLOAT sumn = 1.;
-					MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
-					Mctfref.setXmippOrigin();
-					FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
+				sum_ref_under_circ_mask = 0.;
+				sum_ref2_under_circ_mask = 0.;
+				RFLOAT suma2 = 0.;
+				RFLOAT sumn = 1.;
+				MultidimArray<RFLOAT> Mctfref(particle_size, particle_size);
+				Mctfref.setXmippOrigin();
+				FOR_ALL_ELEMENTS_IN_ARRAY2D(Mctfref) // only loop over smaller Mctfref, but take values from large Maux!
+				{
+					if (i*i + j*j < particle_radius2)
 					{
-						if (i*i + j*j < particle_radius2)
-						{
-							suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
-							sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
-							sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
-							sumn += 1.;
-						}
+						suma2 += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+						suma2 += 2. * A2D_ELEM(Maux, i, j) * rnd_gaus(0., 1.);
+						sum_ref_under_circ_mask += A2D_ELEM(Maux, i, j);
+						sum_ref2_under_circ_mask += A2D_ELEM(Maux, i, j) * A2D_ELEM(Maux, i, j);
+						sumn += 1.;
+					}
 #ifdef DEBUG
-						A2D_ELEM(Mctfref, i, j) = A2D_ELEM(Maux, i, j);
+					A2D_ELEM(Mctfref, i, j) = A2D_ELEM(Maux, i, j);
 #endif
-					}
-					sum_ref_under_circ_mask /= sumn;
-					sum_ref2_under_circ_mask /= sumn;
-					expected_Pratio = exp(suma2 / (2. * sumn));
+				}
+				sum_ref_under_circ_mask /= sumn;
+				sum_ref2_under_circ_mask /= sumn;
+				expected_Pratio = exp(suma2 / (2. * sumn));
 #ifdef DEBUG
-					std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
-					tt()=Mctfref;
-					tt.write("Mctfref.spi");
-					std::cerr << "suma2 " << suma2<< " sumn " << sumn << " suma2/2sumn="<< suma2 / (2. * sumn) << std::endl;
-					std::cerr << " nr_pixels_under_mask= " << nr_pixels_circular_mask << " nr_pixels_under_invmask= " << nr_pixels_circular_invmask << std::endl;
-					std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
-					std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
-					std::cerr << "expected_Pratio " << expected_Pratio << std::endl;
+				std::cerr << " expected_Pratio["<<iref<<"]= " << expected_Pratio << std::endl;
+				tt()=Mctfref;
+				tt.write("Mctfref.spi");
+				std::cerr << "suma2 " << suma2<< " sumn " << sumn << " suma2/2sumn="<< suma2 / (2. * sumn) << std::endl;
+				std::cerr << " nr_pixels_under_mask= " << nr_pixels_circular_mask << " nr_pixels_under_invmask= " << nr_pixels_circular_invmask << std::endl;
+				std::cerr << "sum_ref_under_circ_mask " << sum_ref_under_circ_mask << std::endl;
+				std::cerr << "sum_ref2_under_circ_mask " << sum_ref2_under_circ_mask << std::endl;
+				std::cerr << "expected_Pratio " << expected_Pratio << std::endl;
 #endif
 
-					// Maux goes back to the workSize
-					Maux.resize(workSize, workSize);
+				// Maux goes back to the workSize
+				Maux.resize(workSize, workSize);
 #ifdef TIMING
-					timer.toc(TIMING_B5);
+				timer.toc(TIMING_B5);
 #endif
-				}
+			}
 
 #ifdef TIMING
-				timer.tic(TIMING_B6);
+			timer.tic(TIMING_B6);
 #endif
+			// Now loop over all in-plane rotations in parallel
+			// Each thread keeps track of its own best values, which are combined afterwards
+			for (int ithread = 0; ithread < nr_threads; ithread++)
+			{
+				rotation_scratch[ithread].Mccf_best.initConstant(-LARGE_NUMBER);
+				rotation_scratch[ithread].Mpsi_best.initZeros();
+			}
+
+			#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+			for (int ipsi = 0; ipsi < psis.size(); ipsi++)
+			{
+				RotationScratch &my_scratch = rotation_scratch[omp_get_thread_num()];
+				RFLOAT psi = psis[ipsi];
+
+				// Get the Euler matrix
+				Matrix2D<RFLOAT> A(3,3);
+				Euler_angles2matrix(0., 0., psi, A);
+
+				// Now get the FT of the rotated (non-ctf-corrected) template
+				MultidimArray<Complex> &Fref = my_scratch.Fref;
+				Fref.initZeros(downsize_mic, downsize_mic/2 + 1);
+				PPref[iref].get2DFourierTransform(Fref, A);
+
+				// Apply the CTF on-the-fly (so same PPref can be used for many different micrographs)
+				if (do_ctf)
+				{
+					FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fref)
+					{
+						DIRECT_MULTIDIM_ELEM(Fref, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+					}
+				}
+
 				// Now multiply template and micrograph to calculate the cross-correlation
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Faux)
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fref)
 				{
-					DIRECT_MULTIDIM_ELEM(Faux, n) = conj(DIRECT_MULTIDIM_ELEM(Faux, n)) * DIRECT_MULTIDIM_ELEM(Fmic, n);
+					DIRECT_MULTIDIM_ELEM(Fref, n) = conj(DIRECT_MULTIDIM_ELEM(Fref, n)) * DIRECT_MULTIDIM_ELEM(Fmic, n);
 				}
 
-				// If we're not doing shrink, then Faux is bigger than Faux2!
-				windowFourierTransform(Faux, Faux2, workSize);
-				CenterFFTbySign(Faux2);
-				transformer.inverseFourierTransform(Faux2, Maux);
-#ifdef DEBUG
-				tt()=Maux*normfft;
-				tt.write("Mcc.spi");
-#endif
+				// If we're not doing shrink, then Fref is bigger than Fccf!
+				windowFourierTransform(Fref, my_scratch.Fccf, workSize);
+				CenterFFTbySign(my_scratch.Fccf);
+				// Mccf always keeps the same size, so the FFTW plans of this thread are re-used for all rotations
+				MultidimArray<RFLOAT> &Mccf = my_scratch.Mccf;
+				my_scratch.transformer.inverseFourierTransform(my_scratch.Fccf, Mccf);
 
 				// Calculate ratio of prabilities P(ref)/P(zero)
 				// Keep track of the best values and their corresponding iref and psi
 
 				// So now we already had precalculated: Mdiff2 = 1/sig*Sum(X^2) - 2/sig*Sum(X) + mu^2/sig*Sum(1)
 				// Still to do (per reference): - 2/sig*Sum(AX) + 2*mu/sig*Sum(A) + Sum(A^2)
-				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Maux)
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Mccf)
 				{
-					RFLOAT diff2 = - 2. * normfft * DIRECT_MULTIDIM_ELEM(Maux, n);
+					RFLOAT diff2 = - 2. * normfft * DIRECT_MULTIDIM_ELEM(Mccf, n);
 					diff2 += 2. * DIRECT_MULTIDIM_ELEM(Mmean, n) * sum_ref_under_circ_mask;
 					if (DIRECT_MULTIDIM_ELEM(Mstddev, n) > 1E-10)
 						diff2 /= DIRECT_MULTIDIM_ELEM(Mstddev, n);
@@ -3814,28 +3826,37 @@ void AutoPicker::autoPickOneMicrograph(FileName &fn_mic, long int imic)
 
 					// Store fraction of (1 - probability-ratio) wrt  (1 - expected Pratio)
 					diff2 = (diff2 - 1.) / (expected_Pratio - 1.);
-#ifdef DEBUG
-					DIRECT_MULTIDIM_ELEM(Maux, n) = diff2;
-#endif
-					if (diff2 > DIRECT_MULTIDIM_ELEM(Mccf_best, n))
+					if (diff2 > DIRECT_MULTIDIM_ELEM(my_scratch.Mccf_best, n))
 					{
-						DIRECT_MULTIDIM_ELEM(Mccf_best, n) = diff2;
-						DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = psi;
+						DIRECT_MULTIDIM_ELEM(my_scratch.Mccf_best, n) = diff2;
+						DIRECT_MULTIDIM_ELEM(my_scratch.Mpsi_best, n) = psi;
 					}
 				}
-#ifdef DEBUG
-				std::cerr << " Maux.computeMax()= " << Maux.computeMax() << std::endl;
-				tt()=Maux;
-				tt.write("Mccf.spi");
-			    std::cerr << " Press any key to continue... "  << std::endl;
-			    char c;
-			    std::cin >> c;
-#endif
-			    is_first_psi = false;
+			} // end for psi
+
+			// Combine the best values of all threads
+			// For equal values, the smallest psi is kept, as when looping over the rotations in order
+			#pragma omp parallel for num_threads(nr_threads)
+			for (long int n = 0; n < MULTIDIM_SIZE(Mccf_best); n++)
+			{
+				RFLOAT best_ccf = -LARGE_NUMBER;
+				RFLOAT best_psi = 0.;
+				for (int ithread = 0; ithread < nr_threads; ithread++)
+				{
+					RFLOAT my_ccf = DIRECT_MULTIDIM_ELEM(rotation_scratch[ithread].Mccf_best, n);
+					RFLOAT my_psi = DIRECT_MULTIDIM_ELEM(rotation_scratch[ithread].Mpsi_best, n);
+					if (my_ccf > best_ccf || (my_ccf == best_ccf && my_ccf > -LARGE_NUMBER && my_psi < best_psi))
+					{
+						best_ccf = my_ccf;
+						best_psi = my_psi;
+					}
+				}
+				DIRECT_MULTIDIM_ELEM(Mccf_best, n) = best_ccf;
+				DIRECT_MULTIDIM_ELEM(Mpsi_best, n) = best_psi;
+			}
 #ifdef TIMING
-	timer.toc(TIMING_B6);
+			timer.toc(TIMING_B6);
 #endif
-			} // end for psi
 #ifdef TIMING
 	timer.toc(TIMING_B3);
 #endif
@@ -102,6 +102,9 @@ public:
 	// Verbosity
 	int verb;
 
+	// Number of threads for the template matching on the CPU
+	int nr_threads;
+
 	// Random seed
 	long int random_seed;
 
@@ -325,7 +328,7 @@ public:
 #ifdef TIMING
     Timer timer;
 	int TIMING_A0, TIMING_A1, TIMING_A2, TIMING_A3, TIMING_A4, TIMING_A5, TIMING_A6, TIMING_A7, TIMING_A8, TIMING_A9;
-	int TIMING_B1, TIMING_B2, TIMING_B3, TIMING_B4, TIMING_B5, TIMING_B6, TIMING_B7, TIMING_B8, TIMING_B9;
+	int TIMING_B1, TIMING_B2, TIMING_B3, TIMING_B5, TIMING_B6, TIMING_B7, TIMING_B8, TIMING_B9;
 #endif
 
 public:
@@ -41,6 +41,7 @@ void BackProjector::initialiseDataAndWeight(int current_size)
 
 	initialiseData(current_size);
 	weight.resize(data);
+	compact_weight.clear();
 
 }
 
@@ -52,6 +53,31 @@ void BackProjector::initZeros(int current_size)
 	weight.initZeros();
 }
 
+void BackProjector::compactDataAndWeight()
+{
+	if (hasCompactData())
+		return;
+
+	// Trilinear interpolation of points within r_max touches voxels up to sqrt(3) pixels further out
+	const int radius = ROUND(r_max * padding_factor) + 2;
+
+	compact_data.compress(data, radius);
+	data.clear();
+	compact_weight.compress(weight, radius);
+	weight.clear();
+}
+
+void BackProjector::expandDataAndWeight()
+{
+	if (!hasCompactData())
+		return;
+
+	compact_data.expand(data);
+	compact_data.clear();
+	compact_weight.expand(weight);
+	compact_weight.clear();
+}
+
 void BackProjector::backproject2Dto3D(const MultidimArray<Complex > &f2d,
   	                              const Matrix2D<RFLOAT> &A,
                                       const MultidimArray<RFLOAT> *Mweight,
@@ -86,6 +112,14 @@ void BackProjector::backproject2Dto3D(const MultidimArray<Complex > &f2d,
 	const int max_r2 = ROUND(r_max * padding_factor) * ROUND(r_max * padding_factor);
 	const int min_r2_nn = ROUND(r_min_nn * padding_factor) * ROUND(r_min_nn * padding_factor);
 
+	// The data and weight may be stored in full or in compact form (see compactDataAndWeight())
+	const bool do_compact = hasCompactData();
+	const long int mdl_xdim = (do_compact) ? compact_data.xdim : XSIZE(data);
+	const long int mdl_ydim = (do_compact) ? compact_data.ydim : YSIZE(data);
+	const long int mdl_zdim = (do_compact) ? compact_data.zdim : ZSIZE(data);
+	const long int mdl_yinit = (do_compact) ? compact_data.yinit : STARTINGY(data);
+	const long int mdl_zinit = (do_compact) ? compact_data.zinit : STARTINGZ(data);
+
 	// precalculated coefficients for ellipse determination (see further down)
 
 	// first, make sure A contains 2D distortion (lowercase 2D, uppercase 3D):
@@ -251,17 +285,17 @@ void BackProjector::backproject2Dto3D(const MultidimArray<Complex > &f2d,
 
 				int y0 = FLOOR(yp);
 				RFLOAT fy = yp - y0;
-				y0 -=  STARTINGY(data);
+				y0 -=  mdl_yinit;
 				int y1 = y0 + 1;
 
 				int z0 = FLOOR(zp);
 				RFLOAT fz = zp - z0;
-				z0 -= STARTINGZ(data);
+				z0 -= mdl_zinit;
 				int z1 = z0 + 1;
 
-				if (x0 < 0 || x0+1 >= data.xdim
-				 || y0 < 0 || y0+1 >= data.ydim
-				 || z0 < 0 || z0+1 >= data.zdim)
+				if (x0 < 0 || x0+1 >= mdl_xdim
+				 || y0 < 0 || y0+1 >= mdl_ydim
+				 || z0 < 0 || z0+1 >= mdl_zdim)
 				{
 					continue;
 				}
@@ -284,6 +318,27 @@ void BackProjector::backproject2Dto3D(const MultidimArray<Complex > &f2d,
 					my_val = conj(my_val);
 				}
 
+				if (do_compact)
+				{
+					compact_data.addValue(z0, y0, x0, dd000 * my_val);
+					compact_data.addValue(z0, y0, x1, dd001 * my_val);
+					compact_data.addValue(z0, y1, x0, dd010 * my_val);
+					compact_data.addValue(z0, y1, x1, dd011 * my_val);
+					compact_data.addValue(z1, y0, x0, dd100 * my_val);
+					compact_data.addValue(z1, y0, x1, dd101 * my_val);
+					compact_data.addValue(z1, y1, x0, dd110 * my_val);
+					compact_data.addValue(z1, y1, x1, dd111 * my_val);
+					compact_weight.addValue(z0, y0, x0, dd000 * my_weight);
+					compact_weight.addValue(z0, y0, x1, dd001 * my_weight);
+					compact_weight.addValue(z0, y1, x0, dd010 * my_weight);
+					compact_weight.addValue(z0, y1, x1, dd011 * my_weight);
+					compact_weight.addValue(z1, y0, x0, dd100 * my_weight);
+					compact_weight.addValue(z1, y0, x1, dd101 * my_weight);
+					compact_weight.addValue(z1, y1, x0, dd110 * my_weight);
+					compact_weight.addValue(z1, y1, x1, dd111 * my_weight);
+					continue;
+				}
+
 				// Store slice in 3D weighted sum
 				DIRECT_A3D_ELEM(data, z0, y0, x0) += dd000 * my_val;
 				DIRECT_A3D_ELEM(data, z0, y0, x1) += dd001 * my_val;
@@ -325,18 +380,23 @@ void BackProjector::backproject2Dto3D(const MultidimArray<Complex > &f2d,
 					is_neg_x = false;
 				}
 
-				const int xr = x0 - STARTINGX(data);
-				const int yr = y0 - STARTINGY(data);
-				const int zr = z0 - STARTINGZ(data);
+				const int xr = x0;
+				const int yr = y0 - mdl_yinit;
+				const int zr = z0 - mdl_zinit;
 
-				if (xr < 0 || xr >= data.xdim
-				 || yr < 0 || yr >= data.ydim
-				 || zr < 0 || zr >= data.zdim)
+				if (xr < 0 || xr >= mdl_xdim
+				 || yr < 0 || yr >= mdl_ydim
+				 || zr < 0 || zr >= mdl_zdim)
 				{
 					continue;
 				}
 
-				if (is_neg_x)
+				if (do_compact)
+				{
+					compact_data.addValue(zr, yr, xr, (is_neg_x) ? conj(my_val) : my_val);
+					compact_weight.addValue(zr, yr, xr, my_weight);
+				}
+				else if (is_neg_x)
 				{
 					DIRECT_A3D_ELEM(data, zr, yr, xr) += conj(my_val);
 					DIRECT_A3D_ELEM(weight, zr, yr, xr) += my_weight;
@@ -359,6 +419,9 @@ void BackProjector::backproject1Dto2D(const MultidimArray<Complex > &f1d,
                                       const Matrix2D<RFLOAT> &A,
                                       const MultidimArray<RFLOAT> *Mweight)
 {
+	if (hasCompactData())
+		REPORT_ERROR("BackProjector::backproject1Dto2D: not implemented for compact data, call expandData() first");
+
 	Matrix2D<RFLOAT> Ainv = A.inv();
 	Ainv *= (RFLOAT)padding_factor;  // take scaling into account directly
 
@@ -473,6 +536,9 @@ void BackProjector::backrotate2D(const MultidimArray<Complex > &f2d,
                                  const MultidimArray<RFLOAT> *Mweight,
                                  Matrix2D<RFLOAT>* magMatrix)
 {
+	if (hasCompactData())
+		REPORT_ERROR("BackProjector::backrotate2D: not implemented for compact data, call expandData() first");
+
 	Matrix2D<RFLOAT> Ainv = A.inv();
 	Ainv *= (RFLOAT)padding_factor;  // take scaling into account directly
 
@@ -671,6 +737,9 @@ void BackProjector::backrotate3D(const MultidimArray<Complex > &f3d,
                                  const Matrix2D<RFLOAT> &A,
                                  const MultidimArray<RFLOAT> *Mweight)
 {
+	if (hasCompactData())
+		REPORT_ERROR("BackProjector::backrotate3D: not implemented for compact data, call expandData() first");
+
 	// f3d should already be in the right size (ori_size,orihalfdim)
 	// AND the points outside max_r should already be zero.
 
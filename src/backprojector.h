@@ -43,6 +43,9 @@ public:
 	// For backward projection: sum of weights
 	MultidimArray<RFLOAT> weight;
 
+	// Compact version of the weight array (see compactDataAndWeight())
+	SphericalFourierArray<RFLOAT> compact_weight;
+
 	// Tabulated blob values
 	TabFtBlob tab_ftblob;
 
@@ -138,6 +141,7 @@ public:
 		{
 			// Projector stuff (is this necessary in C++?)
 			data = op.data;
+			compact_data = op.compact_data;
 			ori_size = op.ori_size;
 			pad_size = op.pad_size;
 			r_max = op.r_max;
@@ -149,6 +153,7 @@ public:
 			skip_gridding = op.skip_gridding;
 			// BackProjector stuff
 			weight = op.weight;
+			compact_weight = op.compact_weight;
 			tab_ftblob = op.tab_ftblob;
 			SL = op.SL;
 		}
@@ -172,6 +177,7 @@ public:
 	{
 		skip_gridding = false;
 		weight.clear();
+		compact_weight.clear();
 		Projector::clear();
 	}
 
@@ -181,6 +187,19 @@ public:
 	// Initialise data and weight arrays to the given size and set all values to zero
 	void initZeros(int current_size = -1);
 
+	/*
+	 * Replace the data and weight arrays by compact ones that only store the voxels that
+	 * backproject2Dto3D can reach (i.e. within r_max plus the interpolation footprint).
+	 * backproject2Dto3D works on either representation; call expandDataAndWeight()
+	 * before anything else (symmetrise, reconstruct, MPI communication) touches the arrays.
+	 */
+	void compactDataAndWeight();
+
+	/*
+	 * Go back from the compact representation to the full data and weight arrays
+	 */
+	void expandDataAndWeight();
+
 	/*
 	* Set a 2D Fourier Transform back into the 2D or 3D data array
 	* Depending on the dimension of the map, this will be a backprojection or a rotation operation
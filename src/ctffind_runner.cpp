@@ -18,7 +18,12 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/ctffind_runner.h"
+#include "src/parallel.h"
+#include "src/jaz/single_particle/ctf/spa_ctf_find.h"
 #include <cmath>
+#include <iomanip>
+#include <exception>
+#include <set>
 
 #ifdef _CUDA_ENABLED
 #include "src/acc/cuda/cuda_mem_utils.h"
@@ -73,9 +78,17 @@ void CtffindRunner::read(int argc, char **argv, int rank)
 	phase_min  = textToFloat(parser.getOption("--phase_min", "Minimum phase shift (in degrees)", "0."));
 	phase_max  = textToFloat(parser.getOption("--phase_max", "Maximum phase shift (in degrees)", "180."));
 	phase_step = textToFloat(parser.getOption("--phase_step", "Step in phase shift (in degrees)", "10."));
-	nr_threads = textToInteger(parser.getOption("--j", "Number of threads (for CTFIND4 only)", "1"));
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads (for CTFIND4 and --use_internal only)", "1"));
+	setThreadBudget(nr_threads);
 	do_fast_search = parser.checkOption("--fast_search", "Disable \"Slower, more exhaustive search\" in CTFFIND4.1 (faster but less accurate)");
 
+	int internal_section = parser.addSection("Internal CTF estimation");
+	do_internal = parser.checkOption("--use_internal", "Estimate CTFs in-process instead of running CTFFIND, for --j micrographs at a time (uses --Box, --ResMin, --ResMax, --dFMin, --dFMax, --FStep, --ctfWin and --use_given_ps)");
+
+	// The internal estimation writes its results in the same form as CTFFIND4
+	if (do_internal)
+		is_ctffind4 = true;
+
 	// Initialise verb for non-parallel execution
 	verb = 1;
 
@@ -110,6 +123,12 @@ void CtffindRunner::initialise(bool is_leader)
 	if (use_given_ps && do_movie_thon_rings)
 		REPORT_ERROR("ERROR: You cannot enable --use_given_ps and --do_movie_thon_rings simultaneously");
 
+	if (do_internal && do_movie_thon_rings)
+		REPORT_ERROR("ERROR: --do_movie_thon_rings is not available with --use_internal");
+
+	if (do_internal && do_phaseshift)
+		REPORT_ERROR("ERROR: --do_phaseshift is not available with --use_internal");
+
 	if (use_given_ps)
 		do_use_without_doseweighting = false;
 
@@ -257,12 +276,21 @@ void CtffindRunner::initialise(bool is_leader)
 	fn_micrographs_ctf.clear();
 
 	bool warned = false;
+
+	// Micrographs in the ledger were finished in an earlier run: their logfiles are not read again
+	if (continue_old)
+		ledger.read(fn_out + "processing_ledger.txt", getLedgerSignature());
+
 	for (long int imic = 0; imic < fn_mic_given_all.size(); imic++)
 	{
 		bool ignore_this = false;
 		bool process_this = true;
 
-		if (continue_old)
+		if (continue_old && ledger.contains(fn_mic_ctf_given_all[imic]) && hasOutputFiles(fn_mic_ctf_given_all[imic]))
+		{
+			process_this = false; // already done
+		}
+		else if (continue_old)
 		{
 			FileName fn_microot = fn_mic_ctf_given_all[imic].withoutExtension();
 			RFLOAT defU, defV, defAng, CC, HT, CS, AmpCnst, XMAG, DStep, maxres=-1., valscore = -1., phaseshift = 0., icering = 0.;
@@ -341,7 +369,10 @@ void CtffindRunner::initialise(bool is_leader)
 
 	if (verb > 0)
 	{
-        std::cout << " Using CTFFIND executable in: " << fn_ctffind_exe << std::endl;
+		if (do_internal)
+			std::cout << " Using the internal CTF estimation" << std::endl;
+		else
+			std::cout << " Using CTFFIND executable in: " << fn_ctffind_exe << std::endl;
 		std::cout << " to estimate CTF parameters for the following micrographs: " << std::endl;
 		if (continue_old)
 			std::cout << " (skipping all micrographs for which a logfile with Final values already exists " << std::endl;
@@ -353,7 +384,11 @@ void CtffindRunner::initialise(bool is_leader)
 void CtffindRunner::run()
 {
 
-	if (!do_only_join_results)
+	if (!do_only_join_results && do_internal)
+	{
+		runInternal(0, fn_micrographs.size() - 1);
+	}
+	else if (!do_only_join_results)
 	{
 		int barstep;
 		if (verb > 0)
@@ -410,14 +445,57 @@ void CtffindRunner::joinCtffindResults()
 		init_progress_bar(fn_micrographs_all.size());
 	}
 
+	// Without --only_do_unfinished, all micrographs have just been (re-)processed
+	if (!continue_old)
+		ledger.reset(fn_out + "processing_ledger.txt", getLedgerSignature());
+
+	// Ledger entries of micrographs that were (re-)processed in this run are out of date
+	std::set<FileName> fn_processed(fn_micrographs_ctf.begin(), fn_micrographs_ctf.end());
+
 	MetaDataTable MDctf;
 	for (long int imic = 0; imic < fn_micrographs_all.size(); imic++)
 	{
 		FileName fn_microot = fn_micrographs_ctf_all[imic].withoutExtension();
 		RFLOAT defU, defV, defAng, CC, HT, CS, AmpCnst, XMAG, DStep;
 		RFLOAT maxres = -999., valscore = -999., phaseshift = -999., icering = 0.;
-		bool has_this_ctf = getCtffindResults(fn_microot, defU, defV, defAng, CC,
-		                                      HT, CS, AmpCnst, XMAG, DStep, maxres, valscore, phaseshift, icering);
+		bool has_this_ctf;
+
+		if (ledger.contains(fn_micrographs_ctf_all[imic]) && fn_processed.count(fn_micrographs_ctf_all[imic]) == 0
+		    && hasOutputFiles(fn_micrographs_ctf_all[imic]))
+		{
+			// Stored when the logfile of this micrograph was first read
+			const std::vector<std::string> &values = ledger.getValues(fn_micrographs_ctf_all[imic]);
+			has_this_ctf = (values.size() == 8);
+			if (has_this_ctf)
+			{
+				defU = textToDouble(values[0]);
+				defV = textToDouble(values[1]);
+				defAng = textToDouble(values[2]);
+				CC = textToDouble(values[3]);
+				maxres = textToDouble(values[4]);
+				valscore = textToDouble(values[5]);
+				phaseshift = textToDouble(values[6]);
+				icering = textToDouble(values[7]);
+			}
+		}
+		else
+		{
+			has_this_ctf = getCtffindResults(fn_microot, defU, defV, defAng, CC,
+			                                 HT, CS, AmpCnst, XMAG, DStep, maxres, valscore, phaseshift, icering);
+			if (has_this_ctf)
+			{
+				std::vector<std::string> values;
+				values.push_back(ProcessingLedger::numberToString(defU));
+				values.push_back(ProcessingLedger::numberToString(defV));
+				values.push_back(ProcessingLedger::numberToString(defAng));
+				values.push_back(ProcessingLedger::numberToString(CC));
+				values.push_back(ProcessingLedger::numberToString(maxres));
+				values.push_back(ProcessingLedger::numberToString(valscore));
+				values.push_back(ProcessingLedger::numberToString(phaseshift));
+				values.push_back(ProcessingLedger::numberToString(icering));
+				ledger.add(fn_micrographs_ctf_all[imic], values);
+			}
+		}
 
 		if (!has_this_ctf)
 		{
@@ -486,7 +564,10 @@ void CtffindRunner::joinCtffindResults()
     }
     else
     {
-        obsModel.save(MDctf, fn_out + "micrographs_ctf.star", "micrographs");
+        // If only micrographs were added since the last run, this only appends them to the file
+        std::ostringstream sstr;
+        obsModel.write(sstr, MDctf, "micrographs");
+        ledger.writeFile(fn_out + "micrographs_ctf.star", sstr.str());
     }
 
 	if (verb > 0)
@@ -784,6 +865,173 @@ void CtffindRunner::executeCtffind4(long int imic)
 	}
 }
 
+void CtffindRunner::runInternal(long int my_first_micrograph, long int my_last_micrograph)
+{
+	const long int my_nr_micrographs = my_last_micrograph - my_first_micrograph + 1;
+
+	int barstep;
+	if (verb > 0)
+	{
+		std::cout << " Estimating CTF parameters using " << nr_threads << " thread(s) ..." << std::endl;
+		init_progress_bar(my_nr_micrographs);
+		barstep = XMIPP_MAX(1, my_nr_micrographs / 60);
+	}
+
+	// Micrographs are handed to the threads one at a time, each estimated single-threaded.
+	// With fewer micrographs than threads, the threads are used within each micrograph.
+	const int mic_threads = (my_nr_micrographs >= nr_threads) ? nr_threads : 1;
+	const int inner_threads = (mic_threads > 1) ? 1 : nr_threads;
+
+	long int nr_done = 0;
+	bool aborted = false;
+	std::exception_ptr error;
+
+	#pragma omp parallel for num_threads(mic_threads) schedule(dynamic, 1)
+	for (long int imic = my_first_micrograph; imic <= my_last_micrograph; imic++)
+	{
+		// Abort through the pipeline_control system: skip the remaining micrographs, exit after the loop
+		if (pipeline_control_check_abort_job())
+		{
+			#pragma omp critical(CtffindRunner_runInternal)
+			aborted = true;
+			continue;
+		}
+
+		try
+		{
+			executeInternal(imic, inner_threads);
+		}
+		catch (RelionError &e)
+		{
+			// As when CTFFIND fails: this micrograph will be skipped when joining the results
+			#pragma omp critical(CtffindRunner_runInternal)
+			std::cerr << "WARNING: CTF estimation failed for " << fn_micrographs[imic] << ": " << e.msg << std::endl;
+		}
+		catch (...)
+		{
+			#pragma omp critical(CtffindRunner_runInternal)
+			error = std::current_exception();
+		}
+
+		#pragma omp critical(CtffindRunner_runInternal)
+		{
+			nr_done++;
+
+			if (verb > 0 && nr_done % barstep == 0)
+				progress_bar(nr_done);
+		}
+	}
+
+	if (aborted) exit(RELION_EXIT_ABORTED);
+	if (error) std::rethrow_exception(error);
+
+	if (verb > 0)
+		progress_bar(my_nr_micrographs);
+}
+
+void CtffindRunner::executeInternal(long int imic, int threads)
+{
+	FileName fn_mic = getOutputFileWithNewUniqueDate(fn_micrographs_ctf[imic], fn_out);
+	FileName fn_root = fn_mic.withoutExtension();
+	FileName fn_log = fn_root + "_ctffind4.log";
+	FileName fn_txt = fn_root + ".txt";
+	FileName fn_ctf = fn_root + ".ctf:mrc";
+
+	RFLOAT my_min_defocus, my_max_defocus, my_maxres;
+	getMySearchParameters(imic, my_min_defocus, my_max_defocus, my_maxres);
+
+	// Not the Cs, Voltage, ... members: those are shared by all threads
+	RFLOAT mic_Cs, mic_voltage, mic_Q0, mic_angpix;
+	const long int optics_group = optics_group_micrographs[imic] - 1;
+	obsModel.opticsMdt.getValue(EMDL_CTF_CS, mic_Cs, optics_group);
+	obsModel.opticsMdt.getValue(EMDL_CTF_VOLTAGE, mic_voltage, optics_group);
+	obsModel.opticsMdt.getValue(EMDL_CTF_Q0, mic_Q0, optics_group);
+	EMDLabel mylabel = (is_tomo) ? EMDL_TOMO_TILT_SERIES_PIXEL_SIZE : EMDL_MICROGRAPH_PIXEL_SIZE;
+	obsModel.opticsMdt.getValue(mylabel, mic_angpix, optics_group);
+
+	Image<float> Imic;
+	Imic.read(fn_mic);
+
+	BufferedImage<float> spectrum;
+	RFLOAT ps_angpix = mic_angpix;
+
+	if (use_given_ps)
+	{
+		// Amplitude spectrum, e.g. from relion_run_motioncorr --grouping_for_ps, with its own pixel size
+		ps_angpix = Imic.samplingRateX();
+
+		BufferedImage<float> amplitudes;
+		amplitudes.copyDataAndSizeFrom(Imic);
+		spectrum = SpaCtfFind::fromCentredAmplitudeSpectrum(amplitudes);
+	}
+	else
+	{
+		// If given, then put a square window of ctf_win on the micrograph for CTF estimation
+		if (ctf_win > 0)
+		{
+			Imic().setXmippOrigin();
+			Imic().window(FIRST_XMIPP_INDEX(ctf_win), FIRST_XMIPP_INDEX(ctf_win), LAST_XMIPP_INDEX(ctf_win), LAST_XMIPP_INDEX(ctf_win));
+		}
+
+		int tile_size = XMIPP_MIN(ROUND(box_size), XMIPP_MIN(XSIZE(Imic()), YSIZE(Imic())));
+		tile_size -= tile_size % 2;
+
+		BufferedImage<float> micrograph;
+		micrograph.copyDataAndSizeFrom(Imic);
+		spectrum = SpaCtfFind::computeTileSpectrum(micrograph, tile_size, threads);
+	}
+
+	SpaCtfFind ctf_find(ps_angpix, mic_voltage, mic_Cs, mic_Q0, resol_min, my_maxres);
+
+	BufferedImage<float> diagnostic;
+	SpaCtfFind::Result result = ctf_find.fit(spectrum, my_min_defocus, my_max_defocus, step_defocus, threads, &diagnostic);
+
+	diagnostic.write(fn_ctf, ps_angpix);
+
+	// Write the summary and the logfile that getCtffind4Results reads, the logfile last
+	std::ofstream fh;
+	fh.open(fn_txt.c_str(), std::ios::out);
+	if (!fh)
+		REPORT_ERROR("CtffindRunner::executeInternal cannot create file: " + fn_txt);
+	fh << "# Output from the internal CTF estimation of relion_run_ctffind" << std::endl;
+	fh << "# Input file: " << fn_mic << std::endl;
+	fh << "# Pixel size: " << ps_angpix << " Angstroms ; acceleration voltage: " << mic_voltage
+	   << " keV ; spherical aberration: " << mic_Cs << " mm ; amplitude contrast: " << mic_Q0 << std::endl;
+	fh << "# Box size: " << spectrum.ydim << " pixels ; min. res.: " << resol_min << " Angstroms ; max. res.: " << my_maxres
+	   << " Angstroms ; min. def.: " << my_min_defocus << " Angstroms ; max. def.: " << my_max_defocus << " Angstroms" << std::endl;
+	fh << "# Columns: #1 - micrograph number; #2 - defocus 1 [Angstroms]; #3 - defocus 2; #4 - azimuth of astigmatism;"
+	   << " #5 - additional phase shift [radians]; #6 - cross correlation; #7 - spacing (in Angstroms) up to which CTF rings were fit successfully" << std::endl;
+	fh << std::fixed << std::setprecision(6) << 1.0 << " " << result.defocusU << " " << result.defocusV << " " << result.defocusAngle
+	   << " " << 0.0 << " " << result.fom << " " << result.maxRes << std::endl;
+	fh.close();
+
+	fh.open(fn_log.c_str(), std::ios::out);
+	if (!fh)
+		REPORT_ERROR("CtffindRunner::executeInternal cannot create file: " + fn_log);
+	fh << "Internal CTF estimation of " << fn_mic << std::endl;
+	fh << "Estimated defocus values        : " << result.defocusU << " , " << result.defocusV << " Angstroms" << std::endl;
+	fh << "Estimated azimuth of astigmatism: " << result.defocusAngle << " degrees" << std::endl;
+	fh << "Score                           : " << result.fom << std::endl;
+	fh << "Thon rings with good fit up to  : " << result.maxRes << " Angstroms" << std::endl;
+	fh << "Summary of results              : " << fn_txt << std::endl;
+	fh.close();
+}
+
+std::string CtffindRunner::getLedgerSignature()
+{
+	std::ostringstream sstr;
+	sstr << (do_internal ? "internal" : (is_ctffind4 ? "ctffind4" : "ctffind3"))
+	     << " " << resol_min << " " << resol_max << " " << min_defocus << " " << max_defocus << " " << step_defocus
+	     << " " << box_size << " " << Cs << " " << AmplitudeConstrast;
+	return sstr.str();
+}
+
+bool CtffindRunner::hasOutputFiles(FileName fn_mic)
+{
+	FileName fn_root = getOutputFileWithNewUniqueDate(fn_mic.withoutExtension(), fn_out);
+	return exists(fn_root + ".ctf") && exists(fn_root + (is_ctffind4 ? "_ctffind4.log" : "_ctffind3.log"));
+}
+
 bool CtffindRunner::getCtffindResults(FileName fn_microot, RFLOAT &defU, RFLOAT &defV, RFLOAT &defAng, RFLOAT &CC,
 		RFLOAT &HT, RFLOAT &CS, RFLOAT &AmpCnst, RFLOAT &XMAG, RFLOAT &DStep,
 		RFLOAT &maxres, RFLOAT &valscore, RFLOAT &phaseshift, RFLOAT &icering, bool do_warn)
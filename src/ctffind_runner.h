@@ -31,6 +31,7 @@
 #include <src/image.h>
 #include <src/time.h>
 #include <src/jaz/single_particle/obs_model.h>
+#include "src/processing_ledger.h"
 #include "src/jaz/tomography/tomogram_set.h"
 
 class CtffindRunner
@@ -82,6 +83,9 @@ public:
 	// Is this ctffind4?
 	bool is_ctffind4;
 
+	// Estimate CTFs in-process instead of running CTFFIND?
+	bool do_internal;
+
 	// Number of OMP threads for CTFFIND4
 	int nr_threads;
 
@@ -106,6 +110,9 @@ public:
 	// Continue an old run: only estimate CTF if logfile WITH Final Values line does not yet exist, otherwise skip the micrograph
 	bool continue_old;
 
+	// Micrographs whose CTF was estimated in earlier runs, with their CTF parameters (for --only_do_unfinished)
+	ProcessingLedger ledger;
+
 	// Process at most this number of unprocessed micrographs
 	long do_at_most;
 
@@ -177,6 +184,18 @@ public:
 	// Execute CTFFIND4.1+ for a single micrograph
 	void executeCtffind4(long int imic);
 
+	// Estimate the CTFs of micrographs first to last in-process, several micrographs at a time
+	void runInternal(long int my_first_micrograph, long int my_last_micrograph);
+
+	// Estimate the CTF of a single micrograph in-process and write the results as CTFFIND4 does
+	void executeInternal(long int imic, int threads);
+
+	// Parameters that change the values stored in the ledger
+	std::string getLedgerSignature();
+
+	// Are the power spectrum and logfile of this micrograph still there?
+	bool hasOutputFiles(FileName fn_mic);
+
 	// Get micrograph metadata
 	bool getCtffindResults(FileName fn_mic, RFLOAT &defU, RFLOAT &defV, RFLOAT &defAng, RFLOAT &CC,
 			RFLOAT &HT, RFLOAT &CS, RFLOAT &AmpCnst, RFLOAT &XMAG, RFLOAT &DStep,
@@ -38,7 +38,15 @@ void CtffindRunnerMpi::read(int argc, char **argv)
 
 void CtffindRunnerMpi::run()
 {
-	if (!do_only_join_results)
+	if (!do_only_join_results && do_internal)
+	{
+		// Each node does part of the work
+		long int my_first_micrograph, my_last_micrograph;
+		divide_equally(fn_micrographs.size(), node->size, node->rank, my_first_micrograph, my_last_micrograph);
+
+		runInternal(my_first_micrograph, my_last_micrograph);
+	}
+	else if (!do_only_join_results)
 	{
 		// Each node does part of the work
 		long int my_first_micrograph, my_last_micrograph, my_nr_micrographs;
@@ -0,0 +1,297 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/file_event_watcher.h"
+#include <cstdlib>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+FileEventWatcher::FileEventWatcher()
+:	fd(-1), initialised(false), reliable(false)
+{
+}
+
+FileEventWatcher::FileEventWatcher(const FileEventWatcher &other)
+:	fd(-1), initialised(false), reliable(false),
+	prefixes(other.prefixes)
+{
+}
+
+FileEventWatcher& FileEventWatcher::operator=(const FileEventWatcher &other)
+{
+	if (this != &other)
+	{
+		close();
+		prefixes = other.prefixes;
+	}
+
+	return *this;
+}
+
+FileEventWatcher::~FileEventWatcher()
+{
+	close();
+}
+
+void FileEventWatcher::setNameFilter(const std::vector<std::string> &_prefixes)
+{
+	prefixes = _prefixes;
+}
+
+static std::string normaliseDirectory(const std::string &dir)
+{
+	std::string out = dir;
+
+	while (out.size() > 1 && out[out.size()-1] == '/')
+		out.erase(out.size()-1);
+
+	if (out == "") out = ".";
+
+	return out;
+}
+
+void FileEventWatcher::init()
+{
+	if (initialised) return;
+
+	initialised = true;
+	reliable = false;
+
+#ifdef __linux__
+	if (getenv("RELION_NO_INOTIFY") != NULL) return;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	reliable = (fd >= 0);
+#endif
+}
+
+void FileEventWatcher::close()
+{
+#ifdef __linux__
+	if (fd >= 0) ::close(fd);
+#endif
+	fd = -1;
+	initialised = false;
+	reliable = false;
+	dirToWatch.clear();
+	watchToDir.clear();
+}
+
+bool FileEventWatcher::watch(const std::string &_dir)
+{
+	init();
+
+	if (!reliable) return false;
+
+	const std::string dir = normaliseDirectory(_dir);
+
+	if (dirToWatch.find(dir) != dirToWatch.end()) return false;
+
+#ifdef __linux__
+	const int wd = inotify_add_watch(fd, dir.c_str(),
+		IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_ONLYDIR);
+
+	// e.g. the directory does not exist (yet); the caller keeps polling it
+	if (wd < 0)
+	{
+		if (errno == ENOSPC || errno == ENOMEM)
+		{
+			// out of inotify watches: give up on events altogether
+			close();
+			initialised = true;
+		}
+		return false;
+	}
+
+	// Events from other machines are never seen on network file systems
+	if (isNetworkFileSystem(dir))
+	{
+		close();
+		initialised = true;
+		return false;
+	}
+
+	dirToWatch[dir] = wd;
+	watchToDir[wd] = dir;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void FileEventWatcher::unwatch(const std::string &_dir)
+{
+	const std::string dir = normaliseDirectory(_dir);
+
+	std::map<std::string, int>::iterator it = dirToWatch.find(dir);
+
+	if (it == dirToWatch.end()) return;
+
+#ifdef __linux__
+	inotify_rm_watch(fd, it->second);
+#endif
+
+	watchToDir.erase(it->second);
+	dirToWatch.erase(it);
+}
+
+bool FileEventWatcher::isReliable()
+{
+	init();
+
+	return reliable;
+}
+
+bool FileEventWatcher::wait(double max_seconds, std::vector<std::string> &changed)
+{
+	init();
+
+	if (!reliable)
+	{
+		if (max_seconds > 0)
+			usleep((useconds_t)(max_seconds * 1e6));
+
+		return true;
+	}
+
+#ifdef __linux__
+	// Events may already be queued
+	bool out = readEvents(changed);
+
+	if (!out && max_seconds > 0)
+	{
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, (int)(max_seconds * 1000)) > 0)
+			out = readEvents(changed);
+	}
+
+	return out;
+#else
+	return true;
+#endif
+}
+
+bool FileEventWatcher::readEvents(std::vector<std::string> &changed)
+{
+	bool out = false;
+
+#ifdef __linux__
+	char buffer[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while (true)
+	{
+		const ssize_t len = read(fd, buffer, sizeof(buffer));
+
+		if (len <= 0) break;
+
+		for (char *ptr = buffer; ptr < buffer + len; )
+		{
+			const struct inotify_event *event = (const struct inotify_event *) ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				// Events were dropped: report a change, so that the caller looks at all files
+				out = true;
+				continue;
+			}
+
+			if (event->mask & IN_IGNORED)
+			{
+				// The directory was deleted or unwatched
+				std::map<int, std::string>::iterator it = watchToDir.find(event->wd);
+				if (it != watchToDir.end())
+				{
+					dirToWatch.erase(it->second);
+					watchToDir.erase(it);
+				}
+				continue;
+			}
+
+			if (event->len == 0) continue;
+
+			const std::string name(event->name);
+
+			if (!passesFilter(name)) continue;
+
+			std::map<int, std::string>::iterator it = watchToDir.find(event->wd);
+			if (it == watchToDir.end()) continue;
+
+			changed.push_back(it->second + "/" + name);
+			out = true;
+		}
+	}
+#endif
+
+	return out;
+}
+
+bool FileEventWatcher::passesFilter(const std::string &name) const
+{
+	if (prefixes.size() == 0) return true;
+
+	for (int i = 0; i < prefixes.size(); i++)
+	{
+		if (name.compare(0, prefixes[i].size(), prefixes[i]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+bool FileEventWatcher::isNetworkFileSystem(const std::string &dir)
+{
+#ifdef __linux__
+	struct statfs buf;
+
+	if (statfs(dir.c_str(), &buf) != 0) return true;
+
+	switch ((unsigned long) buf.f_type)
+	{
+		case 0x6969:     // NFS
+		case 0xFF534D42: // CIFS
+		case 0xFE534D42: // SMB2
+		case 0x517B:     // SMB
+		case 0x0BD00BD0: // Lustre
+		case 0x47504653: // GPFS
+		case 0x19830326: // BeeGFS
+		case 0x00C36400: // Ceph
+		case 0x65735546: // FUSE
+		case 0x5346414F: // AFS
+			return true;
+
+		default:
+			return false;
+	}
+#else
+	return true;
+#endif
+}
@@ -0,0 +1,83 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef FILE_EVENT_WATCHER_H_
+#define FILE_EVENT_WATCHER_H_
+
+#include <string>
+#include <vector>
+#include <map>
+
+/*
+ * Reports files that are created, renamed into, closed after writing, touched or deleted
+ * inside a set of directories, so that callers can sleep until something happens
+ * instead of repeatedly stat-ing files.
+ *
+ * On Linux this uses inotify. inotify does not see changes made by other clients
+ * of a network file system (NFS, Lustre, GPFS, ...), so a watcher on such a file
+ * system (or on a platform without inotify, or with RELION_NO_INOTIFY set) reports
+ * itself as not reliable: wait() then simply sleeps and callers have to poll the
+ * files themselves, as before.
+ *
+ * Copying a watcher does not copy its watches: the copy starts empty.
+ */
+class FileEventWatcher
+{
+public:
+
+	FileEventWatcher();
+	FileEventWatcher(const FileEventWatcher &other);
+	FileEventWatcher& operator=(const FileEventWatcher &other);
+	~FileEventWatcher();
+
+	// Only report files whose name starts with one of these (default: report all files)
+	void setNameFilter(const std::vector<std::string> &prefixes);
+
+	// Start watching directory dir. Returns true if a new watch was added, i.e. if
+	// changes that happened before this call may have been missed.
+	bool watch(const std::string &dir);
+
+	// Stop watching directory dir
+	void unwatch(const std::string &dir);
+
+	// False if file changes can not be relied on to be reported
+	bool isReliable();
+
+	// Wait at most max_seconds for a change and add all changed files (dir + name) to changed.
+	// If the watcher is not reliable, this sleeps for max_seconds and returns true.
+	// Otherwise returns true if any file has changed (or if events were lost).
+	bool wait(double max_seconds, std::vector<std::string> &changed);
+
+protected:
+
+	int fd;
+	bool initialised, reliable;
+	std::vector<std::string> prefixes;
+	std::map<std::string, int> dirToWatch;
+	std::map<int, std::string> watchToDir;
+
+	void init();
+	void close();
+	bool readEvents(std::vector<std::string> &changed);
+	bool passesFilter(const std::string &name) const;
+
+	static bool isNetworkFileSystem(const std::string &dir);
+};
+
+#endif /* FILE_EVENT_WATCHER_H_ */
@@ -18,6 +18,7 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/healpix_sampling.h"
+#include <algorithm>
 //#define DEBUG_SAMPLING
 //#define DEBUG_CHECKSIZES
 //#define DEBUG_HELICAL_ORIENTATIONAL_SEARCH
@@ -39,6 +40,7 @@ void HealpixSampling::clear()
 	translations_x.clear();
 	translations_y.clear();
 	translations_z.clear();
+	ipix_to_idir.clear();
 	L_repository.clear();
 	R_repository.clear();
 	L_repository_relax.clear();
@@ -535,6 +537,8 @@ void HealpixSampling::setOrientations(int _order, RFLOAT _psi_step)
 		directions_ipix.push_back(-1);
 	}
 
+	indexDirections();
+
 	// 2D in-plane angles
 	// By default in 3D case: use more-or-less same psi-sampling as the 3D healpix object
 	// By default in 2D case: use 5 degree
@@ -568,6 +572,9 @@ void HealpixSampling::addOneOrientation(RFLOAT rot, RFLOAT tilt, RFLOAT psi, boo
 		psi_angles.clear();
 	}
 
+	// This direction is not a HEALPix pixel
+	ipix_to_idir.clear();
+
 	// 3D directions
 	if (is_3D)
 	{
@@ -715,6 +722,22 @@ void HealpixSampling::selectOrientationsWithNonZeroPriorProbability(
 			Euler_angles2direction(0., 90., prior90_direction);
 		}
 
+		// Get the direction of the prior
+		Matrix1D<RFLOAT> prior_direction;
+		Euler_angles2direction(prior_rot, prior_tilt, prior_direction);
+
+		// For local searches, only look at the directions near the prior (or near one of its symmetry mates)
+		std::vector<long int> idirs_near_prior;
+		bool use_index = false;
+		if ( (sigma_rot > 0.) && (sigma_tilt > 0.) && !isRelax)
+		{
+			std::vector<Matrix1D<RFLOAT> > centres(1, prior_direction);
+			if (do_bimodal_search_psi)
+				centres.push_back(-prior_direction);
+			use_index = findDirectionsNearCentres(centres, sigma_cutoff * XMIPP_MAX(sigma_rot, sigma_tilt), false, idirs_near_prior);
+		}
+		const long int nr_idirs_to_check = (use_index) ? idirs_near_prior.size() : rot_angles.size();
+
 		// Loop over all directions
 		RFLOAT sumprior = 0.;
 		RFLOAT sumprior_withsigmafromzero = 0.;
@@ -722,8 +745,10 @@ void HealpixSampling::selectOrientationsWithNonZeroPriorProbability(
 		RFLOAT best_ang = 9999.;
 		long int best_idir = -999;
 
-		for (long int idir = 0; idir < rot_angles.size(); idir++)
+		for (long int i = 0; i < nr_idirs_to_check; i++)
 		{
+			const long int idir = (use_index) ? idirs_near_prior[i] : i;
+
 			// Check if this direction was met before as symmetry mate
 			if (idir_flag[idir] == true)
 					continue;
@@ -733,36 +758,7 @@ void HealpixSampling::selectOrientationsWithNonZeroPriorProbability(
 			// Any prior involving BOTH rot and tilt.
 			if ( (sigma_rot > 0.) && (sigma_tilt > 0.) )
 			{
-				// Get the direction of the prior
-				Matrix1D<RFLOAT> prior_direction, my_direction, sym_direction, best_direction;
-				Euler_angles2direction(prior_rot, prior_tilt, prior_direction);
-
-				// Get the current direction in the loop
-				Euler_angles2direction(rot_angles[idir], tilt_angles[idir], my_direction);
-				best_direction = my_direction;
-
-				// Loop over all symmetry operators to find the operator that brings this direction nearest to the prior if no symmetry relaxation
-				if (!isRelax)
-				{
-					RFLOAT best_dotProduct = dotProduct(prior_direction, my_direction);
-					for (int j = 0; j < R_repository.size(); j++)
-					{
-						sym_direction =  L_repository[j] * (my_direction.transpose() * R_repository[j]).transpose();
-						RFLOAT my_dotProduct = dotProduct(prior_direction, sym_direction);
-						if (my_dotProduct > best_dotProduct)
-						{
-							best_direction = sym_direction;
-							best_dotProduct = my_dotProduct;
-						}
-					}
-				}
-
-				// Now that we have the best direction, find the corresponding prior probability
-				RFLOAT diffang = ACOSD( dotProduct(best_direction, prior_direction) );
-				if (diffang > 180.)
-					diffang = ABS(diffang - 360.);
-				if (do_bimodal_search_psi && (diffang > 90.))  // KThurber
-					diffang = ABS(diffang - 180.);	// KThurber
+				RFLOAT diffang = calculateDistanceToPriorDirection(prior_direction, idir, do_bimodal_search_psi);
 
 				// Only consider differences within sigma_cutoff * sigma_rot
 				// TODO: If sigma_rot and sigma_tilt are not the same (NOT for helices)?
@@ -935,6 +931,22 @@ void HealpixSampling::selectOrientationsWithNonZeroPriorProbability(
 				directions_prior[idir] /= sumprior;
 		}
 
+		// The nearest direction may be one that was not near the prior
+		if (use_index && directions_prior.size() == 0)
+		{
+			best_ang = 9999.;
+			best_idir = -999;
+			for (long int idir = 0; idir < rot_angles.size(); idir++)
+			{
+				RFLOAT diffang = calculateDistanceToPriorDirection(prior_direction, idir, do_bimodal_search_psi);
+				if (diffang < best_ang)
+				{
+					best_idir = idir;
+					best_ang = diffang;
+				}
+			}
+		}
+
 		// If there were no directions at all, just select the single nearest one:
 		if (directions_prior.size() == 0)
 		{
@@ -1165,94 +1177,46 @@ void HealpixSampling::selectOrientationsWithNonZeroPriorProbabilityFor3DHelicalR
 		//			<< " degrees. It will probably impact searches of orientations in 3D helical reconstruction."<< std::endl;
 		//}
 
+		// Get the direction of the prior
+		Matrix1D<RFLOAT> prior_direction;
+		Euler_angles2direction(prior_rot, prior_tilt, prior_direction);
+
+		// For local searches, only look at the directions near the prior (or near one of its symmetry mates)
+		// A direction within sigma_cutoff * sigma_rot in rot and sigma_cutoff * sigma_tilt in tilt
+		// lies within sigma_cutoff * (sigma_rot + sigma_tilt) on the sphere
+		std::vector<long int> idirs_near_prior;
+		bool use_index = false;
+		if ( (sigma_rot > 0.) && (sigma_tilt > 0.) )
+		{
+			std::vector<Matrix1D<RFLOAT> > centres(1, prior_direction);
+			if (!do_auto_refine_local_searches)
+			{
+				Matrix1D<RFLOAT> prior_direction_rot_flipped;
+				Euler_angles2direction(prior_rot + 180., prior_tilt, prior_direction_rot_flipped);
+				centres.push_back(prior_direction_rot_flipped);
+			}
+			use_index = findDirectionsNearCentres(centres, sigma_cutoff * (sigma_rot + sigma_tilt),
+					!do_auto_refine_local_searches && (prior_psi_flip_ratio > -1.), idirs_near_prior);
+		}
+		const long int nr_idirs_to_check = (use_index) ? idirs_near_prior.size() : rot_angles.size();
+
 		// Loop over all directions
 		RFLOAT sumprior = 0.;
 		// Keep track of the closest distance to prevent 0 orientations
 		RFLOAT best_ang = 9999.;
 		long int best_idir = -999;
-		for (long int idir = 0; idir < rot_angles.size(); idir++)
+		for (long int i = 0; i < nr_idirs_to_check; i++)
 		{
+			const long int idir = (use_index) ? idirs_near_prior[i] : i;
+
 			// Any prior involving BOTH rot and tilt.
 			if ( (sigma_rot > 0.) && (sigma_tilt > 0.) )
 			{
-				Matrix1D<RFLOAT> prior_direction, my_direction, sym_direction, best_direction;
-
-				// Get the direction of the prior
-				Euler_angles2direction(prior_rot, prior_tilt, prior_direction);
-
-				// Get the current direction in the loop
-				Euler_angles2direction(rot_angles[idir], tilt_angles[idir], my_direction);
-
-				// Loop over all symmetry operators to find the operator that brings this direction nearest to the prior
-				RFLOAT best_dotProduct = dotProduct(prior_direction, my_direction);
-				best_direction = my_direction;
-				for (int j = 0; j < R_repository.size(); j++)
-				{
-					sym_direction =  L_repository[j] * (my_direction.transpose() * R_repository[j]).transpose();
-					RFLOAT my_dotProduct = dotProduct(prior_direction, sym_direction);
-					if (my_dotProduct > best_dotProduct)
-					{
-						best_direction = sym_direction;
-						best_dotProduct = my_dotProduct;
-					}
-				}
-
-				if (!do_auto_refine_local_searches)
-				{
-					// Assume tilt = (0, +180)
-					// TODO: Check if "(tilt_angles[idir] > 0.01) && (tilt_angles[idir] < 179.99)" is needed
-					//if (prior_psi_flip_ratio > prior_psi_flip_ratio_thres_min)
-					if (prior_psi_flip_ratio > -1.)		// KThurber above line changed to primarily dummy if
-					{
-						Matrix1D<RFLOAT> my_direction2, sym_direction2, best_direction2;
-
-						// Get the current direction in the loop
-						Euler_angles2direction(rot_angles[idir], (180. - tilt_angles[idir]), my_direction2);
-
-						// Loop over all symmetry operators to find the operator that brings this direction nearest to the prior
-						RFLOAT best_dotProduct2 = dotProduct(prior_direction, my_direction2);
-						best_direction2 = my_direction2;
-						for (int j = 0; j < R_repository.size(); j++)
-						{
-							sym_direction2 =  L_repository[j] * (my_direction2.transpose() * R_repository[j]).transpose();
-							RFLOAT my_dotProduct2 = dotProduct(prior_direction, sym_direction2);
-							if (my_dotProduct2 > best_dotProduct2)
-							{
-								best_direction2 = sym_direction2;
-								best_dotProduct2 = my_dotProduct2;
-							}
-						}
-
-						if (best_dotProduct2 > best_dotProduct)
-						{
-							best_dotProduct = best_dotProduct2;
-							best_direction = best_direction2;
-						}
-					}
-				}
-
 				// Calculate the differences from sym_rot, sym_tilt to prior_rot, prior_tilt
-				RFLOAT sym_rot, sym_tilt, diff_rot, diff_tilt, diffang;
-				Euler_direction2angles(best_direction, sym_rot, sym_tilt);
-				diff_rot = ABS(sym_rot - prior_rot);
-				if (diff_rot > 180.)
-					diff_rot = ABS(diff_rot - 360.);
-
-				// KThurber begin add
-				bool is_rot_flipped = false;
-				if (!do_auto_refine_local_searches)
-				{
-					if (diff_rot > 90.)
-					{
-						diff_rot = ABS(diff_rot - 180.);
-						is_rot_flipped = true;
-					}
-				}
-				// KThurber end add
-
-				diff_tilt = ABS(sym_tilt - prior_tilt);
-				if (diff_tilt > 180.)
-					diff_tilt = ABS(diff_tilt - 360.);
+				RFLOAT diff_rot, diff_tilt, diffang;
+				bool is_rot_flipped;
+				calculateHelicalDifferencesToPrior(prior_direction, prior_rot, prior_tilt, idir,
+						do_auto_refine_local_searches, prior_psi_flip_ratio, diff_rot, diff_tilt, is_rot_flipped);
 				diffang = sqrt((diff_rot * diff_rot) + (diff_tilt * diff_tilt));
 				if ( (diff_rot < sigma_cutoff * sigma_rot) && (diff_tilt < sigma_cutoff * sigma_tilt) )
 				{
@@ -1403,6 +1367,26 @@ void HealpixSampling::selectOrientationsWithNonZeroPriorProbabilityFor3DHelicalR
 		for (long int idir = 0; idir < directions_prior.size(); idir++)
 			directions_prior[idir] /= sumprior;
 
+		// The nearest direction may be one that was not near the prior
+		if (use_index && directions_prior.size() == 0)
+		{
+			best_ang = 9999.;
+			best_idir = -999;
+			for (long int idir = 0; idir < rot_angles.size(); idir++)
+			{
+				RFLOAT diff_rot, diff_tilt;
+				bool is_rot_flipped;
+				calculateHelicalDifferencesToPrior(prior_direction, prior_rot, prior_tilt, idir,
+						do_auto_refine_local_searches, prior_psi_flip_ratio, diff_rot, diff_tilt, is_rot_flipped);
+				RFLOAT diffang = sqrt((diff_rot * diff_rot) + (diff_tilt * diff_tilt));
+				if (diffang < best_ang)
+				{
+					best_idir = idir;
+					best_ang = diffang;
+				}
+			}
+		}
+
 		// If there were no directions at all, just select the single nearest one:
 		if (directions_prior.size() == 0)
 		{
@@ -2224,19 +2208,32 @@ void HealpixSampling::removeSymmetryEquivalentPoints(RFLOAT max_ang)
 		std::vector <RFLOAT> no_redundant_tilt_angles;
 		std::vector <int> no_redundant_directions_ipix;
 
+		// Keep track of the HEALPix pixel of each point that was kept,
+		// so that each point is only checked against the kept points near its symmetry mates
+		std::vector <long int> ipix_to_no_redundant(healpix_base.Npix(), -1);
+		std::vector <int> listpix;
+
 		// Then check all points versus each other
 		for (long int i = 0; i < rot_angles.size(); i++)
 		{
+			if (directions_ipix[i] < 0 || directions_ipix[i] >= ipix_to_no_redundant.size())
+				REPORT_ERROR("HealpixSampling::removeSymmetryEquivalentPoints BUG: direction is not a HEALPix pixel");
 
 			direction1=directions_vector[i];
 			bool uniq = true;
 
-			//for (long int k = 0; k < no_redundant_directions_vector.size(); k++)
-			// i is probably closer to latest additions: loop backwards over k....
-			for (long int k = no_redundant_directions_vector.size() -1; k >= 0; k--)
+			for (int j = 0; j < R_repository.size(); j++)
 			{
-				for (int j = 0; j < R_repository.size(); j++)
+				// Symmetry operator j brings direction d to L_j R_j^T d, so only points near R_j L_j^T direction1 can be brought near direction1
+				// (all symmetry operators are orthogonal)
+				queryDisc(R_repository[j] * (L_repository[j].transpose() * direction1), max_ang, listpix);
+
+				for (long int ipix = 0; ipix < listpix.size(); ipix++)
 				{
+					long int k = ipix_to_no_redundant[listpix[ipix]];
+					if (k < 0)
+						continue;
+
 					direction =  L_repository[j] *
 						(no_redundant_directions_vector[k].transpose() *
 						 R_repository[j]).transpose();
@@ -2247,12 +2244,13 @@ void HealpixSampling::removeSymmetryEquivalentPoints(RFLOAT max_ang)
 						uniq = false;
 						break;
 					}
-				}// for j
+				}
 				if (!uniq) break;
-			} // for k
+			} // for j
 
 			if (uniq)
 			{
+				ipix_to_no_redundant[directions_ipix[i]] = no_redundant_directions_vector.size();
 				no_redundant_directions_vector.push_back(directions_vector[i]);
 				no_redundant_rot_angles.push_back(rot_angles[i]);
 				no_redundant_tilt_angles.push_back(tilt_angles[i]);
@@ -2874,4 +2872,224 @@ void HealpixSampling::removeSymmetryEquivalentPointsGeometric(const int symmetry
 }
 
 
+void HealpixSampling::indexDirections()
+{
+	ipix_to_idir.clear();
+
+	if (!is_3D)
+		return;
+
+	ipix_to_idir.resize(healpix_base.Npix(), -1);
+	for (long int idir = 0; idir < directions_ipix.size(); idir++)
+	{
+		int ipix = directions_ipix[idir];
+		if (ipix < 0 || ipix >= ipix_to_idir.size())
+		{
+			ipix_to_idir.clear();
+			return;
+		}
+		ipix_to_idir[ipix] = idir;
+	}
+}
+
+bool HealpixSampling::findDirectionsNearCentres(const std::vector<Matrix1D<RFLOAT> > &centres, RFLOAT max_ang,
+		bool include_tilt_flipped, std::vector<long int> &idirs) const
+{
+	idirs.clear();
+
+	// The index is only valid for the directions it was made for
+	if (max_ang >= 90. || ipix_to_idir.size() == 0 || ipix_to_idir.size() != healpix_base.Npix()
+			|| directions_ipix.size() != rot_angles.size())
+		return false;
+
+	// Symmetry operator j brings direction d to L_j R_j^T d, so the direction it brings onto centre c is R_j L_j^T c
+	// (all symmetry operators are orthogonal)
+	std::vector<Matrix1D<RFLOAT> > all_centres;
+	for (int i = 0; i < centres.size(); i++)
+	{
+		all_centres.push_back(centres[i]);
+		for (int j = 0; j < R_repository.size(); j++)
+			all_centres.push_back(R_repository[j] * (L_repository[j].transpose() * centres[i]));
+	}
+	if (include_tilt_flipped)
+	{
+		long int nr_centres = all_centres.size();
+		for (long int i = 0; i < nr_centres; i++)
+		{
+			Matrix1D<RFLOAT> flipped = all_centres[i];
+			ZZ(flipped) = -ZZ(flipped);
+			all_centres.push_back(flipped);
+		}
+	}
+
+	// The pixel centres are a superset of the directions within max_ang
+	std::vector<int> listpix;
+	for (long int i = 0; i < all_centres.size(); i++)
+	{
+		queryDisc(all_centres[i], max_ang, listpix);
+
+		for (long int k = 0; k < listpix.size(); k++)
+		{
+			int ipix = listpix[k];
+			if (ipix < 0 || ipix >= ipix_to_idir.size())
+				continue;
+			int idir = ipix_to_idir[ipix];
+			if (idir < 0)
+				continue;
+			// The directions were changed after they were indexed
+			if (idir >= directions_ipix.size() || directions_ipix[idir] != ipix)
+			{
+				idirs.clear();
+				return false;
+			}
+			idirs.push_back(idir);
+		}
+	}
+
+	// Keep the order of a loop over all directions, so that the same priors are summed in the same order
+	std::sort(idirs.begin(), idirs.end());
+	idirs.erase(std::unique(idirs.begin(), idirs.end()), idirs.end());
+
+	return true;
+}
+
+void HealpixSampling::queryDisc(const Matrix1D<RFLOAT> &centre, RFLOAT max_ang, std::vector<int> &listpix) const
+{
+	double theta = atan2(sqrt(XX(centre) * XX(centre) + YY(centre) * YY(centre)), ZZ(centre));
+	double phi = atan2(YY(centre), XX(centre));
+
+	// query_disc cannot be centred exactly on a pole: move the centre a little and widen the disc accordingly
+	const double min_theta = 1e-6;
+	double extra_radius = 0.;
+	if (theta < min_theta)
+	{
+		extra_radius = min_theta - theta;
+		theta = min_theta;
+	}
+	else if (theta > PI - min_theta)
+	{
+		extra_radius = theta - (PI - min_theta);
+		theta = PI - min_theta;
+	}
+
+	// query_disc_inclusive also returns the pixels that only partly overlap with the disc
+	healpix_base.query_disc_inclusive(pointing(theta, phi), DEG2RAD(max_ang) + extra_radius, listpix);
+}
+
+RFLOAT HealpixSampling::calculateDistanceToPriorDirection(const Matrix1D<RFLOAT> &prior_direction, long int idir,
+		bool do_bimodal_search_psi)
+{
+	Matrix1D<RFLOAT> my_direction, sym_direction, best_direction;
+
+	// Get the current direction in the loop
+	Euler_angles2direction(rot_angles[idir], tilt_angles[idir], my_direction);
+	best_direction = my_direction;
+
+	// Loop over all symmetry operators to find the operator that brings this direction nearest to the prior if no symmetry relaxation
+	if (!isRelax)
+	{
+		RFLOAT best_dotProduct = dotProduct(prior_direction, my_direction);
+		for (int j = 0; j < R_repository.size(); j++)
+		{
+			sym_direction =  L_repository[j] * (my_direction.transpose() * R_repository[j]).transpose();
+			RFLOAT my_dotProduct = dotProduct(prior_direction, sym_direction);
+			if (my_dotProduct > best_dotProduct)
+			{
+				best_direction = sym_direction;
+				best_dotProduct = my_dotProduct;
+			}
+		}
+	}
+
+	// Now that we have the best direction, find the corresponding prior probability
+	RFLOAT diffang = ACOSD( dotProduct(best_direction, prior_direction) );
+	if (diffang > 180.)
+		diffang = ABS(diffang - 360.);
+	if (do_bimodal_search_psi && (diffang > 90.))  // KThurber
+		diffang = ABS(diffang - 180.);	// KThurber
+
+	return diffang;
+}
+
+void HealpixSampling::calculateHelicalDifferencesToPrior(const Matrix1D<RFLOAT> &prior_direction, RFLOAT prior_rot, RFLOAT prior_tilt,
+		long int idir, bool do_auto_refine_local_searches, RFLOAT prior_psi_flip_ratio,
+		RFLOAT &diff_rot, RFLOAT &diff_tilt, bool &is_rot_flipped)
+{
+	Matrix1D<RFLOAT> my_direction, sym_direction, best_direction;
+
+	// Get the current direction in the loop
+	Euler_angles2direction(rot_angles[idir], tilt_angles[idir], my_direction);
+
+	// Loop over all symmetry operators to find the operator that brings this direction nearest to the prior
+	RFLOAT best_dotProduct = dotProduct(prior_direction, my_direction);
+	best_direction = my_direction;
+	for (int j = 0; j < R_repository.size(); j++)
+	{
+		sym_direction =  L_repository[j] * (my_direction.transpose() * R_repository[j]).transpose();
+		RFLOAT my_dotProduct = dotProduct(prior_direction, sym_direction);
+		if (my_dotProduct > best_dotProduct)
+		{
+			best_direction = sym_direction;
+			best_dotProduct = my_dotProduct;
+		}
+	}
+
+	if (!do_auto_refine_local_searches)
+	{
+		// Assume tilt = (0, +180)
+		// TODO: Check if "(tilt_angles[idir] > 0.01) && (tilt_angles[idir] < 179.99)" is needed
+		//if (prior_psi_flip_ratio > prior_psi_flip_ratio_thres_min)
+		if (prior_psi_flip_ratio > -1.)		// KThurber above line changed to primarily dummy if
+		{
+			Matrix1D<RFLOAT> my_direction2, sym_direction2, best_direction2;
+
+			// Get the current direction in the loop
+			Euler_angles2direction(rot_angles[idir], (180. - tilt_angles[idir]), my_direction2);
+
+			// Loop over all symmetry operators to find the operator that brings this direction nearest to the prior
+			RFLOAT best_dotProduct2 = dotProduct(prior_direction, my_direction2);
+			best_direction2 = my_direction2;
+			for (int j = 0; j < R_repository.size(); j++)
+			{
+				sym_direction2 =  L_repository[j] * (my_direction2.transpose() * R_repository[j]).transpose();
+				RFLOAT my_dotProduct2 = dotProduct(prior_direction, sym_direction2);
+				if (my_dotProduct2 > best_dotProduct2)
+				{
+					best_direction2 = sym_direction2;
+					best_dotProduct2 = my_dotProduct2;
+				}
+			}
+
+			if (best_dotProduct2 > best_dotProduct)
+			{
+				best_dotProduct = best_dotProduct2;
+				best_direction = best_direction2;
+			}
+		}
+	}
+
+	// Calculate the differences from sym_rot, sym_tilt to prior_rot, prior_tilt
+	RFLOAT sym_rot, sym_tilt;
+	Euler_direction2angles(best_direction, sym_rot, sym_tilt);
+	diff_rot = ABS(sym_rot - prior_rot);
+	if (diff_rot > 180.)
+		diff_rot = ABS(diff_rot - 360.);
+
+	// KThurber begin add
+	is_rot_flipped = false;
+	if (!do_auto_refine_local_searches)
+	{
+		if (diff_rot > 90.)
+		{
+			diff_rot = ABS(diff_rot - 180.);
+			is_rot_flipped = true;
+		}
+	}
+	// KThurber end add
+
+	diff_tilt = ABS(sym_tilt - prior_tilt);
+	if (diff_tilt > 180.)
+		diff_tilt = ABS(diff_tilt - 360.);
+}
+
 #undef DEBUG_SAMPLING
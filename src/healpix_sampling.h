@@ -97,6 +97,11 @@ public:
     /** vector with the X,Y(,Z)-translations (as of v3.1 in Angstroms!) */
     std::vector<RFLOAT> translations_x, translations_y, translations_z;
 
+    /** For each HEALPix pixel, the index of its direction in the vectors above (or -1 if it was removed)
+     * This allows local searches to only look at the directions near the prior
+     */
+    std::vector<int> ipix_to_idir;
+
 
 public:
 
@@ -127,6 +132,7 @@ public:
     	translations_x.clear();
     	translations_y.clear();
     	translations_z.clear();
+    	ipix_to_idir.clear();
     }
 
     // Start from all empty vectors and meaningless parameters
@@ -401,6 +407,7 @@ private:
         and then checks each point versus all others to calculate an angular distance
         If this distance is less than 0.8 times the angular sampling, the point is deleted
         This cares care of sampling points near the edge of the geometrical considerations
+        (Only the points in the HEALPix pixels near the symmetry mates of a point are actually looked at)
     */
     void removeSymmetryEquivalentPoints(RFLOAT max_ang);
 
@@ -409,6 +416,33 @@ private:
     void removeSymmetryEquivalentPointsGeometric(const int symmetry, int sym_order,
 												 std::vector <Matrix1D<RFLOAT> >  &sampling_points_vector);
 
+    /* Fill ipix_to_idir for the current directions */
+    void indexDirections();
+
+    /* Get all HEALPix pixels that overlap with the disc of max_ang degrees around direction centre */
+    void queryDisc(const Matrix1D<RFLOAT> &centre, RFLOAT max_ang, std::vector<int> &listpix) const;
+
+    /* Get (in ascending order) all directions that may lie within max_ang degrees of one of the centres
+     * or of one of their symmetry mates. If include_tilt_flipped, also those that do so after tilt -> 180 - tilt.
+     * The result is a superset of the directions that lie that close; it is empty and false is returned
+     * if the index cannot be used (the directions were changed after indexing, or max_ang is too large to gain anything).
+     */
+    bool findDirectionsNearCentres(const std::vector<Matrix1D<RFLOAT> > &centres, RFLOAT max_ang,
+    		bool include_tilt_flipped, std::vector<long int> &idirs) const;
+
+    /* Angular distance (in degrees) between the prior direction and the nearest symmetry mate of direction idir
+     * (for selectOrientationsWithNonZeroPriorProbability with priors on both rot and tilt)
+     */
+    RFLOAT calculateDistanceToPriorDirection(const Matrix1D<RFLOAT> &prior_direction, long int idir,
+    		bool do_bimodal_search_psi);
+
+    /* Differences in rot and tilt (in degrees) between the prior and the nearest symmetry mate of direction idir
+     * (for selectOrientationsWithNonZeroPriorProbabilityFor3DHelicalReconstruction with priors on both rot and tilt)
+     */
+    void calculateHelicalDifferencesToPrior(const Matrix1D<RFLOAT> &prior_direction, RFLOAT prior_rot, RFLOAT prior_tilt,
+    		long int idir, bool do_auto_refine_local_searches, RFLOAT prior_psi_flip_ratio,
+    		RFLOAT &diff_rot, RFLOAT &diff_tilt, bool &is_rot_flipped);
+
 
 
 };
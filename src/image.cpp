@@ -367,7 +367,12 @@ void rescale(Image<RFLOAT> &I, int mysize)
 
 	resizeMap(I(), mysize);
 
-	// Also modify the scale in the MDmainheader (if present)
+	rescaleSamplingRateInHeader(I, olddim, mysize);
+}
+
+void rescaleSamplingRateInHeader(Image<RFLOAT> &I, int olddim, int mysize)
+{
+	// Modify the scale in the MDmainheader (if present)
 	RFLOAT oldscale, newscale;
 	if (I.MDMainHeader.getValue(EMDL_IMAGE_SAMPLINGRATE_X, oldscale))
 	{
@@ -1756,6 +1756,9 @@ void invert_contrast(Image<RFLOAT> &I);
 // for image re-scaling
 void rescale(Image<RFLOAT> &I, int mysize);
 
+// Update the pixel size in the header of an image that was re-scaled from olddim to mysize pixels
+void rescaleSamplingRateInHeader(Image<RFLOAT> &I, int olddim, int mysize);
+
 // for image re-windowing
 void rewindow(Image<RFLOAT> &I, int mysize);
 
@@ -2,6 +2,7 @@
 #define JAZ_VECTOR_IMAGE_H
 
 #include "raw_image.h"
+#include <src/memory_policy.h>
 
 
 template <typename T>
@@ -20,7 +21,8 @@ class BufferedImage : public RawImage<T>
 		BufferedImage(std::string filename);
 		
 		
-			std::vector<T> dataVec;
+			// 64-byte aligned; large images follow RELION_MEMORY_POLICY (see memory_policy.h)
+			std::vector<T, RelionAllocator<T> > dataVec;
 		
 			
 		void resize(size_t xdim, size_t ydim, size_t zdim = 1);
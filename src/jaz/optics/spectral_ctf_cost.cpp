@@ -203,13 +203,30 @@ std::vector<double> SpectralCtfCost::getInitialParams(double defocus)
 }
 
 BufferedImage<float> SpectralCtfCost::render(const std::vector<double> &x)
+{
+	const double zeta = x[ZETA];
+	
+	const int wh = spectrum.xdim;
+	const int h  = spectrum.ydim;
+	
+	BufferedImage<float> out = renderCtf(x);
+	
+	for (int yi = 0; yi < h;  yi++)
+	for (int xi = 0; xi < wh; xi++)
+	{
+		out(xi,yi) += zeta * background(xi,yi);
+	}
+	
+	return out;
+}
+
+BufferedImage<float> SpectralCtfCost::renderCtf(const std::vector<double> &x)
 {
 	const double dZ    =     Z_SCALE * x[DEFOCUS];
 	const double alpha =     Z_SCALE * x[ALPHA];
 	const double beta  =     Z_SCALE * x[BETA];
 	const double scale =               x[SCALE];
 	const double B4px  = 4 * B_SCALE * x[BFAC];
-	const double zeta  =               x[ZETA];
 	
 	const int wh = spectrum.xdim;
 	const int h  = spectrum.ydim;
@@ -230,14 +247,31 @@ BufferedImage<float> SpectralCtfCost::render(const std::vector<double> &x)
 		const double k4 = k2 * k2;
 		
 		double gamma = R1 * (Axx*kx*kx + 2.0*Axy*kx*ky + Ayy*ky*ky) + R2 * k4 - R3_5;
-		const double ctf = -scale * exp(-B4px*k2) * cos(2.0 * gamma);
 		
-		out(xi,yi) = zeta * background(xi,yi) + ctf;
+		out(xi,yi) = -scale * exp(-B4px*k2) * cos(2.0 * gamma);
 	}
 	
 	return out;
 }
 
+void SpectralCtfCost::getAstigmaticDefocus(
+		const std::vector<double>& x, 
+		double& defocusU, double& defocusV, double& azimuth) const
+{
+	const double dZ    = Z_SCALE * x[DEFOCUS];
+	const double alpha = Z_SCALE * x[ALPHA];
+	const double beta  = Z_SCALE * x[BETA];
+	
+	// The CTF class uses A = -R diag(U,V) R^T, with R the rotation by the azimuth,
+	// while here Axx = -dZ + alpha, Axy = beta and Ayy = -dZ - alpha.
+	
+	const double delta = sqrt(alpha * alpha + beta * beta);
+	
+	defocusU = dZ + delta;
+	defocusV = dZ - delta;
+	azimuth = RAD2DEG(0.5 * atan2(-beta, -alpha));
+}
+
 void SpectralCtfCost::addAlignedSpectrum(
 	double z0, const std::vector<double> &x, BufferedImage<double> &accum, BufferedImage<double> &weight)
 {
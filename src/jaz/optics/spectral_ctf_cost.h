@@ -42,6 +42,11 @@ class SpectralCtfCost : public DifferentiableOptimization
 		//CTF getCtf(const std::vector<double>& x);
 		
 		BufferedImage<float> render(const std::vector<double>& x);
+		BufferedImage<float> renderCtf(const std::vector<double>& x);
+		
+		// defoci (Å) and azimuth (degrees) as used by Relion's CTF class
+		void getAstigmaticDefocus(const std::vector<double>& x, 
+								  double& defocusU, double& defocusV, double& azimuth) const;
 		void addAlignedSpectrum(double z0, const std::vector<double>& x, 
 								BufferedImage<double>& accum, BufferedImage<double>& weight);
 		
@@ -197,6 +197,180 @@ std::vector<double> NelderMead::optimize(
 	return simplex[order[0]];
 }
 
+std::vector<double> NelderMead::optimizeBatched(
+		const std::vector<double>& initial,
+		const Optimization& opt,
+		double initialStep, double tolerance, long maxIters,
+		double alpha, double gamma, double rho, double sigma,
+		bool verbose, double* minCost)
+{
+	const int n = initial.size();
+	const int m = initial.size() + 1;
+
+	std::vector<std::vector<double> > simplex(m);
+
+	simplex[0] = initial;
+
+	for (int j = 1; j < m; j++)
+	{
+		simplex[j] = initial;
+		simplex[j][j-1] += initialStep;
+	}
+
+	std::vector<std::vector<double> > nextSimplex(m), candidates(3, std::vector<double>(n));
+	std::vector<double> values(m), nextValues(m), centroid(n), candValues(3);
+
+	std::vector<double>& reflected = candidates[0];
+	std::vector<double>& expanded = candidates[1];
+	std::vector<double>& contracted = candidates[2];
+
+	void* tempStorage = opt.allocateTempStorage();
+
+	opt.fBatch(simplex, values, tempStorage);
+
+	for (long i = 0; i < maxIters; i++)
+	{
+		// sort x and f(x) by ascending f(x)
+		std::vector<int> order = IndexSort<double>::sortIndices(values);
+
+		if (verbose)
+		{
+			opt.report(i, values[order[0]], simplex[order[0]]);
+		}
+
+		for (int j = 0; j < m; j++)
+		{
+			nextSimplex[j] = simplex[order[j]];
+			nextValues[j] = values[order[j]];
+		}
+
+		simplex = nextSimplex;
+		values = nextValues;
+
+		// compute centroid
+		for (int k = 0; k < n; k++)
+		{
+			centroid[k] = 0.0;
+		}
+		for (int j = 0; j < n; j++) // leave out the worst x
+		{
+			for (int k = 0; k < n; k++)
+			{
+				centroid[k] += simplex[j][k];
+			}
+		}
+		for (int k = 0; k < n; k++)
+		{
+			centroid[k] /= n;
+		}
+
+		// check for convergence
+		bool allInside = true;
+		for (int j = 0; j < m; j++)
+		{
+			double dx = 0.0;
+
+			for (int k = 0; k < n; k++)
+			{
+				double ddx = simplex[j][k] - centroid[k];
+				dx += ddx * ddx;
+			}
+
+			if (sqrt(dx) > tolerance)
+			{
+				allInside = false;
+				break;
+			}
+		}
+		if (allInside)
+		{
+			break;
+		}
+
+		// evaluate the reflected, expanded and contracted points together
+		for (int k = 0; k < n; k++)
+		{
+			reflected[k] = (1.0 + alpha) * centroid[k] - alpha * simplex[n][k];
+			expanded[k] = (1.0 - gamma) * centroid[k] + gamma * reflected[k];
+			contracted[k] = (1.0 - rho) * centroid[k] + rho * simplex[n][k];
+		}
+
+		opt.fBatch(candidates, candValues, tempStorage);
+
+		const double vRefl = candValues[0];
+		const double vExp = candValues[1];
+		const double vContr = candValues[2];
+
+		// reflect
+		if (vRefl < values[n-1] && vRefl > values[0])
+		{
+			simplex[n] = reflected;
+			values[n] = vRefl;
+			continue;
+		}
+
+		// expand
+		if (vRefl < values[0])
+		{
+			if (vExp < vRefl)
+			{
+				simplex[n] = expanded;
+				values[n] = vExp;
+			}
+			else
+			{
+				simplex[n] = reflected;
+				values[n] = vRefl;
+			}
+
+			continue;
+		}
+
+		// contract
+		if (vContr < values[n])
+		{
+			simplex[n] = contracted;
+			values[n] = vContr;
+
+			continue;
+		}
+
+		// shrink
+		std::vector<std::vector<double> > shrunk(m-1);
+
+		for (int j = 1; j < m; j++)
+		{
+			for (int k = 0; k < n; k++)
+			{
+				simplex[j][k] = (1.0 - sigma) * simplex[0][k] + sigma * simplex[j][k];
+			}
+
+			shrunk[j-1] = simplex[j];
+		}
+
+		std::vector<double> shrunkValues;
+		opt.fBatch(shrunk, shrunkValues, tempStorage);
+
+		for (int j = 1; j < m; j++)
+		{
+			values[j] = shrunkValues[j-1];
+		}
+	}
+
+	if (verbose) std::cout << std::endl;
+
+	opt.deallocateTempStorage(tempStorage);
+
+	std::vector<int> order = IndexSort<double>::sortIndices(values);
+
+	if (minCost)
+	{
+		*minCost = values[order[0]];
+	}
+
+	return simplex[order[0]];
+}
+
 void NelderMead::test()
 {
 	RosenbrockBanana rb;
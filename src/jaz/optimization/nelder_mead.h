@@ -36,6 +36,18 @@ class NelderMead
                 double rho = 0.5, double sigma = 0.5,
                 bool verbose = false, double* minCost = 0);
 
+        /* Same steps as optimize(), but all points that might be needed in one
+           iteration (reflection, expansion and contraction) are evaluated together
+           through Optimization::fBatch, as are the initial simplex and shrinks.
+           This costs more evaluations, but they can be carried out in parallel. */
+        static std::vector<double> optimizeBatched(
+                const std::vector<double>& initial,
+                const Optimization& opt,
+                double initialStep, double tolerance, long maxIters,
+                double alpha = 1.0, double gamma = 2.0,
+                double rho = 0.5, double sigma = 0.5,
+                bool verbose = false, double* minCost = 0);
+
         static void test();
 };
 
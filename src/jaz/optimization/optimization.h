@@ -33,6 +33,20 @@ class Optimization
 	public:
 		
 		virtual double f(const std::vector<double>& x, void* tempStorage) const = 0;
+
+		// evaluate f at several points at once (override to evaluate them in parallel)
+		virtual void fBatch(
+				const std::vector<std::vector<double>>& x,
+				std::vector<double>& values,
+				void* tempStorage) const
+		{
+			values.resize(x.size());
+
+			for (int i = 0; i < x.size(); i++)
+			{
+				values[i] = f(x[i], tempStorage);
+			}
+		}
 		
 		virtual void* allocateTempStorage() const 
 		{
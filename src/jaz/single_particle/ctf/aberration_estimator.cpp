@@ -65,7 +65,8 @@ void AberrationEstimator::init(
 void AberrationEstimator::processMicrograph(
 		long g, MetaDataTable& mdt,
 		const std::vector<Image<Complex>>& obs,
-		const std::vector<Image<Complex>>& pred)
+		const std::vector<Image<Complex>>& pred,
+		int threads)
 {
 	if (!ready)
 	{
@@ -87,15 +88,15 @@ void AberrationEstimator::processMicrograph(
 		const int pc = partIndices.size();
 
 		std::vector<Image<RFLOAT>>
-			Axx(nr_omp_threads, Image<RFLOAT>(sh[og],s[og])),
-			Axy(nr_omp_threads, Image<RFLOAT>(sh[og],s[og])),
-			Ayy(nr_omp_threads, Image<RFLOAT>(sh[og],s[og])),
-			bx(nr_omp_threads, Image<RFLOAT>(sh[og],s[og])),
-			by(nr_omp_threads, Image<RFLOAT>(sh[og],s[og]));
+			Axx(threads, Image<RFLOAT>(sh[og],s[og])),
+			Axy(threads, Image<RFLOAT>(sh[og],s[og])),
+			Ayy(threads, Image<RFLOAT>(sh[og],s[og])),
+			bx(threads, Image<RFLOAT>(sh[og],s[og])),
+			by(threads, Image<RFLOAT>(sh[og],s[og]));
 
 		const double as = (double)s[og] * angpix[og];
 
-		#pragma omp parallel for num_threads(nr_omp_threads)
+		#pragma omp parallel for num_threads(threads)
 		for (long pp = 0; pp < pc; pp++)
 		{
 			const int p = partIndices[pp];
@@ -136,7 +137,7 @@ void AberrationEstimator::processMicrograph(
 			AxxSum(sh[og],s[og]), AxySum(sh[og],s[og]), AyySum(sh[og],s[og]),
 			bxSum(sh[og],s[og]), bySum(sh[og],s[og]);
 
-		for (int threadnum = 0; threadnum < nr_omp_threads; threadnum++)
+		for (int threadnum = 0; threadnum < threads; threadnum++)
 		{
 			ImageOp::linearCombination(AxxSum, Axx[threadnum], 1.0, 1.0, AxxSum);
 			ImageOp::linearCombination(AxySum, Axy[threadnum], 1.0, 1.0, AxySum);
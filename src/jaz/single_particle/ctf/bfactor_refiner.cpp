@@ -72,7 +72,8 @@ void BFactorRefiner::processMicrograph(
 		long g, MetaDataTable& mdt,
 		const std::vector<Image<Complex>>& obs,
 		const std::vector<Image<Complex>>& pred,
-		bool do_ctf_padding)
+		bool do_ctf_padding,
+		int threads)
 {
 	if (!ready)
 	{
@@ -84,7 +85,7 @@ void BFactorRefiner::processMicrograph(
 	std::stringstream stsg;
 	stsg << g;
 
-	std::vector<std::vector<std::pair<int,d2Vector>>> valsPerPart(nr_omp_threads);
+	std::vector<std::vector<std::pair<int,d2Vector>>> valsPerPart(threads);
 
 	const int ogc = obsModel->numberOfOpticsGroups();
 
@@ -103,7 +104,7 @@ void BFactorRefiner::processMicrograph(
 
 	if (perMicrograph)
 	{
-		std::vector<std::vector<double>>  t_rad(nr_omp_threads), s_rad(nr_omp_threads);
+		std::vector<std::vector<double>>  t_rad(threads), s_rad(threads);
 
 		// find optics group of minimal pixel size present in this micrograph
 
@@ -126,14 +127,14 @@ void BFactorRefiner::processMicrograph(
 		const int s_ref = s[ogRef];
 		const int sh_ref = sh[ogRef];
 
-		for (int t = 0; t < nr_omp_threads; t++)
+		for (int t = 0; t < threads; t++)
 		{
 			t_rad[t] = std::vector<double>(sh_ref, 0.0);
 			s_rad[t] = std::vector<double>(sh_ref, 0.0);
 		}
 
 		// Parallel loop over all particles in this micrograph
-		#pragma omp parallel for num_threads(nr_omp_threads)
+		#pragma omp parallel for num_threads(threads)
 		for (long p = 0; p < pc; p++)
 		{
 			const int og = obsModel->getOpticsGroup(mdt, p);
@@ -168,7 +169,7 @@ void BFactorRefiner::processMicrograph(
 			}
 		}
 
-		for (int t = 1; t < nr_omp_threads; t++)
+		for (int t = 1; t < threads; t++)
 		{
 			for (int r = 0; r < sh_ref; r++)
 			{
@@ -190,7 +191,7 @@ void BFactorRefiner::processMicrograph(
 	}
 	else
 	{
-		#pragma omp parallel for num_threads(nr_omp_threads)
+		#pragma omp parallel for num_threads(threads)
 		for (long p = 0; p < pc; p++)
 		{
 			const int og = obsModel->getOpticsGroup(mdt, p);
@@ -239,7 +240,7 @@ void BFactorRefiner::processMicrograph(
 			if (diag) writePerParticleDiagEPS(mdt, BK, s_rad, t_rad, p);
 		}
 
-		for (int t = 0; t < nr_omp_threads; t++)
+		for (int t = 0; t < threads; t++)
 		{
 			for (int i = 0; i < valsPerPart[t].size(); i++)
 			{
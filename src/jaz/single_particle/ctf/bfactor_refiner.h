@@ -25,12 +25,13 @@ class BFactorRefiner
 				ObservationModel* obsModel);
 
 
-		// Fit B-factors for all particles on one micrograph
+		// Fit B-factors for all particles on one micrograph, using the given number of threads
 		void processMicrograph(
 				long g, MetaDataTable& mdt,
 				const std::vector<Image<Complex>>& obs,
 				const std::vector<Image<Complex>>& pred,
-				bool do_ctf_padding = false);
+				bool do_ctf_padding,
+				int threads);
 
 		// Combine all .stars and .eps files
 		std::vector<MetaDataTable> merge(const std::vector<MetaDataTable>& mdts);
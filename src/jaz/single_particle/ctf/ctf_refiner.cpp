@@ -38,8 +38,11 @@
 #include <src/image.h>
 #include <src/fftw.h>
 #include <src/time.h>
+#include <src/parallel.h>
 
 #include <omp.h>
+#include <exception>
+#include <set>
 
 using namespace gravis;
 
@@ -96,6 +99,7 @@ void CtfRefiner::read(int argc, char **argv)
 
 	int comp_section = parser.addSection("Computational options");
 	nr_omp_threads = textToInteger(parser.getOption("--j", "Number of (OMP) threads", "1"));
+	setThreadBudget(nr_omp_threads);
 	minMG = textToInteger(parser.getOption("--min_MG", "First micrograph index", "0"));
 	maxMG = textToInteger(parser.getOption("--max_MG", "Last micrograph index (default is to process all)", "-1"));
 
@@ -247,105 +251,127 @@ void CtfRefiner::processSubsetMicrographs(long g_start, long g_end)
 		barstep = XMIPP_MAX(1, my_nr_micrographs/ 60);
 	}
 
-	std::vector<ParFourierTransformer> fts(nr_omp_threads);
+	// With enough micrographs, they are processed concurrently (one per thread,
+	// handed out dynamically) and the estimators run single-threaded inside each.
+	// Otherwise, the threads are used within each micrograph as before.
+	const int mg_threads = (my_nr_micrographs >= 2 * nr_omp_threads)? nr_omp_threads : 1;
+	const int inner_threads = (mg_threads > 1)? 1 : nr_omp_threads;
+
+	// Make sure the output directories exist
+	std::set<FileName> newdirs;
+	for (long g = g_start; g <= g_end; g++)
+	{
+		newdirs.insert(getOutputFilenameRoot(unfinishedMdts[g], outPath).beforeLastOf("/"));
+	}
+	for (std::set<FileName>::const_iterator it = newdirs.begin(); it != newdirs.end(); it++)
+	{
+		mktree(*it);
+	}
 
 	long nr_done = 0;
-	FileName prevdir = "";
+	bool aborted = false;
+	std::exception_ptr error;
 
+	#pragma omp parallel for num_threads(mg_threads) schedule(dynamic, 1)
 	for (long g = g_start; g <= g_end; g++)
 	{
 		// Abort through the pipeline_control system, TODO: check how this goes with MPI....
+		// Once the abort file exists, all remaining micrographs are skipped
 		if (pipeline_control_check_abort_job())
 		{
-			exit(RELION_EXIT_ABORTED);
+			#pragma omp critical(CtfRefiner_processSubsetMicrographs)
+			aborted = true;
+			continue;
 		}
 
-		std::vector<Image<Complex> > obs;
-
-		// all CTF-refinement programs need the same observations
-		obs = StackHelper::loadStackFS(unfinishedMdts[g], "", nr_omp_threads, true, &obsModel);
-
-		// Make sure output directory exists
-		FileName newdir = getOutputFilenameRoot(unfinishedMdts[g], outPath);
-		newdir = newdir.beforeLastOf("/");
-
-		if (newdir != prevdir)
+		try
 		{
-			std::string command = " mkdir -p " + newdir;
-			int res = system(command.c_str());
+			processMicrograph(g, inner_threads);
 		}
-
-		std::vector<Image<Complex>>
-				predSameT, // phase-demodulated (defocus)
-				predOppNT, // not phase-demodulated (tilt)
-				predOppT;  // phase-demodulated (mag and aberr)
-		// applyMtf is always true
-
-		// Four booleans in predictAll are applyCtf, applyTilt, applyShift, applyMtf.
-		if (do_defocus_fit || do_bfac_fit)
+		catch (...)
 		{
-			predSameT = reference.predictAll(
-				unfinishedMdts[g], obsModel, ReferenceMap::Own, nr_omp_threads,
-				false, true, false, true, do_ctf_padding);
+			#pragma omp critical(CtfRefiner_processSubsetMicrographs)
+			error = std::current_exception();
 		}
 
-		if (do_tilt_fit)
+		#pragma omp critical(CtfRefiner_processSubsetMicrographs)
 		{
-			predOppNT = reference.predictAll(
-				unfinishedMdts[g], obsModel, ReferenceMap::Own, nr_omp_threads,
-				false, false, false, true, do_ctf_padding);
-		}
+			nr_done++;
 
-		if (do_aberr_fit || do_mag_fit)
-		{
-			predOppT = reference.predictAll(
-				unfinishedMdts[g], obsModel, ReferenceMap::Own, nr_omp_threads,
-				false, true, false, true, do_ctf_padding);
+			if (verb > 0 && nr_done % barstep == 0)
+			{
+				progress_bar(nr_done);
+			}
 		}
+	}
 
-		if (do_defocus_fit)
-		{
-			defocusEstimator.processMicrograph(g, unfinishedMdts[g], obs, predSameT);
-		}
+	if (aborted) exit(RELION_EXIT_ABORTED);
+	if (error) std::rethrow_exception(error);
 
-		// B-factor fit is always performed after the defocus fit (so it can use the optimal CTFs)
-		// The prediction is *not* CTF-weighted, so an up-to-date CTF can be used internally
-		if (do_bfac_fit)
-		{
-			bfactorEstimator.processMicrograph(g, unfinishedMdts[g], obs, predSameT, do_ctf_padding);
-		}
+	if (verb > 0)
+	{
+		progress_bar(my_nr_micrographs);
+	}
+}
 
-		if (do_tilt_fit)
-		{
-			tiltEstimator.processMicrograph(g, unfinishedMdts[g], obs, predOppNT, do_ctf_padding);
-		}
+void CtfRefiner::processMicrograph(long g, int threads)
+{
+	std::vector<Image<Complex> > obs;
 
-		if (do_aberr_fit)
-		{
-			aberrationEstimator.processMicrograph(g, unfinishedMdts[g], obs, predOppT);
-		}
+	// all CTF-refinement programs need the same observations
+	obs = StackHelper::loadStackFS(unfinishedMdts[g], "", threads, true, &obsModel);
 
-		if (do_mag_fit)
-		{
-			std::vector<Volume<t2Vector<Complex>>> predGradient =
-				reference.predictAllComplexGradients(
-					unfinishedMdts[g], obsModel, ReferenceMap::Opposite, nr_omp_threads,
-					false, true, false, true, do_ctf_padding);
+	std::vector<Image<Complex>>
+			predT,  // phase-demodulated (defocus, B-factors, mag and aberr)
+			predNT; // not phase-demodulated (tilt)
+	// applyMtf is always true
 
-			magnificationEstimator.processMicrograph(g, unfinishedMdts[g], obs, predOppT, predGradient, do_ctf_padding);
-		}
+	// Four booleans in predictAll are applyCtf, applyTilt, applyShift, applyMtf.
+	// The same prediction is shared by all estimators that need it.
+	if (do_defocus_fit || do_bfac_fit || do_aberr_fit || do_mag_fit)
+	{
+		predT = reference.predictAll(
+			unfinishedMdts[g], obsModel, ReferenceMap::Own, threads,
+			false, true, false, true, do_ctf_padding);
+	}
 
-		nr_done++;
+	if (do_tilt_fit)
+	{
+		predNT = reference.predictAll(
+			unfinishedMdts[g], obsModel, ReferenceMap::Own, threads,
+			false, false, false, true, do_ctf_padding);
+	}
 
-		if (verb > 0 && nr_done % barstep == 0)
-		{
-			progress_bar(nr_done);
-		}
+	if (do_defocus_fit)
+	{
+		defocusEstimator.processMicrograph(g, unfinishedMdts[g], obs, predT, threads);
 	}
 
-	if (verb > 0)
+	// B-factor fit is always performed after the defocus fit (so it can use the optimal CTFs)
+	// The prediction is *not* CTF-weighted, so an up-to-date CTF can be used internally
+	if (do_bfac_fit)
 	{
-		progress_bar(my_nr_micrographs);
+		bfactorEstimator.processMicrograph(g, unfinishedMdts[g], obs, predT, do_ctf_padding, threads);
+	}
+
+	if (do_tilt_fit)
+	{
+		tiltEstimator.processMicrograph(g, unfinishedMdts[g], obs, predNT, do_ctf_padding, threads);
+	}
+
+	if (do_aberr_fit)
+	{
+		aberrationEstimator.processMicrograph(g, unfinishedMdts[g], obs, predT, threads);
+	}
+
+	if (do_mag_fit)
+	{
+		std::vector<Volume<t2Vector<Complex>>> predGradient =
+			reference.predictAllComplexGradients(
+				unfinishedMdts[g], obsModel, ReferenceMap::Opposite, threads,
+				false, true, false, true, do_ctf_padding);
+
+		magnificationEstimator.processMicrograph(g, unfinishedMdts[g], obs, predT, predGradient, do_ctf_padding, threads);
 	}
 }
 
@@ -86,6 +86,9 @@ class CtfRefiner
 		// Fit CTF parameters for all particles on a subset of the micrographs micrograph
 		void processSubsetMicrographs(long g_start, long g_end);
 
+		// Load the particles of micrograph g, predict them once and pass them to all estimators
+		void processMicrograph(long g, int threads);
+
 		// Combine all .stars and .eps files
 		std::vector<MetaDataTable> merge(const std::vector<MetaDataTable>& mdts, std::vector <FileName> &fn_eps);
 };
@@ -122,7 +122,8 @@ void DefocusEstimator::init(
 void DefocusEstimator::processMicrograph(
 		long g, MetaDataTable& mdt,
 		const std::vector<Image<Complex>>& obs,
-		const std::vector<Image<Complex>>& pred)
+		const std::vector<Image<Complex>>& pred,
+		int threads)
 {
 	if (!ready)
 	{
@@ -131,12 +132,12 @@ void DefocusEstimator::processMicrograph(
 
 	if (bruteForcePre || bruteForceOnly) 
 	{
-		bruteForceFit(g, mdt, obs, pred, "pre");
+		bruteForceFit(g, mdt, obs, pred, "pre", threads);
 	}
 		
 	if (!bruteForceOnly)
 	{
-		ModularCtfOptimisation mco(mdt, obsModel, obs, pred, freqWeights, fittingMode, nr_omp_threads);
+		ModularCtfOptimisation mco(mdt, obsModel, obs, pred, freqWeights, fittingMode, threads);
 		std::vector<double> x0 = mco.encodeInitial();
 			
 		std::vector<double> x = LBFGS::optimize(x0, mco, debug, max_iters, 1e-9);
@@ -145,7 +146,7 @@ void DefocusEstimator::processMicrograph(
 			
 		if (bruteForcePost) 
 		{
-			bruteForceFit(g, mdt, obs, pred, "post");
+			bruteForceFit(g, mdt, obs, pred, "post", threads);
 		}
 	}
 
@@ -243,7 +244,8 @@ void DefocusEstimator::bruteForceFit(
 		long g, MetaDataTable &mdt, 
 		const std::vector<Image<Complex> > &obs, 
 		const std::vector<Image<Complex> > &pred,
-		std::string tag)
+		std::string tag,
+		int threads)
 {
 	long pc = obs.size();
 	
@@ -264,7 +266,7 @@ void DefocusEstimator::bruteForceFit(
 
 			std::vector<d2Vector> cost = DefocusHelper::diagnoseDefocus(
 				pred[p], obs[p], freqWeights[og],
-				ctf0, angpix[og], defocusRange, 100, nr_omp_threads);
+				ctf0, angpix[og], defocusRange, 100, threads);
 
 			double cMin = cost[0][1];
 			double dOpt = cost[0][0];
@@ -287,7 +289,7 @@ void DefocusEstimator::bruteForceFit(
 	}
 
 	// Parallel loop over all particles in this micrograph
-	#pragma omp parallel for num_threads(nr_omp_threads)
+	#pragma omp parallel for num_threads(threads)
 	for (long p = 0; p < pc; p++)
 	{
 		const int og = obsModel->getOpticsGroup(mdt, p);
@@ -44,11 +44,12 @@ class DefocusEstimator
 				ObservationModel* obsModel);
 		
 		
-		// Fit defocus for all particles on one micrograph
+		// Fit defocus for all particles on one micrograph, using the given number of threads
 		void processMicrograph(
 				long g, MetaDataTable& mdt, 
 				const std::vector<Image<Complex>>& obs,
-				const std::vector<Image<Complex>>& pred);
+				const std::vector<Image<Complex>>& pred,
+				int threads);
 	
 		// Write PostScript file with per-particle defocus 
 		// plotted onto micrograph in blue-red color scale
@@ -85,7 +86,8 @@ class DefocusEstimator
 				long g, MetaDataTable& mdt, 
 				const std::vector<Image<Complex>>& obs,
 				const std::vector<Image<Complex>>& pred,
-				std::string tag);
+				std::string tag,
+				int threads);
 		
 };
 
@@ -77,7 +77,8 @@ void MagnificationEstimator::processMicrograph(
 		const std::vector<Image<Complex>>& obs,
 		const std::vector<Image<Complex>>& pred,
 		const std::vector<Volume<t2Vector<Complex>>>& predGradient,
-		bool do_ctf_padding)
+		bool do_ctf_padding,
+		int threads)
 {
 	if (!ready)
 	{
@@ -99,14 +100,14 @@ void MagnificationEstimator::processMicrograph(
 
 		const int pc = partIndices.size();
 
-		std::vector<Volume<Equation2x2>> magEqs(nr_omp_threads);
+		std::vector<Volume<Equation2x2>> magEqs(threads);
 
-		for (int i = 0; i < nr_omp_threads; i++)
+		for (int i = 0; i < threads; i++)
 		{
 			magEqs[i] = Volume<Equation2x2>(sh[og],s[og],1);
 		}
 
-		#pragma omp parallel for num_threads(nr_omp_threads)
+		#pragma omp parallel for num_threads(threads)
 		for (long pp = 0; pp < pc; pp++)
 		{
 			const int p = partIndices[pp];
@@ -122,7 +123,7 @@ void MagnificationEstimator::processMicrograph(
 
 		Volume<Equation2x2> magEq(sh[og], s[og],1);
 
-		for (int threadnum = 0; threadnum < nr_omp_threads; threadnum++)
+		for (int threadnum = 0; threadnum < threads; threadnum++)
 		{
 			magEq += magEqs[threadnum];
 		}
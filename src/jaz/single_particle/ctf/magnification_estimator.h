@@ -47,13 +47,14 @@ class MagnificationEstimator
 				bool debug, bool diag, std::string outPath,
 				ReferenceMap* reference, ObservationModel* obsModel);
 
-		// Compute per-pixel information for one micrograph
+		// Compute per-pixel information for one micrograph, using the given number of threads
 		void processMicrograph(
 				long g, MetaDataTable& mdt,
 				const std::vector<Image<Complex>>& obs,
 				const std::vector<Image<Complex>>& pred,
 				const std::vector<Volume<gravis::t2Vector<Complex>>>& predGradient,
-				bool do_ctf_padding = false);
+				bool do_ctf_padding,
+				int threads);
 
 		// Sum up per-pixel information from all micrographs,
 		// then fit beam-tilt model to the per-pixel fit
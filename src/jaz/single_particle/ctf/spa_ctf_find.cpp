@@ -0,0 +1,395 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "spa_ctf_find.h"
+#include <src/jaz/tomography/tomo_ctf_find.h>
+#include <src/jaz/optics/spectral_ctf_cost.h>
+#include <src/jaz/optimization/lbfgs.h>
+#include <src/jaz/image/radial_avg.h>
+#include <src/jaz/image/centering.h>
+#include <src/jaz/math/fft.h>
+#include <src/ctf.h>
+#include <src/error.h>
+#include <limits>
+
+
+SpaCtfFind::SpaCtfFind(
+		double pixelSize, double voltage, double Cs, double Q0,
+		double r0_ang, double r1_ang)
+	:	pixelSize(pixelSize),
+		voltage(voltage),
+		Cs(Cs),
+		Q0(Q0),
+		r0_ang(r0_ang),
+		r1_ang(r1_ang)
+{
+}
+
+BufferedImage<float> SpaCtfFind::computeTileSpectrum(
+		const RawImage<float>& micrograph,
+		int tileSize,
+		int num_threads)
+{
+	const int w = micrograph.xdim;
+	const int h = micrograph.ydim;
+
+	const int s = tileSize;
+	const int sh = s/2 + 1;
+
+	if (w < s || h < s)
+	{
+		REPORT_ERROR_STR("SpaCtfFind::computeTileSpectrum: the micrograph (" << w << " x " << h
+						 << ") is smaller than the box size for the power spectrum (" << s << ")");
+	}
+
+	const double overlap = 2.0;
+
+	const int tw = (int)(overlap * (w-s) / s + 0.5) + 1;
+	const int th = (int)(overlap * (h-s) / s + 0.5) + 1;
+	const int tc = tw * th;
+
+	const double tdx = (tw > 1)? (w - s) / (double)(tw - 1) : 0.0;
+	const double tdy = (th > 1)? (h - s) / (double)(th - 1) : 0.0;
+
+	if (num_threads > tc) num_threads = tc;
+
+	// one plan for all tiles, shared by all threads
+	FFT::FloatPlan plan(s, s);
+
+	std::vector<BufferedImage<double>> sums(num_threads);
+
+	#pragma omp parallel for num_threads(num_threads)
+	for (int t = 0; t < num_threads; t++)
+	{
+		BufferedImage<float> tile(s,s);
+		BufferedImage<fComplex> tileFS(sh,s);
+
+		sums[t] = BufferedImage<double>(sh,s);
+		sums[t].fill(0.0);
+
+		for (int ti = t; ti < tc; ti += num_threads)
+		{
+			const int x0 = (int)((ti % tw) * tdx);
+			const int y0 = (int)((ti / tw) * tdy);
+
+			double mean = 0.0;
+
+			for (int y = 0; y < s; y++)
+			for (int x = 0; x < s; x++)
+			{
+				tile(x,y) = micrograph(x0 + x, y0 + y);
+				mean += tile(x,y);
+			}
+
+			tile -= (float)(mean / (s * s));
+
+			FFT::FourierTransform(tile, tileFS, plan, FFT::Both);
+
+			for (int y = 0; y < s; y++)
+			for (int x = 0; x < sh; x++)
+			{
+				sums[t](x,y) += tileFS(x,y).norm();
+			}
+		}
+	}
+
+	BufferedImage<float> out(sh,s);
+
+	for (int y = 0; y < s; y++)
+	for (int x = 0; x < sh; x++)
+	{
+		double a = 0.0;
+
+		for (int t = 0; t < num_threads; t++)
+		{
+			a += sums[t](x,y);
+		}
+
+		out(x,y) = a / tc;
+	}
+
+	return out;
+}
+
+BufferedImage<float> SpaCtfFind::fromCentredAmplitudeSpectrum(
+		const RawImage<float>& amplitudes)
+{
+	if (amplitudes.xdim != amplitudes.ydim || amplitudes.xdim % 2 != 0)
+	{
+		REPORT_ERROR_STR("SpaCtfFind::fromCentredAmplitudeSpectrum: the spectrum has to be square and of even size, but it is "
+						 << amplitudes.xdim << " x " << amplitudes.ydim);
+	}
+
+	BufferedImage<float> out = Centering::humanFullToFftwHalf(amplitudes);
+
+	const size_t n = out.getSize();
+
+	for (size_t i = 0; i < n; i++)
+	{
+		out[i] = out[i] * out[i];
+	}
+
+	return out;
+}
+
+SpaCtfFind::Result SpaCtfFind::fit(
+		const RawImage<float>& spectrum,
+		double z0, double z1, double dz,
+		int num_threads,
+		BufferedImage<float>* diagnostic) const
+{
+	const int s = spectrum.ydim;
+	const int sh = s/2 + 1;
+
+	if (spectrum.xdim != sh)
+	{
+		REPORT_ERROR_STR("SpaCtfFind::fit: the spectrum is not in FFTW half-format ("
+						 << spectrum.xdim << " x " << spectrum.ydim << ")");
+	}
+
+	int r0_pix = (int)(s * pixelSize / r0_ang);
+	int r1_pix = (int)(s * pixelSize / r1_ang);
+
+	if (r0_pix < 2) r0_pix = 2;
+	if (r1_pix >= sh) r1_pix = sh - 1;
+
+	if (r1_pix - r0_pix < 4)
+	{
+		REPORT_ERROR_STR("SpaCtfFind::fit: the resolution range from " << r0_ang << " Å to " << r1_ang
+						 << " Å is too narrow for a spectrum of size " << s << " at " << pixelSize << " Å/px");
+	}
+
+	const int b0 = 2, b1 = 1;
+
+
+	// normalise the spectrum to a mean of 1 in the fitting range
+
+	double avgVal(0.0), avgWgh(0.0);
+
+	for (int y = b0; y < s-b1; y++)
+	for (int x = b0; x < sh; x++)
+	{
+		const double yy = y < s/2? y : y - s;
+		const double r = sqrt(x*x + yy*yy);
+
+		if (r >= r0_pix && r <= r1_pix)
+		{
+			avgVal += spectrum(x,y);
+			avgWgh += 1.0;
+		}
+	}
+
+	avgVal /= avgWgh;
+
+	if (!(avgVal > 0.0))
+	{
+		REPORT_ERROR("SpaCtfFind::fit: the power spectrum is empty");
+	}
+
+	BufferedImage<float> spec(sh,s);
+
+	for (int y = 0; y < s; y++)
+	for (int x = 0; x < sh; x++)
+	{
+		spec(x,y) = spectrum(x,y) / avgVal;
+	}
+
+
+	// subtract the background
+
+	const double sigmaK_px = (s * pixelSize) / 50.0;
+
+	BufferedImage<float> background = TomoCtfFind::estimateBackground(
+				spec, sigmaK_px / 2.0, sigmaK_px, sh / 3.0, false);
+
+	BufferedImage<float> specBgSub = spec - background;
+
+
+	// find the best defocus for the normalised radial average
+
+	std::vector<float> radAvg = RadialAvg::fftwHalf_2D_lin(specBgSub, 2);
+	std::vector<double> frqWgh(sh), radAvgNrm(sh);
+
+	for (int r = 0; r < sh; r++)
+	{
+		frqWgh[r] = r / (double)sh;
+	}
+
+	double mu(0.0), cwgh(0.0);
+
+	for (int r = r0_pix; r <= r1_pix; r++)
+	{
+		mu += frqWgh[r] * radAvg[r];
+		cwgh += frqWgh[r];
+	}
+
+	mu /= cwgh;
+
+	double var(0.0);
+
+	for (int r = r0_pix; r <= r1_pix; r++)
+	{
+		const double d = radAvg[r] - mu;
+		var += frqWgh[r] * d*d;
+	}
+
+	const double sd = sqrt(var / cwgh);
+
+	for (int r = 0; r < sh; r++)
+	{
+		radAvgNrm[r] = sd > 0.0? (radAvg[r] - mu) / sd : 0.0;
+	}
+
+	const int zc = (int)((z1 - z0) / dz) + 1;
+
+	double minCost(std::numeric_limits<double>::max());
+	double bestZ(z0);
+
+	for (int zi = 0; zi < zc; zi++)
+	{
+		const double z = z0 + zi * dz;
+
+		CTF ctf;
+		ctf.setValues(z, z, 0.0, voltage, Cs, Q0, 0.0);
+
+		double cost(0.0);
+
+		for (int r = r0_pix; r <= r1_pix; r++)
+		{
+			const double ra = r / (double)(s * pixelSize);
+			const double c = ctf.getCTF(ra, 0.0);
+
+			cost -= frqWgh[r] * (c*c - 0.5) * radAvgNrm[r];
+		}
+
+		if (cost < minCost)
+		{
+			minCost = cost;
+			bestZ = z;
+		}
+	}
+
+
+	// refine defocus, astigmatism, envelope and background scale on the 2D spectrum
+
+	SpectralCtfCost scf(
+		spec, background, pixelSize, voltage, Cs, Q0,
+		num_threads, r0_pix, r1_pix);
+
+	std::vector<double> x0 = scf.getInitialParams(bestZ);
+	std::vector<double> x1 = LBFGS::optimize(x0, scf, 0, 2000);
+
+	Result out;
+
+	scf.getAstigmaticDefocus(x1, out.defocusU, out.defocusV, out.defocusAngle);
+
+
+	/* Compare the fitted CTF term to the spectrum without the fitted background:
+	   over the whole fitting range (figure of merit), and in narrow shells
+	   up to the first one where they stop agreeing (maximum resolution) */
+
+	BufferedImage<float> ctfFit = scf.renderCtf(x1);
+	BufferedImage<float> dataCtf = spec - scf.render(x1) + ctfFit;
+
+	std::vector<double> sxy(sh, 0.0), sxx(sh, 0.0), syy(sh, 0.0);
+
+	for (int y = b0; y < s-b1; y++)
+	for (int x = b0; x < sh; x++)
+	{
+		const double yy = y < s/2? y : y - s;
+		const int r = (int)(sqrt(x*x + yy*yy) + 0.5);
+
+		if (r >= sh) continue;
+
+		const double a = dataCtf(x,y);
+		const double b = ctfFit(x,y);
+
+		sxy[r] += a * b;
+		sxx[r] += a * a;
+		syy[r] += b * b;
+	}
+
+	double fxy(0.0), fxx(0.0), fyy(0.0);
+
+	for (int r = r0_pix; r <= r1_pix; r++)
+	{
+		fxy += sxy[r];
+		fxx += sxx[r];
+		fyy += syy[r];
+	}
+
+	out.fom = (fxx > 0.0 && fyy > 0.0)? fxy / sqrt(fxx * fyy) : 0.0;
+
+	const int shell_radius = 3;
+	const double min_correlation = 0.3;
+
+	int r_max = sh - 1;
+
+	for (int r = r0_pix; r < sh; r++)
+	{
+		double wxy(0.0), wxx(0.0), wyy(0.0);
+
+		for (int rr = r - shell_radius; rr <= r + shell_radius; rr++)
+		{
+			if (rr < r0_pix || rr >= sh) continue;
+
+			wxy += sxy[rr];
+			wxx += sxx[rr];
+			wyy += syy[rr];
+		}
+
+		const double cc = (wxx > 0.0 && wyy > 0.0)? wxy / sqrt(wxx * wyy) : 0.0;
+
+		if (cc < min_correlation)
+		{
+			r_max = r;
+			break;
+		}
+	}
+
+	out.maxRes = s * pixelSize / r_max;
+
+	if (diagnostic != 0)
+	{
+		// centred spectrum on the left, centred fit on the right (as written by CTFFIND)
+
+		BufferedImage<float> dataFull = Centering::fftwHalfToHumanFull(dataCtf);
+		BufferedImage<float> fitFull = Centering::fftwHalfToHumanFull(ctfFit);
+
+		*diagnostic = BufferedImage<float>(s,s);
+
+		for (int y = 0; y < s; y++)
+		for (int x = 0; x < s; x++)
+		{
+			const double xx = x - s/2;
+			const double yy = y - s/2;
+
+			if (xx*xx + yy*yy < r0_pix * r0_pix)
+			{
+				(*diagnostic)(x,y) = 0.f;
+			}
+			else
+			{
+				(*diagnostic)(x,y) = (x < s/2)? dataFull(x,y) : fitFull(x,y);
+			}
+		}
+	}
+
+	return out;
+}
@@ -0,0 +1,80 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef SPA_CTF_FIND_H
+#define SPA_CTF_FIND_H
+
+#include <src/jaz/image/buffered_image.h>
+
+/*
+	CTF estimation for a single micrograph (or a pre-computed power spectrum),
+	using the same steps as TomoCtfFind on a tilt series:
+
+		1. average the power spectra of overlapping tiles
+		2. subtract a smooth background
+		3. find the best defocus from the radial average
+		4. refine defocus, astigmatism, envelope and background scale
+		   on the full 2D spectrum (SpectralCtfCost)
+
+	Everything is kept in memory and all state is local to a call,
+	so many micrographs can be processed concurrently.
+*/
+class SpaCtfFind
+{
+	public:
+
+		struct Result
+		{
+			double defocusU, defocusV, defocusAngle; // in Å and degrees, as in the CTF class
+			double fom;                               // correlation between fit and spectrum
+			double maxRes;                            // resolution (Å) up to which the Thon rings are fit
+		};
+
+		/* pixelSize refers to the spectrum that is passed to fit(),
+		   r0_ang and r1_ang delimit the frequency range to fit (in Å). */
+		SpaCtfFind(double pixelSize, double voltage, double Cs, double Q0,
+				   double r0_ang, double r1_ang);
+
+			double pixelSize, voltage, Cs, Q0;
+			double r0_ang, r1_ang;
+
+
+		/* Average power spectrum (FFTW half-format) of square tiles of size tileSize
+		   that overlap by half in each direction. */
+		static BufferedImage<float> computeTileSpectrum(
+				const RawImage<float>& micrograph,
+				int tileSize,
+				int num_threads);
+
+		/* Power spectrum (FFTW half-format) from a centred, square amplitude spectrum,
+		   e.g. the *_PS.mrc written by relion_run_motioncorr --grouping_for_ps */
+		static BufferedImage<float> fromCentredAmplitudeSpectrum(
+				const RawImage<float>& amplitudes);
+
+		/* Search defoci between z0 and z1 (in Å, step dz) and refine the best one.
+		   If diagnostic is given, it receives the centred spectrum (left half)
+		   next to the fit (right half). */
+		Result fit(
+				const RawImage<float>& spectrum,
+				double z0, double z1, double dz,
+				int num_threads,
+				BufferedImage<float>* diagnostic = 0) const;
+};
+
+#endif
@@ -90,7 +90,8 @@ void TiltEstimator::processMicrograph(
 		long g, MetaDataTable& mdt,
 		const std::vector<Image<Complex>>& obs,
 		const std::vector<Image<Complex>>& pred,
-		bool do_ctf_padding)
+		bool do_ctf_padding,
+		int threads)
 {
 	if (!ready)
 	{
@@ -111,10 +112,10 @@ void TiltEstimator::processMicrograph(
 
 		const int pc = partIndices.size();
 
-		std::vector<Image<Complex>> xyAcc(nr_omp_threads);
-		std::vector<Image<RFLOAT>> wAcc(nr_omp_threads);
+		std::vector<Image<Complex>> xyAcc(threads);
+		std::vector<Image<RFLOAT>> wAcc(threads);
 
-		for (int i = 0; i < nr_omp_threads; i++)
+		for (int i = 0; i < threads; i++)
 		{
 			xyAcc[i] = Image<Complex>(sh[og],s[og]);
 			xyAcc[i].data.initZeros();
@@ -123,7 +124,7 @@ void TiltEstimator::processMicrograph(
 			wAcc[i].data.initZeros();
 		}
 
-		#pragma omp parallel for num_threads(nr_omp_threads)
+		#pragma omp parallel for num_threads(threads)
 		for (long pp = 0; pp < pc; pp++)
 		{
 			const int p = partIndices[pp];
@@ -144,7 +145,7 @@ void TiltEstimator::processMicrograph(
 		Image<Complex> xyAccSum(sh[og], s[og]);
 		Image<RFLOAT> wAccSum(sh[og], s[og]);
 
-		for (int threadnum = 0; threadnum < nr_omp_threads; threadnum++)
+		for (int threadnum = 0; threadnum < threads; threadnum++)
 		{
 			ImageOp::linearCombination(xyAccSum, xyAcc[threadnum], 1.0, 1.0, xyAccSum);
 			ImageOp::linearCombination(wAccSum, wAcc[threadnum], 1.0, 1.0, wAccSum);
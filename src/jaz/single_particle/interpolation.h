@@ -310,6 +310,94 @@ class Interpolation
             return gravis::t2Vector<T>(xxd.dot(AVA * yy), xx.dot(AVA * yyd));
         }
 
+        /* Same as cubicXY and cubicXYgrad combined (for z = 0, n = 0), but the value and
+           the gradient are computed from one set of 16 samples, using separable weights. */
+        template<typename T>
+        static void cubicXYvalueAndGrad(
+                const Image<T>& img, double x, double y,
+                T& value, gravis::t2Vector<T>& grad, bool wrap = false)
+        {
+            const int xi = (int)std::floor(x);
+            const int yi = (int)std::floor(y);
+
+            const double xf = x - xi;
+            const double yf = y - yi;
+
+            const int w = img.data.xdim;
+            const int h = img.data.ydim;
+
+            int xs[4], ys[4];
+
+            for (int i = 0; i < 4; i++)
+            {
+                xs[i] = xi - 1 + i;
+                ys[i] = yi - 1 + i;
+
+                if (wrap)
+                {
+                    xs[i] = INTERPOL_WRAP(xs[i], w);
+                    ys[i] = INTERPOL_WRAP(ys[i], h);
+                }
+                else
+                {
+                    xs[i] = XMIPP_MAX(0, XMIPP_MIN(w - 1, xs[i]));
+                    ys[i] = XMIPP_MAX(0, XMIPP_MIN(h - 1, ys[i]));
+                }
+            }
+
+            // rows of A^T * (t^3, t^2, t, 1) and of its derivative, with A as in cubicXY
+            const double xf2 = xf * xf, yf2 = yf * yf;
+            const double xf3 = xf2 * xf, yf3 = yf2 * yf;
+
+            const double wx[4] = {
+                -0.5*xf3 + xf2 - 0.5*xf,
+                 1.5*xf3 - 2.5*xf2 + 1.0,
+                -1.5*xf3 + 2.0*xf2 + 0.5*xf,
+                 0.5*xf3 - 0.5*xf2};
+
+            const double wy[4] = {
+                -0.5*yf3 + yf2 - 0.5*yf,
+                 1.5*yf3 - 2.5*yf2 + 1.0,
+                -1.5*yf3 + 2.0*yf2 + 0.5*yf,
+                 0.5*yf3 - 0.5*yf2};
+
+            const double dwx[4] = {
+                -1.5*xf2 + 2.0*xf - 0.5,
+                 4.5*xf2 - 5.0*xf,
+                -4.5*xf2 + 4.0*xf + 0.5,
+                 1.5*xf2 - xf};
+
+            const double dwy[4] = {
+                -1.5*yf2 + 2.0*yf - 0.5,
+                 4.5*yf2 - 5.0*yf,
+                -4.5*yf2 + 4.0*yf + 0.5,
+                 1.5*yf2 - yf};
+
+            double v = 0.0, gx = 0.0, gy = 0.0;
+
+            for (int j = 0; j < 4; j++)
+            {
+                const T* row = &DIRECT_A2D_ELEM(img.data, ys[j], 0);
+
+                double rv = 0.0, rdx = 0.0;
+
+                for (int i = 0; i < 4; i++)
+                {
+                    const double f = row[xs[i]];
+
+                    rv  += wx[i] * f;
+                    rdx += dwx[i] * f;
+                }
+
+                v  += wy[j] * rv;
+                gx += wy[j] * rdx;
+                gy += dwy[j] * rv;
+            }
+
+            value = (T) v;
+            grad = gravis::t2Vector<T>((T) gx, (T) gy);
+        }
+
         static void test2D();
 };
 
@@ -34,11 +34,13 @@ MicrographHandler::MicrographHandler()
 	  debug(false),
 	  saveMem(false),
 	  ready(false),
+	  cacheMovies(false),
 	  last_gainFn(""),
 	  last_movieFn(""),
 	  corrMicFn(""),
 	  eer_upsampling(-1),
-	  eer_grouping(-1)
+	  eer_grouping(-1),
+	  cachedFrame0(0)
 {}
 
 void MicrographHandler::init(
@@ -431,6 +433,7 @@ std::vector<std::vector<Image<Complex>>> MicrographHandler::loadMovie(
 	}
 	
 	BufferedImage<float> muGraph;
+	RawImage<float> frames;
 	
 	RawImage<RFLOAT> gainRef_new(lastGainRef);
 	RawImage<bool> defectMask_new(defectMask);
@@ -448,36 +451,68 @@ std::vector<std::vector<Image<Complex>>> MicrographHandler::loadMovie(
 
 	const int frame0 = returnSingleFrame? single_frame_relative_index : firstFrame;
 	const int fc = returnSingleFrame? 1 : lastFrame - firstFrame + 1;
-				
-	if (isEER)			
+
+	// The gain-corrected frames of the last full movie are kept, so that the motion
+	// estimation and frame recombination of the same micrograph only read it once.
+	const bool cacheHit = cacheMovies && !saveMem && movieFn == cachedMovieFn
+			&& frame0 >= cachedFrame0 && frame0 + fc <= cachedFrame0 + cachedMovie.zdim;
+
+	if (cacheHit)
+	{
+		frames = RawImage<float>(
+			cachedMovie.xdim, cachedMovie.ydim, fc,
+			cachedMovie.data + (frame0 - cachedFrame0) * cachedMovie.xdim * cachedMovie.ydim);
+	}
+	else
 	{
-		if (eer_upsampling < 0)
+		// Single frames are not cached: frame-by-frame reading is meant to save memory
+		const bool storeInCache = cacheMovies && !saveMem && !returnSingleFrame;
+
+		if (storeInCache)
 		{
-			eer_upsampling = micrograph.getEERUpsampling();
+			releaseMovieCache();
 		}
-		
-		if (eer_grouping < 0)
+
+		BufferedImage<float>& dest = storeInCache? cachedMovie : muGraph;
+
+		if (isEER)
 		{
-			eer_grouping = micrograph.getEERGrouping();
+			if (eer_upsampling < 0)
+			{
+				eer_upsampling = micrograph.getEERUpsampling();
+			}
+
+			if (eer_grouping < 0)
+			{
+				eer_grouping = micrograph.getEERGrouping();
+			}
+
+			dest = MovieLoader::readEER<float>(
+				movieFn, gainRefToUse, defectMaskToUse,
+				frame0, fc,
+				eer_upsampling, eer_grouping,
+				nr_omp_threads);
+		}
+		else
+		{
+			dest = MovieLoader::readDense<float>(
+				movieFn, gainRefToUse, defectMaskToUse,
+				frame0, fc,
+				hotCutoff,
+				nr_omp_threads);
 		}
 
-		muGraph = MovieLoader::readEER<float>(
-			movieFn, gainRefToUse, defectMaskToUse,
-			frame0, fc,
-			eer_upsampling, eer_grouping,
-			nr_omp_threads);
-	}
-	else
-	{
-		muGraph = MovieLoader::readDense<float>(
-			movieFn, gainRefToUse, defectMaskToUse,
-			frame0, fc,
-			hotCutoff,
-			nr_omp_threads);
+		if (storeInCache)
+		{
+			cachedMovieFn = movieFn;
+			cachedFrame0 = frame0;
+		}
+
+		frames = dest;
 	}
 	
 	std::vector<std::vector<Image<Complex>>> movie = SpaExtraction::extractMovieStackFS(
-			mdt, muGraph, s,
+			mdt, frames, s,
 			angpix, coords_angpix, movie_angpix, data_angpix,
 			offsets_in, offsets_out, 
 			nr_omp_threads);
@@ -504,6 +539,13 @@ std::vector<std::vector<Image<Complex>>> MicrographHandler::loadMovie(
 	return movie;
 }
 
+void MicrographHandler::releaseMovieCache()
+{
+	cachedMovie = BufferedImage<float>();
+	cachedMovieFn = "";
+	cachedFrame0 = 0;
+}
+
 void MicrographHandler::loadInitialTracks(
 		const MetaDataTable &mdt, double angpix,
 		const std::vector<d2Vector>& pos,
@@ -29,6 +29,7 @@
 
 #include <src/micrograph_model.h>
 #include <src/image.h>
+#include <src/jaz/image/buffered_image.h>
 
 class MicrographHandler
 {
@@ -42,6 +43,9 @@ class MicrographHandler
 		int eer_upsampling, eer_grouping;
 	
 		bool debug, saveMem, ready;
+
+		// keep the frames of the last full movie read by loadMovie (ignored with saveMem)
+		bool cacheMovies;
 	
 		std::string corrMicFn;
 	
@@ -86,6 +90,9 @@ class MicrographHandler
 		double data_angpix = -1,
 		int single_frame_relative_index = -1); // if this isn't negative, return a single frame for all particles
 
+	// drop the frames of the last movie kept by loadMovie
+	void releaseMovieCache();
+
 	/* Write the initial tracks of particles at 'pos' into 'tracks_out' 
 	   (by interpolating  the polynomial motionCor2 model).
 	   If 'unregGlob' is set, also write the global component of motion into 'globalComponent_out'.*/
@@ -116,6 +123,10 @@ class MicrographHandler
 		Image<RFLOAT> lastGainRef;
 		MultidimArray<bool> lastDefectMask;
 		std::string last_gainFn, last_movieFn;
+
+		BufferedImage<float> cachedMovie;
+		std::string cachedMovieFn;
+		int cachedFrame0;
 	
 		std::map<std::string, std::string> mic2meta;
 
@@ -83,382 +83,228 @@ GpMotionFit::GpMotionFit(
 	{
 		eigenVals[d] = (RFLOAT) defBasis.eigenvalues[d];
 	}
-}
-
-
-double GpMotionFit::f(const std::vector<double> &x) const
-{
-	std::vector<std::vector<d2Vector>> pos(pc, std::vector<d2Vector>(fc));
-
-	paramsToPos(x, pos);
 
-	const int pad = 512;
-	std::vector<double> e_t(pad*threads, 0.0);
+	basisPD.resize(pc*dc);
+	basisDP.resize(pc*dc);
 
-#pragma omp parallel for num_threads(threads)
 	for (int p = 0; p < pc; p++)
+	for (int d = 0; d < dc; d++)
 	{
-		int t = omp_get_thread_num();
-
-		for (int f = 0; f < fc; f++)
-		{
-			e_t[pad*t] -= Interpolation::cubicXY(
-						correlation[p][f],
-						cc_pad * (pos[p][f].x + perFrameOffsets[f].x),
-						cc_pad * (pos[p][f].y + perFrameOffsets[f].y),
-						0, 0, true);
-		}
+		basisPD[p*dc + d] = basis(p,d);
+		basisDP[d*pc + p] = basis(p,d);
 	}
+}
 
-#pragma omp parallel for num_threads(threads)
-	for (int f = 0; f < fc-1; f++)
-	{
-		int t = omp_get_thread_num();
-
-		for (int d = 0; d < dc; d++)
-		{
-			const double cx = x[2*(pc + dc*f + d)    ];
-			const double cy = x[2*(pc + dc*f + d) + 1];
-
-			e_t[pad*t] += cx*cx + cy*cy;
-		}
-	}
 
-	if (sig_acc_px > 0.0)
-	{
-#pragma omp parallel for num_threads(threads)
-		for (int f = 0; f < fc-2; f++)
-		{
-			int t = omp_get_thread_num();
+double GpMotionFit::f(const std::vector<double> &x) const
+{
+	void* ts = allocateTempStorage();
+	const double out = f(x, ts);
+	deallocateTempStorage(ts);
 
-			for (int d = 0; d < dc; d++)
-			{
-				const double cx0 = x[2*(pc + dc*f + d)    ];
-				const double cy0 = x[2*(pc + dc*f + d) + 1];
-				const double cx1 = x[2*(pc + dc*(f+1) + d)    ];
-				const double cy1 = x[2*(pc + dc*(f+1) + d) + 1];
+	return out;
+}
 
-				const double dcx = cx1 - cx0;
-				const double dcy = cy1 - cy0;
+double GpMotionFit::f(const std::vector<double> &x, void* tempStorage) const
+{
+	if (tempStorage == 0) return f(x);
 
-				e_t[pad*t] += eigenVals[d]*(dcx*dcx + dcy*dcy) / (sig_acc_px*sig_acc_px);
-			}
-		}
-	}
+	TempStorage* ts = (TempStorage*) tempStorage;
 
-	double e_tot = 0.0;
+	evaluate(x, ts);
 
-	for (int t = 0; t < threads; t++)
-	{
-		e_tot += e_t[pad*t];
-	}
+	return ts->value;
+}
 
-	return e_tot;
+void GpMotionFit::grad(const std::vector<double> &x,
+					   std::vector<double> &gradDest) const
+{
+	void* ts = allocateTempStorage();
+	grad(x, gradDest, ts);
+	deallocateTempStorage(ts);
 }
 
-double GpMotionFit::f(const std::vector<double> &x, void* tempStorage) const
+void GpMotionFit::grad(const std::vector<double> &x,
+					   std::vector<double> &gradDest,
+					   void* tempStorage) const
 {
-	if (tempStorage == 0) return f(x);
+	if (tempStorage == 0) return grad(x, gradDest);
 
 	TempStorage* ts = (TempStorage*) tempStorage;
 
-	paramsToPos(x, ts->pos);
+	evaluate(x, ts);
 
-	for (int t = 0; t < threads; t++)
-	{
-		ts->e_t[ts->pad*t] = 0.0;
-	}
+	// every thread writes to its own parameters, so no per-thread copies are needed
 
 #pragma omp parallel for num_threads(threads)
 	for (int p = 0; p < pc; p++)
 	{
-		int t = omp_get_thread_num();
-
-		for (int f = 0; f < fc; f++)
-		{
-			const double epf = Interpolation::cubicXY(correlation[p][f],
-													  cc_pad * (ts->pos[p][f].x + perFrameOffsets[f].x),
-													  cc_pad * (ts->pos[p][f].y + perFrameOffsets[f].y),
-													  0, 0, true);
-			
-			ts->e_t[ts->pad*t] -= epf;
-		}
+		gradDest[2*p  ] = -ts->ccgSumX[p];
+		gradDest[2*p+1] = -ts->ccgSumY[p];
 	}
 
+	const double sa2 = sig_acc_px*sig_acc_px;
+
 #pragma omp parallel for num_threads(threads)
-	for (int f = 0; f < fc-1; f++)
+	for (int d = 0; d < dc; d++)
 	{
-		int t = omp_get_thread_num();
+		const double* bd = &basisDP[d*pc];
 
-		for (int d = 0; d < dc; d++)
+		for (int f = 0; f < fc-1; f++)
 		{
-			const double cx = x[2*(pc + dc*f + d)    ];
-			const double cy = x[2*(pc + dc*f + d) + 1];
+			// the velocity at f moves the particles in all frames after f
+			const double* sx = &ts->ccgSumX[(f+1)*pc];
+			const double* sy = &ts->ccgSumY[(f+1)*pc];
+
+			double gx = 0.0, gy = 0.0;
+
+			for (int p = 0; p < pc; p++)
+			{
+				gx += bd[p] * sx[p];
+				gy += bd[p] * sy[p];
+			}
 
-			ts->e_t[ts->pad*t] += cx*cx + cy*cy;
+			gradDest[2*(pc + dc*f + d)  ] = 2.0 * x[2*(pc + dc*f + d)  ] - gx;
+			gradDest[2*(pc + dc*f + d)+1] = 2.0 * x[2*(pc + dc*f + d)+1] - gy;
 		}
-	}
 
-	if (sig_acc_px > 0.0)
-	{
-#pragma omp parallel for num_threads(threads)
-		for (int f = 0; f < fc-2; f++)
+		if (sig_acc_px > 0.0)
 		{
-			int t = omp_get_thread_num();
+			const double* cx = &ts->coeffX[d*(fc-1)];
+			const double* cy = &ts->coeffY[d*(fc-1)];
 
-			for (int d = 0; d < dc; d++)
+			for (int f = 0; f < fc-2; f++)
 			{
-				const double cx0 = x[2*(pc + dc*f + d)    ];
-				const double cy0 = x[2*(pc + dc*f + d) + 1];
-				const double cx1 = x[2*(pc + dc*(f+1) + d)    ];
-				const double cy1 = x[2*(pc + dc*(f+1) + d) + 1];
-
-				const double dcx = cx1 - cx0;
-				const double dcy = cy1 - cy0;
+				const double dcx = cx[f+1] - cx[f];
+				const double dcy = cy[f+1] - cy[f];
 
-				ts->e_t[ts->pad*t] += eigenVals[d]*(dcx*dcx + dcy*dcy) / (sig_acc_px*sig_acc_px);
+				gradDest[2*(pc + dc*f + d)  ] -= 2.0 * eigenVals[d] * dcx / sa2;
+				gradDest[2*(pc + dc*f + d)+1] -= 2.0 * eigenVals[d] * dcy / sa2;
+				gradDest[2*(pc + dc*(f+1) + d)  ] += 2.0 * eigenVals[d] * dcx / sa2;
+				gradDest[2*(pc + dc*(f+1) + d)+1] += 2.0 * eigenVals[d] * dcy / sa2;
 			}
 		}
 	}
-
-	double e_tot = 0.0;
-
-	for (int t = 0; t < threads; t++)
-	{
-		e_tot += ts->e_t[ts->pad*t];
-	}
-
-	return e_tot;
 }
 
-void GpMotionFit::grad(const std::vector<double> &x,
-					   std::vector<double> &gradDest) const
+void GpMotionFit::evaluate(const std::vector<double>& x, TempStorage* ts) const
 {
-	std::vector<std::vector<d2Vector>> pos(pc, std::vector<d2Vector>(fc));
-	paramsToPos(x, pos);
+	if (ts->valid && ts->x == x) return;
 
-	int pad = 512;
-	std::vector<std::vector<d2Vector>> ccg_pf(pc, std::vector<d2Vector>(fc + pad));
+	const int fc1 = fc - 1;
 
-#pragma omp parallel for num_threads(threads)
-	for (int p = 0; p < pc; p++)
+	for (int f = 0; f < fc1; f++)
+	for (int d = 0; d < dc; d++)
 	{
-		for (int f = 0; f < fc; f++)
-		{
-			d2Vector vr = Interpolation::cubicXYgrad(
-						correlation[p][f],
-						cc_pad * (pos[p][f].x + perFrameOffsets[f].x),
-						cc_pad * (pos[p][f].y + perFrameOffsets[f].y),
-						0, 0, true);
-
-			ccg_pf[p][f] = d2Vector(vr.x, vr.y);
-		}
+		ts->coeffX[d*fc1 + f] = x[2*(pc + dc*f + d)    ];
+		ts->coeffY[d*fc1 + f] = x[2*(pc + dc*f + d) + 1];
 	}
 
-	std::vector<std::vector<double>> gradDestT(threads, std::vector<double>(gradDest.size()+pad, 0.0));
+	double e_cc = 0.0;
 
-#pragma omp parallel for num_threads(threads)
+#pragma omp parallel for num_threads(threads) reduction(+:e_cc)
 	for (int p = 0; p < pc; p++)
-		for (int f = 0; f < fc; f++)
-		{
-			int t = omp_get_thread_num();
+	{
+		double* px = &ts->posX[p*fc];
+		double* py = &ts->posY[p*fc];
 
-			gradDestT[t][2*p  ] -= ccg_pf[p][f].x;
-			gradDestT[t][2*p+1] -= ccg_pf[p][f].y;
-		}
+		// velocities, stored one frame ahead and integrated below
+		px[0] = x[2*p];
+		py[0] = x[2*p+1];
 
-#pragma omp parallel for num_threads(threads)
-	for (int d = 0; d < dc; d++)
-		for (int p = 0; p < pc; p++)
+		for (int f = 1; f < fc; f++)
 		{
-			int t = omp_get_thread_num();
-
-			d2Vector g(0.0, 0.0);
-
-			const double bpd = basis(p,d);
-
-			for (int f = fc-2; f >= 0; f--)
-			{
-				g.x += bpd * ccg_pf[p][f+1].x;
-				g.y += bpd * ccg_pf[p][f+1].y;
-
-				gradDestT[t][2*(pc + dc*f + d)  ] -= g.x;
-				gradDestT[t][2*(pc + dc*f + d)+1] -= g.y;
-			}
+			px[f] = 0.0;
+			py[f] = 0.0;
 		}
 
-#pragma omp parallel for num_threads(threads)
-	for (int f = 0; f < fc-1; f++)
 		for (int d = 0; d < dc; d++)
 		{
-			int t = omp_get_thread_num();
-
-			gradDestT[t][2*(pc + dc*f + d)  ] += 2.0 * x[2*(pc + dc*f + d)  ];
-			gradDestT[t][2*(pc + dc*f + d)+1] += 2.0 * x[2*(pc + dc*f + d)+1];
-		}
-
-	if (sig_acc_px > 0.0)
-	{
-		const double sa2 = sig_acc_px*sig_acc_px;
+			const double b = basisPD[p*dc + d];
+			const double* cx = &ts->coeffX[d*fc1];
+			const double* cy = &ts->coeffY[d*fc1];
 
-#pragma omp parallel for num_threads(threads)
-		for (int f = 0; f < fc-2; f++)
-			for (int d = 0; d < dc; d++)
+			for (int f = 0; f < fc1; f++)
 			{
-				int t = omp_get_thread_num();
-
-				const double cx0 = x[2*(pc + dc*f + d)    ];
-				const double cy0 = x[2*(pc + dc*f + d) + 1];
-				const double cx1 = x[2*(pc + dc*(f+1) + d)    ];
-				const double cy1 = x[2*(pc + dc*(f+1) + d) + 1];
-
-				const double dcx = cx1 - cx0;
-				const double dcy = cy1 - cy0;
-
-				//e_tot += eigenVals[d]*(dcx*dcx + dcy*dcy) / (sig_acc_px*sig_acc_px);
-
-				gradDestT[t][2*(pc + dc*f + d)  ] -= 2.0 * eigenVals[d] * dcx / sa2;
-				gradDestT[t][2*(pc + dc*f + d)+1] -= 2.0 * eigenVals[d] * dcy / sa2;
-				gradDestT[t][2*(pc + dc*(f+1) + d)  ] += 2.0 * eigenVals[d] * dcx / sa2;
-				gradDestT[t][2*(pc + dc*(f+1) + d)+1] += 2.0 * eigenVals[d] * dcy / sa2;
+				px[f+1] += b * cx[f];
+				py[f+1] += b * cy[f];
 			}
-	}
-
-	for (int i = 0; i < gradDest.size(); i++)
-	{
-		gradDest[i] = 0.0;
-	}
-
-	for (int t = 0; t < threads; t++)
-		for (int i = 0; i < gradDest.size(); i++)
-		{
-			gradDest[i] += gradDestT[t][i];
 		}
-}
 
-void GpMotionFit::grad(const std::vector<double> &x,
-					   std::vector<double> &gradDest,
-					   void* tempStorage) const
-{
-	if (tempStorage == 0) return grad(x, gradDest);
-
-	TempStorage* ts = (TempStorage*) tempStorage;
-
-	paramsToPos(x, ts->pos);
-
-#pragma omp parallel for num_threads(threads)
-	for (int p = 0; p < pc; p++)
-	{
-		for (int f = 0; f < fc; f++)
+		for (int f = 1; f < fc; f++)
 		{
-			d2Vector vr = Interpolation::cubicXYgrad(
-						correlation[p][f],
-						cc_pad * (ts->pos[p][f].x + perFrameOffsets[f].x),
-						cc_pad * (ts->pos[p][f].y + perFrameOffsets[f].y),
-						0, 0, true);
-
-			ts->ccg_pf[p][f] = d2Vector(vr.x, vr.y);
+			px[f] += px[f-1];
+			py[f] += py[f-1];
 		}
-	}
 
-#pragma omp parallel for num_threads(threads)
-	for (int t = 0; t < threads; t++)
-		for (int i = 0; i < gradDest.size(); i++)
-		{
-			ts->gradDestT[t][i] = 0.0;
-		}
+		double sx = 0.0, sy = 0.0;
 
-#pragma omp parallel for num_threads(threads)
-	for (int p = 0; p < pc; p++)
-		for (int f = 0; f < fc; f++)
+		for (int f = fc-1; f >= 0; f--)
 		{
-			int t = omp_get_thread_num();
+			double v;
+			d2Vector g;
 
-			ts->gradDestT[t][2*p  ] -= ts->ccg_pf[p][f].x;
-			ts->gradDestT[t][2*p+1] -= ts->ccg_pf[p][f].y;
-		}
+			Interpolation::cubicXYvalueAndGrad(
+						correlation[p][f],
+						cc_pad * (px[f] + perFrameOffsets[f].x),
+						cc_pad * (py[f] + perFrameOffsets[f].y),
+						v, g, true);
 
-#pragma omp parallel for num_threads(threads)
-	for (int d = 0; d < dc; d++)
-		for (int p = 0; p < pc; p++)
-		{
-			int t = omp_get_thread_num();
+			e_cc -= v;
 
-			d2Vector g(0.0, 0.0);
+			sx += g.x;
+			sy += g.y;
 
-			const double bpd = basis(p,d);
+			ts->ccgSumX[f*pc + p] = sx;
+			ts->ccgSumY[f*pc + p] = sy;
+		}
+	}
 
-			for (int f = fc-2; f >= 0; f--)
-			{
-				g.x += bpd * ts->ccg_pf[p][f+1].x;
-				g.y += bpd * ts->ccg_pf[p][f+1].y;
+	double e_reg = 0.0;
 
-				ts->gradDestT[t][2*(pc + dc*f + d)  ] -= g.x;
-				ts->gradDestT[t][2*(pc + dc*f + d)+1] -= g.y;
-			}
-		}
+	for (int d = 0; d < dc; d++)
+	{
+		const double* cx = &ts->coeffX[d*fc1];
+		const double* cy = &ts->coeffY[d*fc1];
 
-#pragma omp parallel for num_threads(threads)
-	for (int f = 0; f < fc-1; f++)
-		for (int d = 0; d < dc; d++)
+		for (int f = 0; f < fc1; f++)
 		{
-			int t = omp_get_thread_num();
-
-			ts->gradDestT[t][2*(pc + dc*f + d)  ] += 2.0 * x[2*(pc + dc*f + d)  ];
-			ts->gradDestT[t][2*(pc + dc*f + d)+1] += 2.0 * x[2*(pc + dc*f + d)+1];
+			e_reg += cx[f]*cx[f] + cy[f]*cy[f];
 		}
 
-	if (sig_acc_px > 0.0)
-	{
-		const double sa2 = sig_acc_px*sig_acc_px;
-
-#pragma omp parallel for num_threads(threads)
-		for (int f = 0; f < fc-2; f++)
-			for (int d = 0; d < dc; d++)
+		if (sig_acc_px > 0.0)
+		{
+			for (int f = 0; f < fc1-1; f++)
 			{
-				int t = omp_get_thread_num();
+				const double dcx = cx[f+1] - cx[f];
+				const double dcy = cy[f+1] - cy[f];
 
-				const double cx0 = x[2*(pc + dc*f + d)    ];
-				const double cy0 = x[2*(pc + dc*f + d) + 1];
-				const double cx1 = x[2*(pc + dc*(f+1) + d)    ];
-				const double cy1 = x[2*(pc + dc*(f+1) + d) + 1];
-
-				const double dcx = cx1 - cx0;
-				const double dcy = cy1 - cy0;
-
-				//e_tot += eigenVals[d]*(dcx*dcx + dcy*dcy) / (sig_acc_px*sig_acc_px);
-
-				ts->gradDestT[t][2*(pc + dc*f + d)  ] -= 2.0 * eigenVals[d] * dcx / sa2;
-				ts->gradDestT[t][2*(pc + dc*f + d)+1] -= 2.0 * eigenVals[d] * dcy / sa2;
-				ts->gradDestT[t][2*(pc + dc*(f+1) + d)  ] += 2.0 * eigenVals[d] * dcx / sa2;
-				ts->gradDestT[t][2*(pc + dc*(f+1) + d)+1] += 2.0 * eigenVals[d] * dcy / sa2;
+				e_reg += eigenVals[d]*(dcx*dcx + dcy*dcy) / (sig_acc_px*sig_acc_px);
 			}
+		}
 	}
 
-	for (int i = 0; i < gradDest.size(); i++)
-	{
-		gradDest[i] = 0.0;
-	}
-
-	for (int t = 0; t < threads; t++)
-		for (int i = 0; i < gradDest.size(); i++)
-		{
-			gradDest[i] += ts->gradDestT[t][i];
-		}
+	ts->value = e_cc + e_reg;
+	ts->x = x;
+	ts->valid = true;
 }
 
 void *GpMotionFit::allocateTempStorage() const
 {
 	TempStorage* ts = new TempStorage;
 
-	const int pad = 512;
 	const int parCt = 2*(pc + dc*(fc-1));
 
-	ts->pad = pad;
-	ts->pos = std::vector<std::vector<d2Vector>>(pc, std::vector<d2Vector>(fc + pad));
-	ts->ccg_pf = std::vector<std::vector<d2Vector>>(pc, std::vector<d2Vector>(fc + pad));
-	ts->gradDestT = std::vector<std::vector<double>>(threads, std::vector<double>(parCt + pad, 0.0));
-	ts->e_t = std::vector<double>(pad*threads, 0.0);
+	ts->x = std::vector<double>(parCt, 0.0);
+	ts->valid = false;
+	ts->value = 0.0;
+
+	ts->coeffX = std::vector<double>(dc*(fc-1));
+	ts->coeffY = std::vector<double>(dc*(fc-1));
+	ts->posX = std::vector<double>(pc*fc);
+	ts->posY = std::vector<double>(pc*fc);
+	ts->ccgSumX = std::vector<double>(pc*fc);
+	ts->ccgSumY = std::vector<double>(pc*fc);
 
 	return ts;
 }
@@ -490,8 +336,8 @@ void GpMotionFit::paramsToPos(
 					const double cx = x[2*(pc + dc*f + d)    ];
 					const double cy = x[2*(pc + dc*f + d) + 1];
 
-					vel.x += cx * basis(p,d);
-					vel.y += cy * basis(p,d);
+					vel.x += cx * basisPD[p*dc + d];
+					vel.y += cy * basisPD[p*dc + d];
 				}
 
 				pp += vel;
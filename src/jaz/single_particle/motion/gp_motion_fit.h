@@ -54,15 +54,27 @@ class GpMotionFit : public DifferentiableOptimization
         void posToParams(const std::vector<std::vector<gravis::d2Vector>>& pos,
                          std::vector<double>& x) const;
 
+        /* Workspace for one optimization: allocated once, reused by every evaluation.
+           f() and grad() are usually called for the same x in succession, so the
+           values computed by f() are kept for grad(). */
         class TempStorage
         {
             public:
 
-                int pad;
+                // the parameters the values below belong to
+                std::vector<double> x;
+                bool valid;
 
-                std::vector<std::vector<gravis::d2Vector>> pos, ccg_pf;
-                std::vector<std::vector<double>> gradDestT;
-                std::vector<double> e_t;
+                double value;
+
+                // velocity coefficients: [d*(fc-1) + f]
+                std::vector<double> coeffX, coeffY;
+
+                // particle positions: [p*fc + f]
+                std::vector<double> posX, posY;
+
+                // sums of the CC gradients over frames f..fc-1: [f*pc + p]
+                std::vector<double> ccgSumX, ccgSumY;
         };
 
     private:
@@ -74,9 +86,14 @@ class GpMotionFit : public DifferentiableOptimization
         Matrix2D<RFLOAT> basis;
         std::vector<double> eigenVals;
 
+        // copies of basis: [p*dc + d] and [d*pc + p]
+        std::vector<double> basisPD, basisDP;
+
         const std::vector<std::vector<Image<double>>>& correlation;
         const std::vector<gravis::d2Vector>& positions;
         const std::vector<gravis::d2Vector>& perFrameOffsets;
+
+        void evaluate(const std::vector<double>& x, TempStorage* ts) const;
 };
 
 #endif
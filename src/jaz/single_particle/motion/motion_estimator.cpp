@@ -527,8 +527,11 @@ std::vector<std::vector<d2Vector>> MotionEstimator::optimize(
 		const std::vector<std::vector<gravis::d2Vector>>& inTracks,
 		double sig_vel_px, double sig_acc_px, double sig_div_px,
 		const std::vector<gravis::d2Vector>& positions,
-		const std::vector<gravis::d2Vector>& globComp) const
+		const std::vector<gravis::d2Vector>& globComp,
+		int threads) const
 {
+	if (threads < 1) threads = nr_omp_threads;
+
 	if (maxIters == 0) return inTracks;
 
 	const double eps = 1e-20;
@@ -550,7 +553,7 @@ std::vector<std::vector<d2Vector>> MotionEstimator::optimize(
 	const int fc = inTracks[0].size();
 
 	GpMotionFit gpmf(movieCC, cc_pad, sig_vel_px, sig_div_px, sig_acc_px,
-					 maxEDs, positions, globComp, nr_omp_threads, expKer);
+					 maxEDs, positions, globComp, threads, expKer);
 
 	std::vector<double> initialCoeffs;
 
@@ -576,8 +579,11 @@ std::vector<std::vector<d2Vector>> MotionEstimator::optimize(
 		const std::vector<std::vector<gravis::d2Vector>>& inTracks,
 		double sig_vel_px, double sig_acc_px, double sig_div_px,
 		const std::vector<gravis::d2Vector>& positions,
-		const std::vector<gravis::d2Vector>& globComp) const
+		const std::vector<gravis::d2Vector>& globComp,
+		int threads) const
 {
+	if (threads < 1) threads = nr_omp_threads;
+
 	const int pc = movieCC.size();
 	const int fc = movieCC[0].size();
 	const int w = movieCC[0][0].data.xdim;
@@ -585,7 +591,7 @@ std::vector<std::vector<d2Vector>> MotionEstimator::optimize(
 
 	std::vector<std::vector<Image<double>>> CCd(pc);
 
-	#pragma omp parallel for num_threads(nr_omp_threads)
+	#pragma omp parallel for num_threads(threads)
 	for (int p = 0; p < pc; p++)
 	{
 		CCd[p].resize(fc);
@@ -602,7 +608,7 @@ std::vector<std::vector<d2Vector>> MotionEstimator::optimize(
 		}
 	}
 
-	return optimize(CCd, inTracks, sig_vel_px, sig_acc_px, sig_div_px, positions, globComp);
+	return optimize(CCd, inTracks, sig_vel_px, sig_acc_px, sig_div_px, positions, globComp, threads);
 }
 
 std::vector<Image<RFLOAT>> MotionEstimator::computeDamageWeights(int opticsGroup)
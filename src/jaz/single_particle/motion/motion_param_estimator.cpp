@@ -29,6 +29,7 @@
 #include <src/jaz/single_particle/vtk_helper.h>
 
 #include <src/jaz/util/zio.h>
+#include <exception>
 
 using namespace gravis;
 
@@ -351,9 +352,13 @@ d4Vector MotionParamEstimator::estimateTwoParamsNM(
 
     double minTsc;
 
-    std::vector<double> final = NelderMead::optimize(
+    std::vector<double> final = batchCandidatePoints()?
+        NelderMead::optimizeBatched(
             initial, thpp, inStep, conv, maxIters,
-			1.0, 2.0, 0.5, 0.5, true, &minTsc);
+            1.0, 2.0, 0.5, 0.5, true, &minTsc) :
+        NelderMead::optimize(
+            initial, thpp, inStep, conv, maxIters,
+            1.0, 2.0, 0.5, 0.5, true, &minTsc);
 
     d2Vector vd = TwoHyperParameterProblem::problemToMotion(final);
 
@@ -372,15 +377,41 @@ d4Vector MotionParamEstimator::estimateThreeParamsNM(
 
     double minTsc;
 
-    std::vector<double> final = NelderMead::optimize(
+    std::vector<double> final = batchCandidatePoints()?
+        NelderMead::optimizeBatched(
+            initial, thpp, inStep, conv, maxIters,
+            1.0, 2.0, 0.5, 0.5, true, &minTsc) :
+        NelderMead::optimize(
             initial, thpp, inStep, conv, maxIters,
-			1.0, 2.0, 0.5, 0.5, true, &minTsc);
+            1.0, 2.0, 0.5, 0.5, true, &minTsc);
 
     d3Vector vd = ThreeHyperParameterProblem::problemToMotion(final);
 
     return d4Vector(vd[0], vd[1], vd[2], -minTsc);
 }
 
+std::vector<int> MotionParamEstimator::getUsableMicrographs() const
+{
+    std::vector<int> out;
+
+    for (int g = 0; g < mdts.size(); g++)
+    {
+        if (mdts[g].numberOfObjects() >= 2) // not really needed, mdts are pre-screened
+        {
+            out.push_back(g);
+        }
+    }
+
+    return out;
+}
+
+bool MotionParamEstimator::batchCandidatePoints() const
+{
+    // Only if the micrographs of a single point cannot keep the threads busy
+    // (see evaluateParams); otherwise batching only costs extra evaluations.
+    return nr_omp_threads > 1 && 2 * (int)getUsableMicrographs().size() < nr_omp_threads;
+}
+
 void MotionParamEstimator::evaluateParams(
     const std::vector<d3Vector>& sig_vals,
     std::vector<double>& TSCs)
@@ -399,71 +430,90 @@ void MotionParamEstimator::evaluateParams(
         sig_a_vals_px[i] = motionEstimator->normalizeSigAcc(sig_vals[i][2], reference->angpix);
     }
 
-    int pctot = 0;
-    std::vector<d3Vector> tscsAs(paramCount, d3Vector(0.0, 0.0, 0.0));
-
     const int gc = mdts.size();
 
-    for (long g = 0; g < gc; g++)
-    {
-        const int pc = mdts[g].numberOfObjects();
+    // All (micrograph, parameter set) pairs are fitted independently. If there are
+    // enough of them, they are distributed over the threads and each fit runs on a
+    // single thread; otherwise, the threads are used inside each fit.
 
-        if (pc < 2) continue; // not really needed, mdts are pre-screened
+    const std::vector<int> taskMg = getUsableMicrographs();
 
-        pctot += pc;
+    const int taskCount = taskMg.size() * paramCount;
 
-        if (debug)
-        {
-            std::cout << "    micrograph " << (g+1) << " / " << mdts.size() << ": "
-                << pc << " particles [" << pctot << " total]" << std::endl;
-        }
+    const int outerThreads = (debug || 2 * taskCount < nr_omp_threads)?
+                1 : std::min(taskCount, nr_omp_threads);
+
+    const int innerThreads = outerThreads > 1? 1 : nr_omp_threads;
+
+    std::vector<d3Vector> taskTsc(taskCount);
+    std::exception_ptr error;
 
-        for (int i = 0; i < paramCount; i++)
+    RCTIC(paramTimer,timeOpt);
+
+    #pragma omp parallel for num_threads(outerThreads) schedule(dynamic)
+    for (int t = 0; t < taskCount; t++)
+    {
+        const int g = taskMg[t / paramCount];
+        const int i = t % paramCount;
+        const int pc = mdts[g].numberOfObjects();
+
+        try
         {
             if (debug)
             {
-                std::cout << "        evaluating: " << sig_vals[i] << std::endl;
+                std::cout << "    micrograph " << (g+1) << " / " << gc << ": "
+                    << pc << " particles, evaluating: " << sig_vals[i] << std::endl;
             }
 
-            RCTIC(paramTimer,timeOpt);
-
             std::vector<std::vector<gravis::d2Vector>> tracks =
                 motionEstimator->optimize(
                     alignmentSet.CCs[g],
                     alignmentSet.initialTracks[g],
                     sig_v_vals_px[i], sig_a_vals_px[i], sig_d_vals_px[i],
-                    alignmentSet.positions[g], alignmentSet.globComp[g]);
+                    alignmentSet.positions[g], alignmentSet.globComp[g],
+                    innerThreads);
 
-			if (debug)
+            if (debug)
             {
-				std::stringstream sts;
-				sts << "debug-track_" << sig_vals[i][0] << "_" << sig_vals[i][1] << "_" << sig_vals[i][2] << ".dat";
+                std::stringstream sts;
+                sts << "debug-track_" << sig_vals[i][0] << "_" << sig_vals[i][1] << "_" << sig_vals[i][2] << ".dat";
 
-				std::ofstream debugStr(sts.str());
+                std::ofstream debugStr(sts.str());
 
-				for (int p = 0; p < pc; p++)
-				{
-					for (int f = 0; f < fc; f++)
-					{
-						debugStr << tracks[p][f] << std::endl;
-					}
+                for (int p = 0; p < pc; p++)
+                {
+                    for (int f = 0; f < fc; f++)
+                    {
+                        debugStr << tracks[p][f] << std::endl;
+                    }
 
-					debugStr << std::endl;
-				}
+                    debugStr << std::endl;
+                }
 
-				debugStr.close();
-			}
+                debugStr.close();
+            }
 
-            RCTOC(paramTimer,timeOpt);
+            taskTsc[t] = alignmentSet.updateTsc(tracks, g, innerThreads);
+        }
+        catch (...)
+        {
+            #pragma omp critical(MotionParamEstimator_evaluateParams)
+            error = std::current_exception();
+        }
+    }
 
-            RCTIC(paramTimer,timeEval);
+    if (error) std::rethrow_exception(error);
 
-            tscsAs[i] += alignmentSet.updateTsc(tracks, g, nr_omp_threads);
+    RCTOC(paramTimer,timeOpt);
 
-            RCTOC(paramTimer,timeEval);
-        }
+    // sum up in the order of the micrographs, so that the result does not depend on the threads
 
-    } // micrographs
+    std::vector<d3Vector> tscsAs(paramCount, d3Vector(0.0, 0.0, 0.0));
+
+    for (int t = 0; t < taskCount; t++)
+    {
+        tscsAs[t % paramCount] += taskTsc[t];
+    }
 
     if (debug)
     {
@@ -481,6 +531,10 @@ void MotionParamEstimator::evaluateParams(
         {
             TSCs[i] = tscsAs[i][0] / sqrt(wg);
         }
+        else
+        {
+            TSCs[i] = 0.0;
+        }
     }
 
     RCTOC(paramTimer,timeEval);
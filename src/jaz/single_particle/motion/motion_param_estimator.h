@@ -112,6 +112,12 @@ class MotionParamEstimator
                 double sig_v_0, double sig_d_0, double sig_a_0,
                 double inStep, double conv, int maxIters);
 
+        // micrographs with enough particles to be fitted
+        std::vector<int> getUsableMicrographs() const;
+
+        // evaluate all candidate points of a Nelder-Mead iteration together?
+        bool batchCandidatePoints() const;
+
 
         void prepAlignment();
 };
@@ -34,6 +34,7 @@
 #include <src/jaz/single_particle/img_proc/image_op.h>
 #include <src/jaz/single_particle/parallel_ft.h>
 #include <src/renderEER.h>
+#include <src/parallel.h>
 
 #include "gp_motion_fit.h"
 #include "motion_helper.h"
@@ -72,6 +73,7 @@ void MotionRefiner::read(int argc, char **argv)
 	parser.addSection("Computational options");
 	
 	nr_omp_threads = textToInteger(parser.getOption("--j", "Number of (OMP) threads", "1"));
+	setThreadBudget(nr_omp_threads);
 	particlesForFcc = textToInteger(parser.getOption("--B_parts", "Number of particles used for B-factor estimation (negative means all)", "-1"));
 	minMG = textToInteger(parser.getOption("--min_MG", "First micrograph index", "0"));
 	maxMG = textToInteger(parser.getOption("--max_MG", "Last micrograph index (default is to process all)", "-1"));
@@ -407,11 +409,12 @@ void MotionRefiner::run()
 			init_progress_bar(mgc - firstTotalMgWithoutFCC);
 		}
 
+		// Keep the frames read by the motion estimator, so that the frame
+		// recombiner does not have to read the movie again (unless --sbs is set).
+		micrographHandler.cacheMovies = estimateMotion;
+
 		for (int m = firstTotalMgWithoutFCC; m < mgc; m++)
 		{
-			// TODO: TAKANORI: micrograph handler can cache movie frames to avoid reading movies twice.
-			//                 (if --sbs, don't cache to save memory)
-
 			if (estimateMotion && motionUnfinished[m])
 			{
 				motionEstimator.process(motionMdts, total2motion[m], total2motion[m], false);
@@ -422,6 +425,8 @@ void MotionRefiner::run()
 				frameRecombiner.process(recombMdts, total2recomb[m], total2recomb[m]);
 			}
 
+			micrographHandler.releaseMovieCache();
+
 			const int nr_done = m - firstTotalMgWithoutFCC;
 
 			if (verb > 0 && nr_done % barstep == 0)
@@ -434,6 +439,8 @@ void MotionRefiner::run()
 		{
 			progress_bar(left);
 		}
+
+		micrographHandler.cacheMovies = false;
 	}
 	else
 	{
@@ -50,6 +50,26 @@ double ThreeHyperParameterProblem::f(const std::vector<double>& x, void *tempSto
     return -tsc[0];
 }
 
+void ThreeHyperParameterProblem::fBatch(
+        const std::vector<std::vector<double>>& x,
+        std::vector<double>& values, void* tempStorage) const
+{
+    const int n = x.size();
+    std::vector<d3Vector> vda(n);
+
+    for (int i = 0; i < n; i++)
+    {
+        vda[i] = problemToMotion(x[i]);
+    }
+
+    motionParamEstimator.evaluateParams(vda, values);
+
+    for (int i = 0; i < n; i++)
+    {
+        values[i] = -values[i];
+    }
+}
+
 void ThreeHyperParameterProblem::report(int iteration, double cost, const std::vector<double>& x) const
 {
 	d3Vector vda = problemToMotion(x);
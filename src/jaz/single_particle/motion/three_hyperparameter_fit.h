@@ -34,6 +34,10 @@ class ThreeHyperParameterProblem : public Optimization
             MotionParamEstimator& motionParamEstimator);
 
         double f(const std::vector<double>& x, void* tempStorage) const;
+
+        // all points are evaluated in one pass over the micrographs
+        void fBatch(const std::vector<std::vector<double>>& x,
+                    std::vector<double>& values, void* tempStorage) const;
         void report(int iteration, double cost, const std::vector<double>& x) const;
 
         static gravis::d3Vector problemToMotion(const std::vector<double>& x);
@@ -44,6 +44,27 @@ double TwoHyperParameterProblem::f(const std::vector<double>& x, void *tempStora
     return -tsc[0];
 }
 
+void TwoHyperParameterProblem::fBatch(
+        const std::vector<std::vector<double>>& x,
+        std::vector<double>& values, void* tempStorage) const
+{
+    const int n = x.size();
+    std::vector<d3Vector> vda(n);
+
+    for (int i = 0; i < n; i++)
+    {
+        d2Vector vd = problemToMotion(x[i]);
+        vda[i] = d3Vector(vd[0], vd[1], s_acc);
+    }
+
+    motionParamEstimator.evaluateParams(vda, values);
+
+    for (int i = 0; i < n; i++)
+    {
+        values[i] = -values[i];
+    }
+}
+
 void TwoHyperParameterProblem::report(int iteration, double cost, const std::vector<double>& x) const
 {
     d2Vector vd = problemToMotion(x);	
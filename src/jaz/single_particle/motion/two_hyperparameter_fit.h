@@ -35,6 +35,10 @@ class TwoHyperParameterProblem : public Optimization
             double s_acc);
 
         double f(const std::vector<double>& x, void* tempStorage) const;
+
+        // all points are evaluated in one pass over the micrographs
+        void fBatch(const std::vector<std::vector<double>>& x,
+                    std::vector<double>& values, void* tempStorage) const;
         void report(int iteration, double cost, const std::vector<double>& x) const;
 
         static gravis::d2Vector problemToMotion(const std::vector<double>& x);
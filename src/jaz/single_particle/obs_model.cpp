@@ -1472,17 +1472,7 @@ void ObservationModel::saveNew(
 	std::string tmpfilename = filename + ".tmp";
 	std::ofstream of(tmpfilename);
 
-	if (generalMdt.numberOfObjects() > 0)
-    {
-        generalMdt.setName("general");
-        generalMdt.write(of);
-    }
-
-	opticsMdt.setName("optics");
-	opticsMdt.write(of);
-
-	particlesMdt.setName(tablename);
-	particlesMdt.write(of);
+	writeNew(of, particlesMdt, opticsMdt, generalMdt, tablename);
 
 	std::rename(tmpfilename.c_str(), filename.c_str());
 }
@@ -1492,19 +1482,34 @@ void ObservationModel::save(MetaDataTable &particlesMdt, std::string filename, s
 	std::string tmpfilename = filename + ".tmp";
 	std::ofstream of(tmpfilename);
 
-    if (generalMdt.numberOfObjects() > 0)
-    {
-        generalMdt.setName("general");
-        generalMdt.write(of);
-    }
+	write(of, particlesMdt, tablename);
+
+	std::rename(tmpfilename.c_str(), filename.c_str());
+}
+
+void ObservationModel::writeNew(
+		std::ostream &out,
+		MetaDataTable &particlesMdt,
+		MetaDataTable &opticsMdt,
+		MetaDataTable &generalMdt,
+		std::string tablename)
+{
+	if (generalMdt.numberOfObjects() > 0)
+	{
+		generalMdt.setName("general");
+		generalMdt.write(out);
+	}
 
 	opticsMdt.setName("optics");
-	opticsMdt.write(of);
+	opticsMdt.write(out);
 
 	particlesMdt.setName(tablename);
-	particlesMdt.write(of);
+	particlesMdt.write(out);
+}
 
-	std::rename(tmpfilename.c_str(), filename.c_str());
+void ObservationModel::write(std::ostream &out, MetaDataTable &particlesMdt, std::string tablename)
+{
+	writeNew(out, particlesMdt, opticsMdt, generalMdt, tablename);
 }
 
 bool ObservationModel::containsAllColumnsNeededForPrediction(const MetaDataTable& partMdt)
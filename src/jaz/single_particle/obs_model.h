@@ -157,6 +157,16 @@ class ObservationModel
 				MetaDataTable& particlesMdt, std::string filename,
 				std::string _tablename = "particles");
 
+		// Write what saveNew() and save() would write to a stream
+		static void writeNew(
+				std::ostream& out,
+				MetaDataTable& particlesMdt, MetaDataTable& opticsMdt, MetaDataTable& generalMdt,
+				std::string _tablename = "particles");
+
+		void write(
+				std::ostream& out,
+				MetaDataTable& particlesMdt, std::string _tablename = "particles");
+
 
 		// Bureaucracy
 
@@ -13,6 +13,7 @@
 #include <src/jaz/image/resampling.h>
 
 #include <src/jaz/tomography/tomogram.h>
+#include <src/jaz/tomography/tile_cached_tilt_series.h>
 
 #define EDGE_FALLOFF 5
 
@@ -43,6 +44,27 @@ class TomoExtraction
 				bool circle_crop = true,
                 FFT::Normalization normalization = FFT::Both);
 		
+		// Same as above, but reading from a tilt series that is loaded on demand.
+		// The required regions need to have been loaded through requestAt3D.
+		template <typename T>
+		static void extractAt3D_Fourier(
+				const TileCachedTiltSeries& tiles, int s, double bin,
+				const Tomogram& tomogram,
+				const std::vector<gravis::d3Vector>& trajectory,
+				const std::vector<bool>& isVisible,
+				RawImage<tComplex<T>>& out,
+				std::vector<gravis::d4Matrix>& projOut,
+				int num_threads = 1,
+				bool circle_crop = true,
+                FFT::Normalization normalization = FFT::Both);
+
+		// Request the regions of the tilt series read by extractAt3D_Fourier
+		static void requestAt3D(
+				TileCachedTiltSeries& tiles, int s,
+				const Tomogram& tomogram,
+				const std::vector<gravis::d3Vector>& trajectory,
+				const std::vector<bool>& isVisible);
+		
 		template <typename T>
 		static void extractAt2D_Fourier(
 				const RawImage<T>& stack, int s, double bin,
@@ -87,6 +109,16 @@ class TomoExtraction
 				bool center,
 				int num_threads = 1);
 
+		template <typename T>
+		static void extractSquares(
+				const TileCachedTiltSeries& tiles,
+				int w, int h,
+				const std::vector<gravis::d2Vector>& origins,
+				const std::vector<bool>& isVisible,
+				RawImage<T>& out,
+				bool center,
+				int num_threads = 1);
+
 		template <typename T>
 		static void cropCircle(
 				RawImage<T>& stack,
@@ -99,6 +131,24 @@ class TomoExtraction
 				RawImage<T>& stack,
 				double boundary,
 				int num_threads = 1);
+
+	protected:
+
+		static std::vector<gravis::d2Vector> getIntegralShifts(
+				const std::vector<gravis::d2Vector>& centers, int s);
+
+		// Fourier transform, bin and shift squares cut out at integralShift
+		template <typename T>
+		static void transformSquares_Fourier(
+				BufferedImage<T>& smallStack, int s, double bin,
+				const std::vector<gravis::d4Matrix>& projIn,
+				const std::vector<gravis::d2Vector>& centers,
+				const std::vector<gravis::d2Vector>& integralShift,
+				RawImage<tComplex<T>>& out,
+				std::vector<gravis::d4Matrix>& projOut,
+				int num_threads,
+				bool circle_crop,
+				FFT::Normalization normalization);
 };
 
 template <typename T>
@@ -148,6 +198,54 @@ void TomoExtraction::extractAt3D_Fourier(
 		out, projOut, num_threads, circle_crop, normalization);
 }
 
+template <typename T>
+void TomoExtraction::extractAt3D_Fourier(
+		const TileCachedTiltSeries& tiles, int s, double bin,
+		const Tomogram& tomogram,
+		const std::vector<gravis::d3Vector>& trajectory,
+		const std::vector<bool>& isVisible,
+		RawImage<tComplex<T>>& out,
+		std::vector<gravis::d4Matrix>& projOut,
+		int num_threads,
+		bool circle_crop,
+        FFT::Normalization normalization)
+{
+	const int fc = tomogram.frameCount;
+	std::vector<gravis::d2Vector> centers(fc);
+
+	for (int f = 0; f < fc; f++)
+	{
+		centers[f] = tomogram.projectPoint(trajectory[f], f);
+	}
+
+	const std::vector<gravis::d2Vector> integralShift = getIntegralShifts(centers, s);
+
+	BufferedImage<T> smallStack(s,s,fc);
+
+	extractSquares(tiles, s, s, integralShift, isVisible, smallStack, false, num_threads);
+
+	transformSquares_Fourier(
+		smallStack, s, bin, tomogram.projectionMatrices, centers, integralShift,
+		out, projOut, num_threads, circle_crop, normalization);
+}
+
+inline void TomoExtraction::requestAt3D(
+		TileCachedTiltSeries& tiles, int s,
+		const Tomogram& tomogram,
+		const std::vector<gravis::d3Vector>& trajectory,
+		const std::vector<bool>& isVisible)
+{
+	const int fc = tomogram.frameCount;
+	std::vector<gravis::d2Vector> centers(fc);
+
+	for (int f = 0; f < fc; f++)
+	{
+		centers[f] = tomogram.projectPoint(trajectory[f], f);
+	}
+
+	tiles.requestSquares(s, s, getIntegralShifts(centers, s), isVisible);
+}
+
 template <typename T>
 void TomoExtraction::extractAt2D_Fourier(
 		const RawImage<T>& stack, int s, double bin,
@@ -160,25 +258,53 @@ void TomoExtraction::extractAt2D_Fourier(
 		bool circle_crop,
         FFT::Normalization normalization)
 {
-	const int sh = s/2 + 1;
 	const int fc = stack.zdim;
 
-	const int sb = (int)(s / bin + 0.5);
-	const int sbh = sb/2 + 1;
-	
 	BufferedImage<T> smallStack(s,s,fc);
-	projOut.resize(fc);
-			
+
+	const std::vector<gravis::d2Vector> integralShift = getIntegralShifts(centers, s);
+	
+	extractSquares(stack, s, s, integralShift, isVisible, smallStack, false, num_threads);
+
+	transformSquares_Fourier(
+		smallStack, s, bin, projIn, centers, integralShift,
+		out, projOut, num_threads, circle_crop, normalization);
+}
+
+inline std::vector<gravis::d2Vector> TomoExtraction::getIntegralShifts(
+		const std::vector<gravis::d2Vector>& centers, int s)
+{
+	const int fc = centers.size();
 	std::vector<gravis::d2Vector> integralShift(fc);
-			
+
 	for (int f = 0; f < fc; f++)
 	{
 		integralShift[f] = gravis::d2Vector(
 				round(centers[f].x) - s/2,
 				round(centers[f].y) - s/2);
 	}
-	
-	extractSquares(stack, s, s, integralShift, isVisible, smallStack, false, num_threads);
+
+	return integralShift;
+}
+
+template <typename T>
+void TomoExtraction::transformSquares_Fourier(
+		BufferedImage<T>& smallStack, int s, double bin,
+		const std::vector<gravis::d4Matrix>& projIn,
+		const std::vector<gravis::d2Vector>& centers,
+		const std::vector<gravis::d2Vector>& integralShift,
+		RawImage<tComplex<T>>& out,
+		std::vector<gravis::d4Matrix>& projOut,
+		int num_threads,
+		bool circle_crop,
+		FFT::Normalization normalization)
+{
+	const int sh = s/2 + 1;
+	const int fc = smallStack.zdim;
+
+	const int sb = (int)(s / bin + 0.5);
+
+	projOut.resize(fc);
 	
 	if (circle_crop) 
 	{
@@ -196,7 +322,7 @@ void TomoExtraction::extractAt2D_Fourier(
 		projOut[f](1,3) += sb/2 - centers[f].y;
 		
 		posInNewImg[f] = (centers[f] - integralShift[f]) / bin;
-	}	
+	}
 	
 	BufferedImage<tComplex<T>> smallStackFS(sh,s,fc);
 
@@ -348,6 +474,60 @@ void TomoExtraction::extractSquares(
 	}
 }
 
+template <typename T>
+void TomoExtraction::extractSquares(
+		const TileCachedTiltSeries& tiles,
+		int w, int h,
+		const std::vector<gravis::d2Vector>& origins,
+		const std::vector<bool>& isVisible,
+		RawImage<T>& out,
+		bool center,
+		int num_threads)
+{
+	const int w0 = tiles.xdim;
+	const int h0 = tiles.ydim;
+	const int fc = out.zdim;
+
+	// Errors cannot be thrown out of the parallel loop
+	for (int f = 0; f < fc; f++)
+	{
+		if (isVisible[f])
+		{
+			tiles.checkSquare(f, (int)origins[f].x, (int)origins[f].y, w, h);
+		}
+	}
+
+	#pragma omp parallel for num_threads(num_threads)
+	for (int f = 0; f < fc; f++)
+	{
+		if (isVisible[f])
+		{
+			for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++)
+			{
+				int xx = (center? (x + w/2) % w : x) + origins[f].x;
+				int yy = (center? (y + h/2) % h : y) + origins[f].y;
+
+				if (xx < 0) xx = 0;
+				else if (xx >= w0) xx = w0 - 1;
+
+				if (yy < 0) yy = 0;
+				else if (yy >= h0) yy = h0 - 1;
+
+				out(x,y,f) = tiles(xx,yy,f);
+			}
+		}
+		else
+		{
+			for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++)
+			{
+				out(x,y,f) = T(0);
+			}
+		}
+	}
+}
+
 template <typename T>
 void TomoExtraction::cropCircle(
 		RawImage<T>& stack,
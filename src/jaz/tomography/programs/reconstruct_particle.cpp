@@ -16,6 +16,7 @@
 #include <src/jaz/util/zio.h>
 #include <src/jaz/util/log.h>
 #include <src/time.h>
+#include <src/parallel.h>
 #include <mpi.h>
 #include <iostream>
 
@@ -80,8 +81,11 @@ void ReconstructParticleProgram::readBasicParameters(int argc, char *argv[])
 	do_circle_crop = !parser.checkOption("--no_circle_crop", "Do not crop 2D images to a circle prior to insertion");
 
 	num_threads = textToInteger(parser.getOption("--j", "Number of OMP threads", "6"));
+	setThreadBudget(num_threads);
 	inner_threads = textToInteger(parser.getOption("--j_in", "Number of inner threads (slower, needs less memory)", "3"));
 	outer_threads = textToInteger(parser.getOption("--j_out", "Number of outer threads (faster, needs more memory)", "2"));
+	shared_volumes = parser.checkOption("--shared_volumes", "Let all threads insert into the same volumes (memory does not grow with --j_out)");
+	roi_tile_size = textToInteger(parser.getOption("--roi_tiles", "Only read the regions of the tilt series that particles project into, in tiles of this size (0: read entire tilt series)", "0"));
 
 	no_reconstruction = parser.checkOption("--no_recon", "Do not reconstruct the volume, only backproject (for benchmarking purposes)");
 	freqCutoffFract = textToDouble(parser.getOption("--cutoff_fract", "Ignore shells for which the dose weight falls below this value", "0.01"));
@@ -94,6 +98,11 @@ void ReconstructParticleProgram::readBasicParameters(int argc, char *argv[])
 	{
 		REPORT_ERROR("Errors encountered on the command line (see above), exiting...");
 	}
+
+	if (roi_tile_size > 0 && do_whiten)
+	{
+		REPORT_ERROR("--roi_tiles cannot be combined with --whiten, since the noise spectrum is estimated from entire tilt series");
+	}
 }
 
 void ReconstructParticleProgram::run()
@@ -126,7 +135,8 @@ void ReconstructParticleProgram::run()
 			2.0 * voxelNum * 3.0 * sizeof(double)   // two halves  *  box size  *  (data (x2) + ctf)
 			/ (1024.0 * 1024.0 * 1024.0);           // in GB
 
-	if (max_mem_GB > 0)
+	// with --shared_volumes, only one pair of volumes is needed, regardless of --j_out
+	if (max_mem_GB > 0 && !shared_volumes)
 	{
 		const double maxThreads = max_mem_GB / GB_per_thread;
 		
@@ -140,9 +150,10 @@ void ReconstructParticleProgram::run()
 		}
 	}
 	
-	const int outCount = 2 * outer_threads;
+	const int volumeSets = shared_volumes? 1 : outer_threads;
+	const int outCount = 2 * volumeSets;
 		
-	Log::print("Memory required for accumulation: " + ZIO::itoa(GB_per_thread  * outer_threads) + " GB");
+	Log::print("Memory required for accumulation: " + ZIO::itoa(GB_per_thread  * volumeSets) + " GB");
 	
 	std::vector<BufferedImage<double>> ctfImgFS(outCount);
 	std::vector<BufferedImage<dComplex>> dataImgFS(outCount);
@@ -283,13 +294,34 @@ void ReconstructParticleProgram::processTomograms(
 			}
 		}
 
-		Tomogram tomogram = tomoSet.loadTomogram(t, true);
+		const bool load_rois = roi_tile_size > 0;
+
+		Tomogram tomogram = tomoSet.loadTomogram(t, !load_rois);
 		tomogram.validateParticleOptics(particles[t], particleSet);
 
 		const int fc = tomogram.frameCount;
 
 		particleSet.checkTrajectoryLengths(particles[t], fc, "reconstruct_particle");
 
+		if (load_rois)
+		{
+			tomoSet.attachTiltSeriesTiles(tomogram, t, roi_tile_size);
+
+			for (int p = 0; p < pc; p++)
+			{
+				const ParticleIndex part_id = particles[t][p];
+
+				const std::vector<d3Vector> traj = particleSet.getTrajectoryInPixels(
+							part_id, fc, tomogram.centre, tomogram.optics.pixelSize);
+
+				const std::vector<bool> isVisible = tomogram.determineVisiblity(traj, s/2.0);
+
+				TomoExtraction::requestAt3D(*tomogram.tiles, s02D, tomogram, traj, isVisible);
+			}
+
+			tomogram.tiles->loadRequested(num_threads);
+		}
+
 		BufferedImage<float> doseWeights = tomogram.computeDoseWeight(s, binning);
 
 		BufferedImage<int> xRanges = tomogram.findDoseXRanges(doseWeights, freqCutoffFract);
@@ -305,6 +337,9 @@ void ReconstructParticleProgram::processTomograms(
 
 		std::vector<BufferedImage<float>> weightStack(outer_threads, BufferedImage<float>(sh,s,fc));
 		std::vector<BufferedImage<fComplex>> particleStack(outer_threads, BufferedImage<fComplex>(sh,s,fc));
+		std::vector<std::vector<d4Matrix>> projPart(outer_threads, std::vector<d4Matrix>(fc));
+		std::vector<std::vector<bool>> isVisible(outer_threads);
+		std::vector<int> halfSet(outer_threads, 0);
 
 		if (!do_ctf)
 		{
@@ -319,42 +354,38 @@ void ReconstructParticleProgram::processTomograms(
 			Log::beginProgress("Backprojecting", (int)ceil(pc/(double)outer_threads));
 		}
 
-		#pragma omp parallel for num_threads(outer_threads)
-		for (int p = 0; p < pc; p++)
-		{
-			const int th = omp_get_thread_num();
-
-			if (th == 0 && verbosity > 0)
-			{
-				if (per_tomogram_progress)
-				{
-					Log::updateProgress(p);
-				}
-				else
-				{
-					Log::updateProgress(particles_in_previous_tomograms + p);
-				}
-			}
+		// Extract particle p into the buffers of slot th and weight it
 
+		auto prepareParticle = [&](int p, int th)
+		{
 			const ParticleIndex part_id = particles[t][p];
 
 			const d3Vector pos = particleSet.getPosition(part_id, tomogram.centre);
 			const std::vector<d3Vector> traj = particleSet.getTrajectoryInPixels(
 						part_id, fc, tomogram.centre, tomogram.optics.pixelSize);
-			std::vector<d4Matrix> projCut(fc), projPart(fc);
+			std::vector<d4Matrix> projCut(fc);
 
-			const std::vector<bool> isVisible = tomogram.determineVisiblity(traj, s/2.0);
+			isVisible[th] = tomogram.determineVisiblity(traj, s/2.0);
 
 			const bool circle_crop = do_circle_crop;
 
-			TomoExtraction::extractAt3D_Fourier(
-					tomogram.stack, s02D, binning, tomogram, traj, isVisible,
-					particleStack[th], projCut, inner_threads, circle_crop);
+			if (load_rois)
+			{
+				TomoExtraction::extractAt3D_Fourier(
+						*tomogram.tiles, s02D, binning, tomogram, traj, isVisible[th],
+						particleStack[th], projCut, inner_threads, circle_crop);
+			}
+			else
+			{
+				TomoExtraction::extractAt3D_Fourier(
+						tomogram.stack, s02D, binning, tomogram, traj, isVisible[th],
+						particleStack[th], projCut, inner_threads, circle_crop);
+			}
 
 
 			const d4Matrix particleToTomo = particleSet.getMatrix4x4(part_id, tomogram.centre, s,s,s);
 
-            const int halfSet = (particleSet.hasHalfSets()) ? particleSet.getHalfSet(part_id) : 0;
+			halfSet[th] = (particleSet.hasHalfSets()) ? particleSet.getHalfSet(part_id) : 0;
 
 			const int og = particleSet.getOpticsGroup(part_id);
 
@@ -364,10 +395,10 @@ void ReconstructParticleProgram::processTomograms(
             const float sign = flip_value? -1.f : 1.f;
 			for (int f = 0; f < fc; f++)
 			{
-				if (!isVisible[f]) continue;
+				if (!isVisible[th][f]) continue;
 				
 				const double scaleRatio = binnedOutPixelSize / binnedPixelSize;
-				projPart[f] = scaleRatio * projCut[f] * particleToTomo;
+				projPart[th][f] = scaleRatio * projCut[f] * particleToTomo;
 
 				if (do_ctf)
 				{
@@ -410,23 +441,95 @@ void ReconstructParticleProgram::processTomograms(
 				particleStack[th] *= noiseWeights;
 				weightStack[th] *= noiseWeights;
 			}
+		};
 
-			for (int f = 0; f < fc; f++)
+		if (shared_volumes)
+		{
+			// All threads insert into the same two volumes: a batch of particles is
+			// extracted (one per thread), then the volumes are split into slabs
+			// along Z and each slab is updated by one thread with the whole batch.
+
+			const int slab_threads = outer_threads * inner_threads;
+			const int slabCount = std::min(s, 4 * slab_threads);
+
+			for (int p0 = 0; p0 < pc; p0 += outer_threads)
 			{
-				if (isVisible[f])
+				const int batch = std::min(outer_threads, pc - p0);
+
+				if (verbosity > 0)
+				{
+					const int done = p0 / outer_threads;
+					Log::updateProgress(per_tomogram_progress? done : particles_in_previous_tomograms + done);
+				}
+
+				#pragma omp parallel for num_threads(outer_threads)
+				for (int b = 0; b < batch; b++)
 				{
-					FourierBackprojection::backprojectSlice_backward(
-						xRanges(0,f),
-						particleStack[th].getSliceRef(f),
-						weightStack[th].getSliceRef(f),
-						projPart[f],
-						dataImgFS[2*th + halfSet],
-						ctfImgFS[2*th + halfSet],
-						inner_threads);
+					prepareParticle(p0 + b, b);
+				}
+
+				#pragma omp parallel for num_threads(slab_threads) schedule(dynamic)
+				for (int sl = 0; sl < slabCount; sl++)
+				{
+					const int z0 = (sl * (long int) s) / slabCount;
+					const int z1 = ((sl + 1) * (long int) s) / slabCount;
+
+					for (int b = 0; b < batch; b++)
+					for (int f = 0; f < fc; f++)
+					{
+						if (isVisible[b][f])
+						{
+							FourierBackprojection::backprojectSlice_backward_slab(
+								xRanges(0,f),
+								particleStack[b].getSliceRef(f),
+								weightStack[b].getSliceRef(f),
+								projPart[b][f],
+								dataImgFS[halfSet[b]],
+								ctfImgFS[halfSet[b]],
+								z0, z1);
+						}
+					}
 				}
 			}
+		}
+		else
+		{
+			#pragma omp parallel for num_threads(outer_threads)
+			for (int p = 0; p < pc; p++)
+			{
+				const int th = omp_get_thread_num();
+
+				if (th == 0 && verbosity > 0)
+				{
+					if (per_tomogram_progress)
+					{
+						Log::updateProgress(p);
+					}
+					else
+					{
+						Log::updateProgress(particles_in_previous_tomograms + p);
+					}
+				}
 
-		} // particles
+				prepareParticle(p, th);
+
+				for (int f = 0; f < fc; f++)
+				{
+					if (isVisible[th][f])
+					{
+						FourierBackprojection::backprojectSlice_backward(
+							xRanges(0,f),
+							particleStack[th].getSliceRef(f),
+							weightStack[th].getSliceRef(f),
+							projPart[th][f],
+							dataImgFS[2*th + halfSet[th]],
+							ctfImgFS[2*th + halfSet[th]],
+							inner_threads);
+					}
+				}
+
+			} // particles
+		}
 
 		if (!no_backup)
 		{
@@ -25,9 +25,9 @@ class ReconstructParticleProgram
 			bool
 				do_whiten, no_reconstruction, only_do_unfinished,
 				run_from_GUI, run_from_MPI,
-				no_backup, do_circle_crop, do_ctf;
+				no_backup, do_circle_crop, do_ctf, shared_volumes;
 
-			int boxSize, cropSize, num_threads, outer_threads, inner_threads, max_mem_GB;
+			int boxSize, cropSize, num_threads, outer_threads, inner_threads, max_mem_GB, roi_tile_size;
 
 			double SNR, taper, binning, freqCutoffFract;
 
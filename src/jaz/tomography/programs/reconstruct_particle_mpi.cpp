@@ -92,7 +92,8 @@ void ReconstructParticleProgramMpi::run()
 			2.0 * voxelNum * 3.0 * sizeof(double)   // two halves  *  box size  *  (data (x2) + ctf)
 			/ (1024.0 * 1024.0 * 1024.0);           // in GB
 
-	if (max_mem_GB > 0)
+	// with --shared_volumes, only one pair of volumes is needed, regardless of --j_out
+	if (max_mem_GB > 0 && !shared_volumes)
 	{
 		const double maxThreads = max_mem_GB / GB_per_thread;
 
@@ -109,11 +110,12 @@ void ReconstructParticleProgramMpi::run()
 		}
 	}
 
-	const int outCount = 2 * outer_threads; // One more count for the accumulated sum
+	const int volumeSets = shared_volumes? 1 : outer_threads;
+	const int outCount = 2 * volumeSets; // One more count for the accumulated sum
 
 	if (verb > 0)
 	{
-		Log::print("Memory required for accumulation: " + ZIO::itoa(GB_per_thread  * outer_threads) + " GB");
+		Log::print("Memory required for accumulation: " + ZIO::itoa(GB_per_thread  * volumeSets) + " GB");
 	}
 
 	std::vector<BufferedImage<double>> ctfImgFS(outCount);
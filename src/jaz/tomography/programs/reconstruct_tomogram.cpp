@@ -13,6 +13,10 @@
 
 
 #include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits>
+#include <exception>
 
 using namespace gravis;
 
@@ -98,6 +102,8 @@ void TomoBackprojectProgram::readParameters(int argc, char *argv[])
     tiltAngleOffset = textToDouble(parser.getOption("--tiltangle_offset", "Offset applied to all tilt angles (in deg)", "0"));
     BfactorPerElectronDose = textToDouble(parser.getOption("--bfactor_per_edose", "B-factor dose-weighting per electron/A^2 dose (default is use Niko's model)", "0"));
     n_threads = textToInteger(parser.getOption("--j", "Number of threads", "1"));
+    setThreadBudget(n_threads);
+    slab_thickness = textToInteger(parser.getOption("--slab", "Reconstruct in Z-slabs of this many (binned) pixels that are written directly into the output file, instead of keeping the whole tomogram in memory (0: no slabs)", "0"));
 
     do_2dproj = parser.checkOption("--do_proj", "Use this to skip calculation of 2D projection of the tomogram along the Z-axis");
     centre_2dproj = textToInteger(parser.getOption("--centre_proj", "Central Z-slice for 2D projection (in tomogram pixels from the middle)", "0"));
@@ -115,6 +121,16 @@ void TomoBackprojectProgram::readParameters(int argc, char *argv[])
 		applyWeight = false;
 	}
 
+	if (slab_thickness > 0)
+	{
+		if (fourierInversion)
+			REPORT_ERROR("ERROR: --slab cannot be combined with --fourier");
+
+		// The 3D Wiener filter needs the entire tomogram
+		if ((applyWeight || applyCtf) && doWiener)
+			REPORT_ERROR("ERROR: --slab requires the weighting to be done in 2D: use --pre_weight, --no_weight or --skip_wiener");
+	}
+
 	ZIO::ensureParentDir(outFn);
 }
 void TomoBackprojectProgram::initialise(bool verbose)
@@ -172,7 +188,16 @@ void TomoBackprojectProgram::initialise(bool verbose)
 void TomoBackprojectProgram::run(int rank, int size)
 {
     long my_first_idx, my_last_idx;
-    divide_equally(tomoIndexTodo.size(), size, rank , my_first_idx, my_last_idx);
+    if (slab_thickness > 0)
+    {
+        // All ranks work on all tomograms: the slabs of each tomogram are divided over the ranks instead
+        my_first_idx = 0;
+        my_last_idx = tomoIndexTodo.size() - 1;
+    }
+    else
+    {
+        divide_equally(tomoIndexTodo.size(), size, rank , my_first_idx, my_last_idx);
+    }
 
     int barstep, nr_todo = my_last_idx-my_first_idx+1;
     if (rank == 0)
@@ -198,12 +223,12 @@ void TomoBackprojectProgram::run(int rank, int size)
         }
         else if (do_even_odd_tomograms)
         {
-            reconstructOneTomogram(tomoIndexTodo[idx],true,false); // true/false indicates to reconstruct tomogram from even frames
-            reconstructOneTomogram(tomoIndexTodo[idx],false,true); // false/true indicates from odd frames
+            reconstructOneTomogram(tomoIndexTodo[idx],true,false,rank,size); // true/false indicates to reconstruct tomogram from even frames
+            reconstructOneTomogram(tomoIndexTodo[idx],false,true,rank,size); // false/true indicates from odd frames
         }
         else
         {
-            reconstructOneTomogram(tomoIndexTodo[idx],false,false);
+            reconstructOneTomogram(tomoIndexTodo[idx],false,false,rank,size);
         }
 
         if (rank == 0 && idx % barstep == 0)
@@ -217,6 +242,8 @@ void TomoBackprojectProgram::run(int rank, int size)
 
 void TomoBackprojectProgram::writeOutput(bool do_all_metadata)
 {
+    if (slab_thickness > 0) finaliseSlabOutputs();
+
     // If we were doing multiple tomograms, then also write the updated tomograms.star.
     if (do_multiple)
     {
@@ -335,13 +362,14 @@ MultidimArray<RFLOAT>  TomoBackprojectProgram::getCtfCorrectedSNR(const Multidim
 void TomoBackprojectProgram::reconstructOneTomogramFourier(int tomoIndex)
 {
 
-    Tomogram tomogram1, tomogram2;
-
-    tomogram1 = tomogramSet.loadTomogram(tomoIndex, true, true, false, w, h, d);
-    tomogram2 = tomogramSet.loadTomogram(tomoIndex, true, false, true, w, h, d);
+    // Only read the metadata here: the even and odd images of each frame are read together in the loop below
+    Tomogram tomogram1 = tomogramSet.loadTomogram(tomoIndex, false, true, false, w, h, d);
 
     MetaDataTable& m = tomogramSet.tomogramTables[tomoIndex];
 
+    if (!m.containsLabel(EMDL_MICROGRAPH_ODD))
+        REPORT_ERROR("ERROR: tomogramTable for " + tomogram1.name + " does not contain a rlnTomoMicrographNameOdd label");
+
     if (!tomogram1.hasMatrices) REPORT_ERROR("ERROR; tomograms do not have tilt series alignment parameters to calculate projectionMatrices!");
 
 	const int fc = tomogram1.frameCount;
@@ -377,115 +405,141 @@ void TomoBackprojectProgram::reconstructOneTomogramFourier(int tomoIndex)
                                      10, 0, 1.9, 15, 2, skip_gridding);
 	BP.initZeros();
 
+    // Get the metadata of all frames and check the image headers before going parallel
+    std::vector<FileName> fn_evens(fc), fn_odds(fc);
+    std::vector<RFLOAT> xshifts(fc), yshifts(fc);
+    for (int f = 0; f < fc; f++)
+    {
+        m.getValueSafely(EMDL_MICROGRAPH_EVEN, fn_evens[f], f);
+        m.getValueSafely(EMDL_MICROGRAPH_ODD, fn_odds[f], f);
+        m.getValueSafely(EMDL_TOMO_XSHIFT_ANGST, xshifts[f], f);
+        m.getValueSafely(EMDL_TOMO_YSHIFT_ANGST, yshifts[f], f);
+
+        Image<RFLOAT> Ih1, Ih2;
+        Ih1.read(fn_evens[f], false);
+        Ih2.read(fn_odds[f], false);
+
+        if (XSIZE(Ih1()) != tomogram1.stack.xdim || YSIZE(Ih1()) != tomogram1.stack.ydim ||
+            XSIZE(Ih2()) != tomogram1.stack.xdim || YSIZE(Ih2()) != tomogram1.stack.ydim)
+        {
+            REPORT_ERROR("ERROR: unequal image dimensions in the individual tilt series images of tomogram: " + tomogram1.name);
+        }
+    }
+
+    // Exceptions cannot leave the parallel region: keep the first one and rethrow it after the loop
+    std::exception_ptr error;
+
     #pragma omp parallel for num_threads(n_threads)
     for (int f = 0; f < fc; f++)
     {
-        //std::cerr << " f= " << f << std::endl;
+        try
+        {
+            //std::cerr << " f= " << f << std::endl;
 
-        CTF ctf = tomogram1.centralCTFs[f];
-        // Don't use CTF scale factors, as we will measure SNRs using the FSC!
-        ctf.scale = 1.0;
-        // Skip any frames that are over-focused, as first-peak calculations below will be invalid. These frames are probably bad anyway....
-        if (ctf.DeltafU < 100. || ctf.DeltafV < 100.)
-            continue;
+            CTF ctf = tomogram1.centralCTFs[f];
+            // Don't use CTF scale factors, as we will measure SNRs using the FSC!
+            ctf.scale = 1.0;
+            // Skip any frames that are over-focused, as first-peak calculations below will be invalid. These frames are probably bad anyway....
+            if (ctf.DeltafU < 100. || ctf.DeltafV < 100.)
+                continue;
 
-        // Get frame from Jasenko's stack
-        MultidimArray<RFLOAT> frame1(tomogram1.stack.ydim, tomogram1.stack.xdim);
-        MultidimArray<RFLOAT> frame2(tomogram1.stack.ydim, tomogram1.stack.xdim);
-        for (long int y=0; y<tomogram1.stack.ydim; y++)
-            for (long int x=0; x<tomogram1.stack.xdim; x++)
+            // Read the even and odd images of this frame
+            Image<RFLOAT> I1, I2;
+            I1.read(fn_evens[f]);
+            I2.read(fn_odds[f]);
+
+            MultidimArray<RFLOAT>& frame1 = I1();
+            MultidimArray<RFLOAT>& frame2 = I2();
+
+            // Make square (plus factor 1.4 padding)
+            frame1.setXmippOrigin();
+            frame2.setXmippOrigin();
+            frame1.window(FIRST_XMIPP_INDEX(square_box), FIRST_XMIPP_INDEX(square_box),
+                       LAST_XMIPP_INDEX(square_box), LAST_XMIPP_INDEX(square_box));
+            frame2.window(FIRST_XMIPP_INDEX(square_box), FIRST_XMIPP_INDEX(square_box),
+                          LAST_XMIPP_INDEX(square_box), LAST_XMIPP_INDEX(square_box));
+
+            // Mirror the image back out into the padding area to prevent low-resolution artifacts
+            int first_x = FIRST_XMIPP_INDEX(tomogram1.stack.xdim);
+            int last_x = LAST_XMIPP_INDEX(tomogram1.stack.xdim);
+            int first_y = FIRST_XMIPP_INDEX(tomogram1.stack.ydim);
+            int last_y = LAST_XMIPP_INDEX(tomogram1.stack.ydim);
+            FOR_ALL_ELEMENTS_IN_ARRAY2D(frame1)
             {
-                DIRECT_A2D_ELEM(frame1, y, x) = tomogram1.stack(x, y, f);
-                DIRECT_A2D_ELEM(frame2, y, x) = tomogram2.stack(x, y, f);
+                int jp = j, ip = i;
+                bool do_change = false;
+                if (j < first_x)      {jp = 2 * first_x  - j; do_change = true;}
+                else if (j > last_x)  {jp = 2 * last_x - j; do_change = true;}
+                if (i < first_y)      {ip = 2 * first_y  - i; do_change = true;}
+                else if (i > last_y)  {ip = 2 * last_y - i; do_change = true;}
+                if (do_change)
+                {
+                    A2D_ELEM(frame1, i, j) = A2D_ELEM(frame1, ip, jp);
+                    A2D_ELEM(frame2, i, j) = A2D_ELEM(frame2, ip, jp);
+                }
+
             }
 
-        // Make square (plus factor 1.4 padding)
-        frame1.setXmippOrigin();
-        frame2.setXmippOrigin();
-        frame1.window(FIRST_XMIPP_INDEX(square_box), FIRST_XMIPP_INDEX(square_box),
-                   LAST_XMIPP_INDEX(square_box), LAST_XMIPP_INDEX(square_box));
-        frame2.window(FIRST_XMIPP_INDEX(square_box), FIRST_XMIPP_INDEX(square_box),
-                      LAST_XMIPP_INDEX(square_box), LAST_XMIPP_INDEX(square_box));
-
-        // Mirror the image back out into the padding area to prevent low-resolution artifacts
-        int first_x = FIRST_XMIPP_INDEX(tomogram1.stack.xdim);
-        int last_x = LAST_XMIPP_INDEX(tomogram1.stack.xdim);
-        int first_y = FIRST_XMIPP_INDEX(tomogram1.stack.ydim);
-        int last_y = LAST_XMIPP_INDEX(tomogram1.stack.ydim);
-        FOR_ALL_ELEMENTS_IN_ARRAY2D(frame1)
-        {
-            int jp = j, ip = i;
-            bool do_change = false;
-            if (j < first_x)      {jp = 2 * first_x  - j; do_change = true;}
-            else if (j > last_x)  {jp = 2 * last_x - j; do_change = true;}
-            if (i < first_y)      {ip = 2 * first_y  - i; do_change = true;}
-            else if (i > last_y)  {ip = 2 * last_y - i; do_change = true;}
-            if (do_change)
+            // Downscale
+            if (new_box != square_box)
             {
-                A2D_ELEM(frame1, i, j) = A2D_ELEM(frame1, ip, jp);
-                A2D_ELEM(frame2, i, j) = A2D_ELEM(frame2, ip, jp);
+                resizeMap(frame1, new_box);
+                resizeMap(frame2, new_box);
             }
 
-        }
+            // Get the transformation matrix
+            const Matrix2D<RFLOAT> A(3,3);
+            for (int row= 0; row < 3; row++)
+                for (int col = 0; col < 3; col++)
+                    MAT_ELEM(A, row, col) = tomogram1.projectionMatrices[f](row, col);
 
-        // Downscale
-        if (new_box != square_box)
-        {
-            resizeMap(frame1, new_box);
-            resizeMap(frame2, new_box);
-        }
-
-        // Get the transformation matrix
-        const Matrix2D<RFLOAT> A(3,3);
-        for (int row= 0; row < 3; row++)
-            for (int col = 0; col < 3; col++)
-                MAT_ELEM(A, row, col) = tomogram1.projectionMatrices[f](row, col);
+            const RFLOAT xshift = xshifts[f], yshift = yshifts[f];
 
-        RFLOAT xshift, yshift;
-        m.getValueSafely(EMDL_TOMO_XSHIFT_ANGST, xshift, f);
-        m.getValueSafely(EMDL_TOMO_YSHIFT_ANGST, yshift, f);
-
-        // FT and get SNRs
-        MultidimArray<Complex> FT1, FT2;
-        // Not entirely sure this is necessary, but FFTW transformers have been troublesome with threads in the past...
-        #pragma omp critical
-        {
+            // FT and get SNRs
+            // (FFTW planning is serialised inside FourierTransformer, execution can run concurrently)
+            MultidimArray<Complex> FT1, FT2;
             FourierTransformer transformer;
             transformer.FourierTransform(frame1, FT1);
             transformer.FourierTransform(frame2, FT2);
-        };
-        MultidimArray<RFLOAT> FSC;
-        getFSC(FT1, FT2, FSC);
+            MultidimArray<RFLOAT> FSC;
+            getFSC(FT1, FT2, FSC);
 
-        // Now that we have the FSC, sum the two halves together
-        FT1 += FT2;
-        // Center and shift
-        CenterFFTbySign(FT1);
-        shiftImageInFourierTransform(FT1, FT1, XSIZE(frame1), -xshift/angpix_spacing, -yshift/angpix_spacing);
+            // Now that we have the FSC, sum the two halves together
+            FT1 += FT2;
+            // Center and shift
+            CenterFFTbySign(FT1);
+            shiftImageInFourierTransform(FT1, FT1, XSIZE(frame1), -xshift/angpix_spacing, -yshift/angpix_spacing);
 
-        // Get CTF
-        MultidimArray<RFLOAT>  Fctf, Ftmp;
-        Fctf.resize(YSIZE(FT1), XSIZE(FT1));
-        ctf.getFftwImage(Fctf, new_box, new_box, angpix_spacing, false, false, ctf_intact_first_peak, false);
+            // Get CTF
+            MultidimArray<RFLOAT>  Fctf, Ftmp;
+            Fctf.resize(YSIZE(FT1), XSIZE(FT1));
+            ctf.getFftwImage(Fctf, new_box, new_box, angpix_spacing, false, false, ctf_intact_first_peak, false);
 
-        // Calculate the CTF-corrected SNR from the FSC
-        MultidimArray<RFLOAT> SNR = getCtfCorrectedSNR(FSC, Fctf, lambda, 0);
+            // Calculate the CTF-corrected SNR from the FSC
+            MultidimArray<RFLOAT> SNR = getCtfCorrectedSNR(FSC, Fctf, lambda, 0);
 
-        FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(FT1)
-        {
-            long int idx = XMIPP_MIN(ROUND(sqrt(ip*ip + jp*jp)), XSIZE(SNR)-1);
-            // Wiener filter = Sum(CTF*SNR*X) / (Sum(CTF^2*SNR) + 1.)
-            DIRECT_A2D_ELEM(FT1, i, j)  *= DIRECT_MULTIDIM_ELEM(SNR, idx) * DIRECT_A2D_ELEM(Fctf, i, j);
-            DIRECT_A2D_ELEM(Fctf, i, j) *= DIRECT_MULTIDIM_ELEM(SNR, idx) * DIRECT_A2D_ELEM(Fctf, i, j);
-        }
+            FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM2D(FT1)
+            {
+                long int idx = XMIPP_MIN(ROUND(sqrt(ip*ip + jp*jp)), XSIZE(SNR)-1);
+                // Wiener filter = Sum(CTF*SNR*X) / (Sum(CTF^2*SNR) + 1.)
+                DIRECT_A2D_ELEM(FT1, i, j)  *= DIRECT_MULTIDIM_ELEM(SNR, idx) * DIRECT_A2D_ELEM(Fctf, i, j);
+                DIRECT_A2D_ELEM(Fctf, i, j) *= DIRECT_MULTIDIM_ELEM(SNR, idx) * DIRECT_A2D_ELEM(Fctf, i, j);
+            }
 
-        #pragma omp critical
+            #pragma omp critical
+            {
+                BP.set2DFourierTransform(FT1, A, &Fctf);
+            };
+        }
+        catch (...)
         {
-            BP.set2DFourierTransform(FT1, A, &Fctf);
-        };
-
+            #pragma omp critical(TomoBackprojectProgram_reconstructOneTomogramFourier)
+            if (!error) error = std::current_exception();
+        }
     }
 
+    if (error) std::rethrow_exception(error);
+
     Image<RFLOAT> vol;
     vol().resize(new_box, new_box, new_box);
     vol().setXmippOrigin();
@@ -533,8 +587,16 @@ void TomoBackprojectProgram::reconstructOneTomogramFourier(int tomoIndex)
 
 }
 
-void TomoBackprojectProgram::reconstructOneTomogram(int tomoIndex, bool doEven, bool doOdd)
+void TomoBackprojectProgram::reconstructOneTomogram(int tomoIndex, bool doEven, bool doOdd, int rank, int size)
 {
+    if (slab_thickness > 0)
+    {
+        // Don't even load the tilt series if this rank has no slab to reconstruct
+        const double slabSpacing = (angpix_spacing > 0.) ? angpix_spacing / tomogramSet.getTiltSeriesPixelSize(tomoIndex) : spacing;
+        const int slabCount = ((int)(d / slabSpacing) + slab_thickness - 1) / slab_thickness;
+
+        if (rank >= slabCount) return;
+    }
 
     Tomogram tomogram;
 
@@ -618,8 +680,6 @@ void TomoBackprojectProgram::reconstructOneTomogram(int tomoIndex, bool doEven,
 	
 	
 	d3Vector orig(x0, y0, z0);
-	BufferedImage<float> out(w1, h1, t1);
-	out.fill(0.f);
 	
 	BufferedImage<float> psfStack;
 
@@ -675,6 +735,35 @@ void TomoBackprojectProgram::reconstructOneTomogram(int tomoIndex, bool doEven,
 		stackAct = RealSpaceBackprojection::preWeight(stackAct, projAct, n_threads);
 	}
 
+    const double samplingRate = tomogramSet.getTiltSeriesPixelSize(tomoIndex) * spacing;
+
+    if (slab_thickness > 0)
+    {
+        if (!do_multiple) Log::print("Backprojecting slabs");
+
+        backprojectSlabs(
+            stackAct, projAct, orig, w1, h1, t1, samplingRate,
+            getOutputFileName(tomoIndex, doEven, doOdd), rank, size);
+
+        // Also add the tomogram sizes and name to the tomogramSet
+        tomogramSet.globalTable.setValue(EMDL_TOMO_SIZE_X, w, tomoIndex);
+        tomogramSet.globalTable.setValue(EMDL_TOMO_SIZE_Y, h, tomoIndex);
+        tomogramSet.globalTable.setValue(EMDL_TOMO_SIZE_Z, d, tomoIndex);
+
+        if (doEven)
+            tomogramSet.globalTable.setValue(EMDL_TOMO_RECONSTRUCTED_TOMOGRAM_HALF1_FILE_NAME, getOutputFileName(tomoIndex, true, false), tomoIndex);
+        else if (doOdd)
+            tomogramSet.globalTable.setValue(EMDL_TOMO_RECONSTRUCTED_TOMOGRAM_HALF2_FILE_NAME, getOutputFileName(tomoIndex, false, true), tomoIndex);
+        else
+            tomogramSet.globalTable.setValue(EMDL_TOMO_RECONSTRUCTED_TOMOGRAM_FILE_NAME, getOutputFileName(tomoIndex, false, false), tomoIndex);
+
+        // The 2D projections are made in finaliseSlabOutputs, once all slabs have been written
+        return;
+    }
+
+	BufferedImage<float> out(w1, h1, t1);
+	out.fill(0.f);
+
     if (!do_multiple) Log::print("Backprojecting");
 	
 	RealSpaceBackprojection::backproject(
@@ -704,8 +793,6 @@ void TomoBackprojectProgram::reconstructOneTomogram(int tomoIndex, bool doEven,
 
     if (!do_multiple) Log::print("Writing output");
 
-    const double samplingRate = tomogramSet.getTiltSeriesPixelSize(tomoIndex) * spacing;
-
     if (doEven)
     	out.write(getOutputFileName(tomoIndex, true, false), samplingRate);
     else if (doOdd)
@@ -759,6 +846,186 @@ void TomoBackprojectProgram::reconstructOneTomogram(int tomoIndex, bool doEven,
 
 }
 
+// MRC header of a float volume that is written slab by slab
+static void writeSlabHeader(int fd, const FileName& fn, int w, int h, int d, double angpix,
+                            float amin = 0.f, float amax = 0.f, float amean = 0.f, float arms = 0.f)
+{
+    Image<float>::MRChead header;
+    memset(&header, 0, sizeof(header));
+
+    header.nx = header.mx = w;
+    header.ny = header.my = h;
+    header.nz = header.mz = d;
+    header.mode = 2;
+    header.a = angpix * w;
+    header.b = angpix * h;
+    header.c = angpix * d;
+    header.alpha = header.beta = header.gamma = 90.f;
+    header.mapc = 1;
+    header.mapr = 2;
+    header.maps = 3;
+    header.amin = amin;
+    header.amax = amax;
+    header.amean = amean;
+    header.arms = arms;
+    strncpy(header.map, "MAP ", 4);
+
+    // Same machine stamp as in Image::write
+    switch (Image<float>().systype())
+    {
+    case BIGIEEE:
+        header.machst[0] = header.machst[1] = 17;
+        break;
+    case LITTLEIEEE:
+        header.machst[0] = 68;
+        header.machst[1] = 65;
+        break;
+    default:
+        REPORT_ERROR("ERROR: unknown system type in the machine stamp of " + fn);
+    }
+
+    header.nlabl = 1;
+    strncpy(header.labels, "Relion slab-wise reconstruction", 80);
+
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        REPORT_ERROR("ERROR: unable to write the header of " + fn);
+}
+
+void TomoBackprojectProgram::backprojectSlabs(
+        const BufferedImage<float>& stack, const std::vector<d4Matrix>& proj,
+        d3Vector orig, int w1, int h1, int t1, double samplingRate,
+        FileName fn_out, int rank, int size)
+{
+    const int slabCount = (t1 + slab_thickness - 1) / slab_thickness;
+    const size_t sliceBytes = (size_t)w1 * h1 * sizeof(float);
+
+    // Several processes write into the same file: never truncate it, only make sure it has the right size
+    const int fd = open(fn_out.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) REPORT_ERROR("ERROR: unable to open " + fn_out + " for writing");
+
+    writeSlabHeader(fd, fn_out, w1, h1, t1, samplingRate);
+
+    if (ftruncate(fd, MRCSIZE + sliceBytes * t1) != 0)
+    {
+        close(fd);
+        REPORT_ERROR("ERROR: unable to resize " + fn_out);
+    }
+
+    BufferedImage<float> slab;
+
+    for (int sl = rank; sl < slabCount; sl += size)
+    {
+        const int z0 = sl * slab_thickness;
+        const int z1 = XMIPP_MIN(z0 + slab_thickness, t1);
+
+        slab.resize(w1, h1, z1 - z0);
+        slab.fill(0.f);
+
+        RealSpaceBackprojection::backproject(
+            stack, proj, slab, n_threads,
+            orig + d3Vector(0.0, 0.0, z0 * spacing), spacing,
+            RealSpaceBackprojection::Linear, taperFalloff, taperDist);
+
+        const size_t bytes = sliceBytes * (z1 - z0);
+        if (pwrite(fd, slab.data, bytes, MRCSIZE + sliceBytes * z0) != bytes)
+        {
+            close(fd);
+            REPORT_ERROR("ERROR: unable to write slab " + integerToString(sl) + " of " + fn_out);
+        }
+    }
+
+    close(fd);
+}
+
+void TomoBackprojectProgram::finaliseSlabOutputs()
+{
+    for (long idx = 0; idx < tomoIndexTodo.size(); idx++)
+    {
+        if (do_even_odd_tomograms)
+        {
+            finaliseSlabOutput(tomoIndexTodo[idx], true, false);
+            finaliseSlabOutput(tomoIndexTodo[idx], false, true);
+        }
+        else
+        {
+            finaliseSlabOutput(tomoIndexTodo[idx], false, false);
+        }
+    }
+}
+
+void TomoBackprojectProgram::finaliseSlabOutput(int tomoIndex, bool doEven, bool doOdd)
+{
+    const FileName fn_vol = getOutputFileName(tomoIndex, doEven, doOdd);
+
+    const int fd = open(fn_vol.c_str(), O_RDWR);
+    if (fd < 0) REPORT_ERROR("ERROR: unable to open " + fn_vol);
+
+    Image<float>::MRChead header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        close(fd);
+        REPORT_ERROR("ERROR: unable to read the header of " + fn_vol);
+    }
+
+    const int w1 = header.nx, h1 = header.ny, t1 = header.nz;
+    const double samplingRate = header.a / w1;
+    const size_t sliceBytes = (size_t)w1 * h1 * sizeof(float);
+
+    // Stream through the volume one Z-slice at a time
+    BufferedImage<float> slice(w1, h1);
+    BufferedImage<float> proj(w1, h1);
+    proj.fill(0.f);
+
+    const int minz = t1/2 + centre_2dproj - thickness_2dproj/2;
+    const int maxz = t1/2 + centre_2dproj + thickness_2dproj/2;
+
+    double sum = 0., sum2 = 0.;
+    float amin = std::numeric_limits<float>::max();
+    float amax = -std::numeric_limits<float>::max();
+
+    for (int z = 0; z < t1; z++)
+    {
+        if (pread(fd, slice.data, sliceBytes, MRCSIZE + sliceBytes * z) != sliceBytes)
+        {
+            close(fd);
+            REPORT_ERROR("ERROR: unable to read slice " + integerToString(z) + " of " + fn_vol);
+        }
+
+        for (size_t i = 0; i < (size_t)w1 * h1; i++)
+        {
+            const float v = slice.data[i];
+            sum += v;
+            sum2 += v * (double)v;
+            if (v < amin) amin = v;
+            if (v > amax) amax = v;
+        }
+
+        if (do_2dproj && z >= minz && z <= maxz)
+        {
+            proj += slice;
+        }
+    }
+
+    const double n = (double)w1 * h1 * t1;
+    const double mean = sum / n;
+    const double var = sum2 / n - mean * mean;
+
+    writeSlabHeader(fd, fn_vol, w1, h1, t1, samplingRate, amin, amax, mean, var > 0. ? sqrt(var) : 0.);
+    close(fd);
+
+    if (do_2dproj)
+    {
+        proj.write(getOutputFileName(tomoIndex, doEven, doOdd, true), samplingRate);
+
+        if (doEven)
+            tomogramSet.globalTable.setValue(EMDL_TOMO_RECONSTRUCTED_TOMOGRAM_PROJ2D_HALF1_FILE_NAME, getOutputFileName(tomoIndex, true, false, true), tomoIndex);
+        else if (doOdd)
+            tomogramSet.globalTable.setValue(EMDL_TOMO_RECONSTRUCTED_TOMOGRAM_PROJ2D_HALF2_FILE_NAME, getOutputFileName(tomoIndex, false, true, true), tomoIndex);
+        else
+            tomogramSet.globalTable.setValue(EMDL_TOMO_RECONSTRUCTED_TOMOGRAM_PROJ2D_FILE_NAME, getOutputFileName(tomoIndex, false, false, true), tomoIndex);
+    }
+}
+
 void TomoBackprojectProgram::setMetaDataAllTomograms()
 {
 
@@ -71,7 +71,7 @@ class TomoBackprojectProgram
 		TomoBackprojectProgram(){}
 			
 			int n_threads;
-			int w, h, d;
+			int w, h, d, slab_thickness;
 			double spacing, angpix_spacing, x0, y0, z0, taperDist, taperFalloff;
 			FileName tomoName, outFn;
 			bool applyPreWeight, applyWeight, applyCtf, doWiener, zeroDC, FourierCrop, fourierInversion;
@@ -94,11 +94,23 @@ class TomoBackprojectProgram
         void initialiseCtfScaleFactors(int tomoIndex, Tomogram &tomogram);
         MultidimArray<RFLOAT> getCtfCorrectedSNR(const MultidimArray<RFLOAT> &FSC, const MultidimArray<RFLOAT>  &Fctf, double lambda, int verb = 0);
 
-        void reconstructOneTomogram(int tomoIndex, bool doEven, bool doOdd);
+        // With slab_thickness > 0, only the slabs with index rank, rank + size, ... are reconstructed
+        void reconstructOneTomogram(int tomoIndex, bool doEven, bool doOdd, int rank = 0, int size = 1);
         void reconstructOneTomogramFourier(int tomoIndex);
         void setMetaDataAllTomograms();
+
+        // Write the header statistics and 2D projections of tomograms that were reconstructed in slabs
+        void finaliseSlabOutputs();
+
     private:
         FileName getOutputFileName(int index, bool nameEven, bool nameOdd, bool is_2dproj = false);
+
+        void backprojectSlabs(
+                const BufferedImage<float>& stack, const std::vector<gravis::d4Matrix>& proj,
+                gravis::d3Vector orig, int w1, int h1, int t1, double samplingRate,
+                FileName fn_out, int rank, int size);
+
+        void finaliseSlabOutput(int tomoIndex, bool doEven, bool doOdd);
 };
 
 #endif
@@ -15,6 +15,7 @@
 #include <src/jaz/util/zio.h>
 #include <iostream>
 #include <src/time.h>
+#include <src/parallel.h>
 
 #define TIMING 0
 
@@ -48,6 +49,7 @@ void RefinementProgram::_readParams(IOParser &parser)
 	
 	diag = parser.checkOption("--diag", "Write out diagnostic information");
 	num_threads = textToInteger(parser.getOption("--j", "Number of OMP threads", "6"));
+	setThreadBudget(num_threads);
 	outDir = parser.getOption("--o", "Output directory");
 
 	run_from_GUI = is_under_pipeline_control();
@@ -15,6 +15,7 @@
 #include <src/jaz/optics/damage.h>
 #include <src/jaz/optics/aberrations_cache.h>
 #include <src/time.h>
+#include <src/parallel.h>
 #include <src/jaz/util/zio.h>
 #include <src/jaz/util/log.h>
 #include <src/jaz/math/Euler_angles_relion.h>
@@ -88,6 +89,8 @@ void SubtomoProgram::readBasicParameters(IOParser& parser)
 	diag = parser.checkOption("--diag", "Write out diagnostic information");
 
 	num_threads = textToInteger(parser.getOption("--j", "Number of OMP threads", "6"));
+	setThreadBudget(num_threads);
+	roi_tile_size = textToInteger(parser.getOption("--roi_tiles", "Only read the regions of the tilt series that particles project into, in tiles of this size (0: read entire tilt series)", "0"));
 
 	freqCutoffFract = textToDouble(parser.getOption("--cutoff_fract", "Ignore shells for which the dose weight falls below this value", "0.01"));
 
@@ -97,6 +100,10 @@ void SubtomoProgram::readBasicParameters(IOParser& parser)
 
     do_real_subtomo = parser.checkOption("--real_subtomo", "Extract true subtomograms and write out projections of those out as 2D stacks");
 
+	if (roi_tile_size > 0 && do_whiten)
+	{
+		REPORT_ERROR("--roi_tiles cannot be combined with --whiten, since the noise spectrum is estimated from entire tilt series");
+	}
 }
 
 void SubtomoProgram::readParameters(int argc, char *argv[])
@@ -631,7 +638,9 @@ void SubtomoProgram::processTomograms(
 			Log::print("Loading");
 		}
 
-		Tomogram tomogram = tomogramSet.loadTomogram(t, true);
+		const bool load_rois = roi_tile_size > 0 && !do_real_subtomo;
+
+		Tomogram tomogram = tomogramSet.loadTomogram(t, !load_rois);
 		tomogram.validateParticleOptics(particles[t], particleSet);
 
         // If using the real_subtomo approach, then need to read in the reconstructed tomogram volume
@@ -683,6 +692,42 @@ void SubtomoProgram::processTomograms(
 		// @TODO: define input and output pixel sizes!
 
 		const double binnedPixelSize = tomogram.optics.pixelSize * binning;
+
+		if (load_rois)
+		{
+			tomogramSet.attachTiltSeriesTiles(tomogram, t, roi_tile_size);
+
+			for (int p = 0; p < pc; p++)
+			{
+				const ParticleIndex part_id = particles[t][p];
+
+				if (only_do_unfinished)
+				{
+					const std::string filenameRoot = getOutputFilename(part_id, t, particleSet, tomogramSet);
+					const std::string outData = (do_stack2d) ? filenameRoot + "_stack2d.mrcs" : filenameRoot + "_data.mrc";
+
+					if (ZIO::fileExists(outData)) continue;
+				}
+
+				const std::vector<d3Vector> traj = particleSet.getTrajectoryInPixels(
+						part_id, fc, tomogram.centre, tomogram.optics.pixelSize, !apply_offsets);
+
+				std::vector<bool> isVisible;
+				if (!tomogram.getVisibilityMinFramesMaxDose(traj, binning * cropSize / 2.0, maxDose, min_frames, isVisible))
+					continue;
+
+				TomoExtraction::requestAt3D(*tomogram.tiles, s02D, tomogram, traj, isVisible);
+			}
+
+			tomogram.tiles->loadRequested(num_threads);
+
+			if (verbosity > 0)
+			{
+				Log::print("Read " + ZIO::itoa(tomogram.tiles->getLoadedTileCount()) + " of "
+						   + ZIO::itoa(tomogram.tiles->getTotalTileCount()) + " tilt series tiles");
+			}
+		}
+
  		if (verbosity > 0)
 		{
             Log::beginProgress(
@@ -743,9 +788,18 @@ void SubtomoProgram::processTomograms(
             else
             {
 
-                TomoExtraction::extractAt3D_Fourier(
-                        tomogram.stack, s02D, binning, tomogram, traj, isVisible,
-                        particleStack, projCut, inner_thread_num, do_circle_precrop);
+                if (load_rois)
+                {
+                    TomoExtraction::extractAt3D_Fourier(
+                            *tomogram.tiles, s02D, binning, tomogram, traj, isVisible,
+                            particleStack, projCut, inner_thread_num, do_circle_precrop);
+                }
+                else
+                {
+                    TomoExtraction::extractAt3D_Fourier(
+                            tomogram.stack, s02D, binning, tomogram, traj, isVisible,
+                            particleStack, projCut, inner_thread_num, do_circle_precrop);
+                }
 
                 if (!do_ctf) weightStack.fill(1.f);
 
@@ -32,7 +32,8 @@ class SubtomoProgram
 				boxSize, 
 				cropSize,
                 min_frames,
-                num_threads;
+                num_threads,
+				roi_tile_size;
 			
 			double 
 				SNR,
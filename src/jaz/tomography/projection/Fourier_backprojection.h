@@ -56,6 +56,18 @@ class FourierBackprojection
 			RawImage<DestType>& destCTF,
 			int num_threads);
 
+		// Only updates the Z slices zBegin <= z < zEnd of destFS and destCTF (single-threaded),
+		// so that several threads can insert into disjoint slabs of the same volumes
+		template <typename SrcType, typename DestType>
+		static void backprojectSlice_backward_slab(
+			int maxFreq,
+			const RawImage<tComplex<SrcType>>& dataFS,
+			const RawImage<SrcType>& weight,
+			const gravis::d4Matrix& proj,
+			RawImage<tComplex<DestType>>& destFS,
+			RawImage<DestType>& destCTF,
+			int zBegin, int zEnd);
+
 		template <typename SrcType, typename DestType>
 		static void backprojectSlice_backward_withMultiplicity(
 			const RawImage<tComplex<SrcType>>& dataFS,
@@ -377,6 +389,28 @@ void FourierBackprojection::backprojectSlice_backward(
 				RawImage<tComplex<DestType>>& destFS,
 				RawImage<DestType>& destCTF,
 				int num_threads)
+{
+	const int d3 = destFS.zdim;
+
+	#pragma omp parallel for num_threads(num_threads)
+	for (int th = 0; th < num_threads; th++)
+	{
+		const int z0 = (th * (long int) d3) / num_threads;
+		const int z1 = ((th + 1) * (long int) d3) / num_threads;
+
+		backprojectSlice_backward_slab(maxFreq, dataFS, weight, proj, destFS, destCTF, z0, z1);
+	}
+}
+
+template <typename SrcType, typename DestType>
+void FourierBackprojection::backprojectSlice_backward_slab(
+				int maxFreq,
+				const RawImage<tComplex<SrcType>>& dataFS,
+				const RawImage<SrcType>& weight,
+				const gravis::d4Matrix& proj,
+				RawImage<tComplex<DestType>>& destFS,
+				RawImage<DestType>& destCTF,
+				int zBegin, int zEnd)
 {
 	const int wh2 = dataFS.xdim;
 	const int h2 = dataFS.ydim;
@@ -387,7 +421,7 @@ void FourierBackprojection::backprojectSlice_backward(
 
 	if (!destCTF.hasSize(wh3, h3, d3))
 	{
-		REPORT_ERROR_STR("FourierBackprojection::backprojectSlice_backward: destCTF has wrong size ("
+		REPORT_ERROR_STR("FourierBackprojection::backprojectSlice_backward_slab: destCTF has wrong size ("
 						 << destCTF.getSizeString() << " instead of " << destCTF.getSizeString() << ")");
 	}
 
@@ -398,8 +432,7 @@ void FourierBackprojection::backprojectSlice_backward(
 	gravis::d3Matrix projInvTransp = A.invert().transpose();
 	gravis::d3Vector normal(projInvTransp(2,0), projInvTransp(2,1), projInvTransp(2,2));
 
-	#pragma omp parallel for num_threads(num_threads)
-	for (long int z = 0; z < d3; z++)
+	for (long int z = zBegin; z < zEnd; z++)
 	for (long int y = 0; y < h3; y++)
 	{
 		const double yy = y >= h3/2? y - h3 : y;
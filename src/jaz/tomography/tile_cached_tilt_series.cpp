@@ -0,0 +1,402 @@
+#include "tile_cached_tilt_series.h"
+#include <src/image.h>
+#include <src/funcs.h>
+#include <src/jaz/util/image_file_helper.h>
+#include <exception>
+#include <cstdio>
+#include <omp.h>
+
+using namespace gravis;
+
+
+TileCachedTiltSeries::TileCachedTiltSeries()
+:	xdim(0), ydim(0), zdim(0), tileSize(0), tilesX(0), tilesY(0)
+{
+}
+
+TileCachedTiltSeries::TileCachedTiltSeries(std::string stackFilename, int tileSize)
+{
+	filenames = std::vector<std::string>(1, stackFilename);
+
+	t3Vector<long int> size = ImageFileHelper::getSize(stackFilename);
+
+	xdim = size.x;
+	ydim = size.y;
+	zdim = size.z;
+
+	init(tileSize);
+}
+
+TileCachedTiltSeries::TileCachedTiltSeries(const std::vector<std::string>& frameFilenames, int tileSize)
+{
+	if (frameFilenames.size() == 0)
+	{
+		REPORT_ERROR("TileCachedTiltSeries: no frames given.");
+	}
+
+	filenames = frameFilenames;
+
+	t3Vector<long int> size = ImageFileHelper::getSize(frameFilenames[0]);
+
+	xdim = size.x;
+	ydim = size.y;
+	zdim = frameFilenames.size();
+
+	init(tileSize);
+}
+
+void TileCachedTiltSeries::init(int tileSize)
+{
+	if (tileSize < 1)
+	{
+		REPORT_ERROR("TileCachedTiltSeries: the tile size has to be positive.");
+	}
+
+	this->tileSize = tileSize;
+
+	tilesX = (xdim + tileSize - 1) / tileSize;
+	tilesY = (ydim + tileSize - 1) / tileSize;
+
+	tiles = std::vector<BufferedImage<float>>(tilesX * tilesY * zdim);
+	requested = std::vector<bool>(tilesX * tilesY * zdim, false);
+}
+
+void TileCachedTiltSeries::requestSquare(int f, int x0, int y0, int w, int h)
+{
+	int tx0, ty0, tx1, ty1;
+	getTileRange(x0, y0, w, h, tx0, ty0, tx1, ty1);
+
+	for (int ty = ty0; ty <= ty1; ty++)
+	for (int tx = tx0; tx <= tx1; tx++)
+	{
+		requested[tileIndex(tx, ty, f)] = true;
+	}
+}
+
+void TileCachedTiltSeries::checkSquare(int f, int x0, int y0, int w, int h) const
+{
+	int tx0, ty0, tx1, ty1;
+	getTileRange(x0, y0, w, h, tx0, ty0, tx1, ty1);
+
+	for (int ty = ty0; ty <= ty1; ty++)
+	for (int tx = tx0; tx <= tx1; tx++)
+	{
+		if (tiles[tileIndex(tx, ty, f)].xdim == 0)
+		{
+			REPORT_ERROR_STR("TileCachedTiltSeries: the " << w << " x " << h << " square at ("
+							 << x0 << ", " << y0 << ") of frame " << f << " has not been loaded.");
+		}
+	}
+}
+
+void TileCachedTiltSeries::getTileRange(
+		int x0, int y0, int w, int h, int& tx0, int& ty0, int& tx1, int& ty1) const
+{
+	// pixels outside the image are clamped to its edges on extraction
+
+	int x1 = x0 + w - 1;
+	int y1 = y0 + h - 1;
+
+	x0 = x0 < 0? 0 : (x0 >= xdim? xdim - 1 : x0);
+	x1 = x1 < 0? 0 : (x1 >= xdim? xdim - 1 : x1);
+	y0 = y0 < 0? 0 : (y0 >= ydim? ydim - 1 : y0);
+	y1 = y1 < 0? 0 : (y1 >= ydim? ydim - 1 : y1);
+
+	tx0 = x0 / tileSize;
+	tx1 = x1 / tileSize;
+	ty0 = y0 / tileSize;
+	ty1 = y1 / tileSize;
+}
+
+void TileCachedTiltSeries::requestSquares(
+		int w, int h,
+		const std::vector<d2Vector>& origins,
+		const std::vector<bool>& isVisible)
+{
+	for (int f = 0; f < zdim; f++)
+	{
+		if (isVisible[f])
+		{
+			requestSquare(f, (int)origins[f].x, (int)origins[f].y, w, h);
+		}
+	}
+}
+
+void TileCachedTiltSeries::loadRequested(int num_threads)
+{
+	std::vector<int> frames;
+
+	for (int f = 0; f < zdim; f++)
+	{
+		for (int t = 0; t < tilesX * tilesY; t++)
+		{
+			const int i = f * tilesX * tilesY + t;
+
+			if (requested[i] && tiles[i].xdim == 0)
+			{
+				frames.push_back(f);
+				break;
+			}
+		}
+	}
+
+	if (frames.size() == 0) return;
+
+	if (filenames.size() == 1 && FileName(filenames[0]).getExtension() != "mrc"
+			&& FileName(filenames[0]).getExtension() != "mrcs"
+			&& FileName(filenames[0]).getExtension() != "st")
+	{
+		// Stacks in other formats can only be read as a whole
+
+		BufferedImage<float> stack;
+		stack.read(filenames[0]);
+
+		#pragma omp parallel for num_threads(num_threads)
+		for (int i = 0; i < frames.size(); i++)
+		{
+			loadFrameFull(frames[i], &stack);
+		}
+
+		return;
+	}
+
+	std::exception_ptr error;
+
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic)
+	for (int i = 0; i < frames.size(); i++)
+	{
+		try
+		{
+			loadFrame(frames[i]);
+		}
+		catch (...)
+		{
+			#pragma omp critical(TileCachedTiltSeries_loadRequested)
+			error = std::current_exception();
+		}
+	}
+
+	if (error) std::rethrow_exception(error);
+}
+
+void TileCachedTiltSeries::clear()
+{
+	for (int i = 0; i < tiles.size(); i++)
+	{
+		tiles[i] = BufferedImage<float>();
+		requested[i] = false;
+	}
+}
+
+size_t TileCachedTiltSeries::getLoadedTileCount() const
+{
+	size_t out = 0;
+
+	for (int i = 0; i < tiles.size(); i++)
+	{
+		if (tiles[i].xdim > 0) out++;
+	}
+
+	return out;
+}
+
+size_t TileCachedTiltSeries::getTotalTileCount() const
+{
+	return tiles.size();
+}
+
+size_t TileCachedTiltSeries::getLoadedBytes() const
+{
+	size_t out = 0;
+
+	for (int i = 0; i < tiles.size(); i++)
+	{
+		out += tiles[i].getSize() * sizeof(float);
+	}
+
+	return out;
+}
+
+void TileCachedTiltSeries::loadFrame(int f)
+{
+	if (!loadFrameMRC(f))
+	{
+		loadFrameFull(f);
+	}
+}
+
+bool TileCachedTiltSeries::loadFrameMRC(int f)
+{
+	const bool isStack = filenames.size() == 1;
+	const std::string fn = isStack? filenames[0] : filenames[f];
+	const std::string ext = FileName(fn).getExtension();
+
+	if (ext != "mrc" && ext != "mrcs" && ext != "st")
+	{
+		return false;
+	}
+
+	FILE* file = fopen(fn.c_str(), "rb");
+
+	if (file == NULL)
+	{
+		REPORT_ERROR("TileCachedTiltSeries: unable to open " + fn);
+	}
+
+	int header[MRCSIZE / 4];
+
+	if (fread(header, 4, MRCSIZE / 4, file) != MRCSIZE / 4)
+	{
+		fclose(file);
+		REPORT_ERROR("TileCachedTiltSeries: unable to read the header of " + fn);
+	}
+
+	// same test as in Image::readMRC
+	const bool swap = abs(header[3]) > SWAPTRIG || abs(header[0]) > SWAPTRIG;
+
+	if (swap)
+	{
+		for (int i = 0; i < 24; i++)
+		{
+			swapbytes((char*)(header + i), 4);
+		}
+	}
+
+	DataType datatype;
+
+	switch (header[3])
+	{
+		case 0:  datatype = SChar;   break;
+		case 1:  datatype = SShort;  break;
+		case 2:  datatype = Float;   break;
+		case 6:  datatype = UShort;  break;
+		case 12: datatype = Float16; break;
+
+		default:
+		{
+			// e.g. 4-bit data: fall back to reading the whole frame
+			fclose(file);
+			return false;
+		}
+	}
+
+	if (header[0] != xdim || header[1] != ydim)
+	{
+		fclose(file);
+		REPORT_ERROR_STR("TileCachedTiltSeries: " << fn << " is " << header[0] << " x " << header[1]
+						 << " pixels, expected " << xdim << " x " << ydim);
+	}
+
+	const size_t typeSize = gettypesize(datatype);
+	const size_t frameOffset = MRCSIZE + header[23] + (isStack? f : 0) * typeSize * xdim * ydim;
+
+	Image<float> converter;
+	std::vector<char> rawRow(xdim * typeSize);
+	std::vector<float> row(xdim);
+	std::vector<bool> toRead(tilesX);
+
+	for (int ty = 0; ty < tilesY; ty++)
+	{
+		int tx0 = tilesX, tx1 = -1;
+
+		for (int tx = 0; tx < tilesX; tx++)
+		{
+			const int i = tileIndex(tx, ty, f);
+
+			toRead[tx] = requested[i] && tiles[i].xdim == 0;
+
+			if (toRead[tx])
+			{
+				if (tx < tx0) tx0 = tx;
+				tx1 = tx;
+
+				tiles[i] = BufferedImage<float>(tileWidth(tx), tileHeight(ty));
+			}
+		}
+
+		if (tx1 < 0) continue;
+
+		// read the rows of this band between the first and last requested tile
+
+		const int x0 = tx0 * tileSize;
+		const int span = tx1 * tileSize + tileWidth(tx1) - x0;
+
+		for (int y = ty * tileSize; y < ty * tileSize + tileHeight(ty); y++)
+		{
+			const size_t pos = frameOffset + typeSize * (y * (size_t)xdim + x0);
+
+			if (fseek(file, pos, SEEK_SET) != 0
+				|| fread(&rawRow[0], typeSize, span, file) != span)
+			{
+				fclose(file);
+				REPORT_ERROR_STR("TileCachedTiltSeries: unable to read row " << y
+								 << " of frame " << f << " from " << fn);
+			}
+
+			if (swap && typeSize > 1)
+			{
+				for (int x = 0; x < span; x++)
+				{
+					swapbytes(&rawRow[x * typeSize], typeSize);
+				}
+			}
+
+			converter.castPage2T(&rawRow[0], &row[0], datatype, span);
+
+			for (int tx = tx0; tx <= tx1; tx++)
+			{
+				if (!toRead[tx]) continue;
+
+				BufferedImage<float>& tile = tiles[tileIndex(tx, ty, f)];
+
+				const int yy = y - ty * tileSize;
+				const int xOff = tx * tileSize - x0;
+
+				for (int x = 0; x < tile.xdim; x++)
+				{
+					tile(x, yy) = row[xOff + x];
+				}
+			}
+		}
+	}
+
+	fclose(file);
+
+	return true;
+}
+
+void TileCachedTiltSeries::loadFrameFull(int f, const BufferedImage<float>* stack)
+{
+	BufferedImage<float> frame;
+
+	if (stack == 0)
+	{
+		frame.read(filenames[f]);
+	}
+
+	const RawImage<float> src = stack == 0? frame.getSliceRef(0) : stack->getConstSliceRef(f);
+
+	if (src.xdim != xdim || src.ydim != ydim)
+	{
+		REPORT_ERROR_STR("TileCachedTiltSeries: frame " << f << " is " << src.xdim << " x " << src.ydim
+						 << " pixels, expected " << xdim << " x " << ydim);
+	}
+
+	for (int ty = 0; ty < tilesY; ty++)
+	for (int tx = 0; tx < tilesX; tx++)
+	{
+		const int i = tileIndex(tx, ty, f);
+
+		if (!requested[i] || tiles[i].xdim > 0) continue;
+
+		BufferedImage<float> tile(tileWidth(tx), tileHeight(ty));
+
+		for (int y = 0; y < tile.ydim; y++)
+		for (int x = 0; x < tile.xdim; x++)
+		{
+			tile(x,y) = src(tx * tileSize + x, ty * tileSize + y);
+		}
+
+		tiles[i] = tile;
+	}
+}
@@ -0,0 +1,112 @@
+#ifndef TILE_CACHED_TILT_SERIES_H
+#define TILE_CACHED_TILT_SERIES_H
+
+#include <string>
+#include <vector>
+#include <src/jaz/image/buffered_image.h>
+#include <src/jaz/gravis/t2Vector.h>
+#include <src/error.h>
+
+/*
+	A tilt series that is only read from disk where it is needed.
+
+	The frames are divided into square tiles of tileSize x tileSize pixels.
+	Callers first declare the regions they are going to read through
+	requestSquare(s), then call loadRequested(), which reads exactly the
+	requested tiles. For MRC files, only the rows spanned by the requested
+	tiles are read from the file; other formats are read frame by frame and
+	only the requested tiles are kept.
+
+	Reading pixels from tiles that have not been loaded is an error. After
+	loadRequested(), concurrent reads are safe.
+*/
+class TileCachedTiltSeries
+{
+	public:
+
+		TileCachedTiltSeries();
+
+		// all frames in one MRC stack
+		TileCachedTiltSeries(std::string stackFilename, int tileSize = 256);
+
+		// one image file per frame
+		TileCachedTiltSeries(const std::vector<std::string>& frameFilenames, int tileSize = 256);
+
+
+			int xdim, ydim, zdim, tileSize, tilesX, tilesY;
+
+
+		// Request all pixels of the w x h square at (x0,y0) in frame f, clamped to the image
+		void requestSquare(int f, int x0, int y0, int w, int h);
+
+		// Report an error if not all pixels of that square have been loaded
+		void checkSquare(int f, int x0, int y0, int w, int h) const;
+
+		void requestSquares(
+				int w, int h,
+				const std::vector<gravis::d2Vector>& origins,
+				const std::vector<bool>& isVisible);
+
+		// Read all requested tiles that have not been loaded yet
+		void loadRequested(int num_threads = 1);
+
+		// Drop all loaded tiles and requests
+		void clear();
+
+		size_t getLoadedTileCount() const;
+		size_t getTotalTileCount() const;
+		size_t getLoadedBytes() const;
+
+		inline float operator() (int x, int y, int f) const;
+
+
+	protected:
+
+			// size 1 for a stack, zdim for one file per frame
+			std::vector<std::string> filenames;
+			std::vector<BufferedImage<float>> tiles;
+			std::vector<bool> requested;
+
+		void init(int tileSize);
+		void loadFrame(int f);
+		bool loadFrameMRC(int f);
+		void loadFrameFull(int f, const BufferedImage<float>* stack = 0);
+
+		// Range of tiles covered by the w x h square at (x0,y0), clamped to the image
+		void getTileRange(int x0, int y0, int w, int h, int& tx0, int& ty0, int& tx1, int& ty1) const;
+
+		inline int tileIndex(int tx, int ty, int f) const
+		{
+			return (f * tilesY + ty) * tilesX + tx;
+		}
+
+		inline int tileWidth(int tx) const
+		{
+			const int w = xdim - tx * tileSize;
+			return w < tileSize? w : tileSize;
+		}
+
+		inline int tileHeight(int ty) const
+		{
+			const int h = ydim - ty * tileSize;
+			return h < tileSize? h : tileSize;
+		}
+};
+
+inline float TileCachedTiltSeries::operator() (int x, int y, int f) const
+{
+	const int tx = x / tileSize;
+	const int ty = y / tileSize;
+
+	const BufferedImage<float>& tile = tiles[tileIndex(tx, ty, f)];
+
+	if (tile.xdim == 0)
+	{
+		REPORT_ERROR_STR("TileCachedTiltSeries: pixel (" << x << ", " << y << ") of frame "
+						 << f << " has not been loaded.");
+	}
+
+	return tile(x - tx * tileSize, y - ty * tileSize);
+}
+
+#endif
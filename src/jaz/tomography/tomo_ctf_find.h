@@ -42,6 +42,14 @@ class TomoCtfFind
 		
 		double evaluateAstigmatic(double deltaF, double a0, double a1, int frame);
 		double evaluate1D(double deltaF, int frame, double hand);
+		
+		// smooth estimate of the background of a power spectrum, in FFTW half-format
+		static BufferedImage<float> estimateBackground(
+				const RawImage<float>& img_fftwHalf, 
+				double sigma_blur_px, 
+				double sigma_cent_px, 
+				double sigma_out_px, 
+				bool debug);
 				
 		
 	protected:
@@ -72,12 +80,6 @@ class TomoCtfFind
 		void subtractBackground();
 		void averageRadially();
 		
-		BufferedImage<float> estimateBackground(
-				const RawImage<float>& img_fftwHalf, 
-				double sigma_blur_px, 
-				double sigma_cent_px, 
-				double sigma_out_px, 
-				bool debug);
 };
 
 class AstigmatismOptimization : public Optimization
@@ -11,6 +11,7 @@
 
 class ParticleIndex;
 class ParticleSet;
+class TileCachedTiltSeries;
 
 class Tomogram
 {
@@ -28,6 +29,9 @@ class Tomogram
 			BufferedImage<float> stack;
 			std::vector<gravis::d4Matrix> projectionMatrices;
 
+			// If set, image data are read from here on demand instead of from stack
+			std::shared_ptr<TileCachedTiltSeries> tiles;
+
 			std::vector<std::shared_ptr<Deformation2D>> imageDeformations;
 			
 			std::vector<CTF> centralCTFs;
@@ -9,6 +9,7 @@
 #include <src/jaz/util/zio.h>
 #include <src/jaz/util/log.h>
 #include <src/jaz/util/image_file_helper.h>
+#include <src/jaz/tomography/tile_cached_tilt_series.h>
 
 using namespace gravis;
 
@@ -506,6 +507,37 @@ Tomogram TomogramSet::loadTomogram(int index, bool loadImageData, bool loadEvenF
 	return out;
 }
 
+void TomogramSet::attachTiltSeriesTiles(Tomogram& tomogram, int index, int tileSize, bool loadEvenFrames, bool loadOddFrames) const
+{
+    if (globalTable.containsLabel(EMDL_TOMO_TILT_SERIES_NAME))
+    {
+        tomogram.tiles = std::make_shared<TileCachedTiltSeries>(tomogram.tiltSeriesFilename, tileSize);
+    }
+    else
+    {
+        const MetaDataTable& m = tomogramTables[index];
+
+        EMDLabel label = EMDL_MICROGRAPH_NAME;
+        if (loadEvenFrames) label = EMDL_MICROGRAPH_EVEN;
+        else if (loadOddFrames) label = EMDL_MICROGRAPH_ODD;
+
+        std::vector<std::string> frameFilenames(tomogram.frameCount);
+        for (int f = 0; f < tomogram.frameCount; f++)
+        {
+            m.getValueSafely(label, frameFilenames[f], f);
+        }
+
+        tomogram.tiles = std::make_shared<TileCachedTiltSeries>(frameFilenames, tileSize);
+    }
+
+    if (tomogram.tiles->xdim != tomogram.imageSize.x ||
+        tomogram.tiles->ydim != tomogram.imageSize.y ||
+        tomogram.tiles->zdim < tomogram.frameCount)
+    {
+        REPORT_ERROR("ERROR: the tilt series of tomogram " + tomogram.name + " does not match its image size or frame count");
+    }
+}
+
 int TomogramSet::size() const
 {
 	return tomogramTables.size();
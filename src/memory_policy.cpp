@@ -0,0 +1,276 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/memory_policy.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+// Stored in front of every block
+struct MemoryBlockHeader
+{
+	void* base;
+	size_t mapped_bytes; // 0 for blocks from the heap
+};
+
+class MemoryPolicy
+{
+	public:
+
+		bool thp, hugetlb, interleave, firsttouch;
+		size_t min_bytes, huge_page_bytes;
+		std::vector<unsigned long> node_mask;
+		int max_node;
+
+		MemoryPolicy()
+		:	thp(false), hugetlb(false), interleave(false), firsttouch(false),
+			min_bytes(64 << 20), huge_page_bytes(2 << 20), max_node(0)
+		{
+			const char* policy = getenv("RELION_MEMORY_POLICY");
+			if (policy == NULL) return;
+
+			std::stringstream sts(policy);
+			std::string item;
+
+			while (std::getline(sts, item, ','))
+			{
+				if (item == "thp") thp = true;
+				else if (item == "hugetlb") hugetlb = true;
+				else if (item == "interleave") interleave = true;
+				else if (item == "firsttouch") firsttouch = true;
+				else if (item != "" && item != "default")
+				{
+					// This may run before main(), so do not throw
+					std::cerr << " WARNING: ignoring unknown entry in RELION_MEMORY_POLICY: " << item << std::endl;
+				}
+			}
+
+			const char* min_mb = getenv("RELION_MEMORY_POLICY_MIN_MB");
+			if (min_mb != NULL)
+				min_bytes = (size_t)(atof(min_mb) * (1 << 20));
+
+			readHugePageSize();
+
+			if (interleave && !readNodes())
+				interleave = false;
+		}
+
+		bool isActive() const
+		{
+			return thp || hugetlb || interleave || firsttouch;
+		}
+
+	private:
+
+		void readHugePageSize()
+		{
+			std::ifstream meminfo("/proc/meminfo");
+			std::string line;
+
+			while (std::getline(meminfo, line))
+			{
+				if (line.compare(0, 13, "Hugepagesize:") == 0)
+				{
+					long int kb = atol(line.c_str() + 13);
+					if (kb > 0) huge_page_bytes = (size_t) kb << 10;
+					break;
+				}
+			}
+		}
+
+		// Read the online NUMA nodes (e.g. "0-1" or "0,2-3"); returns false if there is only one
+		bool readNodes()
+		{
+			std::ifstream online("/sys/devices/system/node/online");
+			std::string list;
+			if (!std::getline(online, list)) return false;
+
+			const int bits = 8 * sizeof(unsigned long);
+			int nr_nodes = 0;
+
+			std::stringstream sts(list);
+			std::string range;
+
+			while (std::getline(sts, range, ','))
+			{
+				int first, last;
+				size_t dash = range.find('-');
+				first = atoi(range.c_str());
+				last = (dash == std::string::npos)? first : atoi(range.c_str() + dash + 1);
+
+				for (int n = first; n <= last; n++)
+				{
+					if (n < 0) continue;
+					if (n / bits >= node_mask.size()) node_mask.resize(n / bits + 1, 0);
+					node_mask[n / bits] |= 1UL << (n % bits);
+					if (n > max_node) max_node = n;
+					nr_nodes++;
+				}
+			}
+
+			return nr_nodes > 1;
+		}
+};
+
+static const MemoryPolicy& getMemoryPolicy()
+{
+	static MemoryPolicy policy;
+	return policy;
+}
+
+static size_t roundUp(size_t bytes, size_t multiple)
+{
+	return ((bytes + multiple - 1) / multiple) * multiple;
+}
+
+static void* mapAligned(size_t bytes, size_t alignment)
+{
+	// Map more than needed and cut off the unaligned ends
+	char* raw = (char*) mmap(0, bytes + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == (char*) MAP_FAILED) return NULL;
+
+	char* base = (char*) roundUp((size_t) raw, alignment);
+
+	if (base > raw) munmap(raw, base - raw);
+	if (raw + alignment > base) munmap(base + bytes, raw + alignment - base);
+
+	return base;
+}
+
+static void* mapLarge(size_t bytes, const MemoryPolicy& policy)
+{
+	const bool huge = policy.thp || policy.hugetlb;
+	const size_t page_bytes = huge? policy.huge_page_bytes : sysconf(_SC_PAGESIZE);
+	const size_t total = roundUp(bytes, page_bytes);
+
+	void* base = NULL;
+
+#ifdef MAP_HUGETLB
+	if (policy.hugetlb)
+	{
+		// Fails if not enough huge pages have been reserved
+		base = mmap(0, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base == MAP_FAILED) base = NULL;
+	}
+#endif
+
+	if (base == NULL)
+		base = mapAligned(total, page_bytes);
+
+	if (base == NULL) return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if (policy.thp)
+		madvise(base, total, MADV_HUGEPAGE);
+#endif
+
+#if defined(__linux__) && defined(SYS_mbind)
+	// Has to happen before the pages are touched
+	if (policy.interleave)
+		syscall(SYS_mbind, base, total, MPOL_INTERLEAVE, &policy.node_mask[0], policy.max_node + 2, 0);
+#endif
+
+	if (policy.firsttouch)
+	{
+		const long int nr_pages = total / page_bytes;
+
+		#pragma omp parallel for schedule(static)
+		for (long int i = 0; i < nr_pages; i++)
+		{
+			((volatile char*) base)[i * page_bytes] = 0;
+		}
+	}
+
+	MemoryBlockHeader* header = (MemoryBlockHeader*) base;
+	header->base = base;
+	header->mapped_bytes = total;
+
+	return base;
+}
+
+void* relion_aligned_malloc(size_t bytes)
+{
+	const MemoryPolicy& policy = getMemoryPolicy();
+	const size_t block_bytes = bytes + RELION_MEMORY_ALIGNMENT;
+
+	char* base = NULL;
+
+	if (policy.isActive() && bytes >= policy.min_bytes)
+	{
+		base = (char*) mapLarge(block_bytes, policy);
+	}
+
+	if (base == NULL)
+	{
+		void* ptr;
+		if (posix_memalign(&ptr, RELION_MEMORY_ALIGNMENT, block_bytes) != 0)
+			return NULL;
+
+		base = (char*) ptr;
+
+		MemoryBlockHeader* header = (MemoryBlockHeader*) base;
+		header->base = base;
+		header->mapped_bytes = 0;
+	}
+
+	return base + RELION_MEMORY_ALIGNMENT;
+}
+
+void relion_aligned_free(void* ptr)
+{
+	if (ptr == NULL) return;
+
+	MemoryBlockHeader* header = (MemoryBlockHeader*) ((char*) ptr - RELION_MEMORY_ALIGNMENT);
+
+	if (header->mapped_bytes > 0)
+		munmap(header->base, header->mapped_bytes);
+	else
+		free(header->base);
+}
+
+std::string relion_memory_policy_description()
+{
+	const MemoryPolicy& policy = getMemoryPolicy();
+
+	if (!policy.isActive())
+		return "default";
+
+	std::stringstream sts;
+	if (policy.thp) sts << "thp,";
+	if (policy.hugetlb) sts << "hugetlb,";
+	if (policy.interleave) sts << "interleave,";
+	if (policy.firsttouch) sts << "firsttouch,";
+
+	sts.seekp(-1, std::ios_base::cur);
+	sts << " for arrays of at least " << policy.min_bytes / (double)(1 << 20) << " MB";
+
+	return sts.str();
+}
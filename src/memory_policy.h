@@ -0,0 +1,91 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef MEMORY_POLICY_H_
+#define MEMORY_POLICY_H_
+
+#include <cstddef>
+#include <new>
+#include <string>
+
+/*
+ * Allocation of the data of MultidimArray and BufferedImage (and hence of all
+ * projectors, backprojectors, weighted sums and tomograms).
+ *
+ * All blocks are aligned to RELION_MEMORY_ALIGNMENT bytes. How the pages of large
+ * blocks are placed is chosen at run time through the environment variable
+ * RELION_MEMORY_POLICY, a comma-separated list of:
+ *
+ *   thp         ask for transparent huge pages
+ *   hugetlb     use explicit huge pages (these have to be reserved by the administrator;
+ *               if there are not enough, normal pages are used)
+ *   interleave  spread the pages over all NUMA nodes
+ *   firsttouch  touch the pages from all threads of the process on allocation, so that
+ *               they end up on the NUMA nodes of the threads that use them
+ *
+ * Only blocks of at least RELION_MEMORY_POLICY_MIN_MB megabytes (default: 64) follow
+ * the policy; smaller ones come from the heap. Without RELION_MEMORY_POLICY, all blocks
+ * come from the heap, as before.
+ */
+
+#define RELION_MEMORY_ALIGNMENT 64
+
+void* relion_aligned_malloc(size_t bytes);
+
+// Also accepts NULL
+void relion_aligned_free(void* ptr);
+
+// Describe the active policy, e.g. for verbose output
+std::string relion_memory_policy_description();
+
+/*
+ * For std::vector: e.g. std::vector<T, RelionAllocator<T> >
+ */
+template <typename T>
+class RelionAllocator
+{
+	public:
+
+		typedef T value_type;
+
+		RelionAllocator() {}
+
+		template <typename T2>
+		RelionAllocator(const RelionAllocator<T2>&) {}
+
+		T* allocate(size_t n)
+		{
+			void* ptr = relion_aligned_malloc(n * sizeof(T));
+			if (ptr == NULL) throw std::bad_alloc();
+			return (T*) ptr;
+		}
+
+		void deallocate(T* ptr, size_t)
+		{
+			relion_aligned_free(ptr);
+		}
+};
+
+template <typename T1, typename T2>
+bool operator == (const RelionAllocator<T1>&, const RelionAllocator<T2>&) { return true; }
+
+template <typename T1, typename T2>
+bool operator != (const RelionAllocator<T1>&, const RelionAllocator<T2>&) { return false; }
+
+#endif /* MEMORY_POLICY_H_ */
@@ -648,32 +648,63 @@ void MetaDataTable::sort(EMDLabel name, bool do_reverse, bool only_set_index, bo
 	firstObject();
 }
 
-void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_after_at, bool do_sort_before_at)
+// Same result as std::stable_sort: sort nr_threads parts in parallel, then merge neighbouring parts in parallel
+template <typename Iterator, typename Comparator>
+static void parallelStableSort(Iterator begin, Iterator end, Comparator comp, int nr_threads)
+{
+	const long int n = end - begin;
+
+	if (nr_threads <= 1 || n < 2 * nr_threads)
+	{
+		std::stable_sort(begin, end, comp);
+		return;
+	}
+
+	std::vector<long int> bounds(nr_threads + 1);
+	for (int i = 0; i <= nr_threads; i++)
+		bounds[i] = (n * i) / nr_threads;
+
+	#pragma omp parallel for num_threads(nr_threads)
+	for (int i = 0; i < nr_threads; i++)
+		std::stable_sort(begin + bounds[i], begin + bounds[i+1], comp);
+
+	for (int width = 1; width < nr_threads; width *= 2)
+	{
+		#pragma omp parallel for num_threads(nr_threads)
+		for (int i = 0; i < nr_threads - width; i += 2 * width)
+		{
+			const int last = (i + 2 * width < nr_threads) ? i + 2 * width : nr_threads;
+			std::inplace_merge(begin + bounds[i], begin + bounds[i + width], begin + bounds[last], comp);
+		}
+	}
+}
+
+void MetaDataTable::newSort(const EMDLabel label, bool do_reverse, bool do_sort_after_at, bool do_sort_before_at, int nr_threads)
 {
 	if (EMDL::isString(label))
 	{
 		if (do_sort_after_at)
 		{
-			std::stable_sort(objects.begin(), objects.end(),
-							 MdStringAfterAtComparator(label2offset[label]));
+			parallelStableSort(objects.begin(), objects.end(),
+							   MdStringAfterAtComparator(label2offset[label]), nr_threads);
 		}
 		else if (do_sort_before_at)
 		{
-			std::stable_sort(objects.begin(), objects.end(),
-							 MdStringBeforeAtComparator(label2offset[label]));
+			parallelStableSort(objects.begin(), objects.end(),
+							   MdStringBeforeAtComparator(label2offset[label]), nr_threads);
 		}
 		else
 		{
-			std::stable_sort(objects.begin(), objects.end(), MdStringComparator(label2offset[label]));
+			parallelStableSort(objects.begin(), objects.end(), MdStringComparator(label2offset[label]), nr_threads);
 		}
 	}
 	else if (EMDL::isDouble(label))
 	{
-		std::stable_sort(objects.begin(), objects.end(), MdDoubleComparator(label2offset[label]));
+		parallelStableSort(objects.begin(), objects.end(), MdDoubleComparator(label2offset[label]), nr_threads);
 	}
 	else if (EMDL::isInt(label))
 	{
-		std::stable_sort(objects.begin(), objects.end(), MdIntComparator(label2offset[label]));
+		parallelStableSort(objects.begin(), objects.end(), MdIntComparator(label2offset[label]), nr_threads);
 	}
 	else
 	{
@@ -1032,7 +1063,7 @@ long int MetaDataTable::goToObject(long int objectID)
 	return current_objectID;
 }
 
-long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
+long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count, long int max_rows)
 {
 	setIsList(false);
 
@@ -1041,8 +1072,12 @@ long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 	std::string line, token;
 
 	// First read all the column labels
-	while (getline(in, line, '\n'))
+	while (true)
 	{
+		std::streampos line_start = in.tellg();
+		if (!getline(in, line, '\n'))
+			break;
+
 		line = simplify(line);
 		// TODO: handle comments...
 		if (line[0] == '#' || line[0] == '\0' || line[0] == ';')
@@ -1068,25 +1103,52 @@ long int MetaDataTable::readStarLoop(std::ifstream& in, bool do_only_count)
 
 			labelPosition++;
 		}
-		else // found first data line
+		else // found first data line: go back to its start
 		{
+			in.seekg(line_start);
 			break;
 		}
 	}
 
-	// Then fill the table (dont read another line until the one from above has been handled)
-	bool is_first = true;
+	// Then fill the table
+	return readStarLoopRows(in, do_only_count, max_rows);
+}
+
+long int MetaDataTable::readStarLoopChunk(std::ifstream& in, long int max_rows)
+{
+	for (long i = 0; i < objects.size(); i++)
+	{
+		delete objects[i];
+	}
+	objects.clear();
+	current_objectID = 0;
+
+	return readStarLoopRows(in, false, max_rows);
+}
+
+long int MetaDataTable::readStarLoopRows(std::ifstream& in, bool do_only_count, long int max_rows)
+{
+	std::string line;
+	int labelPosition;
 	long int nr_objects = 0;
 	const int num_labels = activeLabels.size();
 
-	while (is_first || getline(in, line, '\n'))
+	if (max_rows > 0 && !do_only_count)
+		objects.reserve(objects.size() + max_rows);
+
+	while ((max_rows < 0 || nr_objects < max_rows) && getline(in, line, '\n'))
 	{
-		is_first = false;
+		const size_t line_length = line.size();
 
 		line = simplify(line);
 		// Stop at empty line
 		if (line[0] == '\0')
+		{
+			// When reading in chunks, stay at the end of the loop, so that the next chunk is empty
+			if (max_rows >= 0 && !in.eof())
+				in.seekg(-(std::streamoff)(line_length + 1), std::ios::cur);
 			break;
+		}
 
 		nr_objects++;
 		if (!do_only_count)
@@ -1199,7 +1261,7 @@ bool MetaDataTable::readStarList(std::ifstream& in)
 	return also_has_loop;
 }
 
-long int MetaDataTable::readStar(std::ifstream& in, const std::string &name, bool do_only_count)
+long int MetaDataTable::readStar(std::ifstream& in, const std::string &name, bool do_only_count, long int max_rows)
 {
 	std::string line, token, value;
 	clear();
@@ -1247,7 +1309,7 @@ long int MetaDataTable::readStar(std::ifstream& in, const std::string &name, boo
 				{
 					if (line.find("loop_") != std::string::npos)
 					{
-						return readStarLoop(in, do_only_count);
+						return readStarLoop(in, do_only_count, max_rows);
 					}
 					else if (line[0] == '_')
 					{
@@ -1362,14 +1424,8 @@ long int MetaDataTable::read(const FileName &filename, const std::string &name,
 	return ret;
 }
 
-void MetaDataTable::write(std::ostream& out) const
+void MetaDataTable::writeStarBlockStart(std::ostream& out) const
 {
-	// Only write tables that have something in them
-	if (isEmpty())
-	{
-		return;
-	}
-
 	if (version >= 30000)
 	{
 		out << "\n";
@@ -1385,84 +1441,100 @@ void MetaDataTable::write(std::ostream& out) const
 	}
 
 	out << "\n";
+}
 
-	if (!isList)
+void MetaDataTable::writeStarLoopHeader(std::ostream& out) const
+{
+	writeStarBlockStart(out);
+
+	out << "loop_ \n";
+
+	for (long i = 0, n_printed = 1; i < activeLabels.size(); i++)
 	{
-		// Write loop header structure
-		out << "loop_ \n";
+		EMDLabel l = activeLabels[i];
+		if (l == EMDL_UNKNOWN_LABEL)
+		{
+			out << "_" << getUnknownLabelNameAt(i) << " #" << (n_printed++) << " \n";
+		}
+		else if (l != EMDL_COMMENT && l != EMDL_SORTED_IDX) // EMDL_SORTED_IDX is only for internal use, never write it out!
+		{
+			out << "_" << EMDL::label2Str(l) << " #" << (n_printed++) << " \n";
+		}
+	}
+}
+
+void MetaDataTable::writeStarLoopRows(std::ostream& out) const
+{
+	//SHWS 31jul2024: writing of large STAR files on our ceph file system was very slow.
+	//SHWS 31jul2024: writing big data blocks (10,000 lines) in one go is much, much faster
+	std::ostringstream dataBlockStream;
+	for (long int idx = 0; idx < objects.size(); idx++)
+	{
+		std::string entryComment = "";
 
-		for (long i = 0, n_printed = 1; i < activeLabels.size(); i++)
+		for (long i = 0; i < activeLabels.size(); i++)
 		{
 			EMDLabel l = activeLabels[i];
+
 			if (l == EMDL_UNKNOWN_LABEL)
 			{
-				out << "_" << getUnknownLabelNameAt(i) << " #" << (n_printed++) << " \n";
+				std::string token, val;
+				long offset = unknownLabelPosition2Offset[i];
+				val = objects[idx]->unknowns[offset];
+				escapeStringForSTAR(val);
+				dataBlockStream << std::setw(10) << val << " ";
+			}
+			else if (l != EMDL_COMMENT && l != EMDL_SORTED_IDX)
+			{
+				std::string val;
+				getValueToString(l, val, idx, true); // escape=true
+				dataBlockStream << std::setw(10) << val << " ";
 			}
-			else if (l != EMDL_COMMENT && l != EMDL_SORTED_IDX) // EMDL_SORTED_IDX is only for internal use, never write it out!
+			if (l == EMDL_COMMENT)
 			{
-				out << "_" << EMDL::label2Str(l) << " #" << (n_printed++) << " \n";
+				getValue(EMDL_COMMENT, entryComment, idx);
 			}
 		}
-
-		// Write actual data block
-        //SHWS 31jul2024: writing of large STAR files on our ceph file system was very slow.
-        //SHWS 31jul2024: writing big data blocks (10,000 lines) in one go is much, much faster
-        std::ostringstream dataBlockStream;
-		for (long int idx = 0; idx < objects.size(); idx++)
+		if (entryComment != std::string(""))
 		{
-			std::string entryComment = "";
-
-            for (long i = 0; i < activeLabels.size(); i++)
-			{
-				EMDLabel l = activeLabels[i];
+			dataBlockStream << "# " << entryComment;
+		}
+		dataBlockStream << "\n";
 
-				if (l == EMDL_UNKNOWN_LABEL)
-				{
-					std::string token, val;
-					long offset = unknownLabelPosition2Offset[i];
-					val = objects[idx]->unknowns[offset];
-					escapeStringForSTAR(val);
-					dataBlockStream << std::setw(10) << val << " ";
-                    //out.width(10);
-                    //out << val << " ";
-				}
-				else if (l != EMDL_COMMENT && l != EMDL_SORTED_IDX)
-				{
-					std::string val;
-					getValueToString(l, val, idx, true); // escape=true
-					dataBlockStream << std::setw(10) << val << " ";
-                    //out.width(10);
-                    //out << val << " ";
-				}
-				if (l == EMDL_COMMENT)
-				{
-					getValue(EMDL_COMMENT, entryComment, idx);
-				}
-			}
-			if (entryComment != std::string(""))
-			{
-				dataBlockStream << "# " << entryComment;
-                //out << "# " << entryComment;
-			}
-            dataBlockStream << "\n";
-			//out << "\n";
+		if ((idx+1)%100000 == 0)
+		{
+			out << dataBlockStream.str();
+			dataBlockStream.str("");
+			dataBlockStream.clear();
+		}
+	}
+	out << dataBlockStream.str();
+}
 
-            if ((idx+1)%100000 == 0)
-            {
-                out << dataBlockStream.str();
-                dataBlockStream.str("");
-                dataBlockStream.clear();
-            }
+void MetaDataTable::writeStarLoopEnd(std::ostream& out)
+{
+	// Finish table with a white-line
+	out << " \n";
+}
 
-		}
-		// Finish table with a white-line
-        dataBlockStream << " \n";
-        //out << " \n";
-        out << dataBlockStream.str();
+void MetaDataTable::write(std::ostream& out) const
+{
+	// Only write tables that have something in them
+	if (isEmpty())
+	{
+		return;
+	}
 
+	if (!isList)
+	{
+		writeStarLoopHeader(out);
+		writeStarLoopRows(out);
+		writeStarLoopEnd(out);
 	}
 	else // isList
 	{
+		writeStarBlockStart(out);
+
 		// Get first object. In this case (row format) there is a single object
 		std::string entryComment = "";
 		int maxWidth=10;
@@ -2090,7 +2162,7 @@ MetaDataTable subsetMetaDataTable(MetaDataTable &MDin, EMDLabel label, std::stri
 	return MDout;
 }
 
-MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label, RFLOAT threshold, RFLOAT origin_scale, FileName fn_removed, bool verb)
+MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label, RFLOAT threshold, RFLOAT origin_scale, FileName fn_removed, bool verb, int nr_threads)
 {
 	// Sanity check
     if (!MDin.containsLabel(EMDL_ORIENT_ORIGIN_X_ANGSTROM) || !MDin.containsLabel(EMDL_ORIENT_ORIGIN_Y_ANGSTROM))
@@ -2105,7 +2177,8 @@ MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label,
 	if (!MDin.containsLabel(mic_label))
 		REPORT_ERROR("STAR file does not contain " + EMDL::label2Str(mic_label));
 
-	std::vector<bool> valid(MDin.numberOfObjects(), true);
+	// (not vector<bool>: threads set elements next to each other)
+	std::vector<char> valid(MDin.numberOfObjects(), true);
 	std::vector<RFLOAT> xs(MDin.numberOfObjects(), 0.0);
 	std::vector<RFLOAT> ys(MDin.numberOfObjects(), 0.0);
     std::vector<RFLOAT> zs;
@@ -2158,25 +2231,31 @@ MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label,
 		grouped[mic_name].push_back(current_object);
 	}
 
-	// find duplicate
+	// find duplicate (micrographs are independent)
+	std::vector<const std::vector<long>*> groups;
+	groups.reserve(grouped.size());
 	for (std::map<std::string, std::vector<long> >::iterator it = grouped.begin(); it != grouped.end(); ++it)
+		groups.push_back(&(it->second));
+
+	#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+	for (long igroup = 0; igroup < groups.size(); igroup++)
 	{
-		long n_particles = it->second.size();
+		const std::vector<long> &group = *groups[igroup];
+		long n_particles = group.size();
 
 		for (long i = 0; i < n_particles; i++)
 		{
-			long part_id1 = it->second[i];
+			long part_id1 = group[i];
 
 			for (long j = i + 1; j < n_particles; j++)
 			{
-				long part_id2 = it->second[j];
+				long part_id2 = group[j];
 				RFLOAT dist_sq = (xs[part_id1] - xs[part_id2]) * (xs[part_id1] - xs[part_id2]) + (ys[part_id1] - ys[part_id2]) * (ys[part_id1] - ys[part_id2]);
 				if (dataIs3D)
                     dist_sq += (zs[part_id1] - zs[part_id2]) * (zs[part_id1] - zs[part_id2]);
 
 				if (dist_sq <= threshold_sq)
 				{
-//					std::cout << it->first << " " << part_id1 << " " << part_id2 << " " << dist_sq << std::endl;
 					valid[part_id1] = false;
 					break;
 				}
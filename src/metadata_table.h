@@ -207,7 +207,7 @@ public:
 	// Sort the order of the elements based on the values in the input label
 	// (only numbers, no strings/bools)
 	void sort(EMDLabel name, bool do_reverse = false, bool only_set_index = false, bool do_random = false);
-	void newSort(const EMDLabel name, bool do_reverse = false, bool do_sort_after_at = false, bool do_sort_before_at = false);
+	void newSort(const EMDLabel name, bool do_reverse = false, bool do_sort_after_at = false, bool do_sort_before_at = false, int nr_threads = 1);
 
 	// Check whether a label is defined in the table.
 	// This is redundant and will be removed in 3.2.
@@ -287,7 +287,14 @@ public:
 	long goToObject(long objectID);
 
 	// Read a STAR loop structure
-	long int readStarLoop(std::ifstream& in, bool do_only_count = false);
+	// If max_rows >= 0, only read that many rows; the next ones can be read with readStarLoopChunk
+	long int readStarLoop(std::ifstream& in, bool do_only_count = false, long int max_rows = -1);
+
+	/* Replace the rows of this table by the next (at most max_rows) rows of the loop
+	 * that was opened with readStar(in, name, false, max_rows). The labels are kept.
+	 * Returns the number of rows read: 0 once the end of the loop has been reached.
+	 * This allows tables that are too large for memory to be processed in chunks. */
+	long int readStarLoopChunk(std::ifstream& in, long int max_rows);
 
 	/* Read a STAR list
 	 * The function returns true if the list is followed by a loop, false otherwise */
@@ -315,7 +322,7 @@ public:
 			int expectedNumber = 0,
 			bool do_only_count = false);
 
-	long int readStar(std::ifstream& in, const std::string &name = "", bool do_only_count = false);
+	long int readStar(std::ifstream& in, const std::string &name = "", bool do_only_count = false, long int max_rows = -1);
 
 	// Read a MetaDataTable (get file format from extension)
 	long int read(const FileName &filename, const std::string &name = "", bool do_only_count = false);
@@ -326,6 +333,12 @@ public:
 	// Write to a single file
 	void write(const FileName & fn_out) const;
 
+	/* Write a loop in chunks: the header (from this table's name and labels) once,
+	 * then the rows of any number of tables with the same labels, then the end of the loop */
+	void writeStarLoopHeader(std::ostream& out) const;
+	void writeStarLoopRows(std::ostream& out) const;
+	static void writeStarLoopEnd(std::ostream& out);
+
 	// Make a histogram of a column
 	void columnHistogram(EMDLabel label, std::vector<RFLOAT> &histX, std::vector<RFLOAT> &histY, int verb = 0, CPlot2D *plot2D = NULL,
 	                     long int nr_bin = -1, RFLOAT hist_min = -LARGE_NUMBER, RFLOAT hist_max = LARGE_NUMBER,
@@ -374,6 +387,12 @@ private:
 	 *  Same as setObject, but assumes that all labels are present. */
 	void setObjectUnsafe(MetaDataContainer* data, long objId);
 
+	// Write the version, name and comment that start a data block
+	void writeStarBlockStart(std::ostream& out) const;
+
+	// Read the data lines of a loop (all of them if max_rows < 0)
+	long int readStarLoopRows(std::ifstream& in, bool do_only_count, long int max_rows);
+
 };
 
 void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
@@ -388,7 +407,8 @@ MetaDataTable subsetMetaDataTable(MetaDataTable &MDin, EMDLabel label, std::stri
 
 // remove duplicated particles that are in the same micrograph (mic_label) and within a given threshold [px]
 // OriginX/Y are multiplied by origin_scale before added to CoordinateX/Y to compensate for down-sampling
-MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label, RFLOAT threshold, RFLOAT origin_scale=1.0, FileName fn_removed="", bool verb=true);
+// Micrographs are processed in parallel by nr_threads threads
+MetaDataTable removeDuplicatedParticles(MetaDataTable &MDin, EMDLabel mic_label, RFLOAT threshold, RFLOAT origin_scale=1.0, FileName fn_removed="", bool verb=true, int nr_threads=1);
 
 // This flag should be enabled via "cmake -DMDT_TYPE_CHECK=ON"
 #ifdef METADATA_TABLE_TYPE_CHECK
@@ -39,6 +39,7 @@
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <unistd.h>
 #include <omp.h>
 #include "src/macros.h"
 #include "src/error.h"
@@ -459,9 +460,13 @@ void MlOptimiser::parseContinue(int argc, char **argv)
 
     x_pool = textToInteger(parser.getOption("--pool", "Number of images to pool for each thread task", "1"));
     nr_threads = textToInteger(parser.getOption("--j", "Number of threads to run in parallel (only useful on multi-core machines)", "1"));
+    setThreadBudget(nr_threads);
+    do_auto_pool = parser.checkOption("--auto_pool", "Choose the number of pooled particles (and, for the standard CPU code, fewer threads if needed) from an estimate of the memory use, instead of using --pool");
+    max_memory_Gb = textToFloat(parser.getOption("--max_memory", "Memory (in Gb) each MPI process may use with --auto_pool (default: its share of the available memory of the node)", "-1"));
     do_parallel_disc_io = !parser.checkOption("--no_parallel_disc_io", "Do NOT let parallel (MPI) processes access the disc simultaneously (use this option with NFS)");
     combine_weights_thru_disc = !parser.checkOption("--dont_combine_weights_via_disc", "Send the large arrays of summed weights through the MPI network, instead of writing large files to disc");
     do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
+    do_compact_refs = parser.checkOption("--compact_refs", "Only store the Fourier components of the references inside the current resolution limit (saves memory on the CPU, ignored on GPUs)");
     do_preread_images  = parser.checkOption("--preread_images", "Use this to let the leader process read all particles into memory. Be careful you have enough RAM for large data sets!");
     fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
     keep_free_scratch_Gb = textToFloat(parser.getOption("--keep_free_scratch", "Space available for copying particle stacks (in Gb)", "10"));
@@ -894,8 +899,12 @@ void MlOptimiser::parseInitial(int argc, char **argv)
     int computation_section = parser.addSection("Computation");
     x_pool = textToInteger(parser.getOption("--pool", "Number of images to pool for each thread task", "1"));
     nr_threads = textToInteger(parser.getOption("--j", "Number of threads to run in parallel (only useful on multi-core machines)", "1"));
+    setThreadBudget(nr_threads);
+    do_auto_pool = parser.checkOption("--auto_pool", "Choose the number of pooled particles (and, for the standard CPU code, fewer threads if needed) from an estimate of the memory use, instead of using --pool");
+    max_memory_Gb = textToFloat(parser.getOption("--max_memory", "Memory (in Gb) each MPI process may use with --auto_pool (default: its share of the available memory of the node)", "-1"));
     combine_weights_thru_disc = !parser.checkOption("--dont_combine_weights_via_disc", "Send the large arrays of summed weights through the MPI network, instead of writing large files to disc");
     do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
+    do_compact_refs = parser.checkOption("--compact_refs", "Only store the Fourier components of the references inside the current resolution limit (saves memory on the CPU, ignored on GPUs)");
     do_parallel_disc_io = !parser.checkOption("--no_parallel_disc_io", "Do NOT let parallel (MPI) processes access the disc simultaneously (use this option with NFS)");
     do_preread_images  = parser.checkOption("--preread_images", "Use this to let the leader process read all particles into memory. Be careful you have enough RAM for large data sets!");
     fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
@@ -1991,6 +2000,9 @@ void MlOptimiser::initialiseGeneral(int rank)
             std::cout << " Running CPU instructions in double precision. " << std::endl;
 #endif
 
+    if (verb > 0 && getenv("RELION_MEMORY_POLICY") != NULL)
+        std::cout << " Memory policy: " << relion_memory_policy_description() << std::endl;
+
     // print symmetry operators or metadata labels before doing anything else...
     if (do_print_symmetry_ops)
     {
@@ -3557,6 +3569,20 @@ void MlOptimiser::expectation()
     // E. Check whether everything fits into memory
     expectationSetupCheckMemory(verb);
 
+    // F. Only keep the Fourier components of the references inside r_max (not for the GPU code)
+    if (do_compact_refs && !do_gpu && !do_sycl)
+    {
+        for (int iclass = 0; iclass < mymodel.PPref.size(); iclass++)
+            mymodel.PPref[iclass].compactData();
+
+        // Without the accelerated CPU kernels, 2D images are backprojected straight into compact arrays
+        if (!do_cpu && mymodel.ref_dim == 3 && mymodel.data_dim == 2)
+        {
+            for (int iclass = 0; iclass < wsum_model.BPref.size(); iclass++)
+                wsum_model.BPref[iclass].compactDataAndWeight();
+        }
+    }
+
 
 #ifdef DEBUG_EXP
     std::cerr << "Expectation: done setupCheckMemory" << std::endl;
@@ -3660,6 +3686,23 @@ void MlOptimiser::expectation()
         // Set up XFLOAT complex array shared by all threads for each class
         for (int iclass = 0; iclass < nr_classes; iclass++)
         {
+            if (mymodel.PPref[iclass].hasCompactData())
+            {
+                // Keep the same compact layout: the CpuKernels read it through the row offsets of PPref
+                const std::vector<Complex> &values = mymodel.PPref[iclass].compact_data.values;
+                try
+                {
+                    mdlClassComplex[iclass] = new std::complex<XFLOAT>[values.size()];
+                }
+                catch (std::bad_alloc& ba)
+                {
+                    CRITICAL(RAMERR);
+                }
+                for (size_t i = 0; i < values.size(); i ++)
+                    mdlClassComplex[iclass][i] = std::complex<XFLOAT>((XFLOAT) values[i].real, (XFLOAT) values[i].imag);
+                continue;
+            }
+
             int mdlX = mymodel.PPref[iclass].data.xdim;
             int mdlY = mymodel.PPref[iclass].data.ydim;
             int mdlZ = mymodel.PPref[iclass].data.zdim;
@@ -3965,7 +4008,14 @@ void MlOptimiser::expectation()
 
     // Clean up some memory
     for (int iclass = 0; iclass < mymodel.nr_classes; iclass++)
+    {
         mymodel.PPref[iclass].data.clear();
+        mymodel.PPref[iclass].compact_data.clear();
+    }
+
+    // The maximisation step needs the full arrays of the weighted sums
+    for (int iclass = 0; iclass < wsum_model.BPref.size(); iclass++)
+        wsum_model.BPref[iclass].expandDataAndWeight();
 
 #ifdef DEBUG_EXP
     std::cerr << "Expectation: done " << std::endl;
@@ -4073,48 +4123,175 @@ void MlOptimiser::expectationSetupCheckMemory(int myverb)
     }
 
 
-    if (myverb > 1)
+    if (do_auto_pool || myverb > 1)
+    {
+        MlMemoryEstimate mem = estimateMemory(pointer_dir_nonzeroprior, pointer_psi_nonzeroprior);
+
+        if (do_auto_pool)
+            planMemory(mem, myverb);
+
+        if (myverb > 1 || (do_auto_pool && myverb > 0))
+        {
+            std::cout << " Estimated memory per process (Gb): " << std::endl;
+            std::cout << "  + references:          " << mem.references << std::endl;
+            std::cout << "  + weighted sums:       " << mem.backprojectors << std::endl;
+            if (mem.preread_images > 0.)
+                std::cout << "  + pre-read particles:  " << mem.preread_images << std::endl;
+            std::cout << "  + pooled particles:    " << nr_pool * mem.per_particle << " (" << nr_pool << " particles)" << std::endl;
+            std::cout << "  + threads:             " << nr_threads * mem.per_thread << " (" << nr_threads << " threads)" << std::endl;
+            std::cout << "  + rest:                " << mem.rest << std::endl;
+            std::cout << " Estimated memory for expectation  step > " << mem.expectation(nr_pool, nr_threads) << " Gb."<<std::endl;
+            std::cout << " Estimated memory for maximization step > " << mem.maximization << " Gb."<<std::endl;
+        }
+    }
+
+#ifdef DEBUG
+    std::cerr << "Leaving expectationSetup" << std::endl;
+#endif
+
+}
+
+MlMemoryEstimate MlOptimiser::estimateMemory(std::vector<int> &pointer_dir_nonzeroprior, std::vector<int> &pointer_psi_nonzeroprior)
+{
+    MlMemoryEstimate mem;
+
+    // Each RFLOAT takes 8 bytes, express in Gb
+    RFLOAT Gb = sizeof(RFLOAT) / (1024. * 1024. * 1024.);
+
+    // A. The reference maps: the forward projectors have complex data, the backprojectors have complex data and a real weight
+    // With --compact_refs, the forward projectors only keep the data inside r_max (see expectation())
+    const bool do_compact = do_compact_refs && !do_gpu && !do_sycl;
+    mem.references = mem.backprojectors = 0.;
+    for (int iref = 0; iref < mymodel.PPref.size(); iref++)
+    {
+        if (do_compact)
+            mem.references += Gb * 2 * (mymodel.PPref[iref]).getCompactSize();
+        else
+            mem.references += Gb * 2 * MULTIDIM_SIZE((mymodel.PPref[iref]).data);
+    }
+    for (int iref = 0; iref < wsum_model.BPref.size(); iref++)
+        mem.backprojectors += Gb * 3 * MULTIDIM_SIZE((wsum_model.BPref[iref]).data);
+
+    // B. The particles that were read into memory (these are stored as floats)
+    mem.preread_images = 0.;
+    if (do_preread_images)
+    {
+        for (long int part_id = 0; part_id < mydata.particles.size(); part_id++)
+            mem.preread_images += MULTIDIM_SIZE(mydata.particles[part_id].img) * sizeof(float) / (1024. * 1024. * 1024.);
+    }
+
+    // C. Every pooled particle keeps its original image
+    int ori_pix = (mymodel.data_dim == 2) ? mymodel.ori_size * mymodel.ori_size : mymodel.ori_size * mymodel.ori_size * mymodel.ori_size;
+    mem.per_particle = Gb * ori_pix;
+
+    // D. Every particle that is being aligned has its weight vectors and image data
+    int nr_pix = (mymodel.data_dim == 2) ? mymodel.current_size * mymodel.current_size : mymodel.current_size * mymodel.current_size * mymodel.current_size;
+    mem.per_thread = Gb * mymodel.nr_classes * sampling.NrSamplingPoints(adaptive_oversampling,
+            &pointer_dir_nonzeroprior, &pointer_psi_nonzeroprior);
+    mem.per_thread += Gb * nr_pix;
+    if (!do_shifts_onthefly)
+    {
+        // All precalculated shifted images as well (both masked and unmasked)
+        mem.per_thread += Gb * nr_pix * 2 * sampling.NrTranslationalSamplings(adaptive_oversampling);
+    }
+
+    // E. Estimate the rest of the program at 0.1 Gb
+    mem.rest = 0.1;
+    // Use tabulated sine and cosine values instead for 2D helical segments / 3D helical sub-tomogram averaging with on-the-fly shifts
+    if ( (do_shifts_onthefly) && (!((do_helical_refine) && (!ignore_helical_symmetry))) )
+    {
+        // Store all AB-matrices
+        mem.rest += Gb * nr_pix * sampling.NrTranslationalSamplings(adaptive_oversampling);
+    }
+
+    // F. Each reconstruction has to store 1 extra complex array (Fconv) and 4 extra RFLOAT arrays (Fweight, Fnewweight. vol_out and Mconv in convoluteBlobRealSpace),
+    // in adddition to the RFLOAT weight-array and the complex data-array of the BPref
+    // That makes a total of 2*2 + 5 = 9 * a RFLOAT array of size BPref
+    mem.maximization = Gb * 9 * MULTIDIM_SIZE((wsum_model.BPref[0]).data);
+
+    return mem;
+}
+
+// Memory (in Gb) that is available to this process: its share of what is not yet used on the node,
+// plus what it uses already (the other processes on the node are assumed to use about as much)
+// Returns -1 if this cannot be determined
+static RFLOAT getAvailableMemoryGb(int nr_ranks_on_node)
+{
+    long long available_kb = -1;
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line))
     {
-        // Check whether things will fit into memory
-        // Each RFLOAT takes 8 bytes, and their are mymodel.nr_classes references, express in Gb
-        RFLOAT Gb = sizeof(RFLOAT) / (1024. * 1024. * 1024.);
-        // A. Calculate approximate size of the reference maps
-        // Forward projector has complex data, backprojector has complex data and real weight
-        RFLOAT mem_references = Gb * mymodel.nr_classes * (2 * MULTIDIM_SIZE((mymodel.PPref[0]).data) + 3 * MULTIDIM_SIZE((wsum_model.BPref[0]).data));
-        // B. Weight vectors
-        RFLOAT mem_pool = Gb * mymodel.nr_classes * sampling.NrSamplingPoints(adaptive_oversampling,
-                &pointer_dir_nonzeroprior, &pointer_psi_nonzeroprior);
-        // C. The original image data
-        int nr_pix = (mymodel.data_dim == 2) ? mymodel.current_size * mymodel.current_size : mymodel.current_size * mymodel.current_size * mymodel.current_size;
-        mem_pool += Gb * nr_pix;
-        if (!do_shifts_onthefly)
+        if (line.compare(0, 13, "MemAvailable:") == 0)
         {
-            // D. All precalculated shifted images as well (both masked and unmasked)
-            mem_pool += Gb * nr_pix * 2 * sampling.NrTranslationalSamplings(adaptive_oversampling);
+            available_kb = strtoll(line.c_str() + 13, NULL, 10);
+            break;
         }
-        // Estimate the rest of the program at 0.1 Gb?
-        RFLOAT mem_rest = 0.1; // This one does NOT scale with nr_pool
-        // Use tabulated sine and cosine values instead for 2D helical segments / 3D helical sub-tomogram averaging with on-the-fly shifts
-        if ( (do_shifts_onthefly) && (!((do_helical_refine) && (!ignore_helical_symmetry))) )
+    }
+    if (available_kb < 0)
+        return -1.;
+
+    long long resident_pages = 0, dummy;
+    std::ifstream statm("/proc/self/statm");
+    if (!(statm >> dummy >> resident_pages))
+        resident_pages = 0;
+
+    return available_kb / (1024. * 1024. * XMIPP_MAX(1, nr_ranks_on_node))
+           + resident_pages * (RFLOAT)sysconf(_SC_PAGESIZE) / (1024. * 1024. * 1024.);
+}
+
+void MlOptimiser::planMemory(const MlMemoryEstimate &mem, int myverb)
+{
+    RFLOAT budget = max_memory_Gb;
+    if (budget <= 0.)
+    {
+        budget = getAvailableMemoryGb(nr_ranks_on_node);
+        if (budget <= 0.)
         {
-            // E. Store all AB-matrices
-            mem_rest += Gb * nr_pix * sampling.NrTranslationalSamplings(adaptive_oversampling);
+            if (myverb > 0)
+                std::cerr << " WARNING: cannot determine the available memory, use --max_memory with --auto_pool. Using --pool " << x_pool << std::endl;
+            return;
         }
+    }
 
-        RFLOAT total_mem_Gb_exp = mem_references + nr_pool * mem_pool + mem_rest;
-        // Each reconstruction has to store 1 extra complex array (Fconv) and 4 extra RFLOAT arrays (Fweight, Fnewweight. vol_out and Mconv in convoluteBlobRealSpace),
-        // in adddition to the RFLOAT weight-array and the complex data-array of the BPref
-        // That makes a total of 2*2 + 5 = 9 * a RFLOAT array of size BPref
-        RFLOAT total_mem_Gb_max = Gb * 9 * MULTIDIM_SIZE((wsum_model.BPref[0]).data);
+    // These do not depend on the number of pooled particles or threads
+    RFLOAT fixed = mem.references + mem.backprojectors + mem.preread_images + mem.rest;
 
-        std::cout << " Estimated memory for expectation  step > " << total_mem_Gb_exp << " Gb."<<std::endl;
-        std::cout << " Estimated memory for maximization step > " << total_mem_Gb_max << " Gb."<<std::endl;
+    // Threads can only be taken away from the standard CPU code:
+    // the accelerated codes have assigned their threads to devices and TBB pools at start-up
+    if (!do_gpu && !do_sycl && !do_cpu && fixed + nr_threads * (mem.per_thread + mem.per_particle) > budget)
+    {
+        int max_threads = XMIPP_MAX(1, FLOOR((budget - fixed) / (mem.per_thread + mem.per_particle)));
+        if (max_threads < nr_threads)
+        {
+            if (myverb > 0)
+                std::cout << " Memory planner: using " << max_threads << " instead of " << nr_threads << " threads to stay within " << budget << " Gb" << std::endl;
+            nr_threads = max_threads;
+            setThreadBudget(nr_threads);
+        }
     }
 
-#ifdef DEBUG
-    std::cerr << "Leaving expectationSetup" << std::endl;
-#endif
+    RFLOAT x_pool_fit = (budget - fixed - nr_threads * mem.per_thread) / (nr_threads * mem.per_particle);
+    x_pool = (x_pool_fit >= AUTO_POOL_MAX_PER_THREAD) ? AUTO_POOL_MAX_PER_THREAD : XMIPP_MAX(1, FLOOR(x_pool_fit));
+
+    // Pooling more particles than this process gets would leave the other processes waiting
+    long int nr_particles_per_follower = (mydata.numberOfParticles() + nr_followers - 1) / XMIPP_MAX(1, nr_followers);
+    long int max_x_pool = XMIPP_MAX(1, (nr_particles_per_follower + nr_threads - 1) / nr_threads);
+    if (x_pool > max_x_pool)
+        x_pool = max_x_pool;
 
+    nr_pool = x_pool * nr_threads;
+
+    if (myverb > 0)
+    {
+        std::cout << " Memory planner: pooling " << x_pool << " particles per thread (" << nr_pool << " in total) with a budget of " << budget << " Gb per process" << std::endl;
+        if (mem.expectation(nr_pool, nr_threads) > budget)
+            std::cerr << " WARNING: the expectation step is estimated to need " << mem.expectation(nr_pool, nr_threads)
+                      << " Gb, more than the " << budget << " Gb available per process. Use fewer MPI processes per node, or a smaller box." << std::endl;
+        if (fixed + mem.maximization > budget)
+            std::cerr << " WARNING: the maximization step is estimated to need " << fixed + mem.maximization
+                      << " Gb, more than the " << budget << " Gb available per process." << std::endl;
+    }
 }
 
 void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int my_last_part_id)
@@ -4269,7 +4446,13 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
     {
         // GPU and traditional CPU case - use RELION's built-in task manager to
         // process multiple particles at once
+        // Particles with more images (e.g. subtomograms) take longer: hand out blocks of similar cost,
+        // which shrink towards the end, so that all threads finish together
+        std::vector<double> part_costs(my_last_part_id - my_first_part_id + 1);
+        for (long int part_id_sorted = my_first_part_id; part_id_sorted <= my_last_part_id; part_id_sorted++)
+            part_costs[part_id_sorted - my_first_part_id] = mydata.numberOfImagesInParticle(mydata.sorted_idx[part_id_sorted]);
         exp_ipart_ThreadTaskDistributor->resize(my_last_part_id - my_first_part_id + 1, 1);
+        exp_ipart_ThreadTaskDistributor->setGuided(nr_threads, part_costs);
         exp_ipart_ThreadTaskDistributor->reset();
         #pragma omp parallel for num_threads(nr_threads)
         for (int thread_id = 0; thread_id < nr_threads; thread_id++)
@@ -4284,8 +4467,7 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
         // (roughly equivalent to GPU "threads").
         std::atomic<int> tCount(0);
 
-        // Set the size of the TBB thread pool for these particles
-        tbb::global_control gc(tbb::global_control::max_allowed_parallelism, nr_threads);
+        // The size of the TBB thread pool was set to nr_threads (by setThreadBudget) when reading --j
         // process all passed particles in parallel
         //for(unsigned long i=my_first_part_id; i<=my_last_part_id; i++) {
         tbb::parallel_for(my_first_part_id, my_last_part_id+1, [&](long int i) {
@@ -4753,7 +4935,7 @@ void MlOptimiser::symmetriseReconstructions()
                 }
 
 
-                wsum_model.BPref[ith_recons].applyPointGroupSymmetry();
+                wsum_model.BPref[ith_recons].applyPointGroupSymmetry(getThreadBudget());
 
 
                 if (grad_pseudo_halfsets)
@@ -4776,7 +4958,7 @@ void MlOptimiser::symmetriseReconstructions()
                     }
 
 
-                    wsum_model.BPref[iclass_half].applyPointGroupSymmetry();
+                    wsum_model.BPref[iclass_half].applyPointGroupSymmetry(getThreadBudget());
 
                 }
 
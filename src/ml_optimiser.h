@@ -93,11 +93,31 @@
 #define MAX_NR_ITER_WO_LARGE_HIDDEN_VARIABLE_CHANGES 1
 #define MAX_NR_ITER_WO_RESOL_GAIN_GRAD 4
 
+// Largest number of particles per thread that --auto_pool will pool
+#define AUTO_POOL_MAX_PER_THREAD 100
+
 // for profiling
 //#define TIMING
 
 class MlOptimiser;
 
+/* Estimated memory use (in Gb) of one process during an iteration */
+struct MlMemoryEstimate
+{
+	RFLOAT references;     // the projectors of all classes and bodies
+	RFLOAT backprojectors; // the weighted sums of all classes and bodies
+	RFLOAT preread_images; // the particles read into memory with --preread_images
+	RFLOAT per_particle;   // every particle in the pool (its image)
+	RFLOAT per_thread;     // every particle that is being aligned (weights and shifted images)
+	RFLOAT rest;           // everything else (e.g. the AB-matrices for on-the-fly shifts)
+	RFLOAT maximization;   // the extra arrays of one reconstruction in the maximization step
+
+	RFLOAT expectation(int nr_pool, int nr_threads) const
+	{
+		return references + backprojectors + preread_images + nr_pool * per_particle + nr_threads * per_thread + rest;
+	}
+};
+
 class MlOptimiser
 {
 public:
@@ -351,6 +371,18 @@ public:
 	// Number of particles to be processed simultaneously
 	int nr_pool;
 
+	// Choose nr_pool (and for the standard CPU code, if needed, fewer threads) from the memory estimate
+	bool do_auto_pool;
+
+	// Memory (in Gb) that this process may use with do_auto_pool (<= 0: its share of what is available on the node)
+	RFLOAT max_memory_Gb;
+
+	// Number of processes that share the memory of this node (set by MlOptimiserMpi)
+	int nr_ranks_on_node;
+
+	// Number of processes that divide the particles among them (set by MlOptimiserMpi)
+	int nr_followers;
+
 	//////////////// Gradient optimisation
 	// If current refinement is gradient based
 	bool gradient_refine;
@@ -476,6 +508,9 @@ public:
 	// Use alternate cpu implementation
 	bool do_cpu;
 
+	// Store the Fourier-space references only inside r_max during the expectation step (CPU only)
+	bool do_compact_refs;
+
 	// Which GPU devices to use?
 	std::string gpu_ids;
 
@@ -782,6 +817,10 @@ public:
             has_large_incr_size_iter_ago(0),
             nr_iter_wo_resol_gain(0),
             nr_pool(0),
+            do_auto_pool(0),
+            max_memory_Gb(0),
+            nr_ranks_on_node(1),
+            nr_followers(1),
             refs_are_ctf_corrected(0),
             has_high_fsc_at_limit(0),
             do_acc_currentsize_despite_highres_exp(0),
@@ -916,6 +955,7 @@ public:
             grad_suspended_finer_sampling_iter(-1),
             grad_pseudo_halfsets(false),
             skip_realspace_helical_sym(false),
+            do_compact_refs(false),
 #ifdef ALTCPU
 		mdlClassComplex(NULL),
 #endif
@@ -1015,6 +1055,12 @@ public:
 	/* Check whether everything fits into memory, possibly adjust nr_pool and setup thread task managers */
 	void expectationSetupCheckMemory(int myverb = 1);
 
+	/* Estimate the memory use of this process for the current sampling and image sizes */
+	MlMemoryEstimate estimateMemory(std::vector<int> &pointer_dir_nonzeroprior, std::vector<int> &pointer_psi_nonzeroprior);
+
+	/* Set x_pool, nr_pool and (for the standard CPU code) nr_threads for do_auto_pool */
+	void planMemory(const MlMemoryEstimate &mem, int myverb);
+
 	/* Perform the expectation integration over all k, phi and series elements for a number (some) of pooled particles
 	 * The number of pooled particles is determined by max_nr_pool and some memory checks in expectationSetup()
 	 */
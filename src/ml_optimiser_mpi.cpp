@@ -35,6 +35,7 @@
 #endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <climits>
 
 //#define PRINT_GPU_MEM_INFO
 //#define DEBUG
@@ -104,6 +105,15 @@ void MlOptimiserMpi::initialise()
 	// Print information about MPI nodes:
 	printMpiNodesMachineNames(*node, nr_threads);
 
+	// How many processes share the memory of each node (for --auto_pool)
+	{
+		MPI_Comm nodeComm;
+		MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &nodeComm);
+		MPI_Comm_size(nodeComm, &nr_ranks_on_node);
+		MPI_Comm_free(&nodeComm);
+	}
+	nr_followers = XMIPP_MAX(1, node->size - 1);
+
 	if (gradient_refine && !do_split_random_halves) {
 		if (node->isLeader())
 			REPORT_ERROR("Gradient refinement is not supported together with MPI. \nPlease rerun with Number of MPI processes: 1");
@@ -1141,9 +1151,42 @@ void MlOptimiserMpi::expectation()
 		int myverb = (node->rank == first_follower) ? 1 : 0;
 		MlOptimiser::expectationSetupCheckMemory(myverb);
 
+		// Only keep the Fourier components of the references inside r_max (not for the GPU code)
+		if (do_compact_refs && !do_gpu && !do_sycl)
+		{
+			for (int iclass = 0; iclass < mymodel.PPref.size(); iclass++)
+				mymodel.PPref[iclass].compactData();
+
+			// Without the accelerated CPU kernels, 2D images are backprojected straight into compact arrays
+			if (!do_cpu && mymodel.ref_dim == 3 && mymodel.data_dim == 2)
+			{
+				for (int iclass = 0; iclass < wsum_model.BPref.size(); iclass++)
+					wsum_model.BPref[iclass].compactDataAndWeight();
+			}
+		}
+
 	}
 	// Follower 1 sends has_converged to everyone else (in particular the leader needs it!)
 	node->relion_MPI_Bcast(&has_converged, 1, MPI_INT, first_follower, MPI_COMM_WORLD);
+	// With --auto_pool, every follower has made its own plan: everyone uses the smallest one,
+	// so that it fits on every node (the leader hands out jobs of nr_pool particles)
+	if (do_auto_pool)
+	{
+		int my_plan[2], plan[2];
+		my_plan[0] = (node->isLeader()) ? INT_MAX : x_pool;
+		my_plan[1] = (node->isLeader()) ? INT_MAX : nr_threads;
+		MPI_Allreduce(my_plan, plan, 2, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+		if (node->rank == first_follower && (plan[0] != x_pool || plan[1] != nr_threads))
+			std::cout << " Memory planner: all followers pool " << plan[0] << " particles per thread with "
+			          << plan[1] << " threads, to fit on every node" << std::endl;
+		x_pool = plan[0];
+		nr_pool = x_pool * plan[1];
+		if (plan[1] != nr_threads)
+		{
+			nr_threads = plan[1];
+			setThreadBudget(nr_threads);
+		}
+	}
 	node->relion_MPI_Bcast(&do_join_random_halves, 1, MPI_INT, first_follower, MPI_COMM_WORLD);
 #ifdef TIMING
 	timer.toc(TIMING_EXP_3);
@@ -1299,6 +1342,23 @@ void MlOptimiserMpi::expectation()
 		// Set up XFLOAT complex array shared by all threads for each class
 		for (int iclass = 0; iclass < nr_classes; iclass++)
 		{
+			if (mymodel.PPref[iclass].hasCompactData())
+			{
+				// Keep the same compact layout: the CpuKernels read it through the row offsets of PPref
+				const std::vector<Complex> &values = mymodel.PPref[iclass].compact_data.values;
+				try
+				{
+					mdlClassComplex[iclass] = new std::complex<XFLOAT>[values.size()];
+				}
+				catch (std::bad_alloc& ba)
+				{
+					CRITICAL(RAMERR);
+				}
+				for (size_t i = 0; i < values.size(); i ++)
+					mdlClassComplex[iclass][i] = std::complex<XFLOAT>((XFLOAT) values[i].real, (XFLOAT) values[i].imag);
+				continue;
+			}
+
 			int mdlX = mymodel.PPref[iclass].data.xdim;
 			int mdlY = mymodel.PPref[iclass].data.ydim;
 			int mdlZ = mymodel.PPref[iclass].data.zdim;
@@ -1909,10 +1969,13 @@ void MlOptimiserMpi::expectation()
 	MPI_Barrier(MPI_COMM_WORLD);
 
 	// All followers reset the size of their projector to zero to save memory
+	// and go back to the full arrays of the weighted sums, which are combined over MPI
 	if (!node->isLeader())
 	{
 		for (int iclass = 0; iclass < mymodel.nr_classes; iclass++)
 			mymodel.PPref[iclass].initialiseData(0);
+		for (int iclass = 0; iclass < wsum_model.BPref.size(); iclass++)
+			wsum_model.BPref[iclass].expandDataAndWeight();
 	}
 
 
@@ -20,6 +20,7 @@
 #include <omp.h>
 
 #include "src/motioncorr_runner.h"
+#include "src/parallel.h"
 #ifdef _CUDA_ENABLED
 #include "src/acc/cuda/cuda_mem_utils.h"
 #elif _HIP_ENABLED
@@ -32,6 +33,7 @@
 #include <src/jaz/single_particle/new_ft.h>
 #include "src/funcs.h"
 #include "src/renderEER.h"
+#include <set>
 
 //#define TIMING
 #ifdef TIMING
@@ -84,6 +86,7 @@ void MotioncorrRunner::read(int argc, char **argv, int rank)
 	fn_out = parser.getOption("--o", "Name for the output directory", "MotionCorr");
 	do_skip_logfile = parser.checkOption("--skip_logfile", "Skip generation of tracks-part of the logfile.pdf");
 	n_threads = textToInteger(parser.getOption("--j", "Number of threads per movie (= process)", "1"));
+	setThreadBudget(n_threads);
 	max_io_threads = textToInteger(parser.getOption("--max_io_threads", "Limit the number of IO threads.", "-1"));
 	continue_old = parser.checkOption("--only_do_unfinished", "Only run motion correction for those micrographs for which there is not yet an output micrograph.");
 	do_at_most = textToInteger(parser.getOption("--do_at_most", "Only process at most this number of (unprocessed) micrographs.", "-1"));
@@ -126,6 +129,9 @@ void MotioncorrRunner::read(int argc, char **argv, int rank)
 	skip_defect = parser.checkOption("--skip_defect", "Skip hot pixel detection");
 	save_noDW = parser.checkOption("--save_noDW", "Save aligned but non dose weighted micrograph");
 	max_iter = textToInteger(parser.getOption("--max_iter", "Maximum number of iterations for alignment. Only valid with --use_own", "5"));
+	prefetch_movies = textToInteger(parser.getOption("--prefetch_movies", "Read this number of movies ahead (and write micrographs in the background) while aligning the current movie. This overlaps disk I/O with the alignment, but needs memory for the additional movies. Only valid with --use_own", "0"));
+	if (prefetch_movies > 0 && !do_own)
+		REPORT_ERROR("--prefetch_movies is valid only with --use_own");
 	if (max_iter != 5 && !do_own)
 		REPORT_ERROR("--max_iter is valid only with --do_own");
 	interpolate_shifts = parser.checkOption("--interpolate_shifts", "(EXPERIMENTAL) Interpolate shifts");
@@ -333,30 +339,18 @@ void MotioncorrRunner::initialise()
 
 	bool warned = false;
 
+	// Micrographs in the ledger were finished in an earlier run: their values are used when joining the results
+	if (continue_old)
+		ledger.read(fn_out + "processing_ledger.txt", getLedgerSignature());
+
 	for (long int imic = 0; imic < fn_mic_given_all.size(); imic++)
 	{
 		bool ignore_this = false;
 		bool process_this = true;
 
-		if (continue_old)
+		if (continue_old && isFinished(fn_mic_given_all[imic]))
 		{
-			if (even_odd_split)
-			{
-				FileName fn_avg = getOutputFileNames(fn_mic_given_all[imic],true);
-				if (exists(fn_avg))
-				{
-			    		process_this = false; // already done
-				}
-			}
-			else
-			{
-				FileName fn_avg = getOutputFileNames(fn_mic_given_all[imic]);
-				if (exists(fn_avg) && exists(fn_avg.withoutExtension() + ".star") &&
-                            (grouping_for_ps <= 0 || exists(fn_avg.withoutExtension() + "_PS.mrc")))
-				{
-					process_this = false; // already done
-				}
-			}
+			process_this = false; // already done
 		}
 
 		if (do_at_most >= 0 && fn_micrographs.size() >= do_at_most)
@@ -417,6 +411,28 @@ void MotioncorrRunner::initialise()
 
 }
 
+bool MotioncorrRunner::isFinished(FileName fn_mic)
+{
+	if (even_odd_split)
+	{
+		return exists(getOutputFileNames(fn_mic, true));
+	}
+	else
+	{
+		FileName fn_avg = getOutputFileNames(fn_mic);
+		return exists(fn_avg) && exists(fn_avg.withoutExtension() + ".star") &&
+		       (grouping_for_ps <= 0 || exists(fn_avg.withoutExtension() + "_PS.mrc"));
+	}
+}
+
+std::string MotioncorrRunner::getLedgerSignature()
+{
+	std::ostringstream sstr;
+	sstr << "motioncorr " << bin_factor << " " << dose_motionstats_cutoff << " " << grouping_for_ps
+	     << " " << even_odd_split << " " << is_tomo;
+	return sstr.str();
+}
+
 void MotioncorrRunner::prepareGainReference(bool write_gain)
 {
 	if (fn_gain_reference == "") return;
@@ -503,6 +519,9 @@ void MotioncorrRunner::run()
 		barstep = XMIPP_MAX(1, fn_micrographs.size() / 60);
 	}
 
+	if (do_own && prefetch_movies > 0)
+		startMovieReader(0, fn_micrographs.size() - 1);
+
 	for (long int imic = 0; imic < fn_micrographs.size(); imic++)
 	{
 		if (verb > 0 && imic % barstep == 0)
@@ -510,7 +529,11 @@ void MotioncorrRunner::run()
 
 		// Abort through the pipeline_control system
 		if (pipeline_control_check_abort_job())
+		{
+			// Do not leave a micrograph half-written
+			stopMovieReaderAndWriter();
 			exit(RELION_EXIT_ABORTED);
+		}
 
 		Micrograph mic(fn_micrographs[imic], fn_gain_reference, bin_factor, eer_upsampling, eer_grouping);
 
@@ -535,6 +558,8 @@ void MotioncorrRunner::run()
 		}
 	}
 
+	stopMovieReaderAndWriter();
+
 	if (verb > 0)
 		progress_bar(fn_micrographs.size());
 
@@ -890,11 +915,20 @@ void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
 	MDavg.clear();
 	MDmov.clear();
 
+	// Without --only_do_unfinished, all micrographs have just been (re-)processed
+	if (!continue_old)
+		ledger.reset(fn_out + "processing_ledger.txt", getLedgerSignature());
+
+	// Ledger entries of micrographs that were (re-)processed in this run are out of date
+	std::set<FileName> fn_processed(fn_micrographs.begin(), fn_micrographs.end());
+
 	for (long int imic = 0; imic < fn_ori_micrographs.size(); imic++)
 	{
 		// For output STAR file
 		FileName fn_avg = getOutputFileNames(fn_ori_micrographs[imic]);
-		if (exists(fn_avg))
+		const bool is_in_ledger = ledger.contains(fn_ori_micrographs[imic]) && fn_processed.count(fn_ori_micrographs[imic]) == 0
+		                          && isFinished(fn_ori_micrographs[imic]);
+		if (is_in_ledger || exists(fn_avg))
 		{
 			MDavg.addObject();
 			if (do_dose_weighting && save_noDW)
@@ -922,7 +956,18 @@ void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
 			MDavg.setValue(EMDL_MICROGRAPH_METADATA_NAME, fn_avg.withoutExtension() + ".star");
 			MDavg.setValue(EMDL_IMAGE_OPTICS_GROUP, optics_group_ori_micrographs[imic]);
 			FileName fn_star = fn_avg.withoutExtension() + ".star";
-			if (exists(fn_star))
+			if (is_in_ledger)
+			{
+				// The accumulated motions were stored when this micrograph was first seen
+				const std::vector<std::string> &values = ledger.getValues(fn_ori_micrographs[imic]);
+				if (values.size() == 3)
+				{
+					MDavg.setValue(EMDL_MICROGRAPH_ACCUM_MOTION_TOTAL, (RFLOAT)textToDouble(values[0]));
+					MDavg.setValue(EMDL_MICROGRAPH_ACCUM_MOTION_EARLY, (RFLOAT)textToDouble(values[1]));
+					MDavg.setValue(EMDL_MICROGRAPH_ACCUM_MOTION_LATE, (RFLOAT)textToDouble(values[2]));
+				}
+			}
+			else if (exists(fn_star))
 			{
 				Micrograph mic(fn_star);
 				RFLOAT cutoff_frame = (dose_motionstats_cutoff - mic.pre_exposure) / mic.dose_per_frame;
@@ -956,6 +1001,21 @@ void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
 				MDavg.setValue(EMDL_MICROGRAPH_ACCUM_MOTION_LATE, sum_late);
 			}
 
+			if (!is_in_ledger && isFinished(fn_ori_micrographs[imic]))
+			{
+				std::vector<std::string> values;
+				if (MDavg.containsLabel(EMDL_MICROGRAPH_ACCUM_MOTION_TOTAL))
+				{
+					RFLOAT sum;
+					MDavg.getValue(EMDL_MICROGRAPH_ACCUM_MOTION_TOTAL, sum);
+					values.push_back(ProcessingLedger::numberToString(sum));
+					MDavg.getValue(EMDL_MICROGRAPH_ACCUM_MOTION_EARLY, sum);
+					values.push_back(ProcessingLedger::numberToString(sum));
+					MDavg.getValue(EMDL_MICROGRAPH_ACCUM_MOTION_LATE, sum);
+					values.push_back(ProcessingLedger::numberToString(sum));
+				}
+				ledger.add(fn_ori_micrographs[imic], values);
+			}
 		}
 
 		if (verb > 0 && imic % 60 == 0) progress_bar(imic);
@@ -991,7 +1051,10 @@ void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
             my_angpix *= bin_factor;
             obsModel.opticsMdt.setValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpix);
     	}
-        obsModel.save(MDavg, fn_out + "corrected_micrographs.star", "micrographs");
+        // If only micrographs were added since the last run, this only appends them to the file
+        std::ostringstream sstr;
+        obsModel.write(sstr, MDavg, "micrographs");
+        ledger.writeFile(fn_out + "corrected_micrographs.star", sstr.str());
         if (verb > 0) std::cout << " Written: " << fn_out << "corrected_micrographs.star" << std::endl;
     }
 
@@ -1076,15 +1139,150 @@ void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
 	}
 }
 
-bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
-	FileName fn_mic = mic.getMovieFilename();
-	FileName fn_avg = getOutputFileNames(fn_mic);
-	FileName fn_avg_noDW = fn_avg.withoutExtension() + "_noDW.mrc";
-	FileName fn_log = fn_avg.withoutExtension() + ".log";
-	FileName fn_ps = fn_avg.withoutExtension() + "_PS.mrc";
-	std::ofstream logfile;
-	logfile.open(fn_log);
+MotioncorrRunner::~MotioncorrRunner()
+{
+	// Do not leave any threads behind (e.g. when an error was thrown)
+	{
+		std::lock_guard<std::mutex> lock(movie_mutex);
+		stop_reading = true;
+	}
+	movie_cond.notify_all();
+	if (movie_reader.joinable())
+		movie_reader.join();
+	if (image_writer.joinable())
+		image_writer.join();
+}
+
+void MotioncorrRunner::startMovieReader(long int first, long int last)
+{
+	stopMovieReaderAndWriter();
+
+	stop_reading = false;
+	movie_reader = std::thread(&MotioncorrRunner::readMoviesInBackground, this, first, last);
+}
+
+void MotioncorrRunner::stopMovieReaderAndWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(movie_mutex);
+		stop_reading = true;
+	}
+	movie_cond.notify_all();
+
+	if (movie_reader.joinable())
+		movie_reader.join();
+	prefetched_movies.clear();
+
+	waitForOutputImages();
+}
+
+void MotioncorrRunner::readMoviesInBackground(long int first, long int last)
+{
+	for (long int imic = first; imic <= last; imic++)
+	{
+		// Keep at most prefetch_movies movies in memory on top of the one that is being aligned
+		{
+			std::unique_lock<std::mutex> lock(movie_mutex);
+			movie_cond.wait(lock, [this]{ return stop_reading || prefetched_movies.size() < (size_t)prefetch_movies; });
+			if (stop_reading) return;
+		}
+
+		MotioncorrMovie movie;
+		try
+		{
+			readOwnMovie(fn_micrographs[imic], movie);
+		}
+		catch (...)
+		{
+			// Hand the error over to the main thread
+			movie.fn_mic = fn_micrographs[imic];
+			movie.error = std::current_exception();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(movie_mutex);
+			prefetched_movies.push_back(std::move(movie));
+		}
+		movie_cond.notify_all();
+	}
+}
+
+void MotioncorrRunner::getOwnMovie(FileName fn_mic, MotioncorrMovie &movie)
+{
+	if (!movie_reader.joinable())
+	{
+		readOwnMovie(fn_mic, movie);
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(movie_mutex);
+		movie_cond.wait(lock, [this]{ return !prefetched_movies.empty(); });
+		movie = std::move(prefetched_movies.front());
+		prefetched_movies.pop_front();
+	}
+	movie_cond.notify_all();
+
+	if (movie.error)
+		std::rethrow_exception(movie.error);
+	if (movie.fn_mic != fn_mic)
+		REPORT_ERROR("BUG: MotioncorrRunner::getOwnMovie: expected " + fn_mic + " but the background reader read " + movie.fn_mic);
+}
+
+void MotioncorrRunner::writeOutputImages(std::vector<FileName> &fn_images, std::vector<Image<float> > &images)
+{
+	// Only one micrograph is written at a time
+	waitForOutputImages();
 
+	if (prefetch_movies <= 0)
+	{
+		for (int i = 0; i < images.size(); i++)
+			images[i].write(fn_images[i], -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+		return;
+	}
+
+	fn_pending_images.swap(fn_images);
+	pending_images.swap(images);
+	image_writer = std::thread([this]
+	{
+		try
+		{
+			// saveModel() writes the STAR file of the micrograph while this is running:
+			// only give the images their final names once they are complete, so that
+			// isFinished() never sees a half-written micrograph (e.g. after an abort or a crash)
+			for (int i = 0; i < pending_images.size(); i++)
+			{
+				FileName fn_tmp = fn_pending_images[i].insertBeforeExtension(".tmp");
+				pending_images[i].write(fn_tmp, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+				if (std::rename(fn_tmp.c_str(), fn_pending_images[i].c_str()))
+					REPORT_ERROR("ERROR: cannot rename " + fn_tmp + " to " + fn_pending_images[i] + ": " + std::strerror(errno));
+			}
+		}
+		catch (...)
+		{
+			write_error = std::current_exception();
+		}
+	});
+}
+
+void MotioncorrRunner::waitForOutputImages()
+{
+	if (image_writer.joinable())
+		image_writer.join();
+
+	fn_pending_images.clear();
+	pending_images.clear();
+
+	if (write_error)
+	{
+		std::exception_ptr error = write_error;
+		write_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void MotioncorrRunner::readOwnMovie(FileName fn_mic, MotioncorrMovie &movie)
+{
 	// EER and compressed MRC related things
 	// TODO: will be refactored
 	EERRenderer renderer;
@@ -1093,27 +1291,14 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	const bool isCompressedMRC = compressedMRCreader.isCompressedMRC(fn_mic);
 
 	int n_io_threads = n_threads;
-	logfile << "Working on " << fn_mic << " with " << n_threads << " thread(s)." << std::endl << std::endl;
 	if (max_io_threads > 0 && n_io_threads > max_io_threads)
-	{
 		n_io_threads = max_io_threads;
-		logfile << "Limitted the number of IO threads per movie to " << n_io_threads << " thread(s)." << std::endl;
-	}
 
-	Image<float> Ihead, Igain, Iref, Iref_odd, Iref_even;
-	std::vector<MultidimArray<fComplex> > Fframes;
-	std::vector<Image<float> > Iframes;
-	std::vector<Image<float> > Irefframes;
-	std::vector<int> frames; // 0-indexed
-
-	RFLOAT output_angpix = angpix * bin_factor;
-	RFLOAT prescaling = 1;
-
-	const int hotpixel_sigma = 6;
-	const int fit_rmsd_threshold = 10; // px
-	int nx, ny, nn;
+	movie.fn_mic = fn_mic;
+	movie.is_EER = isEER;
 
 	// Check image size
+	int nx, ny, nn;
 	if (isEER)
 	{
 		renderer.read(fn_mic, eer_upsampling);
@@ -1128,25 +1313,122 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	}
 	else
 	{
+		Image<float> Ihead;
 		Ihead.read(fn_mic, false, -1, false, true); // select_img -1, mmap false, is_2D true
 		nx = XSIZE(Ihead()); ny = YSIZE(Ihead()); nn = NSIZE(Ihead());
 	}
+	movie.nx = nx; movie.ny = ny; movie.nn = nn;
 
 	// Which frame to use?
-	logfile << "Movie size: X = " << nx << " Y = " << ny << " N = " << nn << std::endl;
-	logfile << "Frames to be used:";
+	movie.frames.clear();
 	for (int i = 0; i < nn; i++) {
 		// For users, all numbers are 1-indexed. Internally they are 0-indexed.
 		int frame = i + 1;
 		if (frame < first_frame_sum) continue;
 		if (last_frame_sum > 0 && frame > last_frame_sum) continue;
-		frames.push_back(i);
-		logfile << " " << frame;
+		movie.frames.push_back(i);
+	}
+
+	// Don't bother reading movies that will be skipped
+	const int n_frames = movie.frames.size();
+	movie.Iframes.clear();
+	if (n_frames / group < 3)
+		return;
+
+	// Read gain reference
+	RCTIC(TIMING_READ_GAIN);
+	if (fn_gain_reference != "") {
+		std::lock_guard<std::mutex> lock(gain_mutex);
+
+		if (!have_gain)
+		{
+			if (isEER)
+				renderer.loadEERGain(fn_gain_reference, Igain());
+			else
+				Igain.read(fn_gain_reference);
+			have_gain = true;
+		}
+
+		if (XSIZE(Igain()) != nx || YSIZE(Igain()) != ny) {
+			std::cerr << "fn_mic: " << fn_mic << " nx = " << nx << " ny = " << ny << " gain nx = " << XSIZE(Igain()) << " gain ny = " << YSIZE(Igain()) <<  std::endl;
+			REPORT_ERROR("The size of the image and the size of the gain reference do not match. Make sure the gain reference has been rotated if necessary.");
+		}
 	}
+	RCTOC(TIMING_READ_GAIN);
+
+	// Read images
+	RCTIC(TIMING_READ_MOVIE);
+	movie.Iframes.resize(n_frames);
+	#pragma omp parallel for num_threads(isCompressedMRC ? 1 : n_io_threads)
+	for (int iframe = 0; iframe < n_frames; iframe++) {
+		if (isEER)
+			renderer.renderFrames(movie.frames[iframe] * eer_grouping + 1, (movie.frames[iframe] + 1) * eer_grouping, movie.Iframes[iframe]());
+		else if (isCompressedMRC)
+			compressedMRCreader.readFrameInto(movie.Iframes[iframe], movie.frames[iframe]);
+		else
+			movie.Iframes[iframe].read(fn_mic, true, movie.frames[iframe], false, true); // mmap false, is_2D true
+	}
+	RCTOC(TIMING_READ_MOVIE);
+
+	// Apply gain
+	RCTIC(TIMING_APPLY_GAIN);
+	if (fn_gain_reference != "") {
+		#pragma omp parallel for num_threads(n_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain()) {
+				DIRECT_MULTIDIM_ELEM(movie.Iframes[iframe](), n) *= DIRECT_MULTIDIM_ELEM(Igain(), n);
+			}
+		}
+	}
+	RCTOC(TIMING_APPLY_GAIN);
+}
+
+bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
+	FileName fn_mic = mic.getMovieFilename();
+	FileName fn_avg = getOutputFileNames(fn_mic);
+	FileName fn_avg_noDW = fn_avg.withoutExtension() + "_noDW.mrc";
+	FileName fn_log = fn_avg.withoutExtension() + ".log";
+	FileName fn_ps = fn_avg.withoutExtension() + "_PS.mrc";
+	std::ofstream logfile;
+	logfile.open(fn_log);
+
+	logfile << "Working on " << fn_mic << " with " << n_threads << " thread(s)." << std::endl << std::endl;
+	if (max_io_threads > 0 && n_threads > max_io_threads)
+	{
+		logfile << "Limitted the number of IO threads per movie to " << max_io_threads << " thread(s)." << std::endl;
+	}
+
+	// Read the movie and apply the gain reference (or get it from the background reader)
+	MotioncorrMovie movie;
+	getOwnMovie(fn_mic, movie);
+
+	const bool isEER = movie.is_EER;
+	std::vector<int> &frames = movie.frames; // 0-indexed
+	std::vector<Image<float> > &Iframes = movie.Iframes;
+
+	Image<float> Iref, Iref_odd, Iref_even;
+	std::vector<MultidimArray<fComplex> > Fframes;
+	std::vector<Image<float> > Irefframes;
+
+	// Output micrographs, written at the end
+	std::vector<FileName> fn_outputs;
+	std::vector<Image<float> > Ioutputs;
+
+	RFLOAT output_angpix = angpix * bin_factor;
+	RFLOAT prescaling = 1;
+
+	const int hotpixel_sigma = 6;
+	const int fit_rmsd_threshold = 10; // px
+	int nx = movie.nx, ny = movie.ny, nn = movie.nn;
+
+	// Which frame to use?
+	logfile << "Movie size: X = " << nx << " Y = " << ny << " N = " << nn << std::endl;
+	logfile << "Frames to be used:";
+	for (int i = 0; i < frames.size(); i++)
+		logfile << " " << frames[i] + 1;
 	logfile << std::endl;
 
 	const int n_frames = frames.size();
-	Iframes.resize(n_frames);
 	Irefframes.resize(n_frames);
 	Fframes.resize(n_frames);
 
@@ -1188,46 +1470,6 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	logfile << "interpolate_shifts = " << interpolate_shifts << std::endl;
 	logfile << std::endl;
 
-	// Read gain reference
-	RCTIC(TIMING_READ_GAIN);
-	if (fn_gain_reference != "") {
-		if (isEER)
-			renderer.loadEERGain(fn_gain_reference, Igain());
-		else
-			Igain.read(fn_gain_reference);
-
-		if (XSIZE(Igain()) != nx || YSIZE(Igain()) != ny) {
-			std::cerr << "fn_mic: " << fn_mic << " nx = " << nx << " ny = " << ny << " gain nx = " << XSIZE(Igain()) << " gain ny = " << YSIZE(Igain()) <<  std::endl;
-			REPORT_ERROR("The size of the image and the size of the gain reference do not match. Make sure the gain reference has been rotated if necessary.");
-		}
-	}
-	RCTOC(TIMING_READ_GAIN);
-
-	// Read images
-	RCTIC(TIMING_READ_MOVIE);
-	#pragma omp parallel for num_threads(isCompressedMRC ? 1 : n_io_threads)
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		if (isEER)
-			renderer.renderFrames(frames[iframe] * eer_grouping + 1, (frames[iframe] + 1) * eer_grouping, Iframes[iframe]());
-		else if (isCompressedMRC)
-			compressedMRCreader.readFrameInto(Iframes[iframe], frames[iframe]);
-		else
-			Iframes[iframe].read(fn_mic, true, frames[iframe], false, true); // mmap false, is_2D true
-	}
-	RCTOC(TIMING_READ_MOVIE);
-
-	// Apply gain
-	RCTIC(TIMING_APPLY_GAIN);
-	if (fn_gain_reference != "") {
-		#pragma omp parallel for num_threads(n_threads)
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain()) {
-				DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n) *= DIRECT_MULTIDIM_ELEM(Igain(), n);
-			}
-		}
-	}
-	RCTOC(TIMING_APPLY_GAIN);
-
 	MultidimArray<float> Isum(ny, nx);
 	Isum.initZeros();
 	// First sum unaligned frames
@@ -1512,11 +1754,12 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	if (do_local) {
 		const int patch_nx = nx / patch_x, patch_ny = ny / patch_y, n_patches = patch_x * patch_y;
 		std::vector<RFLOAT> patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys;
-		std::vector<MultidimArray<fComplex> > Fpatches(n_groups);
+		std::vector<int> x_starts(n_patches), x_ends(n_patches), y_starts(n_patches), y_ends(n_patches);
+		std::vector<int> pnxs(n_patches), pnys(n_patches);
+		std::vector<std::string> patch_headers(n_patches);
 
-		int ipatch = 1;
-		for (int iy = 0; iy < patch_y; iy++) {
-			for (int ix = 0; ix < patch_x; ix++) {
+		for (int iy = 0, ipatch = 0; iy < patch_y; iy++) {
+			for (int ix = 0; ix < patch_x; ix++, ipatch++) {
 				int x_start = ix * patch_nx, y_start = iy * patch_ny; // Inclusive
 				int x_end = x_start + patch_nx, y_end = y_start + patch_ny; // Exclusive
 				if (x_end > nx) x_end = nx;
@@ -1531,65 +1774,92 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 					else y_end--;
 				}
 
+				x_starts[ipatch] = x_start; x_ends[ipatch] = x_end;
+				y_starts[ipatch] = y_start; y_ends[ipatch] = y_end;
+				pnxs[ipatch] = x_end - x_start; pnys[ipatch] = y_end - y_start;
+
 				int x_center = (x_start + x_end - 1) / 2, y_center = (y_start + y_end - 1) / 2;
-				logfile << "Patch (" << iy + 1 << ", " << ix + 1 << "): " << ipatch << " / " << patch_x * patch_y;
-				logfile << ", X range = [" << x_start << ", " << x_end << "), Y range = [" << y_start << ", " << y_end << ")";
-				logfile << ", Center = (" << x_center << ", " << y_center << ")" << std::endl;
-				ipatch++;
-
-				std::vector<RFLOAT> local_xshifts(n_groups), local_yshifts(n_groups);
-				RCTIC(TIMING_PREP_PATCH);
-				std::vector<MultidimArray<float> >Ipatches(n_threads);
-				#pragma omp parallel for num_threads(n_threads)
-				for (int igroup = 0; igroup < n_groups; igroup++) {
-					const int tid = omp_get_thread_num();
-					Ipatches[tid].reshape(y_end - y_start, x_end - x_start); // end is not included
-					RCTIC(TIMING_CLIP_PATCH);
-					for (int iframe = group_start[igroup]; iframe < group_start[igroup] + group_size[igroup]; iframe++) {
-						for (int ipy = y_start; ipy < y_end; ipy++) {
-							for (int ipx = x_start; ipx < x_end; ipx++) {
-								DIRECT_A2D_ELEM(Ipatches[tid], ipy - y_start, ipx - x_start) = DIRECT_A2D_ELEM(Iframes[iframe](), ipy, ipx);
-							}
-						}
-					}
-					RCTOC(TIMING_CLIP_PATCH);
+				std::ostringstream header;
+				header << "Patch (" << iy + 1 << ", " << ix + 1 << "): " << ipatch + 1 << " / " << patch_x * patch_y;
+				header << ", X range = [" << x_start << ", " << x_end << "), Y range = [" << y_start << ", " << y_end << ")";
+				header << ", Center = (" << x_center << ", " << y_center << ")" << std::endl;
+				patch_headers[ipatch] = header.str();
+			}
+		}
+
+		// Cut out and Fourier transform all patches of all frame groups in one go
+		RCTIC(TIMING_PREP_PATCH);
+		std::vector<std::vector<MultidimArray<fComplex> > > Fpatches(n_patches, std::vector<MultidimArray<fComplex> >(n_groups));
+		std::map<std::pair<int, int>, NewFFT::FloatPlan> patch_plans;
+		for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+			std::pair<int, int> patch_size(pnxs[ipatch], pnys[ipatch]);
+			if (patch_plans.find(patch_size) == patch_plans.end())
+				patch_plans.insert(std::make_pair(patch_size, NewFFT::FloatPlan(pnxs[ipatch], pnys[ipatch])));
+		}
 
-					RCTIC(TIMING_PATCH_FFT);
-					NewFFT::FourierTransform(Ipatches[tid], Fpatches[igroup]);
-					RCTOC(TIMING_PATCH_FFT);
+		std::vector<MultidimArray<float> > Ipatches(n_threads);
+		#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+		for (int ijob = 0; ijob < n_patches * n_groups; ijob++) {
+			const int tid = omp_get_thread_num();
+			const int ipatch = ijob / n_groups, igroup = ijob % n_groups;
+			const int x_start = x_starts[ipatch], x_end = x_ends[ipatch];
+			const int y_start = y_starts[ipatch], y_end = y_ends[ipatch];
+
+			Ipatches[tid].reshape(y_end - y_start, x_end - x_start); // end is not included
+			RCTIC(TIMING_CLIP_PATCH);
+			for (int iframe = group_start[igroup]; iframe < group_start[igroup] + group_size[igroup]; iframe++) {
+				for (int ipy = y_start; ipy < y_end; ipy++) {
+					for (int ipx = x_start; ipx < x_end; ipx++) {
+						DIRECT_A2D_ELEM(Ipatches[tid], ipy - y_start, ipx - x_start) = DIRECT_A2D_ELEM(Iframes[iframe](), ipy, ipx);
+					}
 				}
-				RCTOC(TIMING_PREP_PATCH);
+			}
+			RCTOC(TIMING_CLIP_PATCH);
 
-				RCTIC(TIMING_PATCH_ALIGN);
-				bool converged = alignPatch(Fpatches, x_end - x_start, y_end - y_start, bfactor / (prescaling * prescaling), local_xshifts, local_yshifts, logfile);
-				RCTOC(TIMING_PATCH_ALIGN);
-				if (!converged) continue;
+			RCTIC(TIMING_PATCH_FFT);
+			NewFFT::FourierTransform(Ipatches[tid], Fpatches[ipatch][igroup], patch_plans.at(std::make_pair(pnxs[ipatch], pnys[ipatch])));
+			RCTOC(TIMING_PATCH_FFT);
+		}
+		RCTOC(TIMING_PREP_PATCH);
 
-				std::vector<RFLOAT> interpolated_xshifts(n_frames), interpolated_yshifts(n_frames);
-				interpolateShifts(group_start, group_size, local_xshifts, local_yshifts, n_frames, interpolated_xshifts, interpolated_yshifts);
-				if (interpolate_shifts) {
-					// Recenter to the first frame
-					for (int iframe = 0; iframe < n_frames; iframe++) {
-						interpolated_xshifts[iframe] -= interpolated_xshifts[0];
-						interpolated_yshifts[iframe] -= interpolated_yshifts[0];
-					}
-					// Store shifts
-					for (int iframe = 0; iframe < n_frames; iframe++) {
-						patch_xshifts.push_back(interpolated_xshifts[iframe]);
-						patch_yshifts.push_back(interpolated_yshifts[iframe]);
-						patch_frames.push_back(iframe);
-						patch_xs.push_back(x_center);
-						patch_ys.push_back(y_center);
-					}
-				} else { // only recenter to the center
-					for (int igroup = 0; igroup < n_groups; igroup++) {
-						patch_xshifts.push_back(local_xshifts[igroup] - interpolated_xshifts[0]);
-						patch_yshifts.push_back(local_yshifts[igroup] - interpolated_yshifts[0]);
-						RFLOAT middle_frame = group_start[igroup] + group_size[igroup] / 2.0;
-						patch_frames.push_back(middle_frame);
-						patch_xs.push_back(x_center);
-						patch_ys.push_back(y_center);
-					}
+		// Align all patches together
+		RCTIC(TIMING_PATCH_ALIGN);
+		std::vector<std::vector<RFLOAT> > local_xshifts(n_patches, std::vector<RFLOAT>(n_groups)), local_yshifts(n_patches, std::vector<RFLOAT>(n_groups));
+		std::vector<bool> patch_converged;
+		std::vector<std::string> patch_logs;
+		alignPatches(Fpatches, pnxs, pnys, bfactor / (prescaling * prescaling), local_xshifts, local_yshifts, patch_converged, patch_logs);
+		RCTOC(TIMING_PATCH_ALIGN);
+
+		for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+			logfile << patch_headers[ipatch] << patch_logs[ipatch];
+			if (!patch_converged[ipatch]) continue;
+
+			const int x_center = (x_starts[ipatch] + x_ends[ipatch] - 1) / 2, y_center = (y_starts[ipatch] + y_ends[ipatch] - 1) / 2;
+
+			std::vector<RFLOAT> interpolated_xshifts(n_frames), interpolated_yshifts(n_frames);
+			interpolateShifts(group_start, group_size, local_xshifts[ipatch], local_yshifts[ipatch], n_frames, interpolated_xshifts, interpolated_yshifts);
+			if (interpolate_shifts) {
+				// Recenter to the first frame
+				for (int iframe = 0; iframe < n_frames; iframe++) {
+					interpolated_xshifts[iframe] -= interpolated_xshifts[0];
+					interpolated_yshifts[iframe] -= interpolated_yshifts[0];
+				}
+				// Store shifts
+				for (int iframe = 0; iframe < n_frames; iframe++) {
+					patch_xshifts.push_back(interpolated_xshifts[iframe]);
+					patch_yshifts.push_back(interpolated_yshifts[iframe]);
+					patch_frames.push_back(iframe);
+					patch_xs.push_back(x_center);
+					patch_ys.push_back(y_center);
+				}
+			} else { // only recenter to the center
+				for (int igroup = 0; igroup < n_groups; igroup++) {
+					patch_xshifts.push_back(local_xshifts[ipatch][igroup] - interpolated_xshifts[0]);
+					patch_yshifts.push_back(local_yshifts[ipatch][igroup] - interpolated_yshifts[0]);
+					RFLOAT middle_frame = group_start[igroup] + group_size[igroup] / 2.0;
+					patch_frames.push_back(middle_frame);
+					patch_xs.push_back(x_center);
+					patch_ys.push_back(y_center);
 				}
 			}
 		}
@@ -1758,7 +2028,8 @@ skip_fitting:
 
 		// Final output
                 Iref.setSamplingRateInHeader(output_angpix, output_angpix);
-		Iref.write(!do_dose_weighting ? fn_avg : fn_avg_noDW, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+		fn_outputs.push_back(!do_dose_weighting ? fn_avg : fn_avg_noDW);
+		Ioutputs.push_back(Iref);
 		logfile << "Written aligned but non-dose weighted sum to " << (!do_dose_weighting ? fn_avg : fn_avg_noDW) << std::endl;
 		// ODD-EVEN Output
 		if (even_odd_split)
@@ -1766,8 +2037,10 @@ skip_fitting:
 		Iref_odd.setSamplingRateInHeader(output_angpix, output_angpix);
 		Iref_even.setSamplingRateInHeader(output_angpix, output_angpix);
 
-		Iref_odd.write(fn_avg.withoutExtension() + "_ODD.mrc", -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-		Iref_even.write(fn_avg.withoutExtension() + "_EVN.mrc", -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+		fn_outputs.push_back(fn_avg.withoutExtension() + "_ODD.mrc");
+		Ioutputs.push_back(Iref_odd);
+		fn_outputs.push_back(fn_avg.withoutExtension() + "_EVN.mrc");
+		Ioutputs.push_back(Iref_even);
 		logfile << "Written aligned but non-dose weighted sum of odd frames to " << (fn_avg.withoutExtension() + "_ODD.mrc") << std::endl;
 		logfile << "Written aligned but non-dose weighted sum of even frames to " << (fn_avg.withoutExtension() + "_EVN.mrc") << std::endl;
 		}
@@ -1822,13 +2095,20 @@ skip_fitting:
 
 		// Final output
                 Iref.setSamplingRateInHeader(output_angpix, output_angpix);
-		Iref.write(fn_avg, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+		fn_outputs.push_back(fn_avg);
+		Ioutputs.push_back(Iref);
 		logfile << "Written aligned and dose-weighted sum to " << fn_avg << std::endl;
 	}
 
 	// Set the start frame for the local motion model.
 	mic.first_frame = frames[0] + 1; // NOTE that this is 1-indexed.
 
+	// Write the output micrographs (in the background with --prefetch_movies)
+	Iframes.clear();
+	Irefframes.clear();
+	Fframes.clear();
+	writeOutputImages(fn_outputs, Ioutputs);
+
 	return true;
 }
 
@@ -2211,109 +2491,190 @@ void MotioncorrRunner::realSpaceInterpolation_ThirdOrderPolynomial(Image <float>
 }
 
 bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile) {
-	std::vector<Image<float> > Iccs(n_threads);
-	MultidimArray<fComplex> Fref;
-	std::vector<MultidimArray<fComplex> > Fccs(n_threads);
-	MultidimArray<float> weight;
-	std::vector<RFLOAT> cur_xshifts, cur_yshifts;
-	bool converged = false;
+	std::vector<std::vector<MultidimArray<fComplex> > > Fpatches(1);
+	std::vector<std::vector<RFLOAT> > patch_xshifts(1), patch_yshifts(1);
+	std::vector<bool> converged;
+	std::vector<std::string> logs;
+
+	// Swapping avoids copying the frames; they are shifted in place
+	Fpatches[0].swap(Fframes);
+	patch_xshifts[0].swap(xshifts);
+	patch_yshifts[0].swap(yshifts);
+
+	alignPatches(Fpatches, std::vector<int>(1, pnx), std::vector<int>(1, pny), scaled_B, patch_xshifts, patch_yshifts, converged, logs);
+
+	Fpatches[0].swap(Fframes);
+	patch_xshifts[0].swap(xshifts);
+	patch_yshifts[0].swap(yshifts);
+
+	logfile << logs[0];
+
+	return converged[0];
+}
+
+void MotioncorrRunner::alignPatches(std::vector<std::vector<MultidimArray<fComplex> > > &Fpatches, const std::vector<int> &pnxs, const std::vector<int> &pnys,
+                                    const RFLOAT scaled_B, std::vector<std::vector<RFLOAT> > &xshifts, std::vector<std::vector<RFLOAT> > &yshifts,
+                                    std::vector<bool> &converged, std::vector<std::string> &logs) {
+
+	// Everything needed to calculate the cross-correlation functions of one patch
+	struct PatchCCF
+	{
+		int nfx, nfy, nfy_half;
+		int ccf_nx, ccf_ny, ccf_nfx, ccf_nfy, ccf_nfy_half;
+		RFLOAT ccf_scale_x, ccf_scale_y;
+		int search_range;
+		MultidimArray<fComplex> Fref;
+		MultidimArray<float> weight;
+	};
 
 	// Parameters TODO: make an option
-	int search_range = 50; // px
 	const RFLOAT tolerance = 0.5; // px
 	const RFLOAT EPS = 1e-15;
 
-	// Shifts within an iteration
-	const int n_frames = xshifts.size();
-	cur_xshifts.resize(n_frames);
-	cur_yshifts.resize(n_frames);
-
-	if (pny % 2 == 1 || pnx % 2 == 1) {
-		REPORT_ERROR("Patch size must be even");
-	}
-
-	// Calculate the size of down-sampled CCF
-	float ccf_requested_scale = ccf_downsample;
-	if (ccf_downsample <= 0) {
-		ccf_requested_scale = sqrt(-log(1E-8) / (2 * scaled_B)); // exp(-2 B max_dist^2) = 1E-8
-	}
-	int ccf_nx = findGoodSize(int(pnx * ccf_requested_scale)), ccf_ny = findGoodSize(int(pny * ccf_requested_scale));
-	if (ccf_nx > pnx) ccf_nx = pnx;
-	if (ccf_ny > pny) ccf_ny = pny;
-	if (ccf_nx % 2 == 1) ccf_nx++;
-	if (ccf_ny % 2 == 1) ccf_ny++;
-	const int ccf_nfx = ccf_nx / 2 + 1, ccf_nfy = ccf_ny;
-	const int ccf_nfy_half = ccf_ny / 2;
-	const RFLOAT ccf_scale_x = (RFLOAT)pnx / ccf_nx;
-	const RFLOAT ccf_scale_y = (RFLOAT)pny / ccf_ny;
-	search_range /= (ccf_scale_x > ccf_scale_y) ? ccf_scale_x : ccf_scale_y; // account for the increase of pixel size in CCF
-	if (search_range * 2 + 1 > ccf_nx) search_range = ccf_nx / 2 - 1;
-	if (search_range * 2 + 1 > ccf_ny) search_range = ccf_ny / 2 - 1;
+	const int n_patches = Fpatches.size();
+	converged.assign(n_patches, false);
+	logs.assign(n_patches, "");
+	if (n_patches == 0) return;
 
-	const int nfx = XSIZE(Fframes[0]), nfy = YSIZE(Fframes[0]);
-	const int nfy_half = nfy / 2;
+	// All patches have the same number of frames
+	const int n_frames = xshifts[0].size();
 
-	Fref.reshape(ccf_nfy, ccf_nfx);
-	for (int i = 0; i < n_threads; i++) {
-		Iccs[i]().reshape(ccf_ny, ccf_nx);
-		Fccs[i].reshape(Fref);
-	}
+	std::vector<PatchCCF> ccfs(n_patches);
+	std::vector<std::vector<RFLOAT> > cur_xshifts(n_patches, std::vector<RFLOAT>(n_frames)), cur_yshifts(n_patches, std::vector<RFLOAT>(n_frames));
+	std::vector<std::ostringstream> patch_logs(n_patches);
+
+	// One FFTW plan for each size of CCF, shared by all threads.
+	// Creating plans on the fly is serialised inside FFTW, so that does not scale with the number of threads.
+	std::map<std::pair<int, int>, NewFFT::FloatPlan> ccf_plans;
+
+	for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+		PatchCCF &ccf = ccfs[ipatch];
+		const int pnx = pnxs[ipatch], pny = pnys[ipatch];
+
+		if (pny % 2 == 1 || pnx % 2 == 1) {
+			REPORT_ERROR("Patch size must be even");
+		}
+
+		// Calculate the size of down-sampled CCF
+		float ccf_requested_scale = ccf_downsample;
+		if (ccf_downsample <= 0) {
+			ccf_requested_scale = sqrt(-log(1E-8) / (2 * scaled_B)); // exp(-2 B max_dist^2) = 1E-8
+		}
+		ccf.ccf_nx = findGoodSize(int(pnx * ccf_requested_scale));
+		ccf.ccf_ny = findGoodSize(int(pny * ccf_requested_scale));
+		if (ccf.ccf_nx > pnx) ccf.ccf_nx = pnx;
+		if (ccf.ccf_ny > pny) ccf.ccf_ny = pny;
+		if (ccf.ccf_nx % 2 == 1) ccf.ccf_nx++;
+		if (ccf.ccf_ny % 2 == 1) ccf.ccf_ny++;
+		ccf.ccf_nfx = ccf.ccf_nx / 2 + 1;
+		ccf.ccf_nfy = ccf.ccf_ny;
+		ccf.ccf_nfy_half = ccf.ccf_ny / 2;
+		ccf.ccf_scale_x = (RFLOAT)pnx / ccf.ccf_nx;
+		ccf.ccf_scale_y = (RFLOAT)pny / ccf.ccf_ny;
+
+		int search_range = 50; // px
+		search_range /= (ccf.ccf_scale_x > ccf.ccf_scale_y) ? ccf.ccf_scale_x : ccf.ccf_scale_y; // account for the increase of pixel size in CCF
+		if (search_range * 2 + 1 > ccf.ccf_nx) search_range = ccf.ccf_nx / 2 - 1;
+		if (search_range * 2 + 1 > ccf.ccf_ny) search_range = ccf.ccf_ny / 2 - 1;
+		ccf.search_range = search_range;
+
+		ccf.nfx = XSIZE(Fpatches[ipatch][0]);
+		ccf.nfy = YSIZE(Fpatches[ipatch][0]);
+		ccf.nfy_half = ccf.nfy / 2;
+
+		ccf.Fref.reshape(ccf.ccf_nfy, ccf.ccf_nfx);
+
+		std::pair<int, int> ccf_size(ccf.ccf_nx, ccf.ccf_ny);
+		if (ccf_plans.find(ccf_size) == ccf_plans.end())
+			ccf_plans.insert(std::make_pair(ccf_size, NewFFT::FloatPlan(ccf.ccf_nx, ccf.ccf_ny)));
 
 #ifdef DEBUG
-	std::cout << "Patch Size X = " << pnx << " Y  = " << pny << std::endl;
-	std::cout << "Fframes X = " << nfx << " Y = " << nfy << std::endl;
-	std::cout << "Fccf X = " << ccf_nfx << " Y = " << ccf_nfy << std::endl;
-	std::cout << "CCF crop request = " << ccf_requested_scale << ", actual X = " << 1 / ccf_scale_x << " Y = " << 1 / ccf_scale_y << std::endl;
-	std::cout << "CCF search range = " << search_range << std::endl;
-	std::cout << "Trajectory size: " << xshifts.size() << std::endl;
+		std::cout << "Patch Size X = " << pnx << " Y  = " << pny << std::endl;
+		std::cout << "Fframes X = " << ccf.nfx << " Y = " << ccf.nfy << std::endl;
+		std::cout << "Fccf X = " << ccf.ccf_nfx << " Y = " << ccf.ccf_nfy << std::endl;
+		std::cout << "CCF crop request = " << ccf_requested_scale << ", actual X = " << 1 / ccf.ccf_scale_x << " Y = " << 1 / ccf.ccf_scale_y << std::endl;
+		std::cout << "CCF search range = " << ccf.search_range << std::endl;
+		std::cout << "Trajectory size: " << xshifts[ipatch].size() << std::endl;
 #endif
+	}
 
 	// Initialize B factor weight
-	weight.reshape(Fref);
 	RCTIC(TIMING_PREP_WEIGHT);
-	#pragma omp parallel for num_threads(n_threads)
-	for (int y = 0; y < ccf_nfy; y++) {
-		const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy) : y;
-		RFLOAT ly2 = ly * (RFLOAT)ly / (nfy * (RFLOAT)nfy);
-
-		for (int x = 0; x < ccf_nfx; x++) {
-			RFLOAT dist2 = ly2 + x * (RFLOAT)x / (nfx * (RFLOAT)nfx);
-			DIRECT_A2D_ELEM(weight, y, x) = exp(- 2 * dist2 * scaled_B); // 2 for Fref and Fframe
+	#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+	for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+		PatchCCF &ccf = ccfs[ipatch];
+		ccf.weight.reshape(ccf.Fref);
+
+		for (int y = 0; y < ccf.ccf_nfy; y++) {
+			const int ly = (y > ccf.ccf_nfy_half) ? (y - ccf.ccf_nfy) : y;
+			RFLOAT ly2 = ly * (RFLOAT)ly / (ccf.nfy * (RFLOAT)ccf.nfy);
+
+			for (int x = 0; x < ccf.ccf_nfx; x++) {
+				RFLOAT dist2 = ly2 + x * (RFLOAT)x / (ccf.nfx * (RFLOAT)ccf.nfx);
+				DIRECT_A2D_ELEM(ccf.weight, y, x) = exp(- 2 * dist2 * scaled_B); // 2 for Fref and Fframe
+			}
 		}
 	}
 	RCTOC(TIMING_PREP_WEIGHT);
 
-	for (int iter = 1; iter	<= max_iter; iter++) {
-		RCTIC(TIMING_MAKE_REF);
-		Fref.initZeros();
+	// Scratch space for the cross-correlation functions, re-used by each thread for all (patch, frame) pairs
+	std::vector<MultidimArray<fComplex> > Fccs(n_threads);
+	std::vector<MultidimArray<float> > Iccs(n_threads);
 
-		#pragma omp parallel for num_threads(n_threads)
-		for (int y = 0; y < ccf_nfy; y++) {
-			const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy + nfy) : y;
-			for (int x = 0; x < ccf_nfx; x++) {
-				for (int iframe = 0; iframe < n_frames; iframe++) {
-					DIRECT_A2D_ELEM(Fref, y, x) += DIRECT_A2D_ELEM(Fframes[iframe], ly, x);
+	// Patches that have not converged yet, and all their (patch, frame) pairs
+	std::vector<int> active(n_patches);
+	for (int ipatch = 0; ipatch < n_patches; ipatch++)
+		active[ipatch] = ipatch;
+
+	for (int iter = 1; iter	<= max_iter && active.size() > 0; iter++) {
+		const int n_active = active.size();
+		const int n_pairs = n_active * n_frames;
+
+		RCTIC(TIMING_MAKE_REF);
+		#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+		for (int iactive = 0; iactive < n_active; iactive++) {
+			const int ipatch = active[iactive];
+			PatchCCF &ccf = ccfs[ipatch];
+			std::vector<MultidimArray<fComplex> > &Fframes = Fpatches[ipatch];
+
+			ccf.Fref.initZeros();
+			for (int y = 0; y < ccf.ccf_nfy; y++) {
+				const int ly = (y > ccf.ccf_nfy_half) ? (y - ccf.ccf_nfy + ccf.nfy) : y;
+				for (int x = 0; x < ccf.ccf_nfx; x++) {
+					for (int iframe = 0; iframe < n_frames; iframe++) {
+						DIRECT_A2D_ELEM(ccf.Fref, y, x) += DIRECT_A2D_ELEM(Fframes[iframe], ly, x);
+					}
 				}
 			}
 		}
 		RCTOC(TIMING_MAKE_REF);
 
-		#pragma omp parallel for num_threads(n_threads)
-		for (int iframe = 0; iframe < n_frames; iframe++) {
+		#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+		for (int ipair = 0; ipair < n_pairs; ipair++) {
 			const int tid = omp_get_thread_num();
+			const int ipatch = active[ipair / n_frames];
+			const int iframe = ipair % n_frames;
+			const PatchCCF &ccf = ccfs[ipatch];
+			MultidimArray<fComplex> &Fframe = Fpatches[ipatch][iframe];
+			MultidimArray<fComplex> &Fcc = Fccs[tid];
+			MultidimArray<float> &Icc = Iccs[tid];
+			const int ccf_nx = ccf.ccf_nx, ccf_ny = ccf.ccf_ny;
+			const int search_range = ccf.search_range;
 
 			RCTIC(TIMING_CCF_CALC);
-			for (int y = 0; y < ccf_nfy; y++) {
-				const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy + nfy) : y;
-				for (int x = 0; x < ccf_nfx; x++) {
-					DIRECT_A2D_ELEM(Fccs[tid], y, x) = (DIRECT_A2D_ELEM(Fref, y, x) - DIRECT_A2D_ELEM(Fframes[iframe], ly, x)) *
-					                                    DIRECT_A2D_ELEM(Fframes[iframe], ly, x).conj() * DIRECT_A2D_ELEM(weight, y, x);
+			Fcc.reshape(ccf.ccf_nfy, ccf.ccf_nfx);
+			for (int y = 0; y < ccf.ccf_nfy; y++) {
+				const int ly = (y > ccf.ccf_nfy_half) ? (y - ccf.ccf_nfy + ccf.nfy) : y;
+				for (int x = 0; x < ccf.ccf_nfx; x++) {
+					DIRECT_A2D_ELEM(Fcc, y, x) = (DIRECT_A2D_ELEM(ccf.Fref, y, x) - DIRECT_A2D_ELEM(Fframe, ly, x)) *
+					                              DIRECT_A2D_ELEM(Fframe, ly, x).conj() * DIRECT_A2D_ELEM(ccf.weight, y, x);
 				}
 			}
 			RCTOC(TIMING_CCF_CALC);
 
 			RCTIC(TIMING_CCF_IFFT);
-			NewFFT::inverseFourierTransform(Fccs[tid], Iccs[tid]());
+			Icc.reshape(ccf_ny, ccf_nx);
+			NewFFT::inverseFourierTransform(Fcc, Icc, ccf_plans.at(std::make_pair(ccf_nx, ccf_ny)), NewFFT::FwdOnly, false);
 			RCTOC(TIMING_CCF_IFFT);
 
 			RCTIC(TIMING_CCF_FIND_MAX);
@@ -2324,8 +2685,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 
 				for (int x = -search_range; x <= search_range; x++) {
 					const int ix = (x < 0) ? ccf_nx + x : x;
-					RFLOAT val = DIRECT_A2D_ELEM(Iccs[tid](), iy, ix);
-//					std::cout << "(x, y) = " << x << ", " << y << ", (ix, iy) = " << ix << " , " << iy << " val = " << val << std::endl;
+					RFLOAT val = DIRECT_A2D_ELEM(Icc, iy, ix);
 					if (val > maxval) {
 						posx = x; posy = y;
 						maxval = val;
@@ -2343,71 +2703,87 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 
 			// Quadratic interpolation by Jasenko
 			RFLOAT vp, vn;
-			vp = DIRECT_A2D_ELEM(Iccs[tid](), ipy, ipx_p);
-			vn = DIRECT_A2D_ELEM(Iccs[tid](), ipy, ipx_n);
- 			if (std::abs(vp + vn - 2.0 * maxval) > EPS) {
-				cur_xshifts[iframe] = posx - 0.5 * (vp - vn) / (vp + vn - 2.0 * maxval);
+			vp = DIRECT_A2D_ELEM(Icc, ipy, ipx_p);
+			vn = DIRECT_A2D_ELEM(Icc, ipy, ipx_n);
+			if (std::abs(vp + vn - 2.0 * maxval) > EPS) {
+				cur_xshifts[ipatch][iframe] = posx - 0.5 * (vp - vn) / (vp + vn - 2.0 * maxval);
 			} else {
-				cur_xshifts[iframe] = posx;
+				cur_xshifts[ipatch][iframe] = posx;
 			}
 
-			vp = DIRECT_A2D_ELEM(Iccs[tid](), ipy_p, ipx);
-			vn = DIRECT_A2D_ELEM(Iccs[tid](), ipy_n, ipx);
- 			if (std::abs(vp + vn - 2.0 * maxval) > EPS) {
-				cur_yshifts[iframe] = posy - 0.5 * (vp - vn) / (vp + vn - 2.0 * maxval);
+			vp = DIRECT_A2D_ELEM(Icc, ipy_p, ipx);
+			vn = DIRECT_A2D_ELEM(Icc, ipy_n, ipx);
+			if (std::abs(vp + vn - 2.0 * maxval) > EPS) {
+				cur_yshifts[ipatch][iframe] = posy - 0.5 * (vp - vn) / (vp + vn - 2.0 * maxval);
 			} else {
-				cur_yshifts[iframe] = posy;
+				cur_yshifts[ipatch][iframe] = posy;
 			}
-			cur_xshifts[iframe] *= ccf_scale_x;
-			cur_yshifts[iframe] *= ccf_scale_y;
+			cur_xshifts[ipatch][iframe] *= ccf.ccf_scale_x;
+			cur_yshifts[ipatch][iframe] *= ccf.ccf_scale_y;
 #ifdef DEBUG_OWN
-			std::cout << "tid " << tid << " Frame " << 1 + iframe << ": raw shift x = " << posx << " y = " << posy << " cc = " << maxval << " interpolated x = " << cur_xshifts[iframe] << " y = " << cur_yshifts[iframe] << std::endl;
+			std::cout << "tid " << tid << " Patch " << ipatch << " Frame " << 1 + iframe << ": raw shift x = " << posx << " y = " << posy << " cc = " << maxval << " interpolated x = " << cur_xshifts[ipatch][iframe] << " y = " << cur_yshifts[ipatch][iframe] << std::endl;
 #endif
 			RCTOC(TIMING_CCF_FIND_MAX);
 		}
 
-		// Set origin
-		RFLOAT x_sumsq = 0, y_sumsq = 0;
-		for (int iframe = n_frames - 1; iframe >= 0; iframe--) { // do frame 0 last!
-			cur_xshifts[iframe] -= cur_xshifts[0];
-			cur_yshifts[iframe] -= cur_yshifts[0];
-			x_sumsq += cur_xshifts[iframe] * cur_xshifts[iframe];
-			y_sumsq += cur_yshifts[iframe] * cur_yshifts[iframe];
-		}
-		cur_xshifts[0] = 0; cur_yshifts[0] = 0;
+		std::vector<RFLOAT> rmsds(n_active);
+		for (int iactive = 0; iactive < n_active; iactive++) {
+			const int ipatch = active[iactive];
+			std::vector<RFLOAT> &cur_x = cur_xshifts[ipatch], &cur_y = cur_yshifts[ipatch];
 
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			xshifts[iframe] += cur_xshifts[iframe];
-			yshifts[iframe] += cur_yshifts[iframe];
-//			std::cout << "Shift for Frame " << iframe << ": delta_x = " << cur_xshifts[iframe] << " delta_y = " << cur_yshifts[iframe] << std::endl;
+			// Set origin
+			RFLOAT x_sumsq = 0, y_sumsq = 0;
+			for (int iframe = n_frames - 1; iframe >= 0; iframe--) { // do frame 0 last!
+				cur_x[iframe] -= cur_x[0];
+				cur_y[iframe] -= cur_y[0];
+				x_sumsq += cur_x[iframe] * cur_x[iframe];
+				y_sumsq += cur_y[iframe] * cur_y[iframe];
+			}
+			cur_x[0] = 0; cur_y[0] = 0;
+
+			for (int iframe = 0; iframe < n_frames; iframe++) {
+				xshifts[ipatch][iframe] += cur_x[iframe];
+				yshifts[ipatch][iframe] += cur_y[iframe];
+			}
+
+			rmsds[iactive] = std::sqrt((x_sumsq + y_sumsq) / n_frames);
 		}
 
 		// Apply shifts
 		// Since the image is not necessarily square, we cannot use the method in fftw.cpp
 		RCTIC(TIMING_FOURIER_SHIFT);
-		#pragma omp parallel for num_threads(n_threads)
-		for (int iframe = 1; iframe < n_frames; iframe++) {
-			shiftNonSquareImageInFourierTransform(Fframes[iframe], -cur_xshifts[iframe] / pnx, -cur_yshifts[iframe] / pny);
+		#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+		for (int ipair = 0; ipair < n_pairs; ipair++) {
+			const int ipatch = active[ipair / n_frames];
+			const int iframe = ipair % n_frames;
+			if (iframe == 0) continue;
+
+			shiftNonSquareImageInFourierTransform(Fpatches[ipatch][iframe], -cur_xshifts[ipatch][iframe] / pnxs[ipatch], -cur_yshifts[ipatch][iframe] / pnys[ipatch]);
 		}
 		RCTOC(TIMING_FOURIER_SHIFT);
 
 		// Test convergence
-		RFLOAT rmsd = std::sqrt((x_sumsq + y_sumsq) / n_frames);
-		logfile << " Iteration " << iter << ": RMSD = " << rmsd << " px" << std::endl;
+		std::vector<int> still_active;
+		for (int iactive = 0; iactive < n_active; iactive++) {
+			const int ipatch = active[iactive];
+			patch_logs[ipatch] << " Iteration " << iter << ": RMSD = " << rmsds[iactive] << " px" << std::endl;
 
-		if (rmsd < tolerance) {
-			converged = true;
-			break;
+			if (rmsds[iactive] < tolerance)
+				converged[ipatch] = true;
+			else
+				still_active.push_back(ipatch);
 		}
+		active.swap(still_active);
 	}
 
+	for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+		logs[ipatch] = patch_logs[ipatch].str();
 #ifdef DEBUG_OWN
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		std::cout << iframe << " " << xshifts[iframe] << " " << yshifts[iframe] << std::endl;
-	}
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			std::cout << ipatch << " " << iframe << " " << xshifts[ipatch][iframe] << " " << yshifts[ipatch][iframe] << std::endl;
+		}
 #endif
-
-	return converged;
+	}
 }
 
 int MotioncorrRunner::findGoodSize(int request) {
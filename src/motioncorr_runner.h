@@ -27,13 +27,43 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <algorithm>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include <src/time.h>
 #include "src/metadata_table.h"
 #include "src/image.h"
 #include "src/micrograph_model.h"
+#include "src/processing_ledger.h"
 #include <src/jaz/single_particle/obs_model.h>
 #include "src/jaz/tomography/tomogram_set.h"
 
+// The frames of one movie after reading and gain correction, as used by our own implementation
+class MotioncorrMovie
+{
+public:
+	FileName fn_mic;
+	bool is_EER;
+
+	// Size of the movie on disk
+	int nx, ny, nn;
+
+	// Frames to be used (0-indexed)
+	std::vector<int> frames;
+
+	// Gain-corrected frames (empty if there are too few frames to process this movie)
+	std::vector<Image<float> > Iframes;
+
+	// Set if anything went wrong while reading in the background
+	std::exception_ptr error;
+
+	MotioncorrMovie(): is_EER(false), nx(0), ny(0), nn(0) {}
+};
+
 class MotioncorrRunner
 {
 public:
@@ -48,6 +78,9 @@ public:
 	int n_threads;
 	int max_io_threads;
 
+	// Number of movies to read ahead (and of micrographs to write behind) during our own motion correction
+	int prefetch_movies;
+
 	// Output rootname
 	FileName fn_in, fn_out, fn_movie;
 
@@ -160,11 +193,18 @@ public:
 	// Output STAR file
 	MetaDataTable MDavg, MDmov;
 
+	// Micrographs that were finished in earlier runs, with their accumulated motions (for --only_do_unfinished)
+	ProcessingLedger ledger;
+
 	// Which GPU devices to use?
 	int devCount;
 	std::string gpu_ids;
 	std::vector < std::vector < std::string > > allThreadIDs;
 
+	MotioncorrRunner(): prefetch_movies(0), have_gain(false), stop_reading(false) {}
+
+	~MotioncorrRunner();
+
 	// Read command line arguments
 	void read(int argc, char **argv, int rank = 0);
 
@@ -182,6 +222,12 @@ public:
 	// Given an input fn_mic filename, this function will determine the names of the output corrected image (fn_avg) and the corrected movie (fn_mov).
 	FileName getOutputFileNames(FileName fn_mic, bool continue_even_odd = false);
 
+	// Do all output files of this micrograph exist?
+	bool isFinished(FileName fn_mic);
+
+	// Parameters that change the values stored in the ledger
+	std::string getLedgerSignature();
+
 	// Execute MOTIONCOR2 for a single micrograph
 	bool executeMotioncor2(Micrograph &mic, int rank = 0);
 
@@ -191,6 +237,15 @@ public:
 	// Execute our own implementation for a single micrograph
 	bool executeOwnMotionCorrection(Micrograph &mic);
 
+	// Read the frames of a movie and apply the gain reference
+	void readOwnMovie(FileName fn_mic, MotioncorrMovie &movie);
+
+	// Start reading fn_micrographs[first] ... fn_micrographs[last] in the background (only with prefetch_movies > 0)
+	void startMovieReader(long int first, long int last);
+
+	// Stop the background reader and wait for any pending output micrographs to be written
+	void stopMovieReaderAndWriter();
+
 	// Plot the shifts
 	void plotShifts(FileName fn_mic, Micrograph &mic);
 
@@ -210,11 +265,44 @@ public:
 	static bool detectSerialEMDefectText(FileName fn_defect);
 
 private:
+	// The gain reference is only read once
+	Image<float> Igain;
+	bool have_gain;
+	std::mutex gain_mutex;
+
+	// Movies read ahead by the background reader
+	std::thread movie_reader;
+	std::deque<MotioncorrMovie> prefetched_movies;
+	std::mutex movie_mutex;
+	std::condition_variable movie_cond;
+	bool stop_reading;
+
+	// Output micrographs that are being written in the background
+	std::thread image_writer;
+	std::vector<FileName> fn_pending_images;
+	std::vector<Image<float> > pending_images;
+	std::exception_ptr write_error;
+
+	void readMoviesInBackground(long int first, long int last);
+
+	// Get the next movie from the background reader, or read it now if there is none
+	void getOwnMovie(FileName fn_mic, MotioncorrMovie &movie);
+
+	// Write output micrographs; in the background if prefetch_movies > 0
+	void writeOutputImages(std::vector<FileName> &fn_images, std::vector<Image<float> > &images);
+	void waitForOutputImages();
+
 	// shiftx, shifty is relative to the (real space) image size
 	void shiftNonSquareImageInFourierTransform(MultidimArray<fComplex> &frame, RFLOAT shiftx, RFLOAT shifty);
 
 	bool alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile);
 
+	// Align the frames of many patches (Fpatches[ipatch][iframe]) as one workload, with threads over all (patch, frame) pairs.
+	// The log of each patch is returned in logs[ipatch], as the patches are processed concurrently.
+	void alignPatches(std::vector<std::vector<MultidimArray<fComplex> > > &Fpatches, const std::vector<int> &pnxs, const std::vector<int> &pnys,
+	                  const RFLOAT scaled_B, std::vector<std::vector<RFLOAT> > &xshifts, std::vector<std::vector<RFLOAT> > &yshifts,
+	                  std::vector<bool> &converged, std::vector<std::string> &logs);
+
 	void binNonSquareImage(Image<float> &Iwork, RFLOAT bin_factor);
 
 	int findGoodSize(int request);
@@ -58,6 +58,9 @@ void MotioncorrRunnerMpi::run()
 		barstep = XMIPP_MAX(1, my_nr_micrographs / 60);
 	}
 
+	if (do_own && prefetch_movies > 0)
+		startMovieReader(my_first_micrograph, my_last_micrograph);
+
 	for (long int imic = my_first_micrograph; imic <= my_last_micrograph; imic++)
 	{
 		if (verb > 0 && imic % barstep == 0)
@@ -65,7 +68,11 @@ void MotioncorrRunnerMpi::run()
 
 		// Abort through the pipeline_control system
 		if (pipeline_control_check_abort_job())
+		{
+			// Do not leave a micrograph half-written
+			stopMovieReaderAndWriter();
 			MPI_Abort(MPI_COMM_WORLD, RELION_EXIT_ABORTED);
+		}
 
 		Micrograph mic(fn_micrographs[imic], fn_gain_reference, bin_factor, eer_upsampling, eer_grouping);
         mic.pre_exposure = pre_exposure + pre_exposure_micrographs[imic];
@@ -87,6 +94,8 @@ void MotioncorrRunnerMpi::run()
 			plotShifts(fn_micrographs[imic], mic);
 		}
 	}
+	stopMovieReaderAndWriter();
+
 	if (verb > 0)
 		progress_bar(my_nr_micrographs);
 
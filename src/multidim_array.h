@@ -55,12 +55,15 @@
 #include "src/matrix1d.h"
 #include "src/matrix2d.h"
 #include "src/complex.h"
+#include "src/memory_policy.h"
 #include <limits>
 
 // Intel MKL provides an FFTW-like interface, so this is enough.
 #include <fftw3.h>
-#define RELION_ALIGNED_MALLOC fftw_malloc
-#define RELION_ALIGNED_FREE fftw_free
+
+// 64-byte aligned, large arrays follow RELION_MEMORY_POLICY (see memory_policy.h)
+#define RELION_ALIGNED_MALLOC relion_aligned_malloc
+#define RELION_ALIGNED_FREE relion_aligned_free
 
 extern int bestPrecision(float F, int _width);
 extern std::string floatToString(float F, int _width, int _prec);
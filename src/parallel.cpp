@@ -42,6 +42,13 @@
  *  e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 #include "src/parallel.h"
+#include <algorithm>
+
+#ifdef ALTCPU
+#define TBB_PREVIEW_GLOBAL_CONTROL 1
+#include <tbb/global_control.h>
+#include <memory>
+#endif
 
 // ================= MUTEX ==========================
 Mutex::Mutex()
@@ -133,23 +140,80 @@ void ThreadTaskDistributor::unlock()
     mutex.unlock();
 }
 
+bool ThreadTaskDistributor::getTasks(size_t &first, size_t &last)
+{
+    // No lock: distribute only touches assignedTasks atomically
+    return distribute(first, last);
+}
+
+void ThreadTaskDistributor::setGuided(int nr_workers, const std::vector<double> &costs)
+{
+    if (nr_workers < 0)
+        REPORT_ERROR("ThreadTaskDistributor::setGuided: nr_workers should be >= 0");
+
+    lock();
+    nrWorkers = nr_workers;
+    costSums.resize(costs.size() + 1);
+    costSums[0] = 0.;
+    for (size_t i = 0; i < costs.size(); i++)
+        costSums[i+1] = costSums[i] + costs[i];
+    if (costs.size() == 0)
+        costSums.clear();
+    unlock();
+}
+
 bool ThreadTaskDistributor::distribute(size_t &first, size_t &last)
 {
-    bool result = true;
     first = last = 0;
-    if (assignedTasks >= numberOfTasks)
+
+    if (nrWorkers == 0)
+    {
+        // Fixed blocks: a single atomic increment per request
+        size_t start = assignedTasks.fetch_add(blockSize);
+        if (start >= numberOfTasks)
+            return false;
+
+        first = start;
+        last = std::min(start + blockSize, numberOfTasks) - 1;
+        return true;
+    }
+
+    // Guided blocks: their size depends on where they start,
+    // so claim them with compare-and-swap
+    size_t start = assignedTasks.load();
+    size_t end;
+    do
+    {
+        if (start >= numberOfTasks)
+            return false;
+        end = guidedBlockEnd(start);
+    }
+    while (!assignedTasks.compare_exchange_weak(start, end));
+
+    first = start;
+    last = end - 1;
+    return true;
+}
+
+size_t ThreadTaskDistributor::guidedBlockEnd(size_t start) const
+{
+    size_t end;
+
+    if (costSums.size() == numberOfTasks + 1)
     {
-        result = false;
+        // Take tasks up to half of an equal share of the remaining cost
+        const double target = costSums[start] + (costSums[numberOfTasks] - costSums[start]) / (2. * nrWorkers);
+        end = std::lower_bound(costSums.begin() + start + 1, costSums.end(), target) - costSums.begin();
     }
     else
     {
-        first = assignedTasks;
-        assignedTasks
-        = (assignedTasks + blockSize < numberOfTasks) ? (assignedTasks
-                + blockSize) : numberOfTasks;
-        last = assignedTasks - 1;
+        end = start + (numberOfTasks - start) / (2 * nrWorkers);
     }
-    return result;
+
+    if (end < start + blockSize) end = start + blockSize;
+    if (end > numberOfTasks) end = numberOfTasks;
+
+    return end;
 }
 
 /** Divides a number into most equally groups */
@@ -183,3 +247,30 @@ int divide_equally_which_group(long int N, int size, long int myself)
     return -1;
 }
 
+#ifdef ALTCPU
+static std::unique_ptr<tbb::global_control> tbb_thread_budget;
+#endif
+
+static int thread_budget = -1;
+
+void setThreadBudget(int nr_threads)
+{
+    if (nr_threads < 1)
+        REPORT_ERROR("setThreadBudget: the number of threads should be at least 1");
+
+    thread_budget = nr_threads;
+
+    omp_set_dynamic(0);
+    omp_set_num_threads(nr_threads);
+    omp_set_max_active_levels(1);
+
+#ifdef ALTCPU
+    tbb_thread_budget.reset();
+    tbb_thread_budget.reset(new tbb::global_control(tbb::global_control::max_allowed_parallelism, nr_threads));
+#endif
+}
+
+int getThreadBudget()
+{
+    return (thread_budget > 0) ? thread_budget : omp_get_max_threads();
+}
@@ -47,6 +47,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <omp.h>
+#include <atomic>
+#include <vector>
 #include "src/error.h"
 
 // This code was copied from a developmental version of Xmipp-3.0
@@ -105,7 +107,8 @@ public:
     //How many tasks give in each request
     size_t blockSize;
     //The number of tasks that have been assigned
-    size_t assignedTasks;
+    //(may run past numberOfTasks once all have been handed out)
+    std::atomic<size_t> assignedTasks;
 
 public:
     //The total number of tasks to be distributed
@@ -162,7 +165,7 @@ public:
      *  }
      *  @endcode
      */
-    bool getTasks(size_t &first, size_t &last); // False = no more jobs, true = more jobs
+    virtual bool getTasks(size_t &first, size_t &last); // False = no more jobs, true = more jobs
     /* This function set the number of completed tasks.
      * Usually this not need to be called. Its more useful
      * for restarting work, when usually the leader detects
@@ -180,21 +183,40 @@ protected:
 
 };//class ParallelTaskDistributor
 
-/** This class is a concrete implementation of ParallelTaskDistributor for POSIX threads.
- * It uses mutex as the locking mechanism
- * and distributes tasks from 0 to numberOfTasks.
+/** This class is a concrete implementation of ParallelTaskDistributor for threads.
+ * It distributes tasks from 0 to numberOfTasks. getTasks does not take a lock:
+ * blocks are claimed by atomic updates of assignedTasks, so that many threads asking
+ * for small blocks do not have to wait for each other. The mutex only protects
+ * reset, setBlockSize and setAssignedTasks.
  */
 class ThreadTaskDistributor: public ParallelTaskDistributor
 {
 public:
-    ThreadTaskDistributor(size_t nTasks, size_t bSize):ParallelTaskDistributor(nTasks, bSize) {}
+    ThreadTaskDistributor(size_t nTasks, size_t bSize):ParallelTaskDistributor(nTasks, bSize), nrWorkers(0) {}
     virtual ~ThreadTaskDistributor(){};
 
+    virtual bool getTasks(size_t &first, size_t &last);
+
+    /** Hand out blocks that shrink as fewer tasks remain (but never below the block size),
+     * so that nr_workers threads finish at about the same time, even if some tasks take
+     * much longer than others. If costs holds an estimate of the cost of every task,
+     * blocks are sized by their total cost instead of by their number of tasks; costs that
+     * do not match the number of tasks (e.g. after resize) are ignored.
+     * nr_workers = 0 goes back to fixed blocks of the block size.
+     * Like reset, this should only be called before the workers start asking for tasks.
+     */
+    void setGuided(int nr_workers, const std::vector<double> &costs = std::vector<double>());
+
 protected:
     Mutex mutex; ///< Mutex to syncronize access to critical region
+    int nrWorkers; ///< 0: fixed blocks
+    std::vector<double> costSums; ///< costSums[i] = total cost of tasks 0 to i-1
     virtual void lock();
     virtual void unlock();
     virtual bool distribute(size_t &first, size_t &last);
+
+    // End (exclusive) of a guided block that starts at task start
+    size_t guidedBlockEnd(size_t start) const;
 };//end of class ThreadTaskDistributor
 
 /// @name Miscellaneous functions
@@ -214,6 +236,20 @@ long int divide_equally(long int N, int size, int rank, long int &first, long in
  */
 int divide_equally_which_group(long int N, int size, long int myself);
 
+/** Set the number of threads this process may use (i.e. --j)
+ *
+ * All threads come from the OpenMP runtime, which keeps them alive between parallel regions.
+ * This makes nr_threads the size of parallel regions that do not ask for a size themselves,
+ * makes nested parallel regions run on the thread that meets them instead of starting
+ * nr_threads more threads each, and limits the TBB thread pool (ALTCPU) to nr_threads
+ * for the rest of the process. Programs call this once, after reading --j.
+ */
+void setThreadBudget(int nr_threads);
+
+/** The number of threads set by setThreadBudget (or the OpenMP default if it was not called)
+ */
+int getThreadBudget();
+
 // Class which use local scope locks on higher-scope mutexes,
 // resulting in zero risk of leaving locks on. Effectively,
 // a mutex is treated like an container capable of holding a
@@ -19,6 +19,7 @@
  ***************************************************************************/
 
 #include "src/particle_subtractor.h"
+#include "src/parallel.h"
 
 void ParticleSubtractor::read(int argc, char **argv)
 {
@@ -32,6 +33,8 @@ void ParticleSubtractor::read(int argc, char **argv)
 	fn_revert = parser.getOption("--revert", "Name of particle STAR file to revert. When this is provided, all other options are ignored.", "");
 	do_ssnr = parser.checkOption("--ssnr", "Don't subtract, only calculate average spectral SNR in the images");
 	write_float16  = parser.checkOption("--float16", "Write in half-precision 16 bit floating point numbers (MRC mode 12), instead of 32 bit (MRC mode 0).");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to subtract particles in parallel", "1"));
+	setThreadBudget(nr_threads);
 
 	int center_section = parser.addSection("Centering options");
 	do_recenter_on_mask = parser.checkOption("--recenter_on_mask", "Use this flag to center the subtracted particles on projections of the centre-of-mass of the input mask");
@@ -48,6 +51,15 @@ void ParticleSubtractor::read(int argc, char **argv)
 
 	if ((fn_opt == "" && fn_revert == "") || (fn_opt != "" && fn_revert != ""))
 		REPORT_ERROR("Please specify only one of --i OR --revert");
+
+	if (nr_threads < 1)
+		REPORT_ERROR("The number of threads (--j) should be at least one");
+}
+
+ParticleSubtractor::~ParticleSubtractor()
+{
+	if (particle_writer.joinable())
+		particle_writer.join();
 }
 
 void ParticleSubtractor::usage()
@@ -303,7 +315,6 @@ void ParticleSubtractor::run()
 {
 
 	long int nr_parts = my_last_part_id - my_first_part_id + 1;
-	long int barstep = XMIPP_MAX(1, nr_parts/120);
 	if (verb > 0)
 	{
 		if (do_ssnr) std::cout << " + Calculating SNR for all particles ..." << std::endl;
@@ -312,27 +323,117 @@ void ParticleSubtractor::run()
 		init_progress_bar(nr_parts);
 	}
 
+	// Particles are read in batches, and the particles in each batch are subtracted in parallel.
+	// Each batch is then written out by a separate thread, while the next one is being subtracted.
+	const long int batch_size = 8 * nr_threads;
+	std::vector<SubtractionScratch> scratch(nr_threads);
+	if (do_ssnr)
+	{
+		for (int ithread = 0; ithread < nr_threads; ithread++)
+		{
+			scratch[ithread].sum_S2.initZeros(sum_S2);
+			scratch[ithread].sum_N2.initZeros(sum_N2);
+			scratch[ithread].sum_count.initZeros(sum_count);
+		}
+	}
+	std::vector<SubtractedParticle> particles(batch_size);
+	particles_to_write.resize(batch_size);
+
 	MDimg_out.clear();
-	//for (long int part_id_sorted = my_first_part_id, cc = 0; part_id_sorted <= my_last_part_id; part_id_sorted++, cc++)
-	for (long int part_id_sorted = my_first_part_id, cc = 0; part_id_sorted <= my_last_part_id; part_id_sorted++, cc++)
+	for (long int first_sorted = my_first_part_id; first_sorted <= my_last_part_id; first_sorted += batch_size)
 	{
+		if (pipeline_control_check_abort_job())
+		{
+			waitForWrittenParticles();
+			exit(RELION_EXIT_ABORTED);
+		}
+
+		const long int last_sorted = XMIPP_MIN(first_sorted + batch_size - 1, my_last_part_id);
+		const long int nr_batch = last_sorted - first_sorted + 1;
+
+		for (long int ipart = 0; ipart < nr_batch; ipart++)
+		{
+			long int part_id = opt.mydata.sorted_idx[first_sorted + ipart];
+			readParticle(part_id, particles[ipart]);
+		}
+
+		std::exception_ptr subtract_error = nullptr;
+		#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+		for (long int ipart = 0; ipart < nr_batch; ipart++)
+		{
+			try
+			{
+				subtractParticle(particles[ipart], scratch[omp_get_thread_num()]);
+			}
+			catch (...)
+			{
+				#pragma omp critical(ParticleSubtractor_error)
+				if (!subtract_error) subtract_error = std::current_exception();
+			}
+		}
+		if (subtract_error)
+		{
+			waitForWrittenParticles();
+			std::rethrow_exception(subtract_error);
+		}
 
-		//long int part_id = opt.mydata.sorted_idx[part_id_sorted];
-		if (cc % barstep == 0)
+		if (!do_ssnr)
 		{
-			if (pipeline_control_check_abort_job())
-				exit(RELION_EXIT_ABORTED);
+			// Filenames and metadata are set in the original order of the particles
+			for (long int ipart = 0; ipart < nr_batch; ipart++)
+				storeParticle(particles[ipart], first_sorted - my_first_part_id + ipart);
+
+			waitForWrittenParticles();
+			particles.swap(particles_to_write);
+			startWritingParticles(nr_batch);
 		}
 
-		long int part_id = opt.mydata.sorted_idx[part_id_sorted];
-		subtractOneParticle(part_id, 0, cc);
+		if (verb > 0) progress_bar(last_sorted - my_first_part_id + 1);
+	}
+	waitForWrittenParticles();
 
-		if (cc % barstep == 0 && verb > 0) progress_bar(cc);
+	if (do_ssnr)
+	{
+		for (int ithread = 0; ithread < nr_threads; ithread++)
+		{
+			sum_S2 += scratch[ithread].sum_S2;
+			sum_N2 += scratch[ithread].sum_N2;
+			sum_count += scratch[ithread].sum_count;
+		}
 	}
 
 	if (verb > 0) progress_bar(nr_parts);
 }
 
+void ParticleSubtractor::startWritingParticles(long int nr_particles)
+{
+	particle_writer = std::thread([this, nr_particles]()
+	{
+		try
+		{
+			for (long int ipart = 0; ipart < nr_particles; ipart++)
+				writeParticle(particles_to_write[ipart]);
+		}
+		catch (...)
+		{
+			write_error = std::current_exception();
+		}
+	});
+}
+
+void ParticleSubtractor::waitForWrittenParticles()
+{
+	if (particle_writer.joinable())
+		particle_writer.join();
+
+	if (write_error)
+	{
+		std::exception_ptr error = write_error;
+		write_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
 void ParticleSubtractor::saveStarFile(int myrank)
 {
 
@@ -463,12 +564,41 @@ FileName ParticleSubtractor::getParticleName(long int imgno, int myrank, int opt
 }
 
 void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, long int counter)
+{
+	SubtractedParticle particle;
+	SubtractionScratch scratch;
+	if (do_ssnr)
+	{
+		scratch.sum_S2.initZeros(sum_S2);
+		scratch.sum_N2.initZeros(sum_N2);
+		scratch.sum_count.initZeros(sum_count);
+	}
+
+	readParticle(part_id, particle);
+	subtractParticle(particle, scratch);
+
+	if (do_ssnr)
+	{
+		sum_S2 += scratch.sum_S2;
+		sum_N2 += scratch.sum_N2;
+		sum_count += scratch.sum_count;
+	}
+	else
+	{
+		storeParticle(particle, counter);
+		writeParticle(particle);
+	}
+}
+
+void ParticleSubtractor::readParticle(long int part_id, SubtractedParticle &particle)
 {
 	// Read the particle image
-	Image<RFLOAT> img;
-	int optics_group = opt.mydata.getOpticsGroup(part_id);
-	img.read(opt.mydata.particles[part_id].name);
-	img().setXmippOrigin();
+	particle.part_id = part_id;
+	particle.optics_group = opt.mydata.getOpticsGroup(part_id);
+	particle.pixel_size = opt.mydata.getImagePixelSize(part_id);
+	particle.has_new_angles = particle.has_new_offset = false;
+	particle.img.read(opt.mydata.particles[part_id].name);
+	particle.img().setXmippOrigin();
 
 	// Make sure gold-standard is adhered to!
 	int my_subset = (rank % 2 == 1) ? 1 : 2;
@@ -477,9 +607,16 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 		std::cerr << " rank= " << rank << " part_id= " << part_id << " opt.mydata.getRandomSubset(part_id)= " << opt.mydata.getRandomSubset(part_id) << std::endl;
 		REPORT_ERROR("BUG:: gold-standard separation of halves is broken!");
 	}
+}
+
+void ParticleSubtractor::subtractParticle(SubtractedParticle &particle, SubtractionScratch &scratch)
+{
+	Image<RFLOAT> &img = particle.img;
+	long int part_id = particle.part_id;
+	int optics_group = particle.optics_group;
 
 	// Get the consensus class, orientational parameters and norm (if present)
-	RFLOAT my_pixel_size = opt.mydata.getImagePixelSize(part_id);
+	RFLOAT my_pixel_size = particle.pixel_size;
 	RFLOAT remap_image_sizes = (opt.mymodel.ori_size * opt.mymodel.pixel_size) / (XSIZE(img()) * my_pixel_size);
 	Matrix1D<RFLOAT> my_old_offset(3), my_residual_offset(3), centering_offset(3);
 	Matrix2D<RFLOAT> Aori;
@@ -528,10 +665,12 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 	}
 
 	// Now that the particle is centered (for multibody), get the FourierTransform of the particle
-	MultidimArray<Complex> Faux, Fimg;
-	MultidimArray<RFLOAT> Fctf;
-	FourierTransformer transformer;
-	transformer.FourierTransform(img(), Fimg);
+	// The copy into scratch.Mreal keeps the FFTW plans of this thread valid for all particles
+	MultidimArray<Complex> &Faux = scratch.Faux;
+	MultidimArray<Complex> &Fimg = scratch.Fimg;
+	MultidimArray<RFLOAT> &Fctf = scratch.Fctf;
+	scratch.Mreal = img();
+	scratch.transformer.FourierTransform(scratch.Mreal, Fimg);
 	CenterFFTbySign(Fimg);
 	Fctf.resize(Fimg);
 	bool ctf_premultiplied = opt.mydata.obsModel.getCtfPremultiplied(optics_group);
@@ -614,7 +753,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 		Fctf.initConstant(1.);
 	}
 
-	MultidimArray<Complex> Fsubtract;
+	MultidimArray<Complex> &Fsubtract = scratch.Fsubtract;
 	Fsubtract.initZeros(Fimg);
 
 	if (opt.fn_body_masks != "None")
@@ -651,7 +790,7 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 			Abody = opt.mydata.obsModel.applyScaleDifference(Abody, optics_group, opt.mymodel.ori_size, opt.mymodel.pixel_size);
 
 			// Get the FT of the projection in the right direction
-			MultidimArray<Complex> FTo;
+			MultidimArray<Complex> &FTo = scratch.FTo;
 			FTo.initZeros(Fimg);
 			// The following line gets the correct pointer to account for overlap in the bodies
 			int oobody = DIRECT_A2D_ELEM(opt.mymodel.pointer_body_overlap, subtract_body, obody);
@@ -683,10 +822,11 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 		Abody = Aori * (opt.mymodel.orient_bodies[subtract_body]).transpose() * A_rot90 * Aresi_subtract * opt.mymodel.orient_bodies[subtract_body];
 		Euler_matrix2angles(Abody, rot, tilt, psi);
 
-		// Store the optimal orientations in the MDimg table
-		opt.mydata.MDimg.setValue(EMDL_ORIENT_ROT, rot, part_id);
-		opt.mydata.MDimg.setValue(EMDL_ORIENT_TILT, tilt, part_id);
-		opt.mydata.MDimg.setValue(EMDL_ORIENT_PSI, psi, part_id);
+		// Store the optimal orientations in the MDimg table (in storeParticle)
+		particle.has_new_angles = true;
+		particle.rot = rot;
+		particle.tilt = tilt;
+		particle.psi = psi;
 
 		// Also get refined offset for this body
 		opt.mydata.MDbodies[subtract_body].getValue(EMDL_ORIENT_ORIGIN_X_ANGSTROM, XX(my_refined_ibody_offset), part_id);
@@ -766,9 +906,9 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 				RFLOAT N2 = norm( dAkij(Fimg, k, i, j) );
 				// division by two keeps the numbers similar to tau2 and sigma2_noise,
 				// which are per real/imaginary component
-				sum_S2(idx_remapped) += S2 / 2.;
-				sum_N2(idx_remapped) += N2 / 2.;
-				sum_count(idx_remapped) += 1.;
+				scratch.sum_S2(idx_remapped) += S2 / 2.;
+				scratch.sum_N2(idx_remapped) += N2 / 2.;
+				scratch.sum_count(idx_remapped) += 1.;
 			}
 		}
 	}
@@ -776,7 +916,8 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 	{
 		// And go finally back to real-space
 		CenterFFTbySign(Fimg);
-		transformer.inverseFourierTransform(Fimg, img());
+		scratch.transformer.inverseFourierTransform(Fimg, scratch.Mreal);
+		img() = scratch.Mreal;
 
 		if (do_center || opt.fn_body_masks != "None")
 		{
@@ -786,13 +927,9 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 			my_residual_offset -= centering_offset;
 			selfTranslate(img(), centering_offset, WRAP);
 
-			// Set the non-integer difference between the rounded centering offset and the actual offsets in the STAR file
-			opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_X_ANGSTROM, my_pixel_size * XX(my_residual_offset), part_id);
-			opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_Y_ANGSTROM, my_pixel_size * YY(my_residual_offset), part_id);
-			if (opt.mymodel.data_dim == 3)
-			{
-				opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_Z_ANGSTROM, my_pixel_size * ZZ(my_residual_offset), part_id);
-			}
+			// Set the non-integer difference between the rounded centering offset and the actual offsets in the STAR file (in storeParticle)
+			particle.has_new_offset = true;
+			particle.offset = my_residual_offset;
 		}
 
 		// Rebox the image
@@ -809,28 +946,50 @@ void ParticleSubtractor::subtractOneParticle(long int part_id, long int imgno, l
 						   LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize),  LAST_XMIPP_INDEX(boxsize));
 			}
 		}
+	}
+}
+
+void ParticleSubtractor::storeParticle(SubtractedParticle &particle, long int counter)
+{
+	long int part_id = particle.part_id;
+	int optics_group = particle.optics_group;
+	RFLOAT my_pixel_size = particle.pixel_size;
 
-		// Now write out the image & set filenames in output metadatatable
-		FileName fn_img = getParticleName(counter, rank, optics_group);
-		opt.mydata.MDimg.setValue(EMDL_IMAGE_NAME, fn_img, part_id);
-		opt.mydata.MDimg.setValue(EMDL_IMAGE_ORI_NAME, opt.mydata.particles[part_id].name, part_id);
-		//Also set the original order in the input STAR file for later combination
-		opt.mydata.MDimg.setValue(EMDL_IMAGE_ID, part_id, part_id);
-		MDimg_out.addObject();
-		MDimg_out.setObject(opt.mydata.MDimg.getObject(part_id));
-
-		//printf("Writing: fn_orig = %s counter = %ld rank = %d optics_group = %d fn_img = %s SIZE = %d nr_particles_in_optics_group[optics_group] = %d\n", fn_orig.c_str(), counter, rank, optics_group+1, fn_img.c_str(), XSIZE(img()), nr_particles_in_optics_group[optics_group]);
-		img.setSamplingRateInHeader(my_pixel_size);
+	if (particle.has_new_angles)
+	{
+		opt.mydata.MDimg.setValue(EMDL_ORIENT_ROT, particle.rot, part_id);
+		opt.mydata.MDimg.setValue(EMDL_ORIENT_TILT, particle.tilt, part_id);
+		opt.mydata.MDimg.setValue(EMDL_ORIENT_PSI, particle.psi, part_id);
+	}
+
+	if (particle.has_new_offset)
+	{
+		opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_X_ANGSTROM, my_pixel_size * XX(particle.offset), part_id);
+		opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_Y_ANGSTROM, my_pixel_size * YY(particle.offset), part_id);
 		if (opt.mymodel.data_dim == 3)
 		{
-			img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-		}
-		else
-		{
-			if (nr_particles_in_optics_group[optics_group] == 0)
-				img.write(fn_img, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-			else
-				img.write(fn_img, -1, false, WRITE_APPEND, write_float16 ? Float16: Float);
+			opt.mydata.MDimg.setValue(EMDL_ORIENT_ORIGIN_Z_ANGSTROM, my_pixel_size * ZZ(particle.offset), part_id);
 		}
 	}
+
+	// Now set filenames in output metadatatable
+	FileName fn_img = getParticleName(counter, rank, optics_group);
+	opt.mydata.MDimg.setValue(EMDL_IMAGE_NAME, fn_img, part_id);
+	opt.mydata.MDimg.setValue(EMDL_IMAGE_ORI_NAME, opt.mydata.particles[part_id].name, part_id);
+	//Also set the original order in the input STAR file for later combination
+	opt.mydata.MDimg.setValue(EMDL_IMAGE_ID, part_id, part_id);
+	MDimg_out.addObject();
+	MDimg_out.setObject(opt.mydata.MDimg.getObject(part_id));
+
+	particle.fn_img = fn_img;
+	if (opt.mymodel.data_dim == 3 || nr_particles_in_optics_group[optics_group] == 0)
+		particle.write_mode = WRITE_OVERWRITE;
+	else
+		particle.write_mode = WRITE_APPEND;
+}
+
+void ParticleSubtractor::writeParticle(SubtractedParticle &particle)
+{
+	particle.img.setSamplingRateInHeader(particle.pixel_size);
+	particle.img.write(particle.fn_img, -1, false, particle.write_mode, write_float16 ? Float16: Float);
 }
@@ -26,6 +26,39 @@
 #include "src/time.h"
 #include "src/mask.h"
 #include "src/funcs.h"
+#include <thread>
+#include <exception>
+
+// Arrays that each thread re-uses for all its particles (this also keeps the FFTW plans)
+class SubtractionScratch
+{
+public:
+	FourierTransformer transformer;
+	MultidimArray<RFLOAT> Mreal, Fctf;
+	MultidimArray<Complex> Fimg, Fsubtract, FTo, Faux;
+
+	// This thread's contribution to the spectral SNR
+	MultidimArray<RFLOAT> sum_count, sum_S2, sum_N2;
+};
+
+// A subtracted particle image, with the changes to its metadata that still need to be stored
+class SubtractedParticle
+{
+public:
+	long int part_id;
+	int optics_group;
+	RFLOAT pixel_size;
+	Image<RFLOAT> img;
+
+	// New orientation (for multi-body) and new (residual) offsets after re-centering
+	bool has_new_angles, has_new_offset;
+	RFLOAT rot, tilt, psi;
+	Matrix1D<RFLOAT> offset;
+
+	// Where and how to write the image
+	FileName fn_img;
+	WriteMode write_mode;
+};
 
 
 class ParticleSubtractor
@@ -58,7 +91,13 @@ public:
 	// verbosity
 	int verb;
 
+	// Number of threads to subtract particles in parallel
+	int nr_threads;
+
 public:
+	// Wait for particles that may still be written out
+	~ParticleSubtractor();
+
 	// Read command line arguments
 	void read(int argc, char **argv);
 
@@ -89,6 +128,19 @@ public:
 	// subtract one particle
 	void subtractOneParticle(long int part_id, long int imgno, long int counter);
 
+	// Read the image of a particle (not thread-safe)
+	void readParticle(long int part_id, SubtractedParticle &particle);
+
+	// Subtract the projection(s) from a particle image that was read with readParticle
+	// This only uses the scratch arrays of the calling thread, so it can be run in parallel
+	void subtractParticle(SubtractedParticle &particle, SubtractionScratch &scratch);
+
+	// Store the new metadata of a subtracted particle and decide where to write it (call in order of the particles)
+	void storeParticle(SubtractedParticle &particle, long int counter);
+
+	// Write a subtracted particle image to disc
+	void writeParticle(SubtractedParticle &particle);
+
 private:
 	// Pre-calculated rotation matrix for (0,90,0) rotation, and its transpose, for multi-body orientations
 	Matrix2D<RFLOAT> A_rot90, A_rot90T;
@@ -117,6 +169,13 @@ private:
 	// image to particle mapping
 	std::vector<long int> nr_particles_in_optics_group;
 	std::map<long int, FileName> imgno_to_filename;
+
+	// Write a batch of particles in a separate thread, while the next batch is being subtracted
+	void startWritingParticles(long int nr_particles);
+	void waitForWrittenParticles();
+	std::vector<SubtractedParticle> particles_to_write;
+	std::thread particle_writer;
+	std::exception_ptr write_error;
 };
 
 #endif /* PARTICLE_SUBTRACTOR_H_ */
@@ -349,11 +349,72 @@ void PipeLine::remakeNodeDirectory()
 }
 
 
+bool PipeLine::watchRunningProcesses()
+{
+	bool added = statusWatcher.watch(".");
+
+	for (long int i = 0; i < processList.size(); i++)
+	{
+		if (processList[i].status == PROC_RUNNING && statusWatcher.watch(processList[i].name))
+			added = true;
+	}
+
+	return added;
+}
+
+bool PipeLine::statusMayHaveChanged()
+{
+	if (watchRunningProcesses())
+		status_events_pending = true;
+
+	if (!statusWatcher.isReliable())
+		return true;
+
+	std::vector<std::string> changed;
+	if (statusWatcher.wait(0, changed))
+		status_events_pending = true;
+
+	time_t now = time(NULL);
+	if (now - time_last_status_check >= PIPELINE_STATUS_RECHECK_SECONDS)
+		status_events_pending = true;
+
+	if (!status_events_pending)
+		return false;
+
+	status_events_pending = false;
+	time_last_status_check = now;
+
+	return true;
+}
+
+void PipeLine::waitForStatusChange(double poll_seconds)
+{
+	if (watchRunningProcesses())
+		status_events_pending = true;
+
+	if (!statusWatcher.isReliable())
+	{
+		sleep(poll_seconds);
+		return;
+	}
+
+	if (status_events_pending)
+		return;
+
+	std::vector<std::string> changed;
+	if (statusWatcher.wait(PIPELINE_STATUS_RECHECK_SECONDS, changed))
+		status_events_pending = true;
+}
+
 bool PipeLine::checkProcessCompletion()
 {
 	if (do_read_only)
 		return false;
 
+	// With file events, only look for exit files once something has happened
+	if (!statusMayHaveChanged())
+		return false;
+
 	std::vector<long int> finished_success_processes;
 	std::vector<long int> finished_failure_processes;
 	std::vector<long int> finished_aborted_processes;
@@ -435,6 +496,12 @@ bool PipeLine::checkProcessCompletion()
 			processList[finished_aborted_processes[i]].status = PROC_FINISHED_ABORTED;
 		}
 
+		for (long int i = 0; i < processList.size(); i++)
+		{
+			if (processList[i].status != PROC_RUNNING)
+				statusWatcher.unwatch(processList[i].name);
+		}
+
 		// Always couple read/write with DO_LOCK
 		// This is to make sure two different windows do not get out-of-sync
 		write(DO_LOCK);
@@ -788,7 +855,7 @@ void PipeLine::waitForJobToFinish(int current_job, bool &is_failure, bool &is_ab
 {
 	while (true)
 	{
-		sleep(1);
+		waitForStatusChange(1);
 		checkProcessCompletion();
 		if (processList[current_job].status == PROC_FINISHED_SUCCESS ||
 		    processList[current_job].status == PROC_FINISHED_ABORTED ||
@@ -902,10 +969,25 @@ void PipeLine::runScheduledJobs(FileName fn_sched, FileName fn_jobids, int nr_re
 			for (long int inode = 0; inode < processList[current_job].inputNodeList.size(); inode++)
 			{
 				long int mynode = processList[current_job].inputNodeList[inode];
-				while (!exists(nodeList[mynode].name))
+				FileName fn_node = nodeList[mynode].name;
+				FileEventWatcher node_watcher;
+				// Other files in the same directory (e.g. run.out of a running job) should not end the wait
+				node_watcher.setNameFilter(std::vector<std::string>(1, fn_node.contains("/") ? fn_node.afterLastOf("/") : fn_node));
+				std::vector<std::string> changed;
+				time_t last_warning = 0;
+				while (!exists(fn_node))
 				{
-					fh << " + -- Warning " << nodeList[mynode].name << " does not exist. Waiting 60 seconds ... " << std::endl;
-					sleep(60);
+					// The node may have appeared before its directory was being watched
+					if (node_watcher.watch(fn_node.contains("/") ? fn_node.beforeLastOf("/") : ".") && exists(fn_node))
+						break;
+
+					if (time(0) - last_warning >= 60)
+					{
+						fh << " + -- Warning " << fn_node << " does not exist. Waiting up to 60 seconds ... " << std::endl;
+						last_warning = time(0);
+					}
+					changed.clear();
+					node_watcher.wait(60, changed);
 				}
 			}
 			now = time(0);
@@ -924,7 +1006,7 @@ void PipeLine::runScheduledJobs(FileName fn_sched, FileName fn_jobids, int nr_re
 					break;
 				}
 
-				sleep(seconds_wait_after);
+				waitForStatusChange(seconds_wait_after);
 				checkProcessCompletion();
 				if (processList[current_job].status == PROC_FINISHED_SUCCESS ||
 					processList[current_job].status == PROC_FINISHED_ABORTED ||
@@ -29,6 +29,7 @@
 #include <dirent.h>
 #include "src/metadata_table.h"
 #include "src/pipeline_jobs.h"
+#include "src/file_event_watcher.h"
 #define DEFAULTPDFVIEWER "evince"
 
 class Process
@@ -74,6 +75,8 @@ public:
 
 
 #define PIPELINE_HAS_CHANGED ".pipeline_has_changed"
+// Even when file events are available, look at the exit files of all running jobs at least this often
+#define PIPELINE_STATUS_RECHECK_SECONDS 60
 class PipeLine
 {
 public:
@@ -85,11 +88,24 @@ public:
 	std::vector<Node> nodeList; //list of all Nodes in the pipeline
 	std::vector<Process> processList; //list of all Processes in the pipeline
 
+	// Watches the directories of running jobs for exit files, and the project directory for PIPELINE_HAS_CHANGED
+	FileEventWatcher statusWatcher;
+	bool status_events_pending;
+	time_t time_last_status_check;
+
 	PipeLine()
 	{
 		name = "default";
 		job_counter = 1;
 		do_read_only = false;
+
+		std::vector<std::string> prefixes;
+		prefixes.push_back("RELION_JOB_EXIT_");
+		prefixes.push_back(PIPELINE_HAS_CHANGED);
+		prefixes.push_back("RUNNING_PIPELINER_");
+		statusWatcher.setNameFilter(prefixes);
+		status_events_pending = true;
+		time_last_status_check = 0;
 	}
 
 	~PipeLine()
@@ -155,6 +171,17 @@ public:
 	// Returns true if any of the running processes has completed, false otherwise
 	bool checkProcessCompletion();
 
+	// Make sure the directories of all running processes are watched
+	// Returns true if a new watch was added, in which case earlier events may have been missed
+	bool watchRunningProcesses();
+
+	// Returns false only if it is certain that no exit file or PIPELINE_HAS_CHANGED has appeared since the last call
+	bool statusMayHaveChanged();
+
+	// Sleep until an exit file, PIPELINE_HAS_CHANGED or a RUNNING_PIPELINER_ file changes
+	// Without reliable file events, this sleeps for poll_seconds
+	void waitForStatusChange(double poll_seconds);
+
 
 	// Get the command line arguments for thisjob
 	bool getCommandLineJob(RelionJob &thisjob, int current_job, bool is_main_continue, bool is_scheduled, bool do_makedir,
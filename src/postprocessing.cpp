@@ -60,6 +60,7 @@ void Postprocessing::read(int argc, char **argv)
 	locres_edgwidth = textToFloat(parser.getOption("--locres_edgwidth", "Width of soft edge (in A) on masks for local-resolution map (default = sampling)", "-1"));
 	locres_randomize_fsc = textToFloat(parser.getOption("--locres_randomize_at", "Randomize phases from this resolution (in A)", "25."));
 	locres_minres = textToFloat(parser.getOption("--locres_minres", "Lowest local resolution allowed (in A)", "50."));
+	do_locres_fast = parser.checkOption("--locres_fast", "Calculate local FSCs for all sampling points at once, from band-passed half-maps and FFT-based convolutions with the spherical mask (much faster)");
 
 	int expert_section = parser.addSection("Expert options");
 	do_ampl_corr = parser.checkOption("--ampl_corr", "Perform amplitude correlation and DPR, also re-normalize amplitudes for non-uniform angular distributions");
@@ -107,6 +108,7 @@ void Postprocessing::clear()
 	filter_edge_width = 2.;
 	verb = 1;
 	do_ampl_corr = false;
+	do_locres_fast = false;
 }
 
 void Postprocessing::initialise()
@@ -987,6 +989,12 @@ void Postprocessing::run_locres(int rank, int size)
 	// Read input maps and perform some checks
 	initialise();
 
+	if (do_locres_fast)
+	{
+		run_locres_fast(rank, size);
+		return;
+	}
+
 	// Also read the user-provided mask
 	//getMask();
 
@@ -1158,6 +1166,14 @@ void Postprocessing::run_locres(int rank, int size)
 		init_progress_bar(nr_samplings);
 
 
+	writeLocresMaps(Ifil, Ilocres, Isumw, rank, size);
+}
+
+void Postprocessing::writeLocresMaps(MultidimArray<RFLOAT> &Ifil, MultidimArray<RFLOAT> &Ilocres, MultidimArray<RFLOAT> &Isumw, int rank, int size)
+{
+	FileName fn_tmp;
+	MultidimArray<RFLOAT> I1m(Ifil);
+
 	if (size > 1)
 	{
 		I1m.initZeros();
@@ -1238,6 +1254,379 @@ void Postprocessing::run_locres(int rank, int size)
 		MPI_Barrier(MPI_COMM_WORLD);
 }
 
+void Postprocessing::run_locres_fast(int rank, int size)
+{
+	MultidimArray<RFLOAT> I1p, I2p, Isum, Ilocres, Ifil, Isumw;
+
+	const long int ori_size = XSIZE(I1());
+	// Same number of shells as in getFSC
+	const int nr_shells = ori_size / 2 + 1;
+
+	// Get sum of two half-maps and sharpen according to estimated or ad-hoc B-factor
+	Isum.resize(I1());
+	I1p.resize(I1());
+	I2p.resize(I1());
+	Ifil.initZeros(I1());
+	Ilocres.initZeros(I1());
+	Isumw.initZeros(I1());
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(I1())
+	{
+		DIRECT_MULTIDIM_ELEM(Isum, n) = 0.5 * (DIRECT_MULTIDIM_ELEM(I1(), n) + DIRECT_MULTIDIM_ELEM(I2(), n));
+		DIRECT_MULTIDIM_ELEM(I1p, n) = DIRECT_MULTIDIM_ELEM(I1(), n);
+		DIRECT_MULTIDIM_ELEM(I2p, n) = DIRECT_MULTIDIM_ELEM(I2(), n);
+	}
+
+	// Pre-sharpen the sum of the two half-maps with the provided MTF curve and adhoc B-factor
+	do_fsc_weighting = false;
+	MultidimArray<Complex > FTsum;
+	FourierTransformer transformer;
+	transformer.FourierTransform(Isum, FTsum, true);
+	divideByMtf(FTsum);
+	applyBFactorToMap(FTsum, XSIZE(Isum), adhoc_bfac, angpix);
+	Isum.clear();
+
+	// Step size of locres-sampling in pixels
+	int step_size = ROUND(locres_sampling / angpix);
+	int maskrad_pix = ROUND(locres_maskrad / angpix);
+	int edgewidth_pix = ROUND(locres_edgwidth / angpix);
+	const RFLOAT mask_radius = maskrad_pix, mask_radius_p = maskrad_pix + edgewidth_pix;
+
+	// Get the unmasked FSC curve
+	getFSC(I1(), I2(), fsc_unmasked);
+
+	// Randomize phases of unmasked maps from user-provided resolution
+	int randomize_at = XSIZE(I1())* angpix / locres_randomize_fsc;
+	if (verb > 0)
+	{
+		std::cout.width(35); std::cout << std::left << "  + randomize phases beyond: "; std::cout << XSIZE(I1())* angpix / randomize_at << " Angstroms" << std::endl;
+	}
+	randomizePhasesBeyond(I1p, randomize_at);
+	randomizePhasesBeyond(I2p, randomize_at);
+
+	// Same sampling points as in run_locres
+	std::vector<long int> samp_k, samp_i, samp_j;
+	int myrad = XSIZE(I1())/2 - maskrad_pix;
+	for (long int kk=((I1()).zinit); kk<=((I1()).zinit + (I1()).zdim - 1); kk+= step_size)
+	for (long int ii=((I1()).yinit); ii<=((I1()).yinit + (I1()).ydim - 1); ii+= step_size)
+	for (long int jj=((I1()).xinit); jj<=((I1()).xinit + (I1()).xdim - 1); jj+= step_size)
+	{
+		float rad = sqrt(kk*kk + ii*ii + jj*jj);
+		if (rad < myrad)
+		{
+			samp_k.push_back(kk);
+			samp_i.push_back(ii);
+			samp_j.push_back(jj);
+		}
+	}
+	const long int nr_samplings = samp_k.size();
+
+	// The soft spherical mask around each sampling point is the same kernel, centred at the origin
+	// (wrapped around the box), so that masked sums for all sampling points at once are convolutions.
+	MultidimArray<RFLOAT> Ikernel(I1());
+	FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ikernel)
+	{
+		const long int kp = (k < ZSIZE(Ikernel)/2) ? k : k - ZSIZE(Ikernel);
+		const long int ip = (i < YSIZE(Ikernel)/2) ? i : i - YSIZE(Ikernel);
+		const long int jp = (j < XSIZE(Ikernel)/2) ? j : j - XSIZE(Ikernel);
+		RFLOAT d = sqrt((RFLOAT)(kp*kp + ip*ip + jp*jp));
+		if (d > mask_radius_p)
+			DIRECT_A3D_ELEM(Ikernel, k, i, j) = 0.;
+		else if (d < mask_radius)
+			DIRECT_A3D_ELEM(Ikernel, k, i, j) = 1.;
+		else
+			DIRECT_A3D_ELEM(Ikernel, k, i, j) = 0.5 - 0.5 * cos(PI * (mask_radius_p - d) / (mask_radius_p - mask_radius));
+	}
+	MultidimArray<Complex > Fkernel;
+	transformer.FourierTransform(Ikernel, Fkernel, true);
+	Ikernel.clear();
+
+	// Fourier transforms of the half-maps and the phase-randomised half-maps
+	MultidimArray<Complex > FT1, FT2, FT1p, FT2p;
+	transformer.FourierTransform(I1(), FT1, true);
+	transformer.FourierTransform(I2(), FT2, true);
+	transformer.FourierTransform(I1p, FT1p, true);
+	transformer.FourierTransform(I2p, FT2p, true);
+	I1p.clear();
+	I2p.clear();
+
+	// Resolution shell of each Fourier component
+	MultidimArray<int> Mshell;
+	Mshell.resize(FT1);
+	FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(FT1)
+	{
+		DIRECT_A3D_ELEM(Mshell, k, i, j) = ROUND(sqrt(kp*kp + ip*ip + jp*jp));
+	}
+
+	// Band-passed maps, their products and the transformers to go back and forth
+	MultidimArray<RFLOAT> Ia(I1()), Ib(I1()), Iprod(I1());
+	MultidimArray<Complex > Fshell;
+	FourierTransformer transformer_a, transformer_b, transformer_prod;
+	transformer_prod.setReal(Iprod);
+	MultidimArray<Complex > &Fprod = transformer_prod.getFourierReference();
+
+	// Masked sums of the product Iprod around all sampling points: convolution with the kernel
+	std::vector<RFLOAT> sum_ab(nr_samplings), sum_aa(nr_samplings), sum_bb(nr_samplings);
+	auto maskedSums = [&](std::vector<RFLOAT> &sums)
+	{
+		transformer_prod.FourierTransform();
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fprod)
+		{
+			DIRECT_MULTIDIM_ELEM(Fprod, n) *= DIRECT_MULTIDIM_ELEM(Fkernel, n);
+		}
+		transformer_prod.inverseFourierTransform();
+		for (long int isamp = 0; isamp < nr_samplings; isamp++)
+			sums[isamp] = A3D_ELEM(Iprod, samp_k[isamp], samp_i[isamp], samp_j[isamp]);
+	};
+
+	// Local FSC in one shell for all sampling points, stored in column ishell of fsc_local
+	auto localFscInShell = [&](MultidimArray<Complex > &FTa, MultidimArray<Complex > &FTb, int ishell, MultidimArray<RFLOAT> &fsc_local)
+	{
+		Fshell.initZeros(FTa);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fshell)
+		{
+			if (DIRECT_MULTIDIM_ELEM(Mshell, n) == ishell)
+				DIRECT_MULTIDIM_ELEM(Fshell, n) = DIRECT_MULTIDIM_ELEM(FTa, n);
+		}
+		transformer_a.inverseFourierTransform(Fshell, Ia);
+
+		Fshell.initZeros(FTb);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fshell)
+		{
+			if (DIRECT_MULTIDIM_ELEM(Mshell, n) == ishell)
+				DIRECT_MULTIDIM_ELEM(Fshell, n) = DIRECT_MULTIDIM_ELEM(FTb, n);
+		}
+		transformer_b.inverseFourierTransform(Fshell, Ib);
+
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Iprod)
+			DIRECT_MULTIDIM_ELEM(Iprod, n) = DIRECT_MULTIDIM_ELEM(Ia, n) * DIRECT_MULTIDIM_ELEM(Ib, n);
+		maskedSums(sum_ab);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Iprod)
+			DIRECT_MULTIDIM_ELEM(Iprod, n) = DIRECT_MULTIDIM_ELEM(Ia, n) * DIRECT_MULTIDIM_ELEM(Ia, n);
+		maskedSums(sum_aa);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Iprod)
+			DIRECT_MULTIDIM_ELEM(Iprod, n) = DIRECT_MULTIDIM_ELEM(Ib, n) * DIRECT_MULTIDIM_ELEM(Ib, n);
+		maskedSums(sum_bb);
+
+		for (long int isamp = 0; isamp < nr_samplings; isamp++)
+		{
+			const RFLOAT den = sum_aa[isamp] * sum_bb[isamp];
+			DIRECT_A2D_ELEM(fsc_local, isamp, ishell) = (den > 0.) ? sum_ab[isamp] / sqrt(den) : 0.;
+		}
+	};
+
+	// Local FSCs of the masked maps and of the masked phase-randomised maps for all sampling points (rows) and shells (columns)
+	MultidimArray<RFLOAT> fsc_local_masked(nr_samplings, nr_shells), fsc_local_random_masked(nr_samplings, nr_shells);
+	fsc_local_masked.initZeros();
+	fsc_local_random_masked.initZeros();
+	for (long int isamp = 0; isamp < nr_samplings; isamp++)
+	{
+		DIRECT_A2D_ELEM(fsc_local_masked, isamp, 0) = 1.;
+		DIRECT_A2D_ELEM(fsc_local_random_masked, isamp, 0) = 1.;
+	}
+
+	if (verb > 0)
+	{
+		std::cout << " Calculating local resolution in " << nr_samplings << " sampling points for up to " << nr_shells << " resolution shells ..." << std::endl;
+		init_progress_bar(nr_shells);
+	}
+
+	// Go through the shells from low to high resolution (each MPI process does one shell of every block of size shells),
+	// until the FSC of every sampling point has dropped below 0.143
+	std::vector<bool> is_done(nr_samplings, false);
+	int nr_shells_done = 1;
+	for (int ishell_start = 1; ishell_start < nr_shells; ishell_start += size)
+	{
+		// Abort through the pipeline_control system, TODO: check how this goes with MPI....
+		if (pipeline_control_check_abort_job())
+			exit(RELION_EXIT_ABORTED);
+
+		const int ishell_end = XMIPP_MIN(ishell_start + size, nr_shells); // exclusive
+		const int my_shell = ishell_start + rank;
+		if (my_shell < ishell_end)
+		{
+			localFscInShell(FT1, FT2, my_shell, fsc_local_masked);
+			// calculateFSCtrue only uses the random-phase FSC from 2 shells beyond randomize_at
+			if (my_shell >= randomize_at + 2)
+				localFscInShell(FT1p, FT2p, my_shell, fsc_local_random_masked);
+		}
+
+		if (size > 1)
+		{
+			// Every process only filled its own shell: sum the block over all processes
+			const int block_size = ishell_end - ishell_start;
+			MultidimArray<RFLOAT> block(2, nr_samplings, block_size), block_sum(2, nr_samplings, block_size);
+			block.initZeros();
+			block_sum.initZeros();
+			if (my_shell < ishell_end)
+			{
+				for (long int isamp = 0; isamp < nr_samplings; isamp++)
+				{
+					DIRECT_A3D_ELEM(block, 0, isamp, my_shell - ishell_start) = DIRECT_A2D_ELEM(fsc_local_masked, isamp, my_shell);
+					DIRECT_A3D_ELEM(block, 1, isamp, my_shell - ishell_start) = DIRECT_A2D_ELEM(fsc_local_random_masked, isamp, my_shell);
+				}
+			}
+			MPI_Allreduce(MULTIDIM_ARRAY(block), MULTIDIM_ARRAY(block_sum), MULTIDIM_SIZE(block), MY_MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+			for (long int isamp = 0; isamp < nr_samplings; isamp++)
+			{
+				for (int ishell = ishell_start; ishell < ishell_end; ishell++)
+				{
+					DIRECT_A2D_ELEM(fsc_local_masked, isamp, ishell) = DIRECT_A3D_ELEM(block_sum, 0, isamp, ishell - ishell_start);
+					DIRECT_A2D_ELEM(fsc_local_random_masked, isamp, ishell) = DIRECT_A3D_ELEM(block_sum, 1, isamp, ishell - ishell_start);
+				}
+			}
+		}
+		nr_shells_done = ishell_end;
+
+		// Check which sampling points have reached their resolution (same as calculateFSCtrue)
+		bool all_done = true;
+		for (long int isamp = 0; isamp < nr_samplings; isamp++)
+		{
+			for (int ishell = ishell_start; ishell < ishell_end && !is_done[isamp]; ishell++)
+			{
+				RFLOAT fsct = DIRECT_A2D_ELEM(fsc_local_masked, isamp, ishell);
+				if (ishell >= randomize_at + 2)
+				{
+					RFLOAT fscn = DIRECT_A2D_ELEM(fsc_local_random_masked, isamp, ishell);
+					fsct = (fsct - fscn) / (1. - fscn);
+				}
+				if (fsct < 0.143)
+					is_done[isamp] = true;
+			}
+			if (!is_done[isamp])
+				all_done = false;
+		}
+
+		if (verb > 0)
+			progress_bar(nr_shells_done);
+
+		if (all_done)
+			break;
+	}
+
+	if (verb > 0)
+		progress_bar(nr_shells);
+
+	FT1.clear(); FT2.clear(); FT1p.clear(); FT2p.clear();
+	Fshell.clear(); Ia.clear(); Ib.clear();
+
+	// Get the local resolution of each sampling point as in run_locres,
+	// and group the sampling points with the same local resolution
+	FileName fn_tmp = fn_out + "_locres_fscs.star";
+	std::ofstream  fh;
+	if (rank == 0)
+	{
+		if (verb > 0)
+		{
+			std::cout.width(35); std::cout << std::left <<"  + Metadata output file: "; std::cout << fn_tmp<< std::endl;
+		}
+
+		fh.open((fn_tmp).c_str(), std::ios::out);
+		if (!fh)
+			REPORT_ERROR( (std::string)"MlOptimiser::write: Cannot write file: " + fn_tmp);
+	}
+
+	std::map<RFLOAT, std::vector<long int> > samplings_per_resol;
+	std::map<RFLOAT, MultidimArray<RFLOAT> > sum_fsc_true_per_resol;
+	for (long int isamp = 0; isamp < nr_samplings; isamp++)
+	{
+		fsc_masked.initZeros(fsc_unmasked);
+		fsc_random_masked.initZeros(fsc_unmasked);
+		for (int ishell = 0; ishell < nr_shells_done; ishell++)
+		{
+			DIRECT_A1D_ELEM(fsc_masked, ishell) = DIRECT_A2D_ELEM(fsc_local_masked, isamp, ishell);
+			DIRECT_A1D_ELEM(fsc_random_masked, ishell) = DIRECT_A2D_ELEM(fsc_local_random_masked, isamp, ishell);
+		}
+		calculateFSCtrue(fsc_true, fsc_unmasked, fsc_masked, fsc_random_masked, randomize_at);
+
+		const long int kk = samp_k[isamp], ii = samp_i[isamp], jj = samp_j[isamp];
+		if (rank == 0)
+		{
+			MetaDataTable MDfsc;
+			FileName fn_name = "fsc_"+integerToString(kk, 5)+"_"+integerToString(ii, 5)+"_"+integerToString(jj, 5);
+			MDfsc.setName(fn_name);
+			for (int i = 0; i < nr_shells_done; i++)
+			{
+				MDfsc.addObject();
+				RFLOAT res = (i > 0) ? (XSIZE(I1()) * angpix / (RFLOAT)i) : 999.;
+				MDfsc.setValue(EMDL_SPECTRAL_IDX, (int)i);
+				MDfsc.setValue(EMDL_RESOLUTION, 1./res);
+				MDfsc.setValue(EMDL_RESOLUTION_ANGSTROM, res);
+				MDfsc.setValue(EMDL_POSTPROCESS_FSC_TRUE, DIRECT_A1D_ELEM(fsc_true, i) );
+				MDfsc.setValue(EMDL_POSTPROCESS_FSC_UNMASKED, DIRECT_A1D_ELEM(fsc_unmasked, i) );
+				MDfsc.setValue(EMDL_POSTPROCESS_FSC_MASKED, DIRECT_A1D_ELEM(fsc_masked, i) );
+				MDfsc.setValue(EMDL_POSTPROCESS_FSC_RANDOM_MASKED, DIRECT_A1D_ELEM(fsc_random_masked, i) );
+			}
+			MDfsc.write(fh);
+		}
+
+		float local_resol = 999.;
+		// See where corrected FSC drops below 0.143
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(fsc_true)
+		{
+			if ( DIRECT_A1D_ELEM(fsc_true, i) < 0.143)
+				break;
+			local_resol = (i > 0) ? XSIZE(I1())*angpix/(RFLOAT)i : 999.;
+		}
+		local_resol = XMIPP_MIN(locres_minres, local_resol);
+		if (rank == 0)
+			fh << " kk= " << kk << " ii= " << ii << " jj= " << jj << " local resolution= " << local_resol << std::endl;
+
+		samplings_per_resol[local_resol].push_back(isamp);
+		if (sum_fsc_true_per_resol.find(local_resol) == sum_fsc_true_per_resol.end())
+			sum_fsc_true_per_resol[local_resol].initZeros(fsc_true);
+		sum_fsc_true_per_resol[local_resol] += fsc_true;
+	}
+	fh.close();
+	fsc_local_masked.clear();
+	fsc_local_random_masked.clear();
+
+	// Low-pass filter the sharpened sum once for every local resolution (with the average FSC of its sampling points),
+	// and add it to the output map with the soft spherical masks of those sampling points
+	const int mask_extent = CEIL(mask_radius_p);
+	MultidimArray<RFLOAT> Ifiltered(I1());
+	int igroup = 0;
+	for (std::map<RFLOAT, std::vector<long int> >::iterator it = samplings_per_resol.begin(); it != samplings_per_resol.end(); it++, igroup++)
+	{
+		if (igroup % size != rank)
+			continue;
+
+		const RFLOAT local_resol = it->first;
+		const std::vector<long int> &samplings = it->second;
+
+		MultidimArray<RFLOAT> avg_fsc_true = sum_fsc_true_per_resol[local_resol];
+		avg_fsc_true /= (RFLOAT)samplings.size();
+
+		MultidimArray<Complex > FT = FTsum;
+		applyFscWeighting(FT, avg_fsc_true);
+		lowPassFilterMap(FT, XSIZE(I1()), local_resol, angpix, filter_edge_width);
+		transformer.inverseFourierTransform(FT, Ifiltered);
+
+		for (long int is = 0; is < samplings.size(); is++)
+		{
+			const long int kk = samp_k[samplings[is]], ii = samp_i[samplings[is]], jj = samp_j[samplings[is]];
+			for (long int k = XMIPP_MAX(STARTINGZ(Ifiltered), kk - mask_extent); k <= XMIPP_MIN(FINISHINGZ(Ifiltered), kk + mask_extent); k++)
+			for (long int i = XMIPP_MAX(STARTINGY(Ifiltered), ii - mask_extent); i <= XMIPP_MIN(FINISHINGY(Ifiltered), ii + mask_extent); i++)
+			for (long int j = XMIPP_MAX(STARTINGX(Ifiltered), jj - mask_extent); j <= XMIPP_MIN(FINISHINGX(Ifiltered), jj + mask_extent); j++)
+			{
+				RFLOAT d = sqrt((RFLOAT)((kk-k)*(kk-k) + (ii-i)*(ii-i) + (jj-j)*(jj-j)));
+				RFLOAT w;
+				if (d > mask_radius_p)
+					continue;
+				else if (d < mask_radius)
+					w = 1.;
+				else
+					w = 0.5 - 0.5 * cos(PI * (mask_radius_p - d) / (mask_radius_p - mask_radius));
+
+				A3D_ELEM(Ifil, k, i, j) += w * A3D_ELEM(Ifiltered, k, i, j);
+				A3D_ELEM(Ilocres, k, i, j) += w / local_resol;
+				A3D_ELEM(Isumw, k, i, j) += w;
+			}
+		}
+	}
+
+	writeLocresMaps(Ifil, Ilocres, Isumw, rank, size);
+}
+
 void Postprocessing::run()
 {
 	// Read input maps and perform some checks
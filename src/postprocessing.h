@@ -110,6 +110,9 @@ public:
 	// Lowest resolution allowed in the locres map
 	RFLOAT locres_minres;
 
+	// Calculate the local FSCs for all sampling points at once (through convolutions), rather than one sampling point at a time
+	bool do_locres_fast;
+
 	//////// Sharpening
 
 	// Filename for the STAR-file with the MTF of the detector
@@ -214,6 +217,12 @@ public:
 	// Local-resolution running
 	void run_locres(int rank = 0, int size = 1);
 
+	// Local-resolution from band-passed half-maps, with masked sums for all sampling points as FFT-based convolutions
+	void run_locres_fast(int rank = 0, int size = 1);
+
+	// Combine the local-resolution maps from all MPI processes and write them out
+	void writeLocresMaps(MultidimArray<RFLOAT> &Ifil, MultidimArray<RFLOAT> &Ilocres, MultidimArray<RFLOAT> &Isumw, int rank = 0, int size = 1);
+
 	// General Running
 	void run();
 
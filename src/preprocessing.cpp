@@ -18,6 +18,11 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include "src/preprocessing.h"
+#include "src/parallel.h"
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <omp.h>
 
 //#define PREP_TIMING
 #ifdef PREP_TIMING
@@ -42,6 +47,50 @@
 #define TIMING_TOC(id)
 #endif
 
+MultidimArray<Complex>& ParticleWorkspace::forwardTransform(const MultidimArray<RFLOAT> &img)
+{
+	// Copy into Mreal, so that the data pointer (and thereby the FFTW plans) stay the same for all images of the same size
+	Mreal = img;
+	transformer.setReal(Mreal);
+	transformer.FourierTransform();
+	return transformer.getFourierReference();
+}
+
+void ParticleWorkspace::inverseTransform(MultidimArray<RFLOAT> &img)
+{
+	transformer.inverseFourierTransform();
+	img = Mreal;
+}
+
+void ParticleWorkspace::rescale(Image<RFLOAT> &I, int newsize)
+{
+	MultidimArray<RFLOAT> &img = I();
+	int olddim = XSIZE(img);
+
+	windowFourierTransform(forwardTransform(img), Fresized, newsize);
+
+	if (img.getDim() == 2)
+		Mresized.resize(newsize, newsize);
+	else if (img.getDim() == 3)
+		Mresized.resize(newsize, newsize, newsize);
+	transformer_resized.setReal(Mresized);
+	transformer_resized.setFourier(Fresized);
+	transformer_resized.inverseFourierTransform();
+
+	// Like resizeMap, keep the origin of the input image
+	STARTINGX(Mresized) = STARTINGX(img);
+	STARTINGY(Mresized) = STARTINGY(img);
+	STARTINGZ(Mresized) = STARTINGZ(img);
+	img = Mresized;
+
+	rescaleSamplingRateInHeader(I, olddim, newsize);
+}
+
+Preprocessing::~Preprocessing()
+{
+	stopMicrographPrefetch();
+}
+
 void Preprocessing::read(int argc, char **argv, int rank)
 {
 	parser.setCommandLine(argc, argv);
@@ -54,6 +103,9 @@ void Preprocessing::read(int argc, char **argv, int rank)
 	fn_part_star = parser.getOption("--part_star", "Output STAR file with all particles metadata", "");
 	fn_pick_star = parser.getOption("--pick_star", "Output STAR file with 2 columns for micrographs and coordinate files", "");
 	fn_data = parser.getOption("--reextract_data_star", "A _data.star file from a refinement to re-extract, e.g. with different binning or re-centered (instead of --coord_suffix)", "");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads to process the particles of each micrograph (with more than one, the next micrograph is also read while the current one is processed)", "1"));
+	setThreadBudget(nr_threads);
+	fn_mic_cache = parser.getOption("--mic_cache", "Directory on a fast local disc to keep copies of the micrographs in, to speed up repeated (re-)extraction", "");
 	write_float16  = parser.checkOption("--float16", "Write in half-precision 16 bit floating point numbers (MRC mode 12), instead of 32 bit (MRC mode 0).");
 	keep_ctf_from_micrographs  = parser.checkOption("--keep_ctfs_micrographs", "By default, CTFs from fn_data will be kept. Use this flag to keep CTFs from input micrographs STAR file");
 	do_reset_offsets = parser.checkOption("--reset_offsets", "reset the origin offsets from the input _data.star file to zero?");
@@ -121,6 +173,18 @@ void Preprocessing::initialise()
 	if (fn_part_dir[fn_part_dir.length()-1] != '/')
 		fn_part_dir+="/";
 
+	if (nr_threads < 1)
+		REPORT_ERROR("Preprocessing::initialise ERROR: the number of threads (--j) should be at least one");
+
+	// The micrograph cache is local to each node, so every process makes sure it exists
+	if (fn_mic_cache != "")
+	{
+		if (fn_mic_cache[fn_mic_cache.length()-1] != '/')
+			fn_mic_cache+="/";
+		if (!exists(fn_mic_cache))
+			mktree(fn_mic_cache);
+	}
+
 	// Set up which coordinate files to extract particles from (or to join STAR file for)
 	if (do_extract)
 	{
@@ -293,6 +357,19 @@ void Preprocessing::initialise()
 				REPORT_ERROR("ERROR: please provide a tube radius that defines the background area when normalising helical segments...");
 		}
 	}
+
+	// Micrographs in the ledger were extracted in an earlier run with the same parameters
+	if (do_extract && only_extract_unfinished)
+		ledger.read(fn_part_dir + "processing_ledger.txt", getLedgerSignature());
+}
+
+std::string Preprocessing::getLedgerSignature()
+{
+	std::ostringstream sstr;
+	sstr << "extract " << extract_size << " " << (do_rescale ? scale : -1) << " " << (do_rewindow ? window : -1)
+	     << " " << (do_normalise ? bg_radius : -1) << " " << do_invert_contrast
+	     << " " << do_phase_flip << " " << do_premultiply_ctf;
+	return sstr.str();
 }
 
 void Preprocessing::run()
@@ -320,11 +397,17 @@ void Preprocessing::joinAllStarFiles()
 	int og;
 	std::cout <<std::endl << " Joining metadata of all particles from " << MDmics.numberOfObjects() << " micrographs in one STAR file..." << std::endl;
 
-	long int imic = 0, ibatch = 0;
-	MetaDataTable MDout, MDmicnames, MDbatch, MDpick;
-	for (long int current_object1 = MDmics.firstObject();
-	              current_object1 != MetaDataTable::NO_MORE_OBJECTS && current_object1 != MetaDataTable::NO_OBJECTS_STORED;
-	              current_object1 = MDmics.nextObject())
+	// Without --only_do_unfinished, all micrographs have just been (re-)extracted
+	if (!only_extract_unfinished)
+		ledger.reset(fn_part_dir + "processing_ledger.txt", getLedgerSignature());
+
+	// Find all micrographs with extracted particles, and those whose STAR file has changed since the last run,
+	// e.g. because it was extracted again (possibly by another MPI process)
+	std::vector<FileName> fn_mics, fn_stars;
+	std::vector<bool> star_changed;
+	std::string all_mic_names;
+	std::vector<size_t> mic_name_ends;
+	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MDmics)
 	{
 		// Micrograph filename
 		FileName fn_mic;
@@ -333,38 +416,77 @@ void Preprocessing::joinAllStarFiles()
 		// Get the filename of the STAR file for just this micrograph
 		FileName fn_star = getOutputFileNameRoot(fn_mic) + "_extract.star";
 
-		if (fn_pick_star != "" && exists(fn_star))
+		if (isAlreadyExtracted(fn_mic))
+		{
+			std::vector<std::string> star_state(1, ProcessingLedger::fileState(fn_star));
+			const bool changed = !ledger.contains(fn_mic) || ledger.getValues(fn_mic) != star_state;
+			if (changed)
+				ledger.add(fn_mic, star_state);
+
+			fn_mics.push_back(fn_mic);
+			fn_stars.push_back(fn_star);
+			star_changed.push_back(changed);
+			all_mic_names += fn_mic + "\n";
+			mic_name_ends.push_back(all_mic_names.size());
+		}
+	}
+	ledger.flush();
+
+	// Write out the pick.star file
+	if (fn_pick_star != "")
+	{
+		MetaDataTable MDpick;
+		for (long int imic = 0; imic < fn_mics.size(); imic++)
 		{
 			MDpick.addObject();
-			MDpick.setValue(EMDL_MICROGRAPH_NAME, fn_mic);
-			MDpick.setValue(EMDL_MICROGRAPH_COORDINATES, fn_star);
+			MDpick.setValue(EMDL_MICROGRAPH_NAME, fn_mics[imic]);
+			MDpick.setValue(EMDL_MICROGRAPH_COORDINATES, fn_stars[imic]);
 		}
+		MDpick.setName("coordinate_files");
+		std::ostringstream sstr;
+		MDpick.write(sstr);
+		ledger.writeFile(fn_pick_star, sstr.str());
+	}
 
-		if (fn_part_star != "")
+	MetaDataTable MDout;
+	if (fn_part_star != "")
+	{
+		// If the particle STAR file from the last run is still there, its micrographs come first now,
+		// and none of them has been extracted again, only the STAR files of the micrographs after those need to be read
+		long int nr_reused = 0;
+		std::string tag;
+		if (only_extract_unfinished && ledger.fileIsUnchanged(fn_part_star, tag))
 		{
-			if (exists(fn_star))
+			std::istringstream tagstream(tag);
+			long int nr_mics_before;
+			std::string hash_before;
+			if (tagstream >> nr_mics_before >> hash_before && nr_mics_before > 0 && nr_mics_before <= fn_mics.size()
+			    && ProcessingLedger::hash(all_mic_names, mic_name_ends[nr_mics_before - 1]) == hash_before
+			    && std::find(star_changed.begin(), star_changed.begin() + nr_mics_before, true) == star_changed.begin() + nr_mics_before)
 			{
-				MetaDataTable MDonestack;
-				MDonestack.read(fn_star);
-
-				if (MDout.numberOfObjects() > 0 && !MetaDataTable::compareLabels(MDout, MDonestack))
-				{
-					std::cout << "The STAR file " << fn_star << " contains a column not present in others. Missing values will be filled by default values (0 or empty string)" << std::endl;
-					MDout.addMissingLabels(&MDonestack);
-					MDonestack.addMissingLabels(&MDout);
-				}
-				MDout.append(MDonestack);
+				MDout.read(fn_part_star, "particles");
+				nr_reused = nr_mics_before;
+				std::cout << " Re-using the particles of " << nr_reused << " micrographs in " << fn_part_star << std::endl;
 			}
 		}
 
-		imic++;
-	} // end loop over all micrographs
+		for (long int imic = nr_reused; imic < fn_mics.size(); imic++)
+		{
+			MetaDataTable MDonestack;
+			MDonestack.read(fn_stars[imic]);
 
-	// Write out the pick.star file
-	if (fn_pick_star != "")
-	{
-		MDpick.setName("coordinate_files");
-		MDpick.write(fn_pick_star);
+			// This is removed from the output below
+			if (nr_reused > 0)
+				MDonestack.deactivateLabel(EMDL_PARTICLE_SELECTION_TYPE);
+
+			if (MDout.numberOfObjects() > 0 && !MetaDataTable::compareLabels(MDout, MDonestack))
+			{
+				std::cout << "The STAR file " << fn_stars[imic] << " contains a column not present in others. Missing values will be filled by default values (0 or empty string)" << std::endl;
+				MDout.addMissingLabels(&MDonestack);
+				MDonestack.addMissingLabels(&MDout);
+			}
+			MDout.append(MDonestack);
+		}
 	}
 
 	// Write out the joined star files
@@ -474,7 +596,12 @@ void Preprocessing::joinAllStarFiles()
         // Don't drag the new rlnParticleSelectionType along the entire processing workflow...
         MDout.deactivateLabel(EMDL_PARTICLE_SELECTION_TYPE);
 
-		ObservationModel::saveNew(MDout, myOutObsModel->opticsMdt, myOutObsModel->generalMdt, fn_part_star, "particles");
+		// If only particles were added since the last run, this only appends them to the file
+		std::ostringstream sstr;
+		ObservationModel::writeNew(sstr, MDout, myOutObsModel->opticsMdt, myOutObsModel->generalMdt, "particles");
+		std::string tag = (fn_mics.size() > 0) ?
+				std::to_string(fn_mics.size()) + " " + ProcessingLedger::hash(all_mic_names) : "";
+		ledger.writeFile(fn_part_star, sstr.str(), tag);
 		std::cout << " Written out STAR file with " << MDout.numberOfObjects() << " particles in " << fn_part_star<< std::endl;
 	}
 }
@@ -503,6 +630,11 @@ void Preprocessing::runExtractParticles()
 		MDmics.getValue(EMDL_MICROGRAPH_NAME, fn_mic);
 		int optics_group = obsModelMic.getOpticsGroup(MDmics);
 
+		// The next micrograph may be read in the background while this one is being processed
+		fn_next_mic = "";
+		if (imic + 1 < nr_mics)
+			MDmics.getValue(EMDL_MICROGRAPH_NAME, fn_next_mic, imic + 1);
+
 		// Set the pixel size for this micrograph
 		angpix = obsModelMic.getPixelSize(optics_group);
 		// Also set the output_angpix (which could be rescaled)
@@ -534,6 +666,7 @@ void Preprocessing::runExtractParticles()
 
 		imic++;
 	}
+	stopMicrographPrefetch();
 
 	MDmics = MDoutMics;
 	if (verb > 0)
@@ -705,10 +838,9 @@ bool Preprocessing::extractParticlesFromFieldOfView(FileName fn_mic, long int im
 	// Name of this micrographs STAR file
 	FileName fn_star = fn_output_img_root + "_extract.star";
 
-	if (exists(fn_star) && only_extract_unfinished)
-	{
-		return(true);
-	}
+	bool mic_is_used;
+	if (skipMicrograph(fn_mic, mic_is_used))
+		return(mic_is_used);
 
 	TIMING_TIC(TIMING_READ_COORD);
 	// Read in the coordinates file
@@ -721,8 +853,6 @@ bool Preprocessing::extractParticlesFromFieldOfView(FileName fn_mic, long int im
 	else
 	{
 		FileName fn_coord = micname2coordname[fn_mic];
-		if (!exists(fn_coord))
-			return false;
 		if (do_extract_helix)
 			readHelicalCoordinates(fn_mic, fn_coord, MDin);
 		else
@@ -824,24 +954,132 @@ bool Preprocessing::extractParticlesFromFieldOfView(FileName fn_mic, long int im
 	}
 }
 
+void Preprocessing::readMicrograph(FileName fn_mic, Image<RFLOAT> &Imic)
+{
+	if (fn_mic_cache == "")
+	{
+		Imic.read(fn_mic);
+		return;
+	}
+
+	// The copy in the cache is named after the full path of the micrograph, and is always in MRC format
+	FileName fn_cached = fn_mic;
+	std::replace(fn_cached.begin(), fn_cached.end(), '/', '_');
+	if (fn_cached.getExtension() != "mrc")
+		fn_cached += ".mrc";
+	fn_cached = fn_mic_cache + fn_cached;
+
+	// Only use the cached copy if it is not older than the micrograph itself
+	struct stat stat_mic, stat_cached;
+	if (stat(fn_cached.c_str(), &stat_cached) == 0 && stat(fn_mic.c_str(), &stat_mic) == 0 &&
+	    stat_cached.st_mtime >= stat_mic.st_mtime)
+	{
+		Imic.read(fn_cached);
+		return;
+	}
+
+	Imic.read(fn_mic);
+
+	// Write to a temporary file first, so that no other process will ever read an incomplete copy
+	FileName fn_tmp = fn_cached.withoutExtension() + "_tmp" + integerToString(getpid()) + ".mrc";
+	try
+	{
+		Imic.write(fn_tmp);
+		if (std::rename(fn_tmp.c_str(), fn_cached.c_str()))
+			std::remove(fn_tmp.c_str());
+	}
+	catch (RelionError &e)
+	{
+		// A full cache disc should not stop the extraction
+		std::cerr << " WARNING: could not write a copy of " << fn_mic << " into the micrograph cache " << fn_mic_cache << std::endl;
+		std::remove(fn_tmp.c_str());
+	}
+}
+
+void Preprocessing::startMicrographPrefetch(FileName fn_mic)
+{
+	// Only keep one extra micrograph in memory, and never an extra tomogram
+	if (nr_threads < 2 || dimensionality != 2 || fn_mic == "")
+		return;
+
+	// Do not read micrographs that extractParticlesFromFieldOfView will skip
+	bool mic_is_used;
+	if (skipMicrograph(fn_mic, mic_is_used) || !exists(fn_mic))
+		return;
+
+	stopMicrographPrefetch();
+
+	fn_prefetched_mic = fn_mic;
+	prefetch_error = nullptr;
+	mic_reader = std::thread([this]()
+	{
+		try
+		{
+			readMicrograph(fn_prefetched_mic, Iprefetched_mic);
+		}
+		catch (...)
+		{
+			prefetch_error = std::current_exception();
+		}
+	});
+}
+
+void Preprocessing::getMicrograph(FileName fn_mic, Image<RFLOAT> &Imic)
+{
+	if (mic_reader.joinable() && fn_prefetched_mic == fn_mic)
+	{
+		mic_reader.join();
+		fn_prefetched_mic = "";
+
+		if (prefetch_error)
+		{
+			std::exception_ptr error = prefetch_error;
+			prefetch_error = nullptr;
+			std::rethrow_exception(error);
+		}
+
+		Imic().moveFrom(Iprefetched_mic());
+		Imic.MDMainHeader = Iprefetched_mic.MDMainHeader;
+		Iprefetched_mic.clear();
+	}
+	else
+	{
+		stopMicrographPrefetch();
+		readMicrograph(fn_mic, Imic);
+	}
+}
+
+void Preprocessing::stopMicrographPrefetch()
+{
+	if (mic_reader.joinable())
+		mic_reader.join();
+
+	fn_prefetched_mic = "";
+	prefetch_error = nullptr;
+	Iprefetched_mic.clear();
+}
+
 // Actually extract particles. This can be from one micrograph
 void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		FileName fn_mic, int imic,
 		FileName fn_output_img_root, FileName fn_oristack, long int &my_current_nr_images, long int my_total_nr_images,
 		RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval)
 {
-	Image<RFLOAT> Ipart, Imic, Itmp;
+	Image<RFLOAT> Imic;
 
 	bool MDin_has_optics_group = MD.containsLabel(EMDL_IMAGE_OPTICS_GROUP); // i.e. re-extracting
 	bool MDin_has_beamtilt = (MD.containsLabel(EMDL_IMAGE_BEAMTILT_X) || MD.containsLabel(EMDL_IMAGE_BEAMTILT_Y));
 	bool MDin_has_ctf = MD.containsLabel(EMDL_CTF_DEFOCUSU);
 	bool MDin_has_tiltgroup = MD.containsLabel(EMDL_PARTICLE_BEAM_TILT_CLASS);
 	int my_extract_size = (do_phase_flip || do_premultiply_ctf) ? premultiply_ctf_extract_size : extract_size;
-	RFLOAT my_angpix;
+	RFLOAT my_angpix = angpix;
 
 	TIMING_TIC(TIMING_READ_IMG);
 
-	Imic.read(fn_mic);
+	getMicrograph(fn_mic, Imic);
+
+	// Read the next micrograph while the particles from this one are being processed
+	startMicrographPrefetch(fn_next_mic);
 
 	// Calculate average value in the micrograph, for filling empty region around large-box extraction for premultiplication with CTF
 	RFLOAT mic_avg = Imic().computeAvg();
@@ -860,41 +1098,49 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 		obsModelMic.opticsMdt.getValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpix, optics_group);
 	}
 
-	// Now window all particles from the micrograph
-	// Now do the actual phase flipping or CTF-multiplication
-	MultidimArray<Complex> FT;
-	FourierTransformer transformer;
+	// First get the positions, CTFs and helical priors of all particles from the metadata,
+	// so that the particles themselves can be processed in parallel
+	struct ParticlePosition
+	{
+		long int xpos, ypos, zpos;
+		long int x0, xF, y0, yF, z0, zF;
+		RFLOAT tilt_deg, psi_deg, angpix;
+		CTF ctf;
+	};
+	std::vector<ParticlePosition> positions;
+	positions.reserve(MD.numberOfObjects());
+
 	int ipos = 0;
 	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
 	{
+		ParticlePosition pos;
 		RFLOAT dxpos, dypos, dzpos;
-		long int xpos, ypos, zpos;
-		long int x0, xF, y0, yF, z0, zF;
 		MD.getValue(EMDL_IMAGE_COORD_X, dxpos);
 		MD.getValue(EMDL_IMAGE_COORD_Y, dypos);
-		xpos = (long int)dxpos;
-		ypos = (long int)dypos;
-
-		x0 = xpos + FIRST_XMIPP_INDEX(my_extract_size);
-		xF = xpos + LAST_XMIPP_INDEX(my_extract_size);
-		y0 = ypos + FIRST_XMIPP_INDEX(my_extract_size);
-		yF = ypos + LAST_XMIPP_INDEX(my_extract_size);
+		pos.xpos = (long int)dxpos;
+		pos.ypos = (long int)dypos;
+
+		pos.x0 = pos.xpos + FIRST_XMIPP_INDEX(my_extract_size);
+		pos.xF = pos.xpos + LAST_XMIPP_INDEX(my_extract_size);
+		pos.y0 = pos.ypos + FIRST_XMIPP_INDEX(my_extract_size);
+		pos.yF = pos.ypos + LAST_XMIPP_INDEX(my_extract_size);
+		pos.zpos = pos.z0 = pos.zF = 0;
 		if (dimensionality == 3)
 		{
 			MD.getValue(EMDL_IMAGE_COORD_Z, dzpos);
-			zpos = (long int)dzpos;
-			z0 = zpos + FIRST_XMIPP_INDEX(extract_size);
-			zF = zpos + LAST_XMIPP_INDEX(extract_size);
+			pos.zpos = (long int)dzpos;
+			pos.z0 = pos.zpos + FIRST_XMIPP_INDEX(extract_size);
+			pos.zF = pos.zpos + LAST_XMIPP_INDEX(extract_size);
 		}
 
 		// Discard particles that are completely outside the micrograph and print a warning
-		if (yF < 0 || y0 >= YSIZE(Imic()) || xF < 0 || x0 >= XSIZE(Imic()) ||
-				(dimensionality==3 && (zF < 0 || z0 >= ZSIZE(Imic())) ) )
+		if (pos.yF < 0 || pos.y0 >= YSIZE(Imic()) || pos.xF < 0 || pos.x0 >= XSIZE(Imic()) ||
+				(dimensionality==3 && (pos.zF < 0 || pos.z0 >= ZSIZE(Imic())) ) )
 		{
 			std::cerr << " micrograph x,y,z,n-size= " << XSIZE(Imic()) << " , " << YSIZE(Imic()) << " , " << ZSIZE(Imic()) << " , " << NSIZE(Imic()) << std::endl;
-			std::cerr << " particle position= " << xpos << " , " << ypos;
+			std::cerr << " particle position= " << pos.xpos << " , " << pos.ypos;
 			if (dimensionality == 3)
-				std::cerr << " , " << zpos;
+				std::cerr << " , " << pos.zpos;
 			std::cerr << std::endl;
 			REPORT_ERROR("Preprocessing::extractParticlesFromOneFrame ERROR: particle" + integerToString(ipos+1) + " lies completely outside micrograph " + fn_mic);
 		}
@@ -908,121 +1154,157 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 				obsModelPart.setBoxSize(optics_group, my_extract_size);
 			obsModelPart.opticsMdt.getValue(EMDL_MICROGRAPH_PIXEL_SIZE, my_angpix, optics_group);
 		}
+		pos.ctf = ctf;
+		pos.angpix = my_angpix;
 
-		TIMING_TIC(TIMING_WINDOW);
-		// extract one particle in Ipart
-		if (dimensionality == 3)
-			Imic().window(Ipart(), z0, y0, x0, zF, yF, xF);
-		else
-			Imic().window(Ipart(), y0, x0, yF, xF, mic_avg);
-		Ipart().setXmippOrigin();
-		TIMING_TOC(TIMING_WINDOW);
+		// Jun24,2015 - Shaoda, extract helical segments
+		pos.tilt_deg = pos.psi_deg = 0.;
+		if (do_extract_helix) // If priors do not exist, errors will occur in 'readHelicalCoordinates()'.
+		{
+			MD.getValue(EMDL_ORIENT_TILT_PRIOR, pos.tilt_deg);
+			MD.getValue(EMDL_ORIENT_PSI_PRIOR, pos.psi_deg);
+		}
 
-		// Premultiply the CTF of each particle, possibly in a bigger box (premultiply_ctf_extract_size)
-		if (do_phase_flip || do_premultiply_ctf)
+		positions.push_back(pos);
+		ipos++;
+	}
+
+	// Now window and process all particles from the micrograph in parallel
+	// This is done in batches, after each of which the particles are appended to the output stack in the original order
+	const long int nr_particles = positions.size();
+	const long int batch_size = XMIPP_MIN(16 * nr_threads, nr_particles);
+	std::vector<ParticleWorkspace> workspaces(nr_threads);
+	std::vector<Image<RFLOAT> > Iparts(batch_size);
+	std::vector<RFLOAT> avgs(batch_size), stddevs(batch_size), minvals(batch_size), maxvals(batch_size);
+
+	for (long int first = 0; first < nr_particles; first += batch_size)
+	{
+		const long int last = XMIPP_MIN(first + batch_size, nr_particles);
+
+		TIMING_TIC(TIMING_PRE_IMG_OPS);
+		#pragma omp parallel for num_threads(nr_threads) schedule(dynamic)
+		for (long int ipart = first; ipart < last; ipart++)
 		{
-			transformer.FourierTransform(Ipart(), FT, false);
-
-			MultidimArray<RFLOAT> Fctf;
-			Fctf.resize(YSIZE(FT), XSIZE(FT));
-			// do_abs, phase_flip, intact_first_peak, damping, padding
-			// 190802 TAKANORI: The original code using getCTF was do_damping=false, but for consistency with Polishing, I changed it.
-			// The boxsize in ObsModel has been updated above.
-			// In contrast to Polish, we premultiply particle BEFORE down-sampling, so PixelSize in ObsModel is OK.
-			// But we are doing this after extraction, so there is not much merit...
-			ctf.getFftwImage(Fctf, my_extract_size, my_extract_size, my_angpix, false, do_phase_flip, do_ctf_intact_first_peak, true, false);
-
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(FT)
-			{
-				DIRECT_MULTIDIM_ELEM(FT, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
-			}
+			ParticlePosition &pos = positions[ipart];
+			ParticleWorkspace &workspace = workspaces[omp_get_thread_num()];
+			Image<RFLOAT> &Ipart = Iparts[ipart - first];
 
-			transformer.inverseFourierTransform(FT, Ipart());
+			// extract one particle in Ipart
+			if (dimensionality == 3)
+				Imic().window(Ipart(), pos.z0, pos.y0, pos.x0, pos.zF, pos.yF, pos.xF);
+			else
+				Imic().window(Ipart(), pos.y0, pos.x0, pos.yF, pos.xF, mic_avg);
+			Ipart().setXmippOrigin();
 
-			if (extract_size != premultiply_ctf_extract_size)
+			// Premultiply the CTF of each particle, possibly in a bigger box (premultiply_ctf_extract_size)
+			if (do_phase_flip || do_premultiply_ctf)
 			{
-				Ipart().window(FIRST_XMIPP_INDEX(extract_size), FIRST_XMIPP_INDEX(extract_size),
-				               LAST_XMIPP_INDEX(extract_size),  LAST_XMIPP_INDEX(extract_size));
+				MultidimArray<Complex> &FT = workspace.forwardTransform(Ipart());
+
+				MultidimArray<RFLOAT> &Fctf = workspace.Fctf;
+				Fctf.resize(YSIZE(FT), XSIZE(FT));
+				// do_abs, phase_flip, intact_first_peak, damping, padding
+				// 190802 TAKANORI: The original code using getCTF was do_damping=false, but for consistency with Polishing, I changed it.
+				// The boxsize in ObsModel has been updated above.
+				// In contrast to Polish, we premultiply particle BEFORE down-sampling, so PixelSize in ObsModel is OK.
+				// But we are doing this after extraction, so there is not much merit...
+				pos.ctf.getFftwImage(Fctf, my_extract_size, my_extract_size, pos.angpix, false, do_phase_flip, do_ctf_intact_first_peak, true, false);
+
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(FT)
+				{
+					DIRECT_MULTIDIM_ELEM(FT, n) *= DIRECT_MULTIDIM_ELEM(Fctf, n);
+				}
+
+				workspace.inverseTransform(Ipart());
+
+				if (extract_size != premultiply_ctf_extract_size)
+				{
+					Ipart().window(FIRST_XMIPP_INDEX(extract_size), FIRST_XMIPP_INDEX(extract_size),
+					               LAST_XMIPP_INDEX(extract_size),  LAST_XMIPP_INDEX(extract_size));
+				}
 			}
-		}
 
-		TIMING_TIC(TIMING_BOUNDARY);
-		// Check boundaries: fill pixels outside the boundary with the nearest ones inside
-		// This will create lines at the edges, rather than zeros
-		Ipart().setXmippOrigin();
+			// Check boundaries: fill pixels outside the boundary with the nearest ones inside
+			// This will create lines at the edges, rather than zeros
+			Ipart().setXmippOrigin();
 
-		// X-boundaries
-		if (x0 < 0 || xF >= XSIZE(Imic()) )
-		{
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+			// X-boundaries
+			if (pos.x0 < 0 || pos.xF >= XSIZE(Imic()) )
 			{
-				if (j + xpos < 0)
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -xpos);
-				else if (j + xpos >= XSIZE(Imic()))
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Imic()) - xpos - 1);
+				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+				{
+					if (j + pos.xpos < 0)
+						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, -pos.xpos);
+					else if (j + pos.xpos >= XSIZE(Imic()))
+						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, i, XSIZE(Imic()) - pos.xpos - 1);
+				}
 			}
-		}
 
-		// Y-boundaries
-		if (y0 < 0 || yF >= YSIZE(Imic()))
-		{
-			FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+			// Y-boundaries
+			if (pos.y0 < 0 || pos.yF >= YSIZE(Imic()))
 			{
-				if (i + ypos < 0)
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -ypos, j);
-				else if (i + ypos >= YSIZE(Imic()))
-					A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Imic()) - ypos - 1, j);
+				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+				{
+					if (i + pos.ypos < 0)
+						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, -pos.ypos, j);
+					else if (i + pos.ypos >= YSIZE(Imic()))
+						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), k, YSIZE(Imic()) - pos.ypos - 1, j);
+				}
 			}
-		}
 
-		if (dimensionality == 3)
-		{
-			// Z-boundaries
-			if (z0 < 0 || zF >= ZSIZE(Imic()))
+			if (dimensionality == 3)
 			{
-				FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+				// Z-boundaries
+				if (pos.z0 < 0 || pos.zF >= ZSIZE(Imic()))
 				{
-					if (k + zpos < 0)
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -zpos, i, j);
-					else if (k + zpos >= ZSIZE(Imic()))
-						A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Imic()) - zpos - 1, i, j);
+					FOR_ALL_ELEMENTS_IN_ARRAY3D(Ipart())
+					{
+						if (k + pos.zpos < 0)
+							A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), -pos.zpos, i, j);
+						else if (k + pos.zpos >= ZSIZE(Imic()))
+							A3D_ELEM(Ipart(), k, i, j) = A3D_ELEM(Ipart(), ZSIZE(Imic()) - pos.zpos - 1, i, j);
+					}
 				}
 			}
-		}
 
-		// 2D projection of 3D sub-tomograms
-		if (dimensionality == 3 && do_project_3d)
-		{
-			// Project the 3D sub-tomogram into a 2D particle again
-			Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
-			Iproj().setXmippOrigin();
-			FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
+			// 2D projection of 3D sub-tomograms
+			if (dimensionality == 3 && do_project_3d)
 			{
-				DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
+				// Project the 3D sub-tomogram into a 2D particle again
+				Image<RFLOAT> Iproj(YSIZE(Ipart()), XSIZE(Ipart()));
+				Iproj().setXmippOrigin();
+				FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Ipart())
+				{
+					DIRECT_A2D_ELEM(Iproj(), i, j) += DIRECT_A3D_ELEM(Ipart(), k, i, j);
+				}
+				Ipart = Iproj;
 			}
-			Ipart = Iproj;
+
+			processImage(Ipart, pos.tilt_deg, pos.psi_deg, &workspace);
+
+			const long int ibatch = ipart - first;
+			Ipart().computeStats(avgs[ibatch], stddevs[ibatch], minvals[ibatch], maxvals[ibatch]);
 		}
-		TIMING_TOC(TIMING_BOUNDARY);
+		TIMING_TOC(TIMING_PRE_IMG_OPS);
 
-		// performPerImageOperations will also append the particle to the output stack in fn_stack
-		// Jun24,2015 - Shaoda, extract helical segments
-		RFLOAT tilt_deg, psi_deg;
-		tilt_deg = psi_deg = 0.;
-		if (do_extract_helix) // If priors do not exist, errors will occur in 'readHelicalCoordinates()'.
+		// Append the particles to the output stack on disc in the original order
+		for (long int ipart = first; ipart < last; ipart++)
 		{
-			MD.getValue(EMDL_ORIENT_TILT_PRIOR, tilt_deg);
-			MD.getValue(EMDL_ORIENT_PSI_PRIOR, psi_deg);
+			const long int ibatch = ipart - first;
+			writeImage(Iparts[ibatch], fn_output_img_root, my_current_nr_images + ipart, my_total_nr_images,
+			           avgs[ibatch], stddevs[ibatch], minvals[ibatch], maxvals[ibatch],
+			           all_avg, all_stddev, all_minval, all_maxval);
 		}
+	}
 
-		TIMING_TIC(TIMING_PRE_IMG_OPS);
-		performPerImageOperations(Ipart, fn_output_img_root, my_current_nr_images + ipos, my_total_nr_images,
-		                          tilt_deg, psi_deg, all_avg, all_stddev, all_minval, all_maxval);
-		TIMING_TOC(TIMING_PRE_IMG_OPS);
-
-		TIMING_TIC(TIMING_REST);
-		// Also store all the particles information in the STAR file
+	TIMING_TIC(TIMING_REST);
+	// Also store all the particles information in the STAR file
+	const bool is_3d_output = (dimensionality == 3 && !do_project_3d);
+	ipos = 0;
+	FOR_ALL_OBJECTS_IN_METADATA_TABLE(MD)
+	{
 		FileName fn_img;
-		if (Ipart().getDim() == 3)
+		if (is_3d_output)
 			fn_img.compose(fn_output_img_root, my_current_nr_images + ipos + 1, "mrc");
 		else
 			fn_img.compose(my_current_nr_images + ipos + 1, fn_output_img_root + ".mrcs"); // start image counting in stacks at 1!
@@ -1084,10 +1366,9 @@ void Preprocessing::extractParticlesFromOneMicrograph(MetaDataTable &MD,
 			}
 		}
 
-		TIMING_TOC(TIMING_REST);
-
 		ipos++;
 	}
+	TIMING_TOC(TIMING_REST);
 }
 
 void Preprocessing::runOperateOnInputFile()
@@ -1147,10 +1428,34 @@ void Preprocessing::performPerImageOperations(
 		RFLOAT &all_minval,
 		RFLOAT &all_maxval)
 {
+	processImage(Ipart, tilt_deg, psi_deg);
+
+	// Calculate mean, stddev, min and max
+	RFLOAT avg, stddev, minval, maxval;
+	TIMING_TIC(TIMING_COMP_STATS);
+	Ipart().computeStats(avg, stddev, minval, maxval);
+	TIMING_TOC(TIMING_COMP_STATS);
+
+	writeImage(Ipart, fn_output_img_root, image_nr, nr_of_images, avg, stddev, minval, maxval,
+	           all_avg, all_stddev, all_minval, all_maxval);
+}
+
+void Preprocessing::processImage(
+		Image<RFLOAT> &Ipart,
+		RFLOAT tilt_deg,
+		RFLOAT psi_deg,
+		ParticleWorkspace *workspace)
+{
 
 	Ipart().setXmippOrigin();
 
-	if (do_rescale) rescale(Ipart, scale);
+	if (do_rescale)
+	{
+		if (workspace != NULL)
+			workspace->rescale(Ipart, scale);
+		else
+			rescale(Ipart, scale);
+	}
 
 	if (do_rewindow) rewindow(Ipart, window);
 
@@ -1171,13 +1476,22 @@ void Preprocessing::performPerImageOperations(
 	TIMING_TIC(TIMING_INV_CONT);
 	if (do_invert_contrast) invert_contrast(Ipart);
 	TIMING_TOC(TIMING_INV_CONT);
+}
 
-	// Calculate mean, stddev, min and max
-	RFLOAT avg, stddev, minval, maxval;
-	TIMING_TIC(TIMING_COMP_STATS);
-	Ipart().computeStats(avg, stddev, minval, maxval);
-	TIMING_TOC(TIMING_COMP_STATS);
-
+void Preprocessing::writeImage(
+		Image<RFLOAT> &Ipart,
+		FileName fn_output_img_root,
+		long int image_nr,
+		long int nr_of_images,
+		RFLOAT avg,
+		RFLOAT stddev,
+		RFLOAT minval,
+		RFLOAT maxval,
+		RFLOAT &all_avg,
+		RFLOAT &all_stddev,
+		RFLOAT &all_minval,
+		RFLOAT &all_maxval)
+{
 	if (Ipart().getDim() == 3)
 	{
 		Ipart.MDMainHeader.setValue(EMDL_IMAGE_STATS_MIN, minval);
@@ -1358,6 +1672,33 @@ MetaDataTable Preprocessing::getCoordinateMetaDataTable(FileName fn_mic)
 }
 
 
+bool Preprocessing::skipMicrograph(FileName fn_mic, bool &mic_is_used)
+{
+	// Finished in a previous run: still counts as used
+	mic_is_used = true;
+	if (only_extract_unfinished && isAlreadyExtracted(fn_mic))
+		return true;
+
+	// No coordinates for this micrograph
+	mic_is_used = false;
+	if (fn_data == "")
+	{
+		std::map<FileName, FileName>::const_iterator it = micname2coordname.find(fn_mic);
+		if (it == micname2coordname.end() || !exists(it->second))
+			return true;
+	}
+
+	return false;
+}
+
+bool Preprocessing::isAlreadyExtracted(FileName fn_mic)
+{
+	// Also for micrographs in the ledger, as their particles may have been removed since
+	FileName fn_root = getOutputFileNameRoot(fn_mic);
+	const bool is_3d_output = (dimensionality == 3 && !do_project_3d);
+	return exists(fn_root + "_extract.star") && (is_3d_output || exists(fn_root + ".mrcs"));
+}
+
 // Get the coordinate filename from the micrograph filename
 FileName Preprocessing::getOutputFileNameRoot(FileName fn_mic)
 {
@@ -33,8 +33,30 @@
 #include "src/ctffind_runner.h"
 #include "src/helix.h"
 #include <src/jaz/single_particle/obs_model.h>
+#include "src/processing_ledger.h"
 #include <src/fftw.h>
 #include <src/time.h>
+#include <thread>
+#include <exception>
+
+// Re-usable arrays and FFTW plans for the per-particle operations of one thread
+class ParticleWorkspace
+{
+public:
+
+	FourierTransformer transformer, transformer_resized;
+	MultidimArray<RFLOAT> Mreal, Mresized, Fctf;
+	MultidimArray<Complex> Fresized;
+
+	// Fourier transform a copy of img; the plans are only made once for all images of the same size
+	MultidimArray<Complex>& forwardTransform(const MultidimArray<RFLOAT> &img);
+
+	// Inverse transform of the array returned by forwardTransform, result goes into img
+	void inverseTransform(MultidimArray<RFLOAT> &img);
+
+	// Same as rescale in image.h, but without re-planning for every image
+	void rescale(Image<RFLOAT> &I, int newsize);
+};
 
 class Preprocessing
 {
@@ -73,6 +95,9 @@ public:
 	// Only extract particles when the STAR file for that micrograph doesn't exist yet
 	bool only_extract_unfinished;
 
+	// Micrographs that were extracted in earlier runs (for --only_do_unfinished)
+	ProcessingLedger ledger;
+
 	// Skip gathering CTF information from the ctffind logfiles (e.g. when the info is already there from Gctf)?
 	bool do_skip_ctf_logfiles;
 
@@ -185,7 +210,26 @@ public:
 	// Name of output stack (only when fn_operate in is given)
 	FileName fn_operate_out;
 
+	// Number of threads to process the particles of one micrograph
+	int nr_threads;
+
+	// Directory on fast local disc to keep copies of the micrographs (e.g. for repeated re-extraction)
+	FileName fn_mic_cache;
+
+	// Name of the micrograph to read in the background while the current one is being processed
+	FileName fn_next_mic;
+
+private:
+	// Reading of the next micrograph in a separate thread
+	std::thread mic_reader;
+	FileName fn_prefetched_mic;
+	Image<RFLOAT> Iprefetched_mic;
+	std::exception_ptr prefetch_error;
+
 public:
+
+	// Wait for a micrograph that may still be read in the background
+	~Preprocessing();
 	// Read command line arguments
 	void read(int argc, char **argv, int rank = 0);
 
@@ -220,6 +264,18 @@ public:
 			long int &my_current_nr_images, long int my_total_nr_images,
 			RFLOAT &all_avg, RFLOAT &all_stddev, RFLOAT &all_minval, RFLOAT &all_maxval);
 
+	// Read a micrograph, from the local cache if fn_mic_cache is given
+	void readMicrograph(FileName fn_mic, Image<RFLOAT> &Imic);
+
+	// Start reading fn_mic in the background (only if its particles will actually be extracted)
+	void startMicrographPrefetch(FileName fn_mic);
+
+	// Get fn_mic, from the background reader if it was read already
+	void getMicrograph(FileName fn_mic, Image<RFLOAT> &Imic);
+
+	// Wait for the background reader to finish
+	void stopMicrographPrefetch();
+
 	// Perform per-image operations (e.g. normalise, rescaling, rewindowing and inverting contrast) on an input stack (or STAR file)
 	void runOperateOnInputFile();
 
@@ -237,11 +293,43 @@ public:
 			RFLOAT &all_minval,
 			RFLOAT &all_maxval);
 
+	// The part of performPerImageOperations that does not write anything: rescaling, rewindowing, normalisation and contrast inversion
+	// If a workspace is given, its FFTW plans are re-used for the rescaling
+	void processImage(
+			Image<RFLOAT> &Ipart,
+			RFLOAT tilt_deg,
+			RFLOAT psi_deg,
+			ParticleWorkspace *workspace = NULL);
+
+	// The other part: update the statistics and write the image to disc
+	void writeImage(
+			Image<RFLOAT> &Ipart,
+			FileName fn_output_img_root,
+			long int image_nr,
+			long int nr_of_images,
+			RFLOAT avg,
+			RFLOAT stddev,
+			RFLOAT minval,
+			RFLOAT maxval,
+			RFLOAT &all_avg,
+			RFLOAT &all_stddev,
+			RFLOAT &all_minval,
+			RFLOAT &all_maxval);
+
 
 	// Get the coordinate metadatatable from fn_data
 	MetaDataTable getCoordinateMetaDataTable(FileName fn_mic);
 	FileName getOutputFileNameRoot(FileName fn_mic);
 
+	// Will extractParticlesFromFieldOfView skip this micrograph? If so, mic_is_used is what it returns
+	bool skipMicrograph(FileName fn_mic, bool &mic_is_used);
+
+	// Has this micrograph been extracted before? (for --only_do_unfinished)
+	bool isAlreadyExtracted(FileName fn_mic);
+
+	// Parameters that change the extracted particles
+	std::string getLedgerSignature();
+
 };
 
 #endif /* PREPROCESSING_H_ */
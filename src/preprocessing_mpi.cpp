@@ -77,6 +77,11 @@ void PreprocessingMpi::runExtractParticles()
 				MDmics.getValue(EMDL_MICROGRAPH_NAME, fn_mic);
 				int optics_group = obsModelMic.getOpticsGroup(MDmics);
 
+				// The next micrograph may be read in the background while this one is being processed
+				fn_next_mic = "";
+				if (imic + 1 <= my_last_mic)
+					MDmics.getValue(EMDL_MICROGRAPH_NAME, fn_next_mic, imic + 1);
+
 				// Set the pixel size for this micrograph
 				angpix = obsModelMic.getPixelSize(optics_group);
 				// Also set the output_angpix (which could be rescaled)
@@ -101,6 +106,7 @@ void PreprocessingMpi::runExtractParticles()
 			}
 			imic++;
 		}
+		stopMicrographPrefetch();
 	}
 
 	// Wait until all nodes have finished to make final star file
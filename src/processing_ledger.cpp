@@ -0,0 +1,343 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/processing_ledger.h"
+#include "src/error.h"
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LEDGER_HEADER "# RELION processing ledger"
+
+static void splitFields(const std::string &line, std::vector<std::string> &fields)
+{
+	fields.clear();
+
+	size_t start = 0;
+	while (true)
+	{
+		size_t tab = line.find('\t', start);
+		if (tab == std::string::npos)
+		{
+			fields.push_back(line.substr(start));
+			break;
+		}
+		fields.push_back(line.substr(start, tab - start));
+		start = tab + 1;
+	}
+}
+
+ProcessingLedger::ProcessingLedger()
+:	must_rewrite(true), needs_newline(false)
+{
+}
+
+ProcessingLedger::~ProcessingLedger()
+{
+	flush();
+}
+
+void ProcessingLedger::reset(const FileName &_fn_ledger, const std::string &_signature)
+{
+	if (fh.is_open()) fh.close();
+
+	fn_ledger = _fn_ledger;
+	signature = _signature;
+	must_rewrite = true;
+	needs_newline = false;
+	items.clear();
+	files.clear();
+}
+
+void ProcessingLedger::read(const FileName &_fn_ledger, const std::string &_signature)
+{
+	reset(_fn_ledger, _signature);
+
+	std::ifstream in(fn_ledger.c_str(), std::ios::in | std::ios::binary);
+	if (!in.is_open()) return;
+
+	std::string line;
+	std::vector<std::string> fields;
+
+	if (!std::getline(in, line) || in.eof()) return;
+
+	splitFields(line, fields);
+	if (fields.size() != 2 || fields[0] != LEDGER_HEADER || fields[1] != signature)
+		return;
+
+	must_rewrite = false;
+
+	while (std::getline(in, line))
+	{
+		// A line without a newline was not written completely
+		if (in.eof())
+		{
+			needs_newline = true;
+			break;
+		}
+
+		splitFields(line, fields);
+
+		if (fields.size() >= 2 && fields[0] == "I")
+		{
+			items[fields[1]] = std::vector<std::string>(fields.begin() + 2, fields.end());
+		}
+		else if (fields.size() == 7 && fields[0] == "F")
+		{
+			FileState state;
+			state.prefix_length = strtoull(fields[2].c_str(), NULL, 10);
+			state.prefix_hash = fields[3];
+			state.size = strtoull(fields[4].c_str(), NULL, 10);
+			state.mtime = strtol(fields[5].c_str(), NULL, 10);
+			state.tag = fields[6];
+			files[fields[1]] = state;
+		}
+		// Anything else is a damaged line: ignore it
+	}
+}
+
+bool ProcessingLedger::contains(const std::string &key) const
+{
+	return items.find(key) != items.end();
+}
+
+const std::vector<std::string>& ProcessingLedger::getValues(const std::string &key) const
+{
+	std::map<std::string, std::vector<std::string> >::const_iterator it = items.find(key);
+	if (it == items.end())
+		REPORT_ERROR("BUG: ProcessingLedger::getValues: " + key + " is not in the ledger " + fn_ledger);
+
+	return it->second;
+}
+
+long int ProcessingLedger::numberOfItems() const
+{
+	return items.size();
+}
+
+void ProcessingLedger::add(const std::string &key, const std::vector<std::string> &values)
+{
+	std::vector<std::string> fields;
+	fields.push_back("I");
+	fields.push_back(key);
+	fields.insert(fields.end(), values.begin(), values.end());
+
+	appendLine(fields);
+
+	items[key] = values;
+}
+
+void ProcessingLedger::writeFile(const FileName &fn, const std::string &content, const std::string &tag)
+{
+	std::string old_tag;
+	bool do_append = false;
+	size_t old_prefix = 0;
+
+	if (fileIsUnchanged(fn, old_tag))
+	{
+		const FileState &old = files[fn];
+		old_prefix = old.prefix_length;
+		do_append = content.size() >= old_prefix && hash(content, old_prefix) == old.prefix_hash;
+	}
+
+	if (do_append)
+	{
+		// Drop the old last line (e.g. the empty line that ends a STAR table) and add the rest
+		if (truncate(fn.c_str(), old_prefix) != 0)
+			REPORT_ERROR("ProcessingLedger::writeFile: cannot truncate " + fn);
+
+		std::ofstream out(fn.c_str(), std::ios::out | std::ios::app | std::ios::binary);
+		if (!out)
+			REPORT_ERROR("ProcessingLedger::writeFile: cannot append to " + fn);
+		out.write(content.data() + old_prefix, content.size() - old_prefix);
+		out.close();
+		if (!out)
+			REPORT_ERROR("ProcessingLedger::writeFile: error appending to " + fn);
+	}
+	else
+	{
+		FileName fn_tmp = fn + ".tmp";
+		std::ofstream out(fn_tmp.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+		if (!out)
+			REPORT_ERROR("ProcessingLedger::writeFile: cannot write " + fn_tmp);
+		out.write(content.data(), content.size());
+		out.close();
+		if (!out)
+			REPORT_ERROR("ProcessingLedger::writeFile: error writing " + fn_tmp);
+		if (std::rename(fn_tmp.c_str(), fn.c_str()) != 0)
+			REPORT_ERROR("ProcessingLedger::writeFile: cannot rename " + fn_tmp + " to " + fn + ": " + strerror(errno));
+	}
+
+	// Everything up to the start of the last line may be kept next time
+	FileState state;
+	size_t end = content.size();
+	if (end > 0 && content[end-1] == '\n') end--;
+	size_t last_newline = (end > 0) ? content.rfind('\n', end - 1) : std::string::npos;
+	state.prefix_length = (last_newline == std::string::npos) ? 0 : last_newline + 1;
+	state.prefix_hash = hash(content, state.prefix_length);
+	state.tag = tag;
+
+	if (!statFile(fn, state.size, state.mtime))
+		REPORT_ERROR("ProcessingLedger::writeFile: cannot find " + fn + " after writing it");
+
+	std::vector<std::string> fields;
+	fields.push_back("F");
+	fields.push_back(fn);
+	fields.push_back(std::to_string(state.prefix_length));
+	fields.push_back(state.prefix_hash);
+	fields.push_back(std::to_string(state.size));
+	fields.push_back(std::to_string(state.mtime));
+	fields.push_back(tag);
+
+	appendLine(fields);
+	flush();
+
+	files[fn] = state;
+}
+
+std::string ProcessingLedger::fileState(const FileName &fn)
+{
+	size_t size;
+	long int mtime;
+	if (!statFile(fn, size, mtime)) return "";
+
+	return std::to_string(size) + ":" + std::to_string(mtime);
+}
+
+bool ProcessingLedger::fileIsUnchanged(const FileName &fn, std::string &tag) const
+{
+	std::map<std::string, FileState>::const_iterator it = files.find(fn);
+	if (it == files.end()) return false;
+
+	size_t size;
+	long int mtime;
+	if (!statFile(fn, size, mtime)) return false;
+
+	if (size != it->second.size || mtime != it->second.mtime)
+		return false;
+
+	tag = it->second.tag;
+	return true;
+}
+
+void ProcessingLedger::flush()
+{
+	if (fh.is_open()) fh.flush();
+}
+
+std::string ProcessingLedger::numberToString(double value)
+{
+	std::ostringstream sstr;
+	sstr << std::setprecision(17) << value;
+	return sstr.str();
+}
+
+std::string ProcessingLedger::hash(const std::string &str, size_t length)
+{
+	if (length > str.size()) length = str.size();
+
+	// 64-bit FNV-1a
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++)
+	{
+		h ^= (unsigned char)str[i];
+		h *= 1099511628211ULL;
+	}
+
+	std::ostringstream sstr;
+	sstr << std::hex << std::setw(16) << std::setfill('0') << h;
+	return sstr.str();
+}
+
+void ProcessingLedger::appendLine(const std::vector<std::string> &fields)
+{
+	if (fn_ledger == "")
+		REPORT_ERROR("BUG: ProcessingLedger: no ledger file name has been set");
+
+	for (int i = 0; i < fields.size(); i++)
+		checkField(fields[i]);
+
+	if (must_rewrite)
+	{
+		// Start a new file, holding everything that is known
+		if (fh.is_open()) fh.close();
+		fh.open(fn_ledger.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+		if (!fh)
+			REPORT_ERROR("ProcessingLedger: cannot write " + fn_ledger);
+
+		must_rewrite = false;
+		needs_newline = false;
+
+		fh << LEDGER_HEADER << "\t" << signature << "\n";
+
+		for (std::map<std::string, std::vector<std::string> >::const_iterator it = items.begin(); it != items.end(); it++)
+		{
+			fh << "I\t" << it->first;
+			for (int i = 0; i < it->second.size(); i++)
+				fh << "\t" << it->second[i];
+			fh << "\n";
+		}
+
+		for (std::map<std::string, FileState>::const_iterator it = files.begin(); it != files.end(); it++)
+		{
+			fh << "F\t" << it->first << "\t" << it->second.prefix_length << "\t" << it->second.prefix_hash
+			   << "\t" << it->second.size << "\t" << it->second.mtime << "\t" << it->second.tag << "\n";
+		}
+	}
+	else if (!fh.is_open())
+	{
+		fh.open(fn_ledger.c_str(), std::ios::out | std::ios::app | std::ios::binary);
+		if (!fh)
+			REPORT_ERROR("ProcessingLedger: cannot append to " + fn_ledger);
+	}
+
+	if (needs_newline)
+	{
+		fh << "\n";
+		needs_newline = false;
+	}
+
+	for (int i = 0; i < fields.size(); i++)
+	{
+		if (i > 0) fh << "\t";
+		fh << fields[i];
+	}
+	fh << "\n";
+}
+
+void ProcessingLedger::checkField(const std::string &field) const
+{
+	if (field.find_first_of("\t\n") != std::string::npos)
+		REPORT_ERROR("ProcessingLedger: cannot store values with tabs or newlines: " + field);
+}
+
+bool ProcessingLedger::statFile(const FileName &fn, size_t &size, long int &mtime)
+{
+	struct stat buf;
+	if (stat(fn.c_str(), &buf) != 0) return false;
+
+	size = buf.st_size;
+	mtime = buf.st_mtime;
+	return true;
+}
@@ -0,0 +1,113 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef PROCESSING_LEDGER_H_
+#define PROCESSING_LEDGER_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include "src/filename.h"
+
+/*
+ * Append-only record of the items (e.g. micrographs) that a job has already processed,
+ * so that --only_do_unfinished does not have to look at the output files of all items
+ * again on every repeat of the job.
+ *
+ * The ledger is a small text file in the output directory. Its first line holds a
+ * signature of the parameters of the job; a ledger written with another signature is
+ * ignored. Every following line is either an item (a key and the values the job needs
+ * to write its output for that item), or the state of an output file written through
+ * writeFile(). Later lines override earlier ones. A truncated last line (e.g. after a
+ * crash) is ignored.
+ *
+ * The ledger does not look at the output files of the items it lists: callers check that
+ * they still exist before relying on an item.
+ */
+class ProcessingLedger
+{
+public:
+
+	ProcessingLedger();
+	~ProcessingLedger();
+
+	// Read an existing ledger; its items are only used if it was written with the same signature
+	void read(const FileName &fn_ledger, const std::string &signature);
+
+	// Start a new, empty ledger (the file is overwritten on the next change)
+	void reset(const FileName &fn_ledger, const std::string &signature);
+
+	bool contains(const std::string &key) const;
+
+	// The values recorded for key (which has to be present)
+	const std::vector<std::string>& getValues(const std::string &key) const;
+
+	long int numberOfItems() const;
+
+	// Record an item, overwriting any earlier values for the same key
+	void add(const std::string &key, const std::vector<std::string> &values = std::vector<std::string>());
+
+	/*
+	 * Write content to fn. If fn has not been touched since it was last written through
+	 * this ledger, and content starts with all but the last line of what was written then,
+	 * only the new part is appended to the file. This turns rewriting a STAR file that has
+	 * gained a few rows at the end of its last table into an append.
+	 * The tag is stored alongside, for the caller to recognise the state of the file.
+	 */
+	void writeFile(const FileName &fn, const std::string &content, const std::string &tag = "");
+
+	// Has fn not been changed since it was written through writeFile? If so, also return its tag.
+	bool fileIsUnchanged(const FileName &fn, std::string &tag) const;
+
+	// Finish all pending writes to the ledger file
+	void flush();
+
+	// Lossless text representation of a number, for use in values
+	static std::string numberToString(double value);
+
+	// Size and modification time of fn (empty if it does not exist), for use in values
+	static std::string fileState(const FileName &fn);
+
+	// Hash of a string, for use in tags
+	static std::string hash(const std::string &str, size_t length = std::string::npos);
+
+protected:
+
+	struct FileState
+	{
+		size_t prefix_length, size;
+		long int mtime;
+		std::string prefix_hash, tag;
+	};
+
+	FileName fn_ledger;
+	std::string signature;
+	bool must_rewrite, needs_newline;
+	std::ofstream fh;
+
+	std::map<std::string, std::vector<std::string> > items;
+	std::map<std::string, FileState> files;
+
+	void appendLine(const std::vector<std::string> &fields);
+	void checkField(const std::string &field) const;
+	static bool statFile(const FileName &fn, size_t &size, long int &mtime);
+};
+
+#endif /* PROCESSING_LEDGER_H_ */
@@ -87,6 +87,9 @@ void Projector::initialiseData(int current_size)
 	data.setXmippOrigin();
 	data.xinit=0;
 
+	// Any compact version of a previous data array is no longer valid
+	compact_data.clear();
+
 }
 void Projector::initZeros(int current_size)
 {
@@ -112,6 +115,33 @@ long int Projector::getSize()
 }
 
 
+void Projector::compactData()
+{
+	if (hasCompactData())
+		return;
+
+	// computeFourierTransformMap sets everything beyond this radius to zero
+	compact_data.compress(data, ROUND(r_max * padding_factor));
+	data.clear();
+}
+
+size_t Projector::getCompactSize() const
+{
+	if (hasCompactData())
+		return compact_data.values.size();
+
+	return SphericalFourierArray<Complex>::numberOfStoredVoxels(data, ROUND(r_max * padding_factor));
+}
+
+void Projector::expandData()
+{
+	if (!hasCompactData())
+		return;
+
+	compact_data.expand(data);
+	compact_data.clear();
+}
+
 // Fill data array with oversampled Fourier transform, and calculate its power spectrum
 void Projector::computeFourierTransformMap(
 		MultidimArray<RFLOAT> &vol_in, MultidimArray<RFLOAT> &power_spectrum,
@@ -647,6 +677,14 @@ void Projector::project(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 
 	const int r_min_NN_ref_2 = r_min_nn * r_min_nn * padding_factor * padding_factor;
 
+	// The data may be stored in full or in compact form (see compactData())
+	const bool do_compact = hasCompactData();
+	const long int mdl_xdim = (do_compact) ? compact_data.xdim : XSIZE(data);
+	const long int mdl_ydim = (do_compact) ? compact_data.ydim : YSIZE(data);
+	const long int mdl_zdim = (do_compact) ? compact_data.zdim : ZSIZE(data);
+	const long int mdl_yinit = (do_compact) ? compact_data.yinit : STARTINGY(data);
+	const long int mdl_zinit = (do_compact) ? compact_data.zinit : STARTINGZ(data);
+
 //#define DEBUG
 #ifdef DEBUG
 	std::cerr << " XSIZE(f2d)= "<< XSIZE(f2d) << std::endl;
@@ -703,31 +741,42 @@ void Projector::project(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 
 				int y0 = FLOOR(yp);
 				const RFLOAT fy = yp - y0;
-				y0 -=  STARTINGY(data);
+				y0 -=  mdl_yinit;
 				const int y1 = y0 + 1;
 
 				int z0 = FLOOR(zp);
 				const RFLOAT fz = zp - z0;
-				z0 -= STARTINGZ(data);
+				z0 -= mdl_zinit;
 				const int z1 = z0 + 1;
 
 				// Avoid reading outside the box
-				if (x0 < 0 || x0+1 >= data.xdim
-				 || y0 < 0 || y0+1 >= data.ydim
-				 || z0 < 0 || z0+1 >= data.zdim)
+				if (x0 < 0 || x0+1 >= mdl_xdim
+				 || y0 < 0 || y0+1 >= mdl_ydim
+				 || z0 < 0 || z0+1 >= mdl_zdim)
 				{
 					continue;
 				}
 
-				// Matrix access can be accelerated through pre-calculation of z0*xydim etc.
-				const Complex d000 = DIRECT_A3D_ELEM(data, z0, y0, x0);
-				const Complex d001 = DIRECT_A3D_ELEM(data, z0, y0, x1);
-				const Complex d010 = DIRECT_A3D_ELEM(data, z0, y1, x0);
-				const Complex d011 = DIRECT_A3D_ELEM(data, z0, y1, x1);
-				const Complex d100 = DIRECT_A3D_ELEM(data, z1, y0, x0);
-				const Complex d101 = DIRECT_A3D_ELEM(data, z1, y0, x1);
-				const Complex d110 = DIRECT_A3D_ELEM(data, z1, y1, x0);
-				const Complex d111 = DIRECT_A3D_ELEM(data, z1, y1, x1);
+				Complex d000, d001, d010, d011, d100, d101, d110, d111;
+				if (do_compact)
+				{
+					compact_data.getPair(z0, y0, x0, d000, d001);
+					compact_data.getPair(z0, y1, x0, d010, d011);
+					compact_data.getPair(z1, y0, x0, d100, d101);
+					compact_data.getPair(z1, y1, x0, d110, d111);
+				}
+				else
+				{
+					// Matrix access can be accelerated through pre-calculation of z0*xydim etc.
+					d000 = DIRECT_A3D_ELEM(data, z0, y0, x0);
+					d001 = DIRECT_A3D_ELEM(data, z0, y0, x1);
+					d010 = DIRECT_A3D_ELEM(data, z0, y1, x0);
+					d011 = DIRECT_A3D_ELEM(data, z0, y1, x1);
+					d100 = DIRECT_A3D_ELEM(data, z1, y0, x0);
+					d101 = DIRECT_A3D_ELEM(data, z1, y0, x1);
+					d110 = DIRECT_A3D_ELEM(data, z1, y1, x0);
+					d111 = DIRECT_A3D_ELEM(data, z1, y1, x1);
+				}
 
 				// Set the interpolated value in the 2D output array
 				const Complex dx00 = LIN_INTERP(fx, d000, d001);
@@ -762,18 +811,23 @@ void Projector::project(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 					z0 = -z0;
 				}
 
-				const int xr = x0 - STARTINGX(data);
-				const int yr = y0 - STARTINGY(data);
-				const int zr = z0 - STARTINGZ(data);
+				const int xr = x0;
+				const int yr = y0 - mdl_yinit;
+				const int zr = z0 - mdl_zinit;
 
-				if (xr < 0 || xr >= data.xdim
-				 || yr < 0 || yr >= data.ydim
-				 || zr < 0 || zr >= data.zdim)
+				if (xr < 0 || xr >= mdl_xdim
+				 || yr < 0 || yr >= mdl_ydim
+				 || zr < 0 || zr >= mdl_zdim)
 				{
 					continue;
 				}
 
-				if (is_neg_x)
+				if (do_compact)
+				{
+					const Complex val = compact_data.getValue(zr, yr, xr);
+					DIRECT_A2D_ELEM(f2d, i, x) = (is_neg_x) ? conj(val) : val;
+				}
+				else if (is_neg_x)
 				{
 					DIRECT_A2D_ELEM(f2d, i, x) = conj(DIRECT_A3D_ELEM(data, zr, yr, xr));
 				}
@@ -798,6 +852,9 @@ void Projector::project(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 
 void Projector::projectGradient(Volume<t2Vector<Complex>>& img_out, Matrix2D<RFLOAT>& At)
 {
+	if (hasCompactData())
+		REPORT_ERROR("Projector::projectGradient: not implemented for compact data, call expandData() first");
+
 	const int s = img_out.dimy;
 	const int sh = img_out.dimx;
 
@@ -916,6 +973,9 @@ void Projector::projectGradient(Volume<t2Vector<Complex>>& img_out, Matrix2D<RFL
 // Never actually used:
 void Projector::project2Dto1D(MultidimArray<Complex > &f1d, Matrix2D<RFLOAT> &A)
 {
+	if (hasCompactData())
+		REPORT_ERROR("Projector::project2Dto1D: not implemented for compact data, call expandData() first");
+
 	// f1d should already be in the right size (ori_size,orihalfdim)
 	// AND the points outside r_max should already be zero...
 	// f1d.initZeros();
@@ -1026,6 +1086,10 @@ void Projector::rotate2D(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 
 	const int r_min_NN_ref_2 = r_min_nn * r_min_nn * padding_factor * padding_factor;
 
+	// The data may be stored in full or in compact form (see compactData())
+	const bool do_compact = hasCompactData();
+	const long int mdl_yinit = (do_compact) ? compact_data.yinit : STARTINGY(data);
+
 #ifdef DEBUG
 	std::cerr << " XSIZE(f2d)= "<< XSIZE(f2d) << std::endl;
 	std::cerr << " YSIZE(f2d)= "<< YSIZE(f2d) << std::endl;
@@ -1077,14 +1141,23 @@ void Projector::rotate2D(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 
 				int y0 = FLOOR(yp);
 				const RFLOAT fy = yp - y0;
-				y0 -=  STARTINGY(data);
+				y0 -=  mdl_yinit;
 				const int y1 = y0 + 1;
 
-				// Matrix access can be accelerated through pre-calculation of z0*xydim etc.
-				const Complex d00 = DIRECT_A2D_ELEM(data, y0, x0);
-				const Complex d01 = DIRECT_A2D_ELEM(data, y0, x1);
-				const Complex d10 = DIRECT_A2D_ELEM(data, y1, x0);
-				const Complex d11 = DIRECT_A2D_ELEM(data, y1, x1);
+				Complex d00, d01, d10, d11;
+				if (do_compact)
+				{
+					compact_data.getPair(0, y0, x0, d00, d01);
+					compact_data.getPair(0, y1, x0, d10, d11);
+				}
+				else
+				{
+					// Matrix access can be accelerated through pre-calculation of z0*xydim etc.
+					d00 = DIRECT_A2D_ELEM(data, y0, x0);
+					d01 = DIRECT_A2D_ELEM(data, y0, x1);
+					d10 = DIRECT_A2D_ELEM(data, y1, x0);
+					d11 = DIRECT_A2D_ELEM(data, y1, x1);
+				}
 
 				// Set the interpolated value in the 2D output array
 				const Complex dx0 = LIN_INTERP(fx, d00, d01);
@@ -1103,7 +1176,14 @@ void Projector::rotate2D(MultidimArray<Complex > &f2d, Matrix2D<RFLOAT> &A)
 				const int x0 = ROUND(xp);
 				const int y0 = ROUND(yp);
 
-				if (x0 < 0)
+				if (do_compact)
+				{
+					if (x0 < 0)
+						DIRECT_A2D_ELEM(f2d, i, x) = conj(compact_data.getValue(0, -y0 - mdl_yinit, -x0));
+					else
+						DIRECT_A2D_ELEM(f2d, i, x) = compact_data.getValue(0, y0 - mdl_yinit, x0);
+				}
+				else if (x0 < 0)
 				{
 					DIRECT_A2D_ELEM(f2d, i, x) = conj(A2D_ELEM(data, -y0, -x0));
 				}
@@ -1139,6 +1219,11 @@ void Projector::rotate3D(MultidimArray<Complex > &f3d, Matrix2D<RFLOAT> &A)
 
 	const int r_min_NN_ref_2 = r_min_nn * r_min_nn * padding_factor * padding_factor;
 
+	// The data may be stored in full or in compact form (see compactData())
+	const bool do_compact = hasCompactData();
+	const long int mdl_yinit = (do_compact) ? compact_data.yinit : STARTINGY(data);
+	const long int mdl_zinit = (do_compact) ? compact_data.zinit : STARTINGZ(data);
+
 #ifdef DEBUG
 	std::cerr << " XSIZE(f3d)= "<< XSIZE(f3d) << std::endl;
 	std::cerr << " YSIZE(f3d)= "<< YSIZE(f3d) << std::endl;
@@ -1201,23 +1286,34 @@ void Projector::rotate3D(MultidimArray<Complex > &f3d, Matrix2D<RFLOAT> &A)
 
 					int y0 = FLOOR(yp);
 					const RFLOAT fy = yp - y0;
-					y0 -=  STARTINGY(data);
+					y0 -=  mdl_yinit;
 					const int y1 = y0 + 1;
 
 					int z0 = FLOOR(zp);
 					const RFLOAT fz = zp - z0;
-					z0 -=  STARTINGZ(data);
+					z0 -=  mdl_zinit;
 					const int z1 = z0 + 1;
 
-					// Matrix access can be accelerated through pre-calculation of z0*xydim etc.
-					const Complex d000 = DIRECT_A3D_ELEM(data, z0, y0, x0);
-					const Complex d001 = DIRECT_A3D_ELEM(data, z0, y0, x1);
-					const Complex d010 = DIRECT_A3D_ELEM(data, z0, y1, x0);
-					const Complex d011 = DIRECT_A3D_ELEM(data, z0, y1, x1);
-					const Complex d100 = DIRECT_A3D_ELEM(data, z1, y0, x0);
-					const Complex d101 = DIRECT_A3D_ELEM(data, z1, y0, x1);
-					const Complex d110 = DIRECT_A3D_ELEM(data, z1, y1, x0);
-					const Complex d111 = DIRECT_A3D_ELEM(data, z1, y1, x1);
+					Complex d000, d001, d010, d011, d100, d101, d110, d111;
+					if (do_compact)
+					{
+						compact_data.getPair(z0, y0, x0, d000, d001);
+						compact_data.getPair(z0, y1, x0, d010, d011);
+						compact_data.getPair(z1, y0, x0, d100, d101);
+						compact_data.getPair(z1, y1, x0, d110, d111);
+					}
+					else
+					{
+						// Matrix access can be accelerated through pre-calculation of z0*xydim etc.
+						d000 = DIRECT_A3D_ELEM(data, z0, y0, x0);
+						d001 = DIRECT_A3D_ELEM(data, z0, y0, x1);
+						d010 = DIRECT_A3D_ELEM(data, z0, y1, x0);
+						d011 = DIRECT_A3D_ELEM(data, z0, y1, x1);
+						d100 = DIRECT_A3D_ELEM(data, z1, y0, x0);
+						d101 = DIRECT_A3D_ELEM(data, z1, y0, x1);
+						d110 = DIRECT_A3D_ELEM(data, z1, y1, x0);
+						d111 = DIRECT_A3D_ELEM(data, z1, y1, x1);
+					}
 
 					// Set the interpolated value in the 2D output array
 					// interpolate in x
@@ -1244,7 +1340,14 @@ void Projector::rotate3D(MultidimArray<Complex > &f3d, Matrix2D<RFLOAT> &A)
 					const int y0 = ROUND(yp);
 					const int z0 = ROUND(zp);
 
-					if (x0 < 0)
+					if (do_compact)
+					{
+						if (x0 < 0)
+							DIRECT_A3D_ELEM(f3d, k, i, x) = conj(compact_data.getValue(-z0 - mdl_zinit, -y0 - mdl_yinit, -x0));
+						else
+							DIRECT_A3D_ELEM(f3d, k, i, x) = compact_data.getValue(z0 - mdl_zinit, y0 - mdl_yinit, x0);
+					}
+					else if (x0 < 0)
 					{
 						DIRECT_A3D_ELEM(f3d, k, i, x) = conj(A3D_ELEM(data, -z0, -y0, -x0));
 					}
@@ -23,6 +23,7 @@
 #include "src/fftw.h"
 #include "src/multidim_array.h"
 #include "src/image.h"
+#include "src/spherical_fourier_array.h"
 
 #include <src/jaz/single_particle/volume.h>
 #include <src/jaz/gravis/t2Vector.h>
@@ -74,6 +75,9 @@ public:
 	// The Fourier-space image data array
 	MultidimArray<Complex > data;
 
+	// Compact version of the data array, only holding the voxels inside r_max (see compactData())
+	SphericalFourierArray<Complex > compact_data;
+
 	// Only points within this many pixels from the origin (in the original size) will be interpolated
 	int r_max;
 
@@ -171,6 +175,7 @@ public:
 		if (&op != this)
 		{
 			data = op.data;
+			compact_data = op.compact_data;
 			ori_size = op.ori_size;
 			pad_size = op.pad_size;
 			r_max = op.r_max;
@@ -202,6 +207,7 @@ public:
 	void clear()
 	{
 		data.clear();
+		compact_data.clear();
 		r_max = r_min_nn = interpolator = ref_dim = data_dim = pad_size = 0;
 		padding_factor = 0.;
 	}
@@ -221,6 +227,26 @@ public:
 	 */
 	long int getSize();
 
+	/*
+	 * Replace the data array by a compact one that only stores the voxels inside r_max.
+	 * This saves about half of the memory (the corners of the padded box are never read).
+	 * project, rotate2D and rotate3D work on either representation.
+	 */
+	void compactData();
+
+	/*
+	 * Go back from the compact representation to the full data array
+	 */
+	void expandData();
+
+	bool hasCompactData() const
+	{
+		return !compact_data.isEmpty();
+	}
+
+	// Number of complex values that are (or would be) stored by compactData()
+	size_t getCompactSize() const;
+
 	/* ** Prepares a 3D map for taking slices in its 3D Fourier Transform
 	 *
 	 * This routine does the following:
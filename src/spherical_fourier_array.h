@@ -0,0 +1,205 @@
+/***************************************************************************
+ *
+ * MRC Laboratory of Molecular Biology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef SPHERICAL_FOURIER_ARRAY_H_
+#define SPHERICAL_FOURIER_ARRAY_H_
+
+#include <vector>
+#include <cmath>
+#include "src/multidim_array.h"
+
+/*
+ * Compact storage of the half-complex Fourier-space arrays used by the (Back)Projector.
+ *
+ * Only voxels within a sphere of a given radius (in padded Fourier pixels) are kept.
+ * The array is stored as rows along X: for each (z,y) pair the row starts at x = 0
+ * and contains all voxels with x*x + y*y + z*z <= radius*radius.
+ * row_offset[z*ydim + y] points to the first element of a row in values,
+ * row_offset[z*ydim + y + 1] to the first element of the next row.
+ * Voxels outside the stored rows are zero.
+ *
+ * Indices passed to the access functions are direct (i.e. STARTINGY and STARTINGZ
+ * have already been subtracted), as in DIRECT_A3D_ELEM. STARTINGX is always zero.
+ */
+template <typename T>
+class SphericalFourierArray
+{
+public:
+
+	// Dimensions and origin of the full (dense) array this was made from
+	long int xdim, ydim, zdim;
+	long int yinit, zinit;
+
+	// Only voxels within this radius are stored
+	int radius;
+
+	// Start of each (z,y) row in values; size zdim*ydim + 1
+	std::vector<size_t> row_offset;
+
+	// The stored voxels, row after row
+	std::vector<T> values;
+
+	SphericalFourierArray()
+	{
+		clear();
+	}
+
+	void clear()
+	{
+		xdim = ydim = zdim = 0;
+		yinit = zinit = 0;
+		radius = 0;
+		std::vector<size_t>().swap(row_offset);
+		std::vector<T>().swap(values);
+	}
+
+	bool isEmpty() const
+	{
+		return row_offset.size() == 0;
+	}
+
+	/*
+	 * Set up the row structure for a dense array with the shape of Min
+	 * (with STARTINGX=0 and Y,Z centered) and set all stored values to zero
+	 */
+	void initZeros(const MultidimArray<T> &Min, int _radius)
+	{
+		xdim = XSIZE(Min);
+		ydim = YSIZE(Min);
+		zdim = ZSIZE(Min);
+		yinit = STARTINGY(Min);
+		zinit = STARTINGZ(Min);
+		radius = _radius;
+
+		row_offset.resize(zdim * ydim + 1);
+
+		size_t n = 0;
+		for (long int k = 0; k < zdim; k++)
+		for (long int i = 0; i < ydim; i++)
+		{
+			row_offset[k * ydim + i] = n;
+			n += rowLength(k + zinit, i + yinit, xdim, radius);
+		}
+		row_offset[zdim * ydim] = n;
+
+		values.assign(n, T(0));
+	}
+
+	// Number of voxels that would be stored for a dense array with the shape of Min
+	static size_t numberOfStoredVoxels(const MultidimArray<T> &Min, int radius)
+	{
+		size_t n = 0;
+		for (long int z = STARTINGZ(Min); z <= FINISHINGZ(Min); z++)
+		for (long int y = STARTINGY(Min); y <= FINISHINGY(Min); y++)
+			n += rowLength(z, y, XSIZE(Min), radius);
+
+		return n;
+	}
+
+	// Number of voxels with x*x + y*y + z*z <= radius*radius in the row (z,y)
+	static long int rowLength(long int z, long int y, long int xdim, int radius)
+	{
+		const long int rem2 = (long int)radius * radius - z*z - y*y;
+		if (rem2 < 0) return 0;
+
+		const long int len = (long int)floor(sqrt((double)rem2)) + 1;
+		return (len > xdim) ? xdim : len;
+	}
+
+	/*
+	 * Copy all voxels within radius from a dense array
+	 */
+	void compress(const MultidimArray<T> &Min, int _radius)
+	{
+		initZeros(Min, _radius);
+
+		for (long int k = 0; k < zdim; k++)
+		for (long int i = 0; i < ydim; i++)
+		{
+			const size_t row = k * ydim + i;
+			const size_t start = row_offset[row];
+			const long int len = row_offset[row + 1] - start;
+
+			for (long int j = 0; j < len; j++)
+				values[start + j] = DIRECT_A3D_ELEM(Min, k, i, j);
+		}
+	}
+
+	/*
+	 * Write all stored voxels back into a dense array (voxels outside radius are set to zero)
+	 */
+	void expand(MultidimArray<T> &Mout) const
+	{
+		Mout.initZeros(zdim, ydim, xdim);
+		Mout.yinit = yinit;
+		Mout.zinit = zinit;
+		Mout.xinit = 0;
+
+		for (long int k = 0; k < zdim; k++)
+		for (long int i = 0; i < ydim; i++)
+		{
+			const size_t row = k * ydim + i;
+			const size_t start = row_offset[row];
+			const long int len = row_offset[row + 1] - start;
+
+			for (long int j = 0; j < len; j++)
+				DIRECT_A3D_ELEM(Mout, k, i, j) = values[start + j];
+		}
+	}
+
+	// Number of bytes used by the stored voxels and the row table
+	size_t memoryUsage() const
+	{
+		return values.size() * sizeof(T) + row_offset.size() * sizeof(size_t);
+	}
+
+	// Read voxel (k,i,j); zero if it lies outside the sphere
+	inline T getValue(long int k, long int i, long int j) const
+	{
+		const size_t row = k * ydim + i;
+		const size_t start = row_offset[row];
+		return (j < (long int)(row_offset[row + 1] - start)) ? values[start + j] : T(0);
+	}
+
+	// Read voxels (k,i,j) and (k,i,j+1) in one go, as needed for linear interpolation along X
+	inline void getPair(long int k, long int i, long int j, T &v0, T &v1) const
+	{
+		const size_t row = k * ydim + i;
+		const size_t start = row_offset[row];
+		const long int len = row_offset[row + 1] - start;
+		v0 = (j < len) ? values[start + j] : T(0);
+		v1 = (j + 1 < len) ? values[start + j + 1] : T(0);
+	}
+
+	// Pointer to voxel (k,i,j) for writing; NULL if it lies outside the sphere
+	inline T* getPointer(long int k, long int i, long int j)
+	{
+		const size_t row = k * ydim + i;
+		const size_t start = row_offset[row];
+		return (j < (long int)(row_offset[row + 1] - start)) ? &values[start + j] : NULL;
+	}
+
+	inline void addValue(long int k, long int i, long int j, const T &val)
+	{
+		T* ptr = getPointer(k, i, j);
+		if (ptr != NULL) *ptr += val;
+	}
+};
+
+#endif /* SPHERICAL_FOURIER_ARRAY_H_ */